@@ -0,0 +1,89 @@
+#pragma once
+
+//
+// Control device interface, shared with user-mode. Open \\.\Gestalt (administrators only) with FILE_FLAG_OVERLAPPED
+// to keep several requests in flight; IOCTL_GESTALT_READ_EXIT_TRACE is the one that pends
+//
+#define GESTALT_DEVICE_NAME L"\\Device\\Gestalt"
+#define GESTALT_SYMBOLIC_LINK L"\\DosDevices\\Gestalt"
+
+#define GESTALT_CONTROL_VERSION 2
+#define FILE_DEVICE_GESTALT 0x8A57
+
+#define IOCTL_GESTALT_QUERY_CAPABILITIES CTL_CODE( FILE_DEVICE_GESTALT, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS )
+#define IOCTL_GESTALT_SET_MSR_INTERCEPT CTL_CODE( FILE_DEVICE_GESTALT, 0x801, METHOD_BUFFERED, FILE_WRITE_ACCESS )
+#define IOCTL_GESTALT_READ_EXIT_TRACE CTL_CODE( FILE_DEVICE_GESTALT, 0x802, METHOD_OUT_DIRECT, FILE_READ_ACCESS )
+#define IOCTL_GESTALT_TRACK_WRITES CTL_CODE( FILE_DEVICE_GESTALT, 0x803, METHOD_BUFFERED, FILE_WRITE_ACCESS )
+#define IOCTL_GESTALT_READ_DIRTY_PAGES CTL_CODE( FILE_DEVICE_GESTALT, 0x804, METHOD_OUT_DIRECT, FILE_READ_ACCESS )
+
+//
+// Pages IOCTL_GESTALT_TRACK_WRITES takes at once, the execution coverage tracks at most that many pages in all
+//
+#define GESTALT_MAX_TRACKED_PAGES 4096
+
+//
+// IOCTL_GESTALT_QUERY_CAPABILITIES output. The control MSRs are the raw IA32_VMX_* values, 0 when not supported
+//
+struct GestaltCapabilities
+{
+	UINT32 Version;
+	UINT32 Virtualized;
+	UINT32 ActiveProcessors;
+	UINT32 MaximumProcessors;
+	UINT32 ExitTraceRecords;		// Capacity per processor, 0 when the exit trace is off
+	UINT32 StatsCpuCount;			// Slots of the Global\GestaltStats section, 0 when it doesn't exist
+	UINT64 VmxBasic;
+	UINT64 PinBasedControls;
+	UINT64 ProcBasedControls;
+	UINT64 ProcBasedControls2;
+	UINT64 ExitControls;
+	UINT64 EntryControls;
+	UINT64 EptVpidCapabilities;
+};
+
+//
+// IOCTL_GESTALT_SET_MSR_INTERCEPT input, Read/Write set (1) or clear (0) the intercept of each access.
+// The MSR is read once when the request arrives, MSRs that fault are refused
+//
+struct GestaltMsrIntercept
+{
+	UINT32 Msr;
+	UINT8 Read;
+	UINT8 Write;
+	UINT16 Reserved;
+};
+
+//
+// IOCTL_GESTALT_READ_EXIT_TRACE input. The output buffer (direct I/O, no intermediate copy) receives an ExitTraceHeader
+// followed by the records of the processor from StartRecord on, as many as fit (see vmx/ExitTrace.h),
+// RecordCount being the number returned. The request pends until MinimumRecords are available past StartRecord
+// or the trace buffer is full
+//
+struct GestaltTraceRequest
+{
+	UINT32 CpuNumber;
+	UINT32 MinimumRecords;
+	UINT64 StartRecord;
+};
+
+//
+// IOCTL_GESTALT_TRACK_WRITES input, a guest-physical range of GESTALT_MAX_TRACKED_PAGES pages at most. Needs the
+// execution coverage (ExecutionCoverage in the service key): the pages lose write in its EPT view and their first write
+// is recorded. The output is a UINT32, the pages tracked
+//
+struct GestaltPhysicalRange
+{
+	UINT64 Base;
+	UINT64 Size;
+};
+
+//
+// IOCTL_GESTALT_READ_DIRTY_PAGES output (direct I/O): the header, then the guest-physical addresses of the pages
+// written since the previous read, as many as fit. They lose write again before the request completes, so the writes
+// that come after are in the next read, and so are the pages that didn't fit
+//
+struct GestaltDirtyPages
+{
+	UINT32 Count;
+	UINT32 Reserved;
+};
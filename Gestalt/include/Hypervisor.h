@@ -2,7 +2,37 @@
 
 
 #include "vmx/vmx.h"
+#include "bench/ExitBench.h"
+#include "GestaltControl.h"
 
+//
+// Where the exit trace is written when the hypervisor stops, see Hypervisor::SetExitTrace
+//
+#define EXIT_TRACE_FILE L"\\SystemRoot\\Gestalt.trace"
+#define EXIT_BENCH_FILE L"\\SystemRoot\\GestaltBench.json"
+#define PROFILE_FILE L"\\SystemRoot\\Gestalt.profile"
+
+//
+// Statistics section, Global\GestaltStats for user-mode (see vmx/Stats.h for the layout)
+//
+#define STATS_SECTION_NAME L"\\BaseNamedObjects\\GestaltStats"
+
+class Hypervisor;
+
+//
+// Pending IOCTL_GESTALT_READ_EXIT_TRACE requests, a timer DPC checks them while the queue isn't empty.
+// Closing is set under Lock, no request gets in afterwards
+//
+struct TraceWaitQueue
+{
+	IO_CSQ Csq;
+	LIST_ENTRY Irps;
+	KSPIN_LOCK Lock;
+	KTIMER Timer;
+	KDPC Dpc;
+	Hypervisor* hv;
+	volatile bool Closing;
+};
 
 class Hypervisor
 {
@@ -12,11 +42,190 @@ public:
 	bool Stop();
 	inline bool IsVirtualized() const { return Virtualized; }
 	bool DeVirtualize();
+	vCPU* GetVCPU( const PROCESSOR_NUMBER& Processor ) const;
+	vCPU* GetCurrentVCPU() const;
+	void ReportFootprint() const;
+	void SetExitTrace( ULONG RecordsPerCpu );
+	bool WriteExitTrace( PCWSTR Path ) const;
+	void SetExitBenchmark( ULONG Iterations );
+	void SetTranslationCache( ULONG Enabled );
+	bool RunExitBenchmark( BENCH_PHASE Phase );
+	bool WriteExitBenchmark( PCWSTR Path );
+	bool CreateControlDevice( PDRIVER_OBJECT DriverObject );
+	void DeleteControlDevice();
+	ULONG KickAll( LONG Requests, bool Wait );
+	void SetProfiler( ULONG Rate, ULONG SamplesPerCpu );
+	bool SetProfileRate( ULONG Rate );
+	void MeasureProfileOverhead();
+	bool WriteProfile( PCWSTR Path ) const;
+	void SetTscCompensation( ULONG Policy );
+	void CalibrateTsc( BENCH_PHASE Phase );
+	void SetIoWatch( ULONG Ports );
+	bool RegisterIoRange( UINT16 First, UINT16 Last, IO_INTERCEPT_HANDLER Handler, void* Context );
+	bool UnregisterIoRange( UINT16 First );
+	void SetDescriptorTableExits( ULONG Enabled );
+	bool ShadowDescriptorTable( bool Idt, UINT64 Base, UINT16 Limit, bool Active );
+	void SetProcessTracking( ULONG Enabled );
+	INT32 WatchProcess( PEPROCESS Process, const ProcessPolicy* Policy );
+	bool UnwatchProcess( INT32 Index );
+	bool GetCurrentProcess( const PROCESSOR_NUMBER& Processor, UINT64* Cr3, INT32* Watched ) const;
+	void SetEptViews( ULONG Views );
+	void SetVeDelivery( ULONG Enabled, EPT_VE_HANDLER Handler, void* Context );
+	bool SetEptPage( UINT32 View, UINT64 GuestPhysical, UINT64 Physical, UINT32 Access );
+	bool SwitchEptView( UINT32 View );
+	void MeasureViewSwitches();
+	void SetExecutionCoverage( ULONG Enabled );
+	ULONG CoverRange( PVOID Base, SIZE_T Size );
+	ULONG ResetCoverage();
+	ULONG CollectCoverage( UINT64* Pages, ULONG Max ) const;
+	ULONG TrackWrites( UINT64 GuestPhysical, UINT64 Size );
+	ULONG DrainDirtyPages( UINT64* Pages, ULONG Max );
 private:
 	bool VMXVirtualize();
+	bool VMXBringUp();
+	static USHORT GetProcessorNode( const PROCESSOR_NUMBER& Processor );
+	bool VMXAllocateGroup( ProcessorGroup* Group );
+	bool VMXAllocateProcessor( ProcessorGroup* Group, ULONG Number );
+	void VMXFreeGroups();
+	bool VMXVirtualizeGroup( ProcessorGroup* Group );
+	bool VMXVirtualizeProcessor( vCPU* vcpu );
+	static void VMXGroupWorker( PVOID Context );
 	static int VMXExitHandler( GCPUContext* context, void* HypervisorPtr, VMX_VMEXIT_REASON ExitReason );
 	bool Virtualized;
 //
+// Exit trace capture
+//
+	bool AllocateExitTrace( vCPU* vcpu );
+	void FreeExitTrace( vCPU* vcpu );
+	ULONG ExitTraceRecords;
+//
+// Guest RIP profiler
+//
+	void InitializeProfiler();
+	bool AllocateProfile( vCPU* vcpu );
+	void FreeProfile( vCPU* vcpu );
+	ULONG ProfileRate;
+	ULONG ProfileSamples;
+	UINT64 TscFrequency;
+	UINT32 PreemptionTimerShift;
+//
+// Guest TSC compensation
+//
+	void ReportTscCompensation() const;
+	void StartTscResync();
+	void StopTscResync();
+	static void TscResyncDpc( PKDPC Dpc, PVOID Context, PVOID Argument1, PVOID Argument2 );
+	ULONG TscPolicy;
+	KTIMER TscResyncTimer;
+	KDPC TscResyncTimerDpc;
+	bool TscResyncStarted;
+	UINT64 TscNativeCycles[BenchWorkloadCount];
+//
+// I/O port intercepts
+//
+	void AddIoWatch();
+	void ReportIoRanges() const;
+	bool IoWatch;
+	UINT16 IoWatchFirst;
+	UINT16 IoWatchLast;
+//
+// Descriptor-table exits
+//
+	void ReportDescriptorTableExits() const;
+	bool DescriptorTableExits;
+//
+// Guest process tracking
+//
+	void AddCr3Targets();
+	void ReportProcessTracking() const;
+	void RegisterProcessNotify();
+	void UnregisterProcessNotify();
+	static void ProcessNotify( HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create );
+	bool ProcessTrackingEnabled;
+	bool ProcessNotifyRegistered;
+	HANDLE WatchedIds[MAX_WATCHED_PROCESSES];	// Process of each watched index, under BringUpLock
+//
+// EPT views
+//
+	bool BuildEpt();
+	void FreeEpt();
+	static bool KvaShadowEnabled();
+	void ReportEptViews() const;
+	ULONG EptViewCount;
+	PVOID EptTables;
+	SIZE_T EptTablesSize;
+	bool VeDeliveryEnabled;
+	EPT_VE_HANDLER VeHandler;
+	void* VeContext;
+//
+// Execution coverage
+//
+	void SetupCoverage();
+	void ReportCoverage() const;
+	bool CoverageEnabled;
+//
+// Exit latency benchmark
+//
+	bool RunExitBenchmarkScale( BENCH_WORKLOAD Workload, UINT32 Threads, BenchRun* Run );
+	static void BenchmarkWorker( PVOID Context );
+	ULONG BenchIterations;
+	BenchReport* Bench;
+//
+// Shared statistics region
+//
+	bool CreateStatsRegion();
+	void DeleteStatsRegion();
+	HANDLE StatsSection;
+	PVOID StatsSectionObject;
+	PVOID StatsView;
+	PMDL StatsMdl;
+	PVOID StatsRegion;
+//
+// Root mode address space and direct map
+//
+	bool BuildHostAddressSpace();
+	void FreeHostAddressSpace();
+	bool MapHostRegion( PVOID Address, SIZE_T Size, UINT32 Flags );
+	bool MapHostImage();
+	PML4E_64* SystemPml4;
+	PVOID HostTables;
+	SIZE_T HostTablesSize;
+	bool TranslationCacheEnabled;
+//
+// vCPU kicks
+//
+	bool MapApic();
+	void UnmapApic();
+//
+// Control device
+//
+	static NTSTATUS DispatchCreateClose( PDEVICE_OBJECT DeviceObject, PIRP Irp );
+	static NTSTATUS DispatchDeviceControl( PDEVICE_OBJECT DeviceObject, PIRP Irp );
+	NTSTATUS QueryCapabilities( GestaltCapabilities* Capabilities ) const;
+	NTSTATUS ControlMsrIntercept( const GestaltMsrIntercept* Intercept );
+	NTSTATUS ReadExitTrace( PIRP Irp );
+	NTSTATUS ControlTrackWrites( const GestaltPhysicalRange* Range, UINT32* Tracked );
+	NTSTATUS ReadDirtyPages( PIRP Irp );
+	vCPU* GetTracedVCPU( PIRP Irp ) const;
+	bool IsTraceReadReady( PIRP Irp ) const;
+	void CompleteTraceRead( PIRP Irp );
+	static PIRP TraceQueuePeekNextIrp( PIO_CSQ Csq, PIRP Irp, PVOID PeekContext );
+	static void TraceWaitDpc( PKDPC Dpc, PVOID Context, PVOID Argument1, PVOID Argument2 );
+	PDEVICE_OBJECT ControlDevice;
+	TraceWaitQueue TraceWaiters;
+//
+// Processor hot-add and sleep/resume
+//
+	bool RegisterProcessorEvents();
+	void UnregisterProcessorEvents();
+	static void ProcessorChangeCallback( PVOID Context, PKE_PROCESSOR_CHANGE_NOTIFY_CONTEXT ChangeContext, PNTSTATUS OperationStatus );
+	static void PowerStateCallback( PVOID Context, PVOID Argument1, PVOID Argument2 );
+	KMUTEX BringUpLock;
+	PVOID ProcessorChangeHandle;
+	PCALLBACK_OBJECT PowerStateObject;
+	PVOID PowerStateHandle;
+	bool Suspended;
+//
 // Intel
 //
 	bool IsVMX;
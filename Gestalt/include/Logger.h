@@ -1,5 +1,10 @@
 #pragma once
 #include "common.h"
 
+#if defined(GESTALT_SIM)
+#define DbgInfo(x, ...) DbgPrint("Info: " x "\n", ##__VA_ARGS__)
+#define DbgError(x, ...) DbgPrint("Error: " x "\n", ##__VA_ARGS__)
+#else
 #define DbgInfo(x, ...) DbgPrint("Info: " x "\n", __VA_ARGS__)
-#define DbgError(x, ...) DbgPrint("Error: " x "\n", __VA_ARGS__)
\ No newline at end of file
+#define DbgError(x, ...) DbgPrint("Error: " x "\n", __VA_ARGS__)
+#endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#pragma once
+#include "vmx/vmx.h"
+
+//
+// Guest-side exit latency benchmark. Each workload times one instruction per sample with the TSC,
+// BenchTimer is the timing overhead alone and BenchCrRead a control that doesn't exit
+//
+enum BENCH_WORKLOAD
+{
+	BenchTimer = 0,
+	BenchCpuidBasic,
+	BenchCpuidFeatures,
+	BenchCpuidHypervisor,
+	BenchRdmsr,
+	BenchWrmsr,
+	BenchVmcall,
+	BenchCrRead,
+	BenchWorkloadCount
+};
+
+enum BENCH_PHASE
+{
+	BenchBaseline = 0,		// Bare metal, before the processors are virtualized
+	BenchVirtualized,
+	BenchPhaseCount
+};
+
+//
+// The MSR used by the RDMSR/WRMSR workloads, it's read once and written back with the same value.
+// Its accesses only exit when the MSR bitmap says so, see vmx::SetMsrIntercept
+//
+#define BENCH_MSR IA32_TSC_AUX
+
+//
+// Log-linear histogram: 16 sub-buckets per power of two, up to 2^40 cycles, percentiles are within 1/16 of the value
+//
+#define BENCH_SUB_BUCKET_BITS 4
+#define BENCH_SUB_BUCKETS ( 1 << BENCH_SUB_BUCKET_BITS )
+#define BENCH_BUCKETS ( ( 40 - BENCH_SUB_BUCKET_BITS + 1 ) * BENCH_SUB_BUCKETS )
+
+#define BENCH_MAX_SCALES 16
+
+struct LatencyHistogram
+{
+	UINT64 Count;
+	UINT64 Sum;
+	UINT64 Min;
+	UINT64 Max;
+	UINT32 Buckets[BENCH_BUCKETS];
+};
+
+//
+// One workload run on Threads processors at once. Cycles is the sum of the time every thread spent in its loop
+//
+struct BenchRun
+{
+	UINT32 Threads;
+	UINT64 Operations;
+	UINT64 Cycles;
+	LatencyHistogram Latency;
+};
+
+struct BenchReport
+{
+	UINT32 Processors;
+	UINT32 Iterations;
+	UINT32 Scales[BenchPhaseCount];
+	BenchRun Runs[BenchWorkloadCount][BenchPhaseCount][BENCH_MAX_SCALES];
+};
+
+namespace bench
+{
+	const char* WorkloadName( BENCH_WORKLOAD Workload );
+	bool NeedsVMX( BENCH_WORKLOAD Workload );
+
+	//
+	// Run Iterations samples of a workload on the current processor, adds them to the histogram and returns the cycles spent
+	//
+	UINT64 Run( BENCH_WORKLOAD Workload, UINT32 Iterations, LatencyHistogram* Histogram );
+
+	void ResetHistogram( LatencyHistogram* Histogram );
+	void AddSample( LatencyHistogram* Histogram, UINT64 Cycles );
+	void MergeHistogram( LatencyHistogram* Destination, const LatencyHistogram* Source );
+	UINT64 Percentile( const LatencyHistogram* Histogram, UINT64 Numerator, UINT64 Denominator );
+
+	//
+	// Thread counts of the scaling runs: 1, 2, 4, ... and the number of processors last
+	//
+	UINT32 GetScales( UINT32 Processors, UINT32* Scales );
+
+	//
+	// Machine-readable report, returns the length the JSON needs (the output is truncated when it doesn't fit)
+	//
+	SIZE_T FormatJson( const BenchReport* Report, char* Buffer, SIZE_T BufferSize );
+}
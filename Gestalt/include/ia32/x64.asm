@@ -1,63 +1,106 @@
 .code _text
 
-__reades proc
-	mov rax, es
-	ret
-__reades endp
-
-__readcs proc
-	mov rax, cs
-	ret
-__readcs endp
-
-__readss proc
-	mov rax, ss
-	ret
-__readss endp
-
-__readfs proc
-	mov rax, fs
-__readfs endp
-
-__readds proc
-	mov rax, ds
-	ret
-__readds endp
-
-__readgs proc
-	mov rax, gs
-	ret
-__readgs endp
-
-__readldtr proc
-	sldt rax
-	ret
-__readldtr endp
-
-__readtr proc
-	str rax
-	ret
-__readtr endp
-
-
-__get_rip proc
-	mov rax, [rsp]
-	ret
-__get_rip endp
-
-__get_rsp proc
-	mov rax, rsp
-	add rax, 8
-	ret
-__get_rsp endp
-
-
-__segment_access_rights proc
-	lar rax, rcx
-	jz success
-	xor rax, rax
-success:
-	ret
-__segment_access_rights endp
-
-end
\ No newline at end of file
+;
+; CpuSnapshot offsets, keep in sync with x64.h
+;
+SNAPSHOT_SEGMENTS		equ 08h
+SEGMENT_SNAPSHOT_SIZE	equ 18h
+SNAPSHOT_GDTR			equ 0C8h
+SNAPSHOT_IDTR			equ 0D8h
+SNAPSHOT_CR0			equ 0E8h
+SNAPSHOT_CR3			equ 0F0h
+SNAPSHOT_CR4			equ 0F8h
+SNAPSHOT_DR7			equ 100h
+SNAPSHOT_RFLAGS			equ 108h
+SNAPSHOT_DEBUGCTL		equ 110h
+SNAPSHOT_SYSENTER_CS	equ 118h
+SNAPSHOT_SYSENTER_ESP	equ 120h
+SNAPSHOT_SYSENTER_EIP	equ 128h
+SNAPSHOT_FS_BASE		equ 130h
+SNAPSHOT_GS_BASE		equ 138h
+SNAPSHOT_EFER			equ 140h
+SNAPSHOT_PAT			equ 148h
+
+IA32_SYSENTER_CS		equ 174h
+IA32_SYSENTER_ESP		equ 175h
+IA32_SYSENTER_EIP		equ 176h
+IA32_DEBUGCTL			equ 1D9h
+IA32_PAT				equ 277h
+IA32_EFER				equ 0C0000080h
+IA32_FS_BASE			equ 0C0000100h
+IA32_GS_BASE			equ 0C0000101h
+
+;
+; Store the selector, then its access rights (lar) and limit (lsl), both zeroed when the selector is not valid
+;
+CAPTURE_SEGMENT macro INDEX
+        movzx   edx, word ptr [r8 + SNAPSHOT_SEGMENTS + INDEX * SEGMENT_SNAPSHOT_SIZE]
+        xor     eax, eax
+        lar     eax, edx
+        mov     dword ptr [r8 + SNAPSHOT_SEGMENTS + INDEX * SEGMENT_SNAPSHOT_SIZE + 4], eax
+        xor     eax, eax
+        lsl     eax, edx
+        mov     dword ptr [r8 + SNAPSHOT_SEGMENTS + INDEX * SEGMENT_SNAPSHOT_SIZE + 8], eax
+endm
+
+CAPTURE_MSR macro MSR_ID, MSR_FIELD
+        mov     ecx, MSR_ID
+        rdmsr
+        mov     dword ptr [r8 + MSR_FIELD], eax
+        mov     dword ptr [r8 + MSR_FIELD + 4], edx
+endm
+
+
+;
+; void __capture_cpu_snapshot( CpuSnapshot* Snapshot )
+;
+__capture_cpu_snapshot proc
+        mov     r8, rcx
+
+        mov     word ptr [r8 + SNAPSHOT_SEGMENTS + 0 * SEGMENT_SNAPSHOT_SIZE], es
+        mov     word ptr [r8 + SNAPSHOT_SEGMENTS + 1 * SEGMENT_SNAPSHOT_SIZE], cs
+        mov     word ptr [r8 + SNAPSHOT_SEGMENTS + 2 * SEGMENT_SNAPSHOT_SIZE], ss
+        mov     word ptr [r8 + SNAPSHOT_SEGMENTS + 3 * SEGMENT_SNAPSHOT_SIZE], ds
+        mov     word ptr [r8 + SNAPSHOT_SEGMENTS + 4 * SEGMENT_SNAPSHOT_SIZE], fs
+        mov     word ptr [r8 + SNAPSHOT_SEGMENTS + 5 * SEGMENT_SNAPSHOT_SIZE], gs
+        sldt    word ptr [r8 + SNAPSHOT_SEGMENTS + 6 * SEGMENT_SNAPSHOT_SIZE]
+        str     word ptr [r8 + SNAPSHOT_SEGMENTS + 7 * SEGMENT_SNAPSHOT_SIZE]
+
+        CAPTURE_SEGMENT 0
+        CAPTURE_SEGMENT 1
+        CAPTURE_SEGMENT 2
+        CAPTURE_SEGMENT 3
+        CAPTURE_SEGMENT 4
+        CAPTURE_SEGMENT 5
+        CAPTURE_SEGMENT 6
+        CAPTURE_SEGMENT 7
+
+        ; The limit is stored 6 bytes in, so the base lands 8-byte aligned
+        sgdt    fword ptr [r8 + SNAPSHOT_GDTR + 6]
+        sidt    fword ptr [r8 + SNAPSHOT_IDTR + 6]
+
+        mov     rax, cr0
+        mov     qword ptr [r8 + SNAPSHOT_CR0], rax
+        mov     rax, cr3
+        mov     qword ptr [r8 + SNAPSHOT_CR3], rax
+        mov     rax, cr4
+        mov     qword ptr [r8 + SNAPSHOT_CR4], rax
+        mov     rax, dr7
+        mov     qword ptr [r8 + SNAPSHOT_DR7], rax
+        pushfq
+        pop     rax
+        mov     qword ptr [r8 + SNAPSHOT_RFLAGS], rax
+
+        CAPTURE_MSR IA32_DEBUGCTL, SNAPSHOT_DEBUGCTL
+        CAPTURE_MSR IA32_SYSENTER_CS, SNAPSHOT_SYSENTER_CS
+        CAPTURE_MSR IA32_SYSENTER_ESP, SNAPSHOT_SYSENTER_ESP
+        CAPTURE_MSR IA32_SYSENTER_EIP, SNAPSHOT_SYSENTER_EIP
+        CAPTURE_MSR IA32_FS_BASE, SNAPSHOT_FS_BASE
+        CAPTURE_MSR IA32_GS_BASE, SNAPSHOT_GS_BASE
+        CAPTURE_MSR IA32_EFER, SNAPSHOT_EFER
+        CAPTURE_MSR IA32_PAT, SNAPSHOT_PAT
+
+        ret
+__capture_cpu_snapshot endp
+
+end
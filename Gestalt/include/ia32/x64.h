@@ -2,22 +2,107 @@
 
 #include "common.h"
 
+#define CPU_SNAPSHOT_MAGIC ( UINT32 ) 'panS'
+#define CPU_SNAPSHOT_VERSION 1
+
+//
+// Segment registers in the same order as the VMCS guest selector encodings (ES, CS, SS, DS, FS, GS, LDTR, TR)
+//
+enum SNAPSHOT_SEGMENT
+{
+	SnapshotEs = 0,
+	SnapshotCs,
+	SnapshotSs,
+	SnapshotDs,
+	SnapshotFs,
+	SnapshotGs,
+	SnapshotLdtr,
+	SnapshotTr,
+	SnapshotSegmentCount
+};
+
+//
+// The layout of the structures bellow is shared with __capture_cpu_snapshot (x64.asm),
+// every offset is checked at compile time, don't reorder the fields
+//
+struct SegmentSnapshot
+{
+	UINT16 Selector;
+	UINT16 Reserved0;
+	UINT32 AccessRights;	// Raw LAR output, 0 when the selector is not valid
+	UINT32 Limit;			// LSL output, 0 when the selector is not valid
+	UINT32 Reserved1;
+	UINT64 Base;			// Resolved by walking the GDT after the capture
+};
+
+struct DescriptorTableSnapshot
+{
+	UINT16 Reserved[3];		// Padding so SGDT/SIDT can store the limit right before an aligned base
+	UINT16 Limit;
+	UINT64 Base;
+};
+
+struct VmxCapabilities
+{
+	UINT64 Basic;
+	UINT64 PinBasedControls;
+	UINT64 ProcessorBasedControls;
+	UINT64 ProcessorBasedControls2;
+	UINT64 ExitControls;
+	UINT64 EntryControls;
+	UINT64 Cr0Fixed0;
+	UINT64 Cr0Fixed1;
+	UINT64 Cr4Fixed0;
+	UINT64 Cr4Fixed1;
+};
+
+//
+// Everything needed to build a VMCS for the current processor, captured at once.
+// The structure has no pointers, so it can be saved and loaded back to replay the VMCS construction
+//
+struct CpuSnapshot
+{
+	UINT32 Magic;
+	UINT16 Version;
+	UINT16 Size;
+
+	SegmentSnapshot Segments[SnapshotSegmentCount];
+	DescriptorTableSnapshot GDTR;
+	DescriptorTableSnapshot IDTR;
+
+	UINT64 Cr0;
+	UINT64 Cr3;
+	UINT64 Cr4;
+	UINT64 Dr7;
+	UINT64 Rflags;
+
+	UINT64 DebugCtl;
+	UINT64 SysenterCs;
+	UINT64 SysenterEsp;
+	UINT64 SysenterEip;
+	UINT64 FsBase;
+	UINT64 GsBase;
+	UINT64 Efer;
+	UINT64 Pat;
+
+	VmxCapabilities Vmx;
+};
+
+static_assert( sizeof( SegmentSnapshot ) == 0x18, "SegmentSnapshot layout is shared with x64.asm" );
+static_assert( FIELD_OFFSET( CpuSnapshot, Segments ) == 0x08, "CpuSnapshot layout is shared with x64.asm" );
+static_assert( FIELD_OFFSET( CpuSnapshot, GDTR ) == 0xC8, "CpuSnapshot layout is shared with x64.asm" );
+static_assert( FIELD_OFFSET( CpuSnapshot, IDTR ) == 0xD8, "CpuSnapshot layout is shared with x64.asm" );
+static_assert( FIELD_OFFSET( CpuSnapshot, Cr0 ) == 0xE8, "CpuSnapshot layout is shared with x64.asm" );
+static_assert( FIELD_OFFSET( CpuSnapshot, DebugCtl ) == 0x110, "CpuSnapshot layout is shared with x64.asm" );
+static_assert( FIELD_OFFSET( CpuSnapshot, Vmx ) == 0x150, "CpuSnapshot layout is shared with x64.asm" );
+static_assert( sizeof( CpuSnapshot ) == 0x1A0, "CpuSnapshot layout is shared with x64.asm" );
+
 
 extern "C"
 {
-	UINT16 __reades();
-	UINT16 __readcs();
-	UINT16 __readds();
-	UINT16 __readss();
-	UINT16 __readfs();
-	UINT16 __readgs();
-	UINT16 __readldtr();
-	UINT16 __readtr();
-
-	UINT64 __get_rip();
-	UINT64 __get_rsp();
-
-	UINT32 __segment_access_rights( UINT16 SegmentValue );
-	void _sgdt( void* );
-
-}
\ No newline at end of file
+	//
+	// Single pass capture of selectors, access rights, limits, GDTR/IDTR, control registers and architectural MSRs
+	//
+	void __capture_cpu_snapshot( CpuSnapshot* Snapshot );
+
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+//
+// Platform selection. The driver builds against the WDK, the GESTALT_SIM build (Linux, user-mode) builds the
+// vmx library against the software VMX model in src/sim, which provides the same intrinsics and kernel routines
+//
+#if defined(GESTALT_SIM)
+#include "platform/sim/ntsim.h"
+#else
+#include <ntifs.h>
+#include <intrin.h>
+#endif
@@ -0,0 +1,158 @@
+#pragma once
+
+//
+// User-mode stand-in for the WDK headers, used by the GESTALT_SIM build only.
+// Types and routines are the subset the vmx library uses, the intrinsics are implemented by the software VMX model (src/sim)
+//
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#else
+typedef struct alignas( 16 ) { float f[4]; } __m128;
+inline void _mm_lfence() { __atomic_thread_fence( __ATOMIC_SEQ_CST ); }
+inline void _mm_pause() {}
+#endif
+
+typedef unsigned char       UINT8;
+typedef unsigned short      UINT16;
+typedef unsigned int        UINT32;
+typedef unsigned long long  UINT64;
+typedef long long           INT64;
+typedef int                 INT32;
+
+typedef unsigned char UCHAR;
+typedef unsigned short USHORT;
+typedef unsigned int ULONG;
+typedef int LONG;
+typedef long long LONG64;
+typedef unsigned char BOOLEAN;
+typedef void* PVOID;
+typedef size_t SIZE_T;
+typedef LONG NTSTATUS;
+typedef uintptr_t ULONG_PTR;
+typedef ULONG_PTR KAFFINITY;
+
+typedef union
+{
+	struct
+	{
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	long long QuadPart;
+} PHYSICAL_ADDRESS;
+
+typedef struct
+{
+	USHORT Group;
+	UCHAR Number;
+	UCHAR Reserved;
+} PROCESSOR_NUMBER;
+
+#define TRUE 1
+#define FALSE 0
+#define IN
+#define OUT
+#define CONST const
+
+#define MAXUINT32 ( ~( UINT32 ) 0 )
+#define MAXUINT64 ( ~( UINT64 ) 0 )
+#define PAGE_SIZE 0x1000
+#define PAGE_SHIFT 12
+#define KERNEL_STACK_SIZE 0x6000
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define FIELD_OFFSET( TYPE, FIELD ) offsetof( TYPE, FIELD )
+#define CONTAINING_RECORD( ADDRESS, TYPE, FIELD ) ( ( TYPE* ) ( ( char* ) ( ADDRESS ) - offsetof( TYPE, FIELD ) ) )
+#define UNREFERENCED_PARAMETER( P ) ( void ) ( P )
+#define PAGED_CODE()
+#define KD_DEBUGGER_NOT_PRESENT TRUE
+
+#define STATUS_SUCCESS ( ( NTSTATUS ) 0 )
+#define NT_SUCCESS( STATUS ) ( ( ( NTSTATUS ) ( STATUS ) ) >= 0 )
+
+//
+// __declspec( align( N ) ) -> __attribute__(( aligned( N ) ))
+//
+#define __declspec( SPEC ) __declspec_##SPEC
+#define __declspec_align( N ) __attribute__( ( aligned( N ) ) )
+
+//
+// There is no SEH in user-mode Linux, faults inside __try are simply not expected from the model
+//
+#define __try if ( true )
+#define __except( FILTER ) else if ( false )
+
+#define __debugbreak() __builtin_trap()
+
+//
+// Kernel routines
+//
+ULONG DbgPrint( const char* Format, ... );
+PHYSICAL_ADDRESS MmGetPhysicalAddress( PVOID BaseAddress );
+
+#define RtlSecureZeroMemory( DESTINATION, LENGTH ) memset( ( DESTINATION ), 0, ( LENGTH ) )
+#define RtlZeroMemory( DESTINATION, LENGTH ) memset( ( DESTINATION ), 0, ( LENGTH ) )
+#define RtlCopyMemory( DESTINATION, SOURCE, LENGTH ) memcpy( ( DESTINATION ), ( SOURCE ), ( LENGTH ) )
+
+#define KeMemoryBarrierWithoutFence() __atomic_signal_fence( __ATOMIC_SEQ_CST )
+#define YieldProcessor() _mm_pause()
+#define InterlockedOr8( TARGET, VALUE ) __atomic_fetch_or( ( TARGET ), ( VALUE ), __ATOMIC_SEQ_CST )
+#define InterlockedAnd8( TARGET, VALUE ) __atomic_fetch_and( ( TARGET ), ( VALUE ), __ATOMIC_SEQ_CST )
+#define KeMemoryBarrier() __atomic_thread_fence( __ATOMIC_SEQ_CST )
+#define InterlockedOr( TARGET, VALUE ) __atomic_fetch_or( ( TARGET ), ( VALUE ), __ATOMIC_SEQ_CST )
+#define InterlockedExchange( TARGET, VALUE ) __atomic_exchange_n( ( TARGET ), ( VALUE ), __ATOMIC_SEQ_CST )
+#define InterlockedExchange64( TARGET, VALUE ) __atomic_exchange_n( ( TARGET ), ( VALUE ), __ATOMIC_SEQ_CST )
+#define InterlockedIncrement64( TARGET ) __atomic_add_fetch( ( TARGET ), 1, __ATOMIC_SEQ_CST )
+#define InterlockedAdd64( TARGET, VALUE ) __atomic_add_fetch( ( TARGET ), ( VALUE ), __ATOMIC_SEQ_CST )
+#define InterlockedOr64( TARGET, VALUE ) __atomic_fetch_or( ( TARGET ), ( VALUE ), __ATOMIC_SEQ_CST )
+#define InterlockedAnd64( TARGET, VALUE ) __atomic_fetch_and( ( TARGET ), ( VALUE ), __ATOMIC_SEQ_CST )
+
+inline LONG64 InterlockedCompareExchange64( volatile LONG64* Destination, LONG64 Exchange, LONG64 Comperand )
+{
+	__atomic_compare_exchange_n( Destination, &Comperand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+	return Comperand;
+}
+
+//
+// Intrinsics, same signatures as <intrin.h>
+//
+unsigned char __vmx_on( UINT64* VmsSupportPhysicalAddress );
+void __vmx_off();
+unsigned char __vmx_vmclear( UINT64* VmcsPhysicalAddress );
+unsigned char __vmx_vmptrld( UINT64* VmcsPhysicalAddress );
+unsigned char __vmx_vmread( size_t Field, unsigned long* FieldValue );
+unsigned char __vmx_vmread( size_t Field, unsigned long long* FieldValue );
+unsigned char __vmx_vmwrite( size_t Field, size_t FieldValue );
+
+UINT64 __readmsr( ULONG Register );
+void __writemsr( ULONG Register, UINT64 Value );
+void __cpuid( int CpuInfo[4], int FunctionId );
+void __cpuidex( int CpuInfo[4], int FunctionId, int SubFunctionId );
+
+unsigned char __inbyte( unsigned short Port );
+unsigned short __inword( unsigned short Port );
+unsigned long __indword( unsigned short Port );
+void __outbyte( unsigned short Port, unsigned char Data );
+void __outword( unsigned short Port, unsigned short Data );
+void __outdword( unsigned short Port, unsigned long Data );
+
+UINT64 __readcr0();
+UINT64 __readcr2();
+UINT64 __readcr3();
+UINT64 __readcr4();
+void __writecr0( UINT64 Data );
+void __writecr2( UINT64 Data );
+void __writecr3( UINT64 Data );
+void __writecr4( UINT64 Data );
+UINT64 __readeflags();
+void _disable();
+void _enable();
+UINT64 __rdtsc();
+
+void _lgdt( void* Source );
+void _sgdt( void* Destination );
+void __lidt( void* Source );
+void __sidt( void* Destination );
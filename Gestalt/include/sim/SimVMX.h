@@ -0,0 +1,103 @@
+#pragma once
+#include "vmx/vmx.h"
+
+//
+// Software VMX model for the GESTALT_SIM build. Every thread is a logical processor with its own control registers,
+// descriptor tables, MSRs and current VMCS, the VMCS itself is a field store keyed by the VMCS physical address.
+// Exits are scripted: InjectExit does what the processor and __vmx_default_exit_handler do around vmx::VMExitHandler
+//
+namespace sim
+{
+	//
+	// Guest state in and out of an injected exit
+	//
+	struct GuestRegisters
+	{
+		UINT64 rax;
+		UINT64 rcx;
+		UINT64 rdx;
+		UINT64 rbx;
+		UINT64 rbp;
+		UINT64 rsi;
+		UINT64 rdi;
+		UINT64 r8;
+		UINT64 r9;
+		UINT64 r10;
+		UINT64 r11;
+		UINT64 r12;
+		UINT64 r13;
+		UINT64 r14;
+		UINT64 r15;
+		UINT64 rsp;
+		UINT64 rip;
+		UINT64 rflags;
+	};
+
+	struct ExitEvent
+	{
+		UINT32 Reason;
+		UINT32 InstructionLength;
+		UINT64 Qualification;
+		GuestRegisters Regs;
+		UINT32 InterruptionInfo;	// Exception or NMI exits
+		UINT64 GuestLinearAddress;	// INS/OUTS exits
+		UINT64 InstructionInfo;		// INVPCID and descriptor-table exits
+		UINT64 GuestPhysicalAddress;	// EPT violations
+	};
+
+	//
+	// Default MSR and CPUID values, MSRs are copied into every processor when it attaches.
+	// A CPUID SubLeaf of -1 matches any subleaf
+	//
+	void SetMsr( UINT32 Msr, UINT64 Value );
+	void SetCpuid( int Leaf, int SubLeaf, const int Regs[4] );
+	void SetLogging( bool Enabled );
+
+	//
+	// I/O ports are latches shared by every processor, IN returns the last value written (0 at first)
+	//
+	void SetPort( UINT16 Port, UINT32 Value );
+	UINT32 GetPort( UINT16 Port );
+
+	//
+	// Bind the calling thread to a fresh logical processor, with VMX off and no current VMCS
+	//
+	void AttachProcessor( int Index );
+	void DetachProcessor();
+
+	bool InVmxOperation();
+	bool IsLaunched();
+
+	//
+	// Deliver an exit to the launched processor. Returns the exit handler status, Exit->Regs holds the guest state
+	// the processor resumes with (or returns to after vmxoff when the status is 0)
+	//
+	int InjectExit( ExitEvent* Exit );
+
+	//
+	// The guest runs mov cr3, rcx (3 bytes) with Exit->Regs. It only exits, through InjectExit, when CR3-load exiting
+	// is on and RCX isn't a CR3-target value in use: Exited tells which way it went
+	//
+	int MovToCr3( ExitEvent* Exit, bool* Exited );
+
+	//
+	// The guest accesses GuestPhysical (Access is EPT_READ, EPT_WRITE or EPT_EXECUTE) through the EPTP of the VMCS.
+	// An access the view doesn't allow is an EPT violation, injected with Exit->Regs, or a #VE the guest handles
+	// without an exit when the page is convertible
+	//
+	int GuestAccess( ExitEvent* Exit, UINT64 GuestPhysical, UINT32 Access, bool* Exited );
+
+	//
+	// INVEPT executions, every processor together
+	//
+	UINT64 InveptCount();
+
+	//
+	// vCPU bring-up on the calling thread, same steps and exit policy as Hypervisor::VMXVirtualizeProcessor
+	//
+	vCPU* AllocateVCPU( int Index, GlobalState* State );
+	void FreeVCPU( vCPU* vcpu );
+	bool Virtualize( vCPU* vcpu );
+
+	UINT64 ReadField( size_t Field );
+}
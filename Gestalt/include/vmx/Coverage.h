@@ -0,0 +1,96 @@
+#pragma once
+#include "common.h"
+
+//
+// Guest-physical pages whose first execution is recorded, at most half the slots so probes stay short
+//
+#define COVERAGE_SLOTS 8192
+#define MAX_COVERED_PAGES ( COVERAGE_SLOTS / 2 )
+#define COVERAGE_NO_SLOT -1
+
+//
+// Open addressing over the page numbers: 0 for an empty slot, COVERAGE_SLOT_REMOVED for a page that couldn't be
+// covered. A slot keeps its page until the hypervisor stops, its index is the bit of Executed
+//
+#define COVERAGE_SLOT_REMOVED MAXUINT64
+
+//
+// Execution coverage in one EPT view where the covered pages are mapped without execute. The first fetch from one is
+// an EPT violation, root mode sets its bit and gives execute back: from then on the page runs without exits.
+// Reset takes execute away again from the pages executed since, with one INVEPT on every processor (KICK_EPT).
+// Writes are tracked the same way in the same view, for the dirty pages: Drain reports the pages written since and
+// takes write away again
+//
+struct ExecutionCoverage
+{
+	UINT64 Pages[COVERAGE_SLOTS];	// Page number + 1
+	volatile LONG64 Executed[COVERAGE_SLOTS / 64];
+	volatile LONG64 Written[COVERAGE_SLOTS / 64];
+	UINT8 Rights[COVERAGE_SLOTS];	// EPT_EXECUTE and EPT_WRITE, the rights tracked on the page
+	UINT32 View;					// 0 while coverage is off
+	UINT32 Count;					// Slots taken, the removed ones included
+	UINT64 Resets;
+	UINT64 Drains;
+};
+
+struct vCPU;
+struct GlobalState;
+
+namespace vmx
+{
+	namespace coverage
+	{
+		//
+		// EPT tables the coverage view can take with every page covered, for vmx::ept::TablesSize: its PML4, and when
+		// the pages are scattered a page table for each, a page directory for each 1 GB and a PDPT for each 512 GB
+		//
+		UINT32 Tables( UINT64 PhysicalLimit );
+
+		//
+		// Guest side, before the first Cover: the view the covered pages lose execute in, created for the coverage
+		//
+		bool Setup( GlobalState* state, UINT32 View );
+
+		//
+		// Guest side, serialized with the other EPT changes. The mapping of the page in the view stays, without execute.
+		// False when the coverage is full, the page is covered already or it can't lose execute (execute-only)
+		//
+		bool Cover( GlobalState* state, UINT64 GuestPhysical );
+
+		//
+		// Same as Cover for writes, the page keeps execute and loses write. A covered page can be tracked as well, it
+		// shares the slot
+		//
+		bool TrackWrites( GlobalState* state, UINT64 GuestPhysical );
+
+		//
+		// Guest side, serialized with Cover. Every executed page loses execute again and its bit is cleared, the caller
+		// kicks every processor (KICK_EPT) once. Returns the pages taken back. The written pages are left to Drain
+		//
+		UINT32 Reset( GlobalState* state );
+
+		//
+		// Guest side, serialized with TrackWrites. The guest-physical addresses of the pages written since the last
+		// drain, up to Max of them, which lose write again; the others stay for the next drain. The caller kicks every
+		// processor (KICK_EPT) before it reads the pages. Returns how many are in Pages
+		//
+		UINT32 Drain( GlobalState* state, UINT64* Pages, UINT32 Max );
+
+		//
+		// Lock-free. The guest-physical addresses of the pages executed since the last reset, up to Max of them.
+		// Returns how many there are
+		//
+		UINT32 Collect( const ExecutionCoverage* Coverage, UINT64* Pages, UINT32 Max );
+
+		//
+		// Root mode, KICK_COVERAGE: a vCPU in view 0 goes to the coverage view
+		//
+		void Apply( vCPU* vcpu );
+
+		//
+		// Root mode, from an execute or a write EPT violation (Right is EPT_EXECUTE or EPT_WRITE): true when it was
+		// the first one on a page tracking it, recorded and allowed. The guest runs the instruction again in the same view
+		//
+		bool Record( vCPU* vcpu, UINT64 GuestPhysical, UINT32 Right );
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "common.h"
+
+//
+// Instructions that exit with descriptor-table exiting, in the order of the instruction-information field
+// (vmexit_access_to_gdtr_or_idtr first, then vmexit_access_to_ldtr_or_tr)
+//
+enum DESCRIPTOR_INSTRUCTION
+{
+	DescriptorSgdt = 0,
+	DescriptorSidt,
+	DescriptorLgdt,
+	DescriptorLidt,
+	DescriptorSldt,
+	DescriptorStr,
+	DescriptorLldt,
+	DescriptorLtr,
+	DescriptorInstructionCount
+};
+
+//
+// GDTR or IDTR value SGDT/SIDT return instead of the real one
+//
+struct DescriptorShadow
+{
+	UINT64 Base;
+	UINT16 Limit;
+	bool Active;
+};
+
+//
+// Per vCPU, only touched by the owner processor: in root mode, or by the guest side with interrupts disabled
+//
+struct DescriptorTableExits
+{
+	DescriptorShadow Gdt;
+	DescriptorShadow Idt;
+	UINT64 Exits[DescriptorInstructionCount];
+	UINT64 Cycles[DescriptorInstructionCount];		// Root mode time of the handler
+	UINT64 Faults;									// #GP, #NP and #PF given to the guest instead of emulating
+};
+
+struct GCPUContext;
+
+namespace vmx
+{
+	namespace dt
+	{
+		//
+		// The memory operands are read and written as the guest would, a translation that fails is a #PF for the guest
+		// and a bad selector a #GP or #NP. Nothing else of the instruction is emulated: the privilege checks come before
+		// the exit, and segments other than FS and GS are taken as flat
+		//
+		int HandleGdtrIdtrAccess( GCPUContext* context );
+		int HandleLdtrTrAccess( GCPUContext* context );
+
+		//
+		// Active false drops the shadow, so does LGDT/LIDT: the guest owns the table it loads
+		//
+		void SetShadow( DescriptorShadow* Shadow, UINT64 Base, UINT16 Limit, bool Active );
+
+		const char* InstructionName( DESCRIPTOR_INSTRUCTION Instruction );
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include "common.h"
+#include "ia32/ia32.h"
+
+#define DIRECT_MAP_MAX_RANGES 64
+#define DIRECT_MAP_SLOT_SIZE ( 512ULL << 30 )		// Bytes mapped by one PML4 entry
+
+//
+// A range of RAM, the only physical memory the copy routines touch
+//
+struct PhysicalRange
+{
+	UINT64 Base;
+	UINT64 Size;
+};
+
+//
+// MapRange rights, mappings are always supervisor only and global
+//
+#define HOST_MAP_WRITE 1
+#define HOST_MAP_EXECUTE 2
+
+//
+// Host address space of the root mode, owned by the hypervisor and shared by every vCPU. It only holds:
+//  - a direct map of the RAM ranges at DirectMapBase, in kernel half slots that are empty in the system PML4.
+//    Physical (and, without EPT, guest-physical) address X is at DirectMapBase + X. Large pages only where the whole
+//    page is RAM of a single MTRR memory type, the holes (MMIO) are not mapped
+//  - the memory the exit handlers touch (driver image, vCPUs, trace buffers, statistics), at the same addresses as in
+//    the system address space, added with MapRange
+// Page tables come from the Tables buffer given to BuildAddressSpace, nothing is ever unmapped
+//
+struct HostAddressSpace
+{
+	UINT64 Cr3;
+	PML4E_64* Pml4;
+	BYTE* DirectMapBase;
+	UINT64 DirectMapSize;
+	UINT32 FirstSlot;
+	UINT32 SlotCount;
+	bool LargePages1Gb;
+	UINT32 DirectMapTables;	// PDPTs, plus the tables of the large pages that were split
+	BYTE* TablesNext;
+	BYTE* TablesEnd;
+	UINT64 MappedPages;		// 4 KB pages added by MapRange, large pages included
+	UINT32 RangeCount;
+	PhysicalRange Ranges[DIRECT_MAP_MAX_RANGES];
+};
+
+namespace vmx
+{
+	namespace host
+	{
+		//
+		// Page table memory BuildAddressSpace needs for Ranges, the PML4 included. It depends on the MTRRs, both are called
+		// on the same processor
+		//
+		SIZE_T TablesSize( const PhysicalRange* Ranges, UINT32 RangeCount, bool LargePages1Gb );
+
+		//
+		// Worst case page table memory MapRange needs for Size bytes
+		//
+		SIZE_T MapTablesSize( UINT64 Size );
+		bool LargePages1GbSupported();
+
+		//
+		// Ranges must be sorted and not overlap. Tables is page aligned and non-paged, TablesSize plus the room of the
+		// later MapRange calls
+		//
+		bool BuildAddressSpace( HostAddressSpace* Host, const PML4E_64* SystemPml4, const PhysicalRange* Ranges, UINT32 RangeCount,
+			void* Tables, SIZE_T Size, bool LargePages1Gb );
+
+		//
+		// Map physically contiguous memory at VirtualAddress, with 2 MB pages wherever both addresses are aligned.
+		// Fails when the tables are exhausted, or the range is in the direct map or under a large page of another range.
+		// Safe while other processors run on the address space, as long as the calls are serialized
+		//
+		bool MapRange( HostAddressSpace* Host, UINT64 VirtualAddress, UINT64 PhysicalAddress, UINT64 Size, UINT32 Flags );
+	}
+
+	//
+	// Physical memory access from root mode through the direct map, no OS call involved
+	//
+	namespace mem
+	{
+		//
+		// A single add: nullptr when [Address, Address + Size) isn't all RAM
+		//
+		void* PhysicalToHost( const HostAddressSpace* Host, UINT64 Address, SIZE_T Size );
+		bool ReadPhysical( const HostAddressSpace* Host, UINT64 Address, void* Buffer, SIZE_T Size );
+		bool WritePhysical( const HostAddressSpace* Host, UINT64 Address, const void* Buffer, SIZE_T Size );
+	}
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include "common.h"
+
+//
+// Views of guest-physical memory, view 0 is the identity map every other view starts from. The view number is its
+// index in the EPTP list, the one VMFUNC 0 takes in ECX
+//
+#define MAX_EPT_VIEWS 8
+#define EPTP_LIST_ENTRIES 512
+#define EPT_NO_VIEW -1
+
+//
+// Page tables each view gets on top of the identity map, for the tables it copies or splits
+//
+#define EPT_TABLES_PER_VIEW 256
+
+//
+// Access rights of a guest-physical page, the low bits of an EPT entry
+//
+#define EPT_READ 1
+#define EPT_WRITE 2
+#define EPT_EXECUTE 4
+#define EPT_ACCESS_ALL ( EPT_READ | EPT_WRITE | EPT_EXECUTE )
+//
+// Not a right: the violations on the page are convertible, they go to the guest as #VE when delivery is on
+//
+#define EPT_CONVERTIBLE 8
+
+#define VE_IDT_ENTRIES 256
+
+//
+// Guest side, the view where the access of the #VE goes through, EPT_NO_VIEW to leave the fault to the hypervisor.
+// Runs in the #VE handler: interrupts disabled, on any stack of the interrupted kernel code
+//
+typedef INT32 ( *EPT_VE_HANDLER )( const VMX_VIRTUALIZATION_EXCEPTION_INFORMATION* Info, void* Context );
+
+//
+// Page tables of every view, from one physically contiguous buffer: a table is found from its physical address with an
+// add, in the guest and in root mode alike (the driver maps the buffer in the host address space). The first pages hold
+// the view owning each table, a view only writes its own tables and copies the shared ones first
+//
+struct EptTables
+{
+	BYTE* Base;
+	UINT64 BasePhysical;
+	UINT8* Owners;
+	UINT32 Count;			// Pages of the buffer
+	UINT32 Used;
+};
+
+struct EptView
+{
+	UINT64 Eptp;			// 0 for a view that doesn't exist
+	EPT_PML4E* Pml4;
+	UINT32 Tables;			// Tables of its own, the PML4 included
+	UINT64 Pages;			// SetPage calls
+};
+
+//
+// Shared by every vCPU. View 0 never changes once built, the other views change with SetPage at any time, with every
+// processor kicked afterwards (KICK_EPT) so no stale translation is left
+//
+struct EptState
+{
+	//
+	// VMCS EPTP list, view number to EPTP
+	//
+	__declspec( align( PAGE_SIZE ) ) UINT64 EptpList[EPTP_LIST_ENTRIES];
+	EptTables Tables;
+	EptView Views[MAX_EPT_VIEWS];
+	UINT32 ViewCount;
+	UINT64 PhysicalLimit;	// Guest-physical memory is mapped up to here
+	bool Enabled;
+	bool Pages1Gb;
+	bool ExecuteOnly;		// Execute without read, IA32_VMX_EPT_VPID_CAP
+	bool InveptAllContexts;	// Otherwise INVEPT goes view by view
+	//
+	// VMFUNC 0 switches the views in the guest. Without it the guest asks with VMCALL_SWITCH_VIEW
+	//
+	bool VmfuncSwitching;
+	//
+	// Violations on EPT_CONVERTIBLE pages are #VE, resolved in the guest by VeHandler or by going back to view 0
+	//
+	bool VeDelivery;
+	EPT_VE_HANDLER VeHandler;
+	void* VeContext;
+};
+
+//
+// #VE delivery of one vCPU: the information page the processor fills in, and the IDT the guest runs with. That one is
+// a copy of the system IDT whose #VE gate goes to __vmx_ve_isr. #VE is only delivered with descriptor-table exiting,
+// which keeps SIDT on the system IDT and rebuilds the copy on LIDT
+//
+struct VeDelivery
+{
+	__declspec( align( PAGE_SIZE ) ) VMX_VIRTUALIZATION_EXCEPTION_INFORMATION Info;
+	__declspec( align( PAGE_SIZE ) ) SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 Idt[VE_IDT_ENTRIES];
+};
+
+//
+// Per vCPU, only touched by the owner processor
+//
+struct EptCounters
+{
+	UINT64 HypercallSwitches;	// EPTP writes asked with VMCALL_SWITCH_VIEW
+	UINT64 FailedVmfuncs;		// VMFUNC exits, the guest got #UD
+	UINT64 Violations;
+	UINT64 LastViolation;		// Guest-physical address
+	UINT64 Invalidations;		// INVEPT of KICK_EPT
+	UINT64 VeDelivered;			// Guest side, the #VE handler ran
+	UINT64 VeUnresolved;		// VMCALL_VE_UNRESOLVED, the guest handler gave the fault to the hypervisor
+	UINT64 VeIdtReloads;		// Guest LIDT, the IDT copy rebuilt
+	UINT64 VeIdtLost;			// Guest LIDT of a table that couldn't be copied, #VE goes through the guest gate
+	UINT64 CoverageHits;		// First executions of covered pages, see vmx::coverage::Record
+	UINT64 DirtyHits;			// First writes of the pages tracking writes
+};
+
+struct vCPU;
+struct GCPUContext;
+struct CpuSnapshot;
+
+namespace vmx
+{
+	namespace ept
+	{
+		//
+		// EPT with a 4-level walk, a memory type for the structures and INVEPT. Pages1Gb tells whether 1 GB pages
+		// are supported
+		//
+		bool Supported( bool* Pages1Gb );
+
+		//
+		// Guest-physical memory the identity map covers: up to MAXPHYADDR, capped to 512 GB without 1 GB pages
+		//
+		UINT64 MapLimit( bool Pages1Gb );
+
+		//
+		// Bytes of the buffer Build needs for the identity map up to PhysicalLimit, Views views of EPT_TABLES_PER_VIEW
+		// tables on top of it and ExtraTables more. Reads the MTRRs, the memory types decide how far large pages go
+		//
+		SIZE_T TablesSize( UINT64 PhysicalLimit, bool Pages1Gb, UINT32 Views, UINT32 ExtraTables );
+
+		//
+		// Guest side, before the launch. Tables is page aligned and physically contiguous. Builds view 0, the
+		// identity map with the MTRR memory types
+		//
+		bool Build( EptState* Ept, void* Tables, SIZE_T Size, UINT64 PhysicalLimit, bool Pages1Gb );
+
+		//
+		// Before the launch, after Build. False when the processor can't convert EPT violations
+		//
+		bool EnableVe( EptState* Ept, EPT_VE_HANDLER Handler, void* Context );
+
+		//
+		// A new view, sharing every table with view 0. Returns its number, EPT_NO_VIEW when there is no room left.
+		// Before the launch, or serialized with SetPage
+		//
+		INT32 CreateView( EptState* Ept );
+
+		//
+		// Map the 4 KB guest-physical page GuestPhysical to Physical with Access in View, copying the shared tables on
+		// the way and splitting the large pages. EPT_CONVERTIBLE in Access makes its violations #VE. View 0 can't
+		// change. The calls are serialized by the caller, which kicks every processor (KICK_EPT, waiting) before
+		// relying on the new mapping
+		//
+		bool SetPage( EptState* Ept, UINT32 View, UINT64 GuestPhysical, UINT64 Physical, UINT32 Access );
+
+		//
+		// The 4 KB entry of GuestPhysical in a table View owns, null when SetPage didn't split the way to it. Its
+		// rights can change in place with an interlocked operation, the address and the type stay
+		//
+		UINT64* PageEntry( EptState* Ept, UINT32 View, UINT64 GuestPhysical );
+
+		//
+		// Where GuestPhysical goes in View. Size is the page size of the mapping
+		//
+		bool GetPage( const EptState* Ept, UINT32 View, UINT64 GuestPhysical, UINT64* Physical, UINT32* Access,
+			UINT32* MemoryType, UINT64* Size );
+
+		//
+		// Root mode, from ConfigureVMCSFields: the vCPU starts in view 0. Vmfunc is whether the VM functions
+		// control made it in the secondary controls
+		//
+		void Reset( vCPU* vcpu, bool Enabled, bool Vmfunc );
+
+		//
+		// Root mode, from ConfigureVMCSFields after Reset: the VE information page and the IDT copy with the #VE gate,
+		// shadowed so SIDT returns the system IDT
+		//
+		void ResetVe( vCPU* vcpu, const CpuSnapshot* snapshot, bool Enabled );
+
+		//
+		// Root mode, LIDT while #VE is delivered: the copy is rebuilt from the new table, which SIDT shows from then on.
+		// A table the page walker can't read is loaded as is, and #VE goes through the guest gate until the next LIDT
+		//
+		bool ReloadVe( vCPU* vcpu, UINT64 Base, UINT16 Limit );
+
+		//
+		// Root mode. The fallback of VMFUNC, a write of the EPTP
+		//
+		bool SwitchView( vCPU* vcpu, UINT32 View );
+		INT32 CurrentView( vCPU* vcpu );
+
+		//
+		// Root mode, KICK_EPT: views changed, the translations they left are flushed
+		//
+		void Invalidate( vCPU* vcpu );
+
+		//
+		// vmexit_ept_violation: an access a view doesn't allow. The vCPU goes back to view 0, the complete one,
+		// where the access goes through, unless the coverage view records the access and allows it
+		//
+		int HandleViolation( GCPUContext* context );
+
+		//
+		// vmexit_vmfunc: VMFUNC with a function or a view that doesn't exist
+		//
+		int HandleVmfunc( GCPUContext* context );
+
+		//
+		// Guest side, from the #VE handler of the calling processor: the fault goes on in the view VeHandler picks,
+		// view 0 without one, and the next #VE can come. Only a fault VeHandler can't resolve enters the hypervisor
+		//
+		void HandleVe( vCPU* vcpu );
+
+		//
+		// Root mode, VMCALL_VE_UNRESOLVED: handled like the EPT violation exit would have been
+		//
+		bool HandleUnresolvedVe( vCPU* vcpu );
+	}
+}
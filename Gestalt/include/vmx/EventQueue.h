@@ -0,0 +1,61 @@
+#pragma once
+#include "common.h"
+
+#define EVENT_QUEUE_SIZE 8
+
+//
+// An event waiting to be injected, Info is the VM-entry interruption-information value (valid bit set)
+//
+struct PendingEvent
+{
+	UINT32 Info;
+	UINT32 ErrorCode;
+	UINT32 InstructionLength;	// Software interrupts and exceptions only
+};
+
+//
+// Events for the guest of one vCPU, only touched by its own processor in root mode. One event goes in per VM entry,
+// the rest wait with interrupt-window or NMI-window exiting armed for the kind that is blocked
+//
+struct EventQueue
+{
+	PendingEvent Events[EVENT_QUEUE_SIZE];
+	UINT32 Count;
+	UINT32 ProcBasedControls;	// Primary controls without the window bits
+	bool InterruptWindow;
+	bool NmiWindow;
+	bool NmiWindowSupported;	// Needs virtual NMIs
+	bool VectoringHandled;		// The exit handler already took care of the IDT-vectoring event
+	UINT64 Injected;
+	UINT64 Dropped;
+};
+
+struct vCPU;
+struct GCPUContext;
+
+namespace vmx
+{
+	namespace events
+	{
+		void Reset( EventQueue* Queue, UINT32 ProcBasedControls, bool NmiWindowSupported );
+
+		//
+		// Fails when the queue is full, the event is counted as dropped
+		//
+		bool Queue( EventQueue* Queue, UINT32 Vector, UINT32 Type, bool HasErrorCode, UINT32 ErrorCode, UINT32 InstructionLength );
+		bool QueueException( EventQueue* Queue, UINT32 Vector, bool HasErrorCode, UINT32 ErrorCode );
+		bool QueueNmi( EventQueue* Queue );
+		bool QueueInterrupt( EventQueue* Queue, UINT32 Vector );
+
+		//
+		// Last thing before VM entry: the event that was being delivered when the exit happened goes first,
+		// then the queued one with the highest priority the guest can take. Arms or disarms the windows
+		//
+		void Inject( vCPU* vcpu, const GCPUContext* context );
+
+		//
+		// vmexit_nmi: a guest exception or NMI caught by the exception bitmap or NMI exiting, given back to the guest
+		//
+		int HandleExceptionOrNmi( GCPUContext* context );
+	}
+}
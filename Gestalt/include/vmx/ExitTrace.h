@@ -0,0 +1,62 @@
+#pragma once
+#include "common.h"
+
+#define EXIT_TRACE_MAGIC ( UINT32 ) 'ecrT'
+#define EXIT_TRACE_VERSION 1
+#define EXIT_TRACE_GPR_COUNT 15
+
+struct GCPUContext;
+
+//
+// One VM exit as it arrived, before any handler ran. The GPRs are in GCPUContext order (r15 first, rax last)
+//
+struct ExitTraceRecord
+{
+	UINT64 Tsc;
+	UINT32 Reason;
+	UINT32 InstructionLength;
+	UINT64 Qualification;
+	UINT64 Rip;
+	UINT64 Rsp;
+	UINT64 Rflags;
+	UINT64 Gpr[EXIT_TRACE_GPR_COUNT];
+};
+
+//
+// A trace file is a sequence of blocks, one per processor: the header followed by RecordCount records
+//
+struct ExitTraceHeader
+{
+	UINT32 Magic;
+	UINT16 Version;
+	UINT16 RecordSize;
+	UINT32 CpuNumber;
+	UINT32 Reserved;
+	UINT64 RecordCount;
+	UINT64 Dropped;
+};
+
+static_assert( sizeof( ExitTraceRecord ) == 0xA8, "ExitTraceRecord is part of the trace file format" );
+static_assert( sizeof( ExitTraceHeader ) == 0x20, "ExitTraceHeader is part of the trace file format" );
+
+//
+// Per vCPU capture buffer, only written by the owner processor from the exit handler.
+// Once full, new exits are counted as dropped so the stream kept is contiguous
+//
+struct ExitTrace
+{
+	ExitTraceRecord* Records;
+	UINT64 Capacity;
+	UINT64 Count;
+	UINT64 Dropped;
+};
+
+namespace vmx
+{
+	namespace trace
+	{
+		void Record( ExitTrace* Trace, const GCPUContext* context, UINT32 Reason, UINT64 Tsc );
+		void FillHeader( const ExitTrace* Trace, int CpuNumber, ExitTraceHeader* Header );
+		const ExitTraceRecord* ParseBlock( const void* Buffer, SIZE_T BufferSize, ExitTraceHeader* Header, SIZE_T* BlockSize );
+	}
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include "common.h"
+#include "DirectMap.h"
+
+//
+// Direct-mapped, a power of two
+//
+#define TRANSLATION_CACHE_ENTRIES 64
+
+#define GUEST_PAGE_SHIFT_4KB 12
+#define GUEST_PAGE_SHIFT_2MB 21
+#define GUEST_PAGE_SHIFT_1GB 30
+
+#define GUEST_CR3_NO_FLUSH ( 1ULL << 63 )		// MOV to CR3 with CR4.PCIDE set: keep the cached translations of the PCID
+#define GUEST_CR3_PCID_MASK 0xFFFULL
+
+enum GUEST_WALK_STATUS
+{
+	GuestWalkOk = 0,
+	GuestWalkNonCanonical,
+	GuestWalkNotPresent,
+	GuestWalkUnreadable,		// A paging structure isn't in RAM
+};
+
+//
+// Result of a guest-virtual to guest-physical translation. The access rights are the combined ones of every level,
+// Executable ignores IA32_EFER.NXE (the XD bits are taken as they are)
+//
+struct GuestTranslation
+{
+	UINT64 PhysicalAddress;
+	UINT8 PageShift;
+	bool Writable;
+	bool User;
+	bool Executable;
+	bool Global;
+};
+
+struct TranslationCacheEntry
+{
+	UINT64 Tag;				// Address space, see vmx::guest::AddressSpaceTag
+	UINT64 VirtualPage;		// Address >> 12
+	UINT64 PhysicalPage;	// 4 KB frame of the translated page, even inside a large page
+	UINT8 PageShift;
+	bool Valid;
+	bool Writable;
+	bool User;
+	bool Executable;
+	bool Global;
+};
+
+//
+// Software TLB of one vCPU, only used by its own processor in root mode.
+// It follows the architectural invalidation rules: MOV to CR3, INVLPG and INVPCID drop the entries the processor would drop,
+// so it is only valid while those instructions exit (see GlobalState::TrackTranslations)
+//
+struct TranslationCache
+{
+	bool Enabled;
+	UINT64 Hits;
+	UINT64 Misses;			// Every miss is a page walk
+	UINT64 WalkCycles;
+	UINT64 Flushes;
+	TranslationCacheEntry Entries[TRANSLATION_CACHE_ENTRIES];
+};
+
+namespace vmx
+{
+	//
+	// Guest paging, the structures are read with the direct map of the host address space
+	//
+	namespace guest
+	{
+		//
+		// CR3 address and, with CR4.PCIDE, the PCID. Two CR3 values with the same tag share the cached translations
+		//
+		UINT64 AddressSpaceTag( UINT64 Cr3, UINT64 Cr4 );
+
+		//
+		// 4-level or 5-level (CR4.LA57) walk with 4 KB, 2 MB and 1 GB pages, no cache involved
+		//
+		GUEST_WALK_STATUS Walk( const HostAddressSpace* Host, UINT64 Cr3, UINT64 Cr4, UINT64 Address, GuestTranslation* Translation );
+
+		//
+		// Walk through the cache, the cache is bypassed when it isn't enabled
+		//
+		GUEST_WALK_STATUS Translate( TranslationCache* Cache, const HostAddressSpace* Host, UINT64 Cr3, UINT64 Cr4, UINT64 Address,
+			GuestTranslation* Translation );
+
+		//
+		// Copy guest-virtual memory, the range can cross pages. Fails on the first page that doesn't translate
+		//
+		bool ReadVirtual( TranslationCache* Cache, const HostAddressSpace* Host, UINT64 Cr3, UINT64 Cr4, UINT64 Address,
+			void* Buffer, SIZE_T Size );
+
+		//
+		// Same for writes, the pages have to be writable. Pages before the first failing one are written
+		//
+		bool WriteVirtual( TranslationCache* Cache, const HostAddressSpace* Host, UINT64 Cr3, UINT64 Cr4, UINT64 Address,
+			const void* Buffer, SIZE_T Size );
+
+		//
+		// Invalidation, named after the guest instruction they follow
+		//
+		void ResetCache( TranslationCache* Cache, bool Enabled );
+		void FlushAll( TranslationCache* Cache, bool Globals );
+		void FlushAddress( TranslationCache* Cache, UINT64 Address );
+		void FlushPcid( TranslationCache* Cache, UINT64 Pcid, bool SingleAddress, UINT64 Address );
+		void LoadCr3( TranslationCache* Cache, UINT64 Cr3, UINT64 Cr4 );
+	}
+}
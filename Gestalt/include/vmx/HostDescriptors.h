@@ -0,0 +1,115 @@
+#pragma once
+#include "common.h"
+#include "ia32/x64.h"
+
+//
+// Room for the system GDT copy, Windows uses 16 entries (the TSS descriptor takes two)
+//
+#define HOST_GDT_ENTRIES 32
+#define HOST_IDT_ENTRIES 256
+#define HOST_EXCEPTION_VECTORS 32
+
+//
+// Exceptions that can hit at any point of the exit handling switch to a known good stack
+//
+#define HOST_IST_NMI 1
+#define HOST_IST_DOUBLE_FAULT 2
+#define HOST_IST_MACHINE_CHECK 3
+#define HOST_IST_COUNT 3
+#define HOST_IST_STACK_SIZE ( 2 * PAGE_SIZE )
+
+//
+// Vector reported for the IDT entries above the exceptions, root mode runs with interrupts disabled so only INT n gets there
+//
+#define HOST_VECTOR_UNEXPECTED HOST_EXCEPTION_VECTORS
+
+//
+// Root mode descriptor tables of one processor, never shared with the guest. The GDT is a copy of the system one,
+// so the host selectors stay the same, with the TSS descriptor pointing to Tss
+//
+struct HostDescriptors
+{
+	__declspec( align( PAGE_SIZE ) ) SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64 Idt[HOST_IDT_ENTRIES];
+	UINT64 Gdt[HOST_GDT_ENTRIES];
+	TASK_STATE_SEGMENT_64 Tss;
+	__declspec( align( PAGE_SIZE ) ) BYTE IstStacks[HOST_IST_COUNT][HOST_IST_STACK_SIZE];
+};
+
+//
+// Built by the host interrupt stubs (vmx_ext.asm), the layout is shared with them
+//
+struct HostTrapFrame
+{
+	__m128 xmm[6];
+	UINT64 r15;
+	UINT64 r14;
+	UINT64 r13;
+	UINT64 r12;
+	UINT64 r11;
+	UINT64 r10;
+	UINT64 r9;
+	UINT64 r8;
+	UINT64 rdi;
+	UINT64 rsi;
+	UINT64 rbp;
+	UINT64 rbx;
+	UINT64 rdx;
+	UINT64 rcx;
+	UINT64 rax;
+	UINT64 Vector;
+	UINT64 ErrorCode;	// 0 for the exceptions without one
+	//
+	// Pushed by the processor
+	//
+	UINT64 rip;
+	UINT64 cs;
+	UINT64 rflags;
+	UINT64 rsp;
+	UINT64 ss;
+};
+
+static_assert( FIELD_OFFSET( HostTrapFrame, Vector ) == 0xD8, "HostTrapFrame layout is shared with vmx_ext.asm" );
+
+//
+// Events that hit root mode, owned by the vCPU processor. NMIs and recoverable machine checks belong to the guest
+// and are injected on the next VM entry, any other exception ends the hypervisor on the processor
+//
+struct HostEvents
+{
+	bool PendingNmi;
+	bool PendingMachineCheck;
+	UINT64 Nmis;
+	UINT64 MachineChecks;
+	UINT64 MsrFaults;		// #GP of an emulated RDMSR/WRMSR, given to the guest
+	//
+	// Last fatal exception
+	//
+	UINT64 FaultVector;
+	UINT64 FaultErrorCode;
+	UINT64 FaultRip;
+	UINT64 FaultAddress;	// CR2 of a page fault
+};
+
+namespace vmx
+{
+	namespace host
+	{
+		//
+		// Fails when the system GDT doesn't fit or TrSelector isn't a TSS, the processor is not virtualized then
+		//
+		bool BuildDescriptors( HostDescriptors* Descriptors, const SEGMENT_DESCRIPTOR_REGISTER_64* SystemGdtr, UINT16 CsSelector,
+			UINT16 TrSelector );
+	}
+
+	//
+	// Interrupt stubs of the exceptions, HOST_VECTOR_UNEXPECTED last
+	//
+	extern "C" const UINT64 __vmx_host_isr_table[HOST_EXCEPTION_VECTORS + 1];
+
+	//
+	// The RDMSR and WRMSR of __vmx_rdmsr_safe/__vmx_wrmsr_safe, a #GP there returns 1 through __vmx_msr_fault
+	//
+	extern "C" const BYTE __vmx_msr_read[];
+	extern "C" const BYTE __vmx_msr_write[];
+	extern "C" void __vmx_msr_fault();
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "common.h"
+
+#define IO_BITMAP_PORTS 0x8000		// Ports per bitmap, A covers 0 - 0x7FFF and B 0x8000 - 0xFFFF
+#define MAX_IO_RANGES 16
+#define MAX_IO_STRING_ITERATIONS 1024	// REP INS/OUTS iterations per exit, the guest runs the rest on its next try
+#define IO_RESTART 2					// Handler result: RIP stays on the instruction
+
+//
+// Decoded I/O instruction exit
+//
+struct IoAccess
+{
+	UINT16 Port;
+	UINT8 Size;				// 1, 2 or 4 bytes
+	bool In;
+	bool String;			// INS/OUTS, the data is in guest memory from LinearAddress on
+	bool Rep;				// Count iterations, the handler does all of them or returns IO_RESTART with RCX updated
+	bool Immediate;			// Port encoded in the instruction, DX otherwise
+	UINT64 LinearAddress;
+	UINT64 Count;			// RCX with a REP prefix, 1 otherwise
+};
+
+struct GCPUContext;
+struct GlobalState;
+
+//
+// Runs in root mode on the processor that exited, RIP is moved past the instruction when it returns 1 and stays on it
+// with IO_RESTART (a queued fault, a partly done REP). Returning 0 leaves VMX operation on that processor, like any exit
+// that can't be handled, a negative value has the access done on the real port
+//
+typedef int ( *IO_INTERCEPT_HANDLER )( GCPUContext* context, const IoAccess* Access, void* Context );
+
+struct IoRange
+{
+	UINT16 First;
+	UINT16 Last;
+	IO_INTERCEPT_HANDLER Handler;
+	void* Context;
+	volatile LONG64 Exits;
+	volatile bool Active;
+};
+
+//
+// Both I/O bitmaps and the ranges behind their bits. Ranges don't overlap, a port that exits has one handler at most
+//
+struct IoIntercepts
+{
+	__declspec( align( PAGE_SIZE ) ) UINT8 BitMapA[PAGE_SIZE];
+	__declspec( align( PAGE_SIZE ) ) UINT8 BitMapB[PAGE_SIZE];
+	IoRange Ranges[MAX_IO_RANGES];
+};
+
+namespace vmx
+{
+	namespace io
+	{
+		//
+		// Registration is not synchronized, the caller serializes it. The bits flip while the processors run:
+		// a range is published before its ports exit, and its ports stop exiting before it goes away
+		//
+		bool AddRange( GlobalState* state, UINT16 First, UINT16 Last, IO_INTERCEPT_HANDLER Handler, void* Context );
+		bool RemoveRange( GlobalState* state, UINT16 First );
+
+		//
+		// vmexit_io_instruction
+		//
+		int HandleIo( GCPUContext* context );
+
+		//
+		// Does the access on the real port. String instructions go through the guest page walker, they need the direct map.
+		// An element the guest can't access is a #PF with the iterations before it done, and a long REP is split over
+		// several exits
+		//
+		int PassThrough( GCPUContext* context, const IoAccess* Access );
+	}
+}
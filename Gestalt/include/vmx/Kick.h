@@ -0,0 +1,71 @@
+#pragma once
+#include "common.h"
+
+//
+// Requests carried by a kick, handled by the vCPU in root mode before it resumes the guest
+//
+#define KICK_SYNC 0x1		// Nothing but the trip through root mode
+#define KICK_PROFILE 0x2	// Apply GlobalState::ProfilePeriod
+#define KICK_PROCESSES 0x4	// Catch up with the watched processes of GlobalState::Processes
+#define KICK_EPT 0x8			// Flush the translations of the EPT views, see vmx::ept::SetPage
+#define KICK_COVERAGE 0x10		// Go to the execution coverage view, see vmx::coverage::Apply
+
+//
+// Local APIC, xAPIC registers (x2APIC uses IA32_X2APIC_ICR)
+//
+#define APIC_ICR_LOW 0x300
+#define APIC_ICR_HIGH 0x310
+#define APIC_ICR_DELIVERY_PENDING ( 1 << 12 )
+#define APIC_ICR_NMI ( ( 4 << 8 ) | ( 1 << 14 ) )	// NMI delivery mode, assert
+
+//
+// A kick is an NMI sent to a vCPU by the hypervisor, with NMI exiting it lands in root mode right away.
+// Pending is set for the one kick NMI in flight, and the first NMI that comes consumes it: NMIs coalesce, so counting
+// them could leave kicks unclaimed forever and swallow the real NMIs after them. Any NMI that finds Pending clear is a
+// real one and goes to the guest. Sent numbers the kicks for the waiters, Completed is the last one handled.
+// Written by every processor, on its own cache line
+//
+struct KickState
+{
+	volatile LONG64 Sent;
+	volatile LONG64 Completed;	// Sent when the requests were last handled
+	volatile LONG Pending;		// A kick NMI was sent and no NMI consumed it yet
+	volatile bool Claimed;		// An NMI consumed a kick, its requests wait for Process
+	volatile LONG Requests;
+	UINT32 ApicId;
+	bool Enabled;				// NMI exiting and virtual NMIs are on
+	UINT64 RealNmis;
+};
+
+struct vCPU;
+struct GlobalState;
+
+namespace vmx
+{
+	namespace kick
+	{
+		UINT32 CurrentApicId();
+
+		//
+		// From the guest side, at any IRQL. The xAPIC needs GlobalState::ApicMmio, the x2APIC nothing.
+		// Returns the ticket to wait for (Completed reaching it), 0 when the vCPU can't be kicked
+		//
+		LONG64 Send( vCPU* vcpu, LONG Requests );
+
+		//
+		// From the guest side, for a kick that wasn't handled in time: the NMI again, only when the previous one was
+		// consumed already, so the vCPU never gets a kick NMI it can't claim. Requests and tickets stay as they are
+		//
+		bool Resend( vCPU* vcpu );
+
+		//
+		// Root mode, for every NMI: true when it was a kick and must not reach the guest. Consumes the pending kick
+		//
+		bool IsKick( KickState* Kick );
+
+		//
+		// Root mode, before resuming the guest
+		//
+		void Process( vCPU* vcpu );
+	}
+}
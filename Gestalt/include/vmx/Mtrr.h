@@ -0,0 +1,41 @@
+#pragma once
+#include "common.h"
+#include "ia32/ia32.h"
+
+#define MTRR_FIXED_LIMIT 0x100000
+#define MTRR_FIXED_REGISTERS 11
+
+struct MtrrRange
+{
+	UINT64 Base;
+	UINT64 Mask;
+	UINT8 Type;
+};
+
+//
+// Memory types of the physical address space, as the MTRRs of the current processor give them. Both the EPT identity
+// map and the direct map of the host address space only use large pages of a single type
+//
+struct Mtrrs
+{
+	bool Enabled;
+	bool FixedEnabled;
+	UINT8 DefaultType;
+	UINT32 VariableCount;
+	MtrrRange Variable[IA32_MTRR_VARIABLE_COUNT];
+	UINT64 Fixed[MTRR_FIXED_REGISTERS];
+};
+
+namespace vmx
+{
+	namespace mtrr
+	{
+		void Read( Mtrrs* Types );
+
+		//
+		// Memory type of [Base, Base + Size), Size a power of two and Base aligned on it. MEMORY_TYPE_INVALID when it isn't
+		// the same all over: the range needs smaller pages
+		//
+		UINT8 RangeType( const Mtrrs* Types, UINT64 Base, UINT64 Size );
+	}
+}
@@ -0,0 +1,175 @@
+#pragma once
+#include "common.h"
+
+//
+// CR3-target values of the VMCS, the processor may support fewer (IA32_VMX_MISC[24:16])
+//
+#define MAX_CR3_TARGETS 4
+#define MAX_WATCHED_PROCESSES 8
+#define MAX_POLICY_MSRS 8
+
+//
+// Open addressing over the directory bases, a power of two kept twice the bases of the watched processes (a kernel
+// and a user one each) so probes stay short
+//
+#define PROCESS_HASH_SLOTS 32
+
+//
+// Bits of CR3 naming the address space, the PCID and the no-flush bit belong to the load
+//
+#define PROCESS_CR3_MASK 0x000FFFFFFFFFF000ULL
+
+#define PROCESS_NOT_WATCHED -1
+
+struct PolicyMsr
+{
+	UINT32 Msr;
+	bool Read;
+	bool Write;
+};
+
+//
+// Intercepts added to the system ones while the process runs, the guest gets the same result as without them:
+// exceptions are reflected and MSRs emulated with the real MSR. EptView, when not 0, is the EPT view the processor
+// runs in while the process does, it goes back to the view it was in when the process is switched away from
+//
+struct ProcessPolicy
+{
+	UINT32 ExceptionBitmap;
+	UINT32 MsrCount;
+	PolicyMsr Msrs[MAX_POLICY_MSRS];
+	UINT32 EptView;
+};
+
+//
+// A process followed on every processor, by the directory base of its address space. With KVA shadowing user mode
+// runs on a second one, UserCr3, both go to the process
+//
+struct WatchedProcess
+{
+	UINT64 Cr3;
+	UINT64 UserCr3;					// 0 without KVA shadowing
+	ProcessPolicy Policy;
+	UINT64 MsrBitMap;				// Physical address of its MSR bitmap, 0 when the policy has no MSR
+	volatile LONG64 Switches;		// Loads of its CR3, every processor together
+	volatile LONG64 Cycles;			// TSC cycles it ran for, counted when a processor switches away from it
+	volatile LONG64 Intercepts;		// Exits its policy asked for: its exceptions and RDMSR/WRMSR of its MSRs
+	volatile bool Active;
+};
+
+struct ProcessHashSlot
+{
+	UINT64 Cr3;						// 0 for an empty slot
+	INT32 Watched;
+};
+
+//
+// Shared by every vCPU. The targets are set before the launch, the watched processes at any time with the processors
+// kicked afterwards (KICK_PROCESSES)
+//
+struct ProcessTracking
+{
+	//
+	// System MSR bitmap with the MSRs of the policy on top, one per watched process
+	//
+	__declspec( align( PAGE_SIZE ) ) VMX_MSR_BITMAP MsrBitMaps[MAX_WATCHED_PROCESSES];
+	//
+	// MOV to CR3 with one of these operands (PCID and bit 63 included) doesn't exit. None of them may be watched
+	//
+	UINT64 Targets[MAX_CR3_TARGETS];
+	UINT32 TargetCount;
+	WatchedProcess Watched[MAX_WATCHED_PROCESSES];
+	//
+	// Directory base to watched process, rebuilt in the unused copy and switched over on every change. A copy is only
+	// rebuilt once every processor was kicked after the previous change, none of them can still be reading it
+	//
+	ProcessHashSlot Hash[2][PROCESS_HASH_SLOTS];
+	volatile LONG HashIndex;
+};
+
+//
+// Process running on one vCPU. Only written by the owner processor in root mode, read from anywhere without a lock:
+// Sequence is odd while the record changes, readers retry until they get the same even value on both sides.
+// The targets only skip exits while no watched process runs, Watched is always right. Cr3 is the last CR3 loaded
+// with an exit, a target may be running instead
+//
+struct ProcessRecord
+{
+	volatile UINT32 Sequence;
+	INT32 Watched;			// Index in ProcessTracking::Watched or PROCESS_NOT_WATCHED
+	UINT64 Cr3;
+	UINT64 Since;			// TSC of the switch to a watched process
+};
+
+//
+// Per vCPU, only touched by the owner processor, but for the record. The Loaded fields are the control set in the VMCS,
+// a switch only writes the ones that change
+//
+struct ProcessSwitches
+{
+	ProcessRecord Current;
+	UINT64 Loads;			// CR3-load exits
+	UINT64 Cycles;			// Root mode cycles spent following the switches
+	UINT64 ControlSwaps;	// Switches that changed the control set
+	UINT64 ViewSwitches;	// EPT view changes of the policies
+	UINT64 SystemMsrBitMap;	// Physical address of GlobalState::MSRBitMap
+	UINT64 LoadedMsrBitMap;
+	UINT32 LoadedExceptions;
+	UINT32 PolicyView;		// EPT view of the policy in force, 0 for none
+	UINT32 ViewBefore;		// View the processor was in before it
+	UINT32 TargetLimit;		// CR3-target values the processor supports, capped to MAX_CR3_TARGETS
+	UINT32 TargetsLoaded;	// VMCS CR3-target count
+	bool Enabled;
+};
+
+struct vCPU;
+struct GCPUContext;
+struct GlobalState;
+
+namespace vmx
+{
+	namespace process
+	{
+		//
+		// Before the launch, after the MSR bitmap is in the VMCS. Cr3 is the one the guest starts with.
+		// The targets are left out when the translation cache is on: it has to see every load
+		//
+		void Reset( vCPU* vcpu, bool Enabled, UINT64 Cr3 );
+
+		//
+		// Root mode, on a MOV to CR3 exit
+		//
+		void Switch( vCPU* vcpu, UINT64 Cr3 );
+
+		//
+		// Root mode, KICK_PROCESSES: the watched processes changed, the record catches up with the running CR3
+		//
+		void Apply( vCPU* vcpu );
+
+		//
+		// From any processor. False when the record kept changing under the reader
+		//
+		bool Read( const ProcessRecord* Record, UINT64* Cr3, INT32* Watched );
+
+		//
+		// Root mode, on every exit while a watched process runs. Counts the ones its policy asked for, the NMIs and the
+		// exits of the system intercepts are not
+		//
+		void CountIntercept( GCPUContext* context, UINT32 Reason );
+
+		//
+		// Returns the index of the watched process, PROCESS_NOT_WATCHED when the table is full, a CR3 is already watched,
+		// it is a CR3-target value or the EPT view of the policy doesn't exist (or is the coverage one). UserCr3 is 0, or
+		// the user-mode directory base of KVA shadowing. Policy can be null, the process is only followed then. Watch,
+		// Unwatch and vmx::SetMsrIntercept are serialized by the caller, which kicks every processor (KICK_PROCESSES,
+		// waiting) before the next change
+		//
+		INT32 Watch( GlobalState* state, UINT64 Cr3, UINT64 UserCr3, const ProcessPolicy* Policy );
+		bool Unwatch( GlobalState* state, INT32 Index );
+
+		//
+		// The system bitmap changed for Msr, from vmx::SetMsrIntercept
+		//
+		void RefreshMsr( GlobalState* state, UINT32 Msr );
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "common.h"
+
+#define PROFILE_MAGIC ( UINT32 ) 'forP'
+#define PROFILE_VERSION 1
+
+//
+// Where the guest was when the preemption timer expired. Cpl is the DPL of the guest SS
+//
+struct ProfileSample
+{
+	UINT64 Tsc;
+	UINT64 Rip;
+	UINT64 Cr3;
+	UINT32 Cpl;
+	UINT32 Reserved;
+};
+
+//
+// A profile file is a sequence of blocks, one per processor: the header followed by SampleCount samples, oldest first
+//
+struct ProfileHeader
+{
+	UINT32 Magic;
+	UINT16 Version;
+	UINT16 SampleSize;
+	UINT32 CpuNumber;
+	UINT32 Period;			// Preemption timer ticks between samples
+	UINT64 SampleCount;
+	UINT64 Lost;			// Overwritten by newer ones
+};
+
+static_assert( sizeof( ProfileSample ) == 0x20, "ProfileSample is part of the profile file format" );
+static_assert( sizeof( ProfileHeader ) == 0x20, "ProfileHeader is part of the profile file format" );
+
+//
+// Per vCPU sample ring, only written by the owner processor from the exit handler. Unlike the exit trace the oldest
+// samples are overwritten, the ring keeps the last Capacity
+//
+struct ProfileRing
+{
+	ProfileSample* Samples;
+	UINT64 Capacity;			// Power of two
+	volatile UINT64 Head;		// Samples taken
+	UINT64 Cycles;				// Root mode time spent taking them
+	UINT32 Period;				// Applied from GlobalState::ProfilePeriod, 0 when off
+	UINT32 PinBasedControls;	// Controls without the preemption timer bits
+	UINT32 ExitControls;
+	bool Supported;
+};
+
+struct vCPU;
+struct GCPUContext;
+
+namespace vmx
+{
+	namespace profile
+	{
+		//
+		// Preemption timer ticks for Rate samples per second, the timer counts every 2^TimerShift TSC cycles
+		// (IA32_VMX_MISC[4:0]). 0 when Rate is 0
+		//
+		UINT32 PeriodFromRate( UINT64 TscFrequency, UINT32 Rate, UINT32 TimerShift );
+
+		void Reset( ProfileRing* Ring, UINT32 PinBasedControls, UINT32 ExitControls, bool Supported );
+
+		//
+		// Arms or disarms the timer of the current VMCS for GlobalState::ProfilePeriod, in root mode or before launch
+		//
+		void Apply( vCPU* vcpu );
+
+		//
+		// vmexit_vmx_preemption_timer_expired: take a sample and re-arm
+		//
+		int HandleTimer( GCPUContext* context );
+
+		//
+		// The samples kept are Count at First, wrapping at Capacity
+		//
+		void FillHeader( const ProfileRing* Ring, int CpuNumber, ProfileHeader* Header, UINT64* First );
+	}
+}
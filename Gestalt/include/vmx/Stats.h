@@ -0,0 +1,64 @@
+#pragma once
+#include "common.h"
+
+#define STATS_MAGIC ( UINT32 ) 'tatS'
+#define STATS_VERSION 2
+#define STATS_EXIT_REASONS 64
+
+struct vCPUCounters;
+struct ExitTrace;
+struct TranslationCache;
+
+//
+// Read-only statistics region shared with user-mode monitors: a header followed by one slot per processor index.
+// Every slot is a seqlock written by its own processor only, from the exit handler: Sequence is odd while the
+// slot is being updated, readers copy the slot and retry when Sequence was odd or changed meanwhile
+//
+struct StatsHeader
+{
+	UINT32 Magic;
+	UINT16 Version;
+	UINT16 CpuSize;
+	UINT32 CpuCount;
+	UINT32 CpuOffset;
+	UINT32 ExitReasons;
+	UINT32 Reserved[11];
+};
+
+struct __declspec( align( SYSTEM_CACHE_ALIGNMENT_SIZE ) ) StatsCpu
+{
+	volatile UINT32 Sequence;
+	UINT32 CpuNumber;
+	UINT64 Exits;
+	UINT64 RootCycles;
+	UINT64 TraceRecords;
+	UINT64 TraceDropped;
+	UINT64 TranslationHits;		// Guest translation cache, see vmx/GuestWalk.h
+	UINT64 TranslationMisses;
+	UINT64 TranslationWalkCycles;
+	UINT64 TranslationFlushes;
+	UINT64 ExitsByReason[STATS_EXIT_REASONS];	// Intercept hits per basic exit reason
+};
+
+static_assert( sizeof( StatsHeader ) == SYSTEM_CACHE_ALIGNMENT_SIZE, "StatsHeader is shared with user-mode" );
+static_assert( sizeof( StatsCpu ) == 0x280, "StatsCpu is shared with user-mode" );
+
+namespace vmx
+{
+	namespace stats
+	{
+		SIZE_T RegionSize( UINT32 CpuCount );
+		void Initialize( void* Region, UINT32 CpuCount );
+		StatsCpu* Slot( void* Region, UINT32 CpuNumber );
+
+		//
+		// Writer side, called by the owner processor at the end of every exit
+		//
+		void Publish( StatsCpu* Slot, const vCPUCounters* Counters, const ExitTrace* Trace, const TranslationCache* Translations, UINT32 Reason );
+
+		//
+		// Reader side, a consistent copy of a slot. Fails when the slot kept changing during MaxRetries attempts
+		//
+		bool Read( const StatsCpu* Slot, StatsCpu* Copy, UINT32 MaxRetries );
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "common.h"
+
+//
+// How much of an exit the guest TSC doesn't see
+//
+enum TSC_POLICY
+{
+	TscAccountOnly = 0,		// Root mode cycles are only counted
+	TscHideRootCycles,		// The cycles measured by the exit handler are taken off the guest TSC
+	TscHideCalibrated,		// Plus the per-reason cost measured at startup, less the cost of the instruction on bare metal
+	TscPolicyCount
+};
+
+//
+// Root mode cycles a vCPU may hide beyond the least compensated one: a processor that rarely exits hides little, the
+// guest TSCs of two processors never drift further apart than this. GlobalState::TscOffset is the highest offset
+//
+#define TSC_MAX_SKEW 100000
+
+//
+// Per vCPU guest TSC compensation, only touched by the owner processor in root mode. The offset only goes down
+// by time that really elapsed, the guest TSC never goes backwards on a processor. Guest writes of the TSC and of
+// IA32_TSC_ADJUST go to Adjust, the real TSC stays as it is. The VMCS TSC offset is Offset + Adjust
+//
+struct TscCompensation
+{
+	volatile INT64 Offset;	// Cycles hidden, negative. Read by Hypervisor::TscResyncDpc from any processor
+	INT64 Adjust;			// Guest TSC moves, IA32_TSC_ADJUST reads the real one plus this
+	UINT64 Hidden;			// Cycles taken off the guest TSC
+	UINT64 Capped;			// Cycles not hidden, TSC_MAX_SKEW was reached
+	bool Enabled;			// TSC offsetting is on
+};
+
+struct vCPU;
+
+namespace vmx
+{
+	namespace tsc
+	{
+		void Reset( TscCompensation* Tsc, bool Enabled );
+
+		//
+		// Last thing of an exit that resumes the guest, RootCycles is the time the exit handler measured
+		//
+		void Compensate( vCPU* vcpu, UINT32 Reason, UINT64 RootCycles );
+
+		//
+		// TSC values of intercepted MSRs (IA32_TIME_STAMP_COUNTER, IA32_TSC_DEADLINE) between guest and host time
+		//
+		UINT64 ToGuest( const TscCompensation* Tsc, UINT64 HostTsc );
+		UINT64 ToHost( const TscCompensation* Tsc, UINT64 GuestTsc );
+
+		//
+		// Root mode, WRMSR of IA32_TIME_STAMP_COUNTER or IA32_TSC_ADJUST with offsetting on: moves the guest TSC of the
+		// processor by Cycles
+		//
+		void Adjust( TscCompensation* Tsc, INT64 Cycles );
+	}
+}
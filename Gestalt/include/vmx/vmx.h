@@ -2,11 +2,33 @@
 #include "common.h"
 #include "vmxUtils.h"
 #include "ia32/x64.h"
+#include "ExitTrace.h"
+#include "Stats.h"
+#include "Mtrr.h"
+#include "DirectMap.h"
+#include "GuestWalk.h"
+#include "HostDescriptors.h"
+#include "EventQueue.h"
+#include "Kick.h"
+#include "Profiler.h"
+#include "TscOffset.h"
+#include "IoIntercept.h"
+#include "DescriptorTables.h"
+#include "Processes.h"
+#include "Ept.h"
+#include "Coverage.h"
 
 #define MAX_VMEXIT_REASON_FILTER 64
 #define MSR_MASK_LOW ((UINT64) (UINT32) -1)
 #define CPUID_HV_VENDOR_INFORMATION ( UINT32 ) 0x40000000
-#define MASK_SELECTOR(VALUE) VALUE & ~0x7
+#define MASK_SELECTOR(VALUE) ( ( VALUE ) & ~0x7 )
+
+//
+// Hypercalls, issued with VMCALL and the number in RCX
+//
+#define VMCALL_DEVIRTUALIZE ( UINT64 ) 0x47530001
+#define VMCALL_SWITCH_VIEW ( UINT64 ) 0x47530002	// EPT view in RDX, the fallback of VMFUNC 0
+#define VMCALL_VE_UNRESOLVED ( UINT64 ) 0x47530003	// From the #VE handler, see vmx::ept::HandleVe
 
 
 struct State
@@ -19,11 +41,51 @@ struct State
 	SEGMENT_DESCRIPTOR_REGISTER_64 IDTR;
 };
 
+//
+// Shared by every vCPU, only written before the first launch, read-only afterwards.
+// The exception are the MSR and I/O bitmaps the watched processes and the EPT views, see vmx::SetMsrIntercept,
+// vmx::io::AddRange, vmx::process::Watch, vmx::ept::SetPage and vmx::coverage::Cover
+//
 struct GlobalState
 {
 	__declspec( align(PAGE_SIZE) ) VMX_MSR_BITMAP MSRBitMap;
-	State GuestState;
-	State HostState;
+	__declspec( align(PAGE_SIZE) ) IoIntercepts Io;
+	__declspec( align(PAGE_SIZE) ) ProcessTracking Processes;
+	__declspec( align(PAGE_SIZE) ) EptState Ept;
+	__declspec( align(PAGE_SIZE) ) ExecutionCoverage Coverage;
+	//
+	// Root mode page tables, the snapshot CR3 is used when they couldn't be built
+	//
+	HostAddressSpace Host;
+	//
+	// MOV to CR3, INVLPG and INVPCID exit so the vCPU translation caches stay coherent
+	//
+	bool TrackTranslations;
+	//
+	// SGDT, SIDT, LGDT, LIDT, SLDT, STR, LLDT and LTR exit, see vmx::dt
+	//
+	bool DescriptorTableExiting;
+	//
+	// MOV to CR3 exits to follow the guest processes, see vmx::process
+	//
+	bool TrackProcesses;
+	//
+	// xAPIC registers, mapped by the driver to send kicks when the x2APIC is off. Guest side only
+	//
+	PVOID ApicMmio;
+	//
+	// Preemption timer ticks between guest RIP samples, 0 when the profiler is off. A change is applied with KICK_PROFILE
+	//
+	volatile UINT32 ProfilePeriod;
+	//
+	// Guest TSC compensation, TSC_POLICY. The TSC offset and the intercepts of IA32_TSC_DEADLINE, of the TSC writes and
+	// of IA32_TSC_ADJUST are only set up when TscOffsetting is on at launch, the policy can change at any time afterwards.
+	// TscOffset is the highest vCPU offset, see TSC_MAX_SKEW
+	//
+	bool TscOffsetting;
+	volatile UINT32 TscPolicy;
+	volatile INT64 TscOffset;
+	INT32 TscExitCost[MAX_VMEXIT_REASON_FILTER];	// Calibrated, see Hypervisor::CalibrateTsc
 };
 
 struct PhysicalAddresses
@@ -32,23 +94,7 @@ struct PhysicalAddresses
 	UINT64 VMXOnRegion;
 };
 
-
-struct vCPU
-{
-	__declspec( align( PAGE_SIZE ) ) VMCS vmcs;
-	__declspec( align( PAGE_SIZE ) ) VMXON vmxonRegion;
-
-	int CpuNumber;
-	PhysicalAddresses Phys;
-	GlobalState* state;
-};
-
-
-struct VMM
-{
-	vCPU* vcpu;
-	GlobalState state;
-};
+struct vCPU;
 
 // 
 // VMExit guest state structures
@@ -81,10 +127,121 @@ struct GCPUContext
 	UINT64 rdx;
 	UINT64 rcx;
 	UINT64 rax;
+	//
+	// Everything bellow lives above the host RSP, at the top of the vCPU host stack
+	//
 	GCPUExtendedRegs ExtRegs;
+	vCPU* vcpu;
 };
 #include <poppack.h>
 
+//
+// Top of the host stack, VMCS_HOST_RSP points here so the exit stub frame ends right on the ExtRegs/vcpu fields of GCPUContext
+//
+struct HostStackTop
+{
+	GCPUExtendedRegs ExtRegs;
+	vCPU* vcpu;
+};
+
+#define HOST_STACK_SIZE KERNEL_STACK_SIZE
+
+//
+// Non-volatile register context captured by __vmx_launch (vmx_ext.asm), the layout is shared with it
+//
+struct LaunchContext
+{
+	__m128 xmm[10];		// xmm6 - xmm15
+	UINT64 rbx;
+	UINT64 rbp;
+	UINT64 rdi;
+	UINT64 rsi;
+	UINT64 r12;
+	UINT64 r13;
+	UINT64 r14;
+	UINT64 r15;
+	UINT64 rsp;
+	UINT64 rflags;
+};
+
+static_assert( FIELD_OFFSET( LaunchContext, rbx ) == 0xA0, "LaunchContext layout is shared with vmx_ext.asm" );
+static_assert( FIELD_OFFSET( LaunchContext, rsp ) == 0xE0, "LaunchContext layout is shared with vmx_ext.asm" );
+
+//
+// Counters written on every exit by the owner processor only
+//
+struct vCPUCounters
+{
+	UINT64 Exits;
+	UINT64 RootCycles;
+	UINT64 ExitsByReason[MAX_VMEXIT_REASON_FILTER];
+};
+
+//
+// One allocation per processor, from the processor's own NUMA node.
+// Hot per-exit data sits on its own cache lines, away from the bring-up fields
+//
+struct vCPU
+{
+	__declspec( align( PAGE_SIZE ) ) VMCS vmcs;
+	__declspec( align( PAGE_SIZE ) ) VMXON vmxonRegion;
+	__declspec( align( PAGE_SIZE ) ) BYTE HostStack[HOST_STACK_SIZE];
+	__declspec( align( PAGE_SIZE ) ) HostDescriptors Descriptors;
+	__declspec( align( PAGE_SIZE ) ) VeDelivery Ve;
+
+	//
+	// Hot, written on every exit
+	//
+	__declspec( align( SYSTEM_CACHE_ALIGNMENT_SIZE ) ) vCPUCounters Counters;
+	__declspec( align( SYSTEM_CACHE_ALIGNMENT_SIZE ) ) ExitTrace Trace;
+	StatsCpu* Stats;	// Slot of the shared statistics region, if any
+	__declspec( align( SYSTEM_CACHE_ALIGNMENT_SIZE ) ) TranslationCache Translations;
+	HostEvents Events;
+	EventQueue Injection;
+	ProfileRing Profile;
+	TscCompensation Tsc;
+	DescriptorTableExits DescriptorTables;
+	ProcessSwitches Processes;
+	EptCounters Ept;
+	__declspec( align( SYSTEM_CACHE_ALIGNMENT_SIZE ) ) KickState Kick;
+
+	//
+	// Cold, written during bring-up only
+	//
+	__declspec( align( SYSTEM_CACHE_ALIGNMENT_SIZE ) ) LaunchContext Launch;
+	int CpuNumber;
+	PROCESSOR_NUMBER ProcessorNumber;
+	USHORT Node;
+	bool Launched;
+	PhysicalAddresses Phys;
+	//
+	// GDTR/IDTR and the host stack are per processor, they can't live in the shared GlobalState.
+	// The host GDTR/IDTR always point to Descriptors, a processor whose system GDT can't be copied is not virtualized
+	//
+	State GuestState;
+	State HostState;
+	GlobalState* state;
+};
+
+//
+// vCPUs of one processor group, indexed by the processor number inside the group
+//
+struct ProcessorGroup
+{
+	USHORT Group;
+	ULONG Count;
+	KAFFINITY ActiveMask;
+	vCPU** vcpu;
+};
+
+
+struct VMM
+{
+	ProcessorGroup* Groups;
+	USHORT GroupCount;
+	GlobalState state;
+};
+
 struct GuestContext
 {
 	GCPUContext* cpu;
@@ -113,8 +270,14 @@ namespace vmx
 		};
 
 		int HandleCPUID( GCPUContext* context, bool hide );
+		int HandleVMCall( GCPUContext* context );
 		int HandleMSRAccess( GCPUContext* context, MSR_ACCESS AccessType );
+		int HandleCRAccess( GCPUContext* context );
+		int HandleInvlpg( GCPUContext* context );
+		int HandleInvpcid( GCPUContext* context );
 		void NextInstruction( GCPUContext* context );
+		UINT64* GetRegister( GCPUContext* context, UINT32 Index );
+		UINT64 OperandAddress( GCPUContext* context, UINT64 InstructionInfo );
 		
 	}
 
@@ -129,14 +292,44 @@ namespace vmx
 	bool Enable();
 
 	bool StartVMX( vCPU* vcpu );
+	bool StopVMX( vCPU* vcpu );
+	void AbortVMX( vCPU* vcpu );
+	void PrepareDevirtualize( GCPUContext* context );
 	bool ConfigureVMCS( vCPU* vcpu );
-	bool ConfigureVMCSFields (GlobalState* state);
+	bool ConfigureVMCSFields( vCPU* vcpu, const CpuSnapshot* snapshot );
 
 	size_t GetVMXErrorCode();
 	
-	extern "C" inline int VMLaunch( UINT64 Rip, UINT64 Rsp, int ( *Handler )( GCPUContext* context, void* Args, VMX_VMEXIT_REASON ExitReason ), void* Argss, BYTE * ExitReasonBitMap );
+	int VMLaunch( vCPU* vcpu, int ( *Handler )( GCPUContext* context, void* Args, VMX_VMEXIT_REASON ExitReason ), void* Args, BYTE * ExitReasonBitMap );
+	extern "C" int __vmx_launch( LaunchContext* Context );
 	extern "C" int __vmx_default_exit_handler();
+	extern "C" UINT64 __vmcall( UINT64 Hypercall, UINT64 Arg1, UINT64 Arg2 );
 	extern "C" int VMExitHandler( GCPUContext * gcpuContext );
+	extern "C" void __vmx_host_fault_resume();
+	extern "C" void __load_tr( UINT16 Selector );
+	extern "C" void __unblock_nmi();
+	extern "C" unsigned char __invept( UINT64 Type, const INVEPT_DESCRIPTOR* Descriptor );
+	extern "C" void __vmfunc( UINT32 Function, UINT32 Index );
+	//
+	// Root mode RDMSR/WRMSR of an MSR the guest chose: 1 when it raised #GP, 0 otherwise
+	//
+	extern "C" unsigned char __vmx_rdmsr_safe( UINT32 Msr, UINT64* Value );
+	extern "C" unsigned char __vmx_wrmsr_safe( UINT32 Msr, UINT64 Value );
+	extern "C" void __vmx_ve_isr();
+	//
+	// Defined by the driver, called by __vmx_ve_isr
+	//
+	extern "C" void GuestVeHandler();
+	extern "C" void HostExceptionHandler( HostTrapFrame* Frame );
+	extern "C" void HostFaultResume( GCPUContext* context );
+
+	UINT64 GetHostStackPointer( vCPU* vcpu );
+	bool SetMsrIntercept( GlobalState* state, UINT32 Msr, bool Read, bool Write );
+	//
+	// One bitmap alone, SetMsrIntercept changes the system one. Outside the bitmap ranges an MSR is always intercepted
+	//
+	bool SetMsrBitMap( VMX_MSR_BITMAP* BitMap, UINT32 Msr, bool Read, bool Write );
+	bool IsMsrIntercepted( const VMX_MSR_BITMAP* BitMap, UINT32 Msr, bool Write );
 
 
 	// helper functions, TODO
@@ -4,11 +4,11 @@
 #include "ia32/x64.h"
 
 
-#define FILL_SEGMENT_SELECTOR(SELECTOR_NAME, GDT_BASE, SELECTOR_VALUE) \
-	__vmx_vmwrite(SELECTOR_NAME##_SELECTOR, SELECTOR_VALUE); \
-	__vmx_vmwrite(SELECTOR_NAME##_BASE, VMXUtils::GetSegmentBase(GDT_BASE, SELECTOR_VALUE)); \
-	__vmx_vmwrite(SELECTOR_NAME##_LIMIT, __segmentlimit(SELECTOR_VALUE)); \
-	__vmx_vmwrite(SELECTOR_NAME##_ACCESS_RIGHTS, VMXUtils::GetSegmentAccessRights(SELECTOR_VALUE));
+#define FILL_SEGMENT_SELECTOR(SELECTOR_NAME, SEGMENT) \
+	__vmx_vmwrite(SELECTOR_NAME##_SELECTOR, (SEGMENT).Selector); \
+	__vmx_vmwrite(SELECTOR_NAME##_BASE, (SEGMENT).Base); \
+	__vmx_vmwrite(SELECTOR_NAME##_LIMIT, (SEGMENT).Limit); \
+	__vmx_vmwrite(SELECTOR_NAME##_ACCESS_RIGHTS, VMXUtils::GetSegmentAccessRights(SEGMENT));
 
 
 enum __vmexit_reason_e
@@ -93,11 +93,20 @@ namespace VMXUtils
 	UINT64 AdjustCR4( UINT64 cr4Value );
 	UINT64 AdjustControlValue( VMX_CONTROL_FIELD Field, UINT64 Value );
 
+	UINT64 AdjustCR0( const VmxCapabilities* Capabilities, UINT64 cr0Value );
+	UINT64 AdjustCR4( const VmxCapabilities* Capabilities, UINT64 cr4Value );
+	UINT64 AdjustControlValue( const VmxCapabilities* Capabilities, VMX_CONTROL_FIELD Field, UINT64 Value );
+
+	void CaptureCpuSnapshot( CpuSnapshot* Snapshot );
+	void CaptureVmxCapabilities( VmxCapabilities* Capabilities );
+	SIZE_T SerializeCpuSnapshot( const CpuSnapshot* Snapshot, void* Buffer, SIZE_T BufferSize );
+	bool DeserializeCpuSnapshot( const void* Buffer, SIZE_T BufferSize, CpuSnapshot* Snapshot );
+
 	UINT64 GetSegmentBase( UINT64 GDTBase, UINT16 SelectorValue );
 
 	UINT64 GetSegmentBaseByDescriptor( IN CONST SEGMENT_DESCRIPTOR_32* SegmentDescriptor );
 	SEGMENT_DESCRIPTOR_32* GetSegmentDescriptor( UINT64 DescriptorTableBase, UINT16 SegmentSelector );
 	UINT64 GetAdjustedControlValue( VMX_CONTROL_FIELD ControlField, UINT64 RequestedValue );
-	UINT64 GetSegmentAccessRights( UINT16 SegmentSelector );
+	UINT64 GetSegmentAccessRights( const SegmentSnapshot& Segment );
 
 }
\ No newline at end of file
@@ -0,0 +1,249 @@
+#include "Hypervisor.h"
+
+//
+// Samples taken per DISPATCH_LEVEL stretch, short enough to stay far from the DPC watchdog
+//
+#define BENCH_BATCH 4096
+
+
+//
+// Per thread benchmark context, the threads start the workload together once all of them are pinned
+//
+struct BenchmarkThread
+{
+	volatile LONG* Ready;
+	LONG Threads;
+	ULONG ProcessorIndex;
+	BENCH_WORKLOAD Workload;
+	UINT32 Iterations;
+	UINT64 Cycles;
+	LatencyHistogram Latency;
+};
+
+
+void Hypervisor::SetExitBenchmark( ULONG Iterations )
+{
+	BenchIterations = Iterations;
+}
+
+
+//
+// Run every workload of the phase on 1, 2, 4 ... and all the processors. Called before Start for the bare metal
+// baseline and after it for the virtualized numbers, does nothing when the benchmark is not enabled
+//
+bool Hypervisor::RunExitBenchmark( BENCH_PHASE Phase )
+{
+	UINT32 Scales[BENCH_MAX_SCALES];
+	UINT32 ScaleCount;
+	bool Succeeded = true;
+
+	PAGED_CODE();
+
+	if ( !BenchIterations )
+		return false;
+
+	if ( !Bench )
+	{
+		Bench = ( BenchReport* ) ExAllocatePoolWithTag( PagedPool, sizeof( BenchReport ), GESTALT_POOL_TAG );
+
+		if ( !Bench )
+		{
+			DbgInfo( "Unable to allocate the benchmark report, system is out-of-memory!" );
+			return false;
+		}
+
+		RtlSecureZeroMemory( Bench, sizeof( BenchReport ) );
+		Bench->Processors = KeQueryActiveProcessorCountEx( ALL_PROCESSOR_GROUPS );
+		Bench->Iterations = BenchIterations;
+	}
+
+	ScaleCount = bench::GetScales( Bench->Processors, Scales );
+	Bench->Scales[Phase] = ScaleCount;
+
+	for ( int w = 0; w < BenchWorkloadCount && Succeeded; w++ )
+	{
+		if ( Phase == BenchBaseline && bench::NeedsVMX( ( BENCH_WORKLOAD ) w ) )
+			continue;
+
+		for ( UINT32 s = 0; s < ScaleCount && Succeeded; s++ )
+			Succeeded = RunExitBenchmarkScale( ( BENCH_WORKLOAD ) w, Scales[s], &Bench->Runs[w][Phase][s] );
+	}
+
+	if ( !Succeeded )
+		DbgInfo( "Unable to run the exit benchmark!" );
+
+	return Succeeded;
+}
+
+
+//
+// One system thread per processor, pinned to the first Threads processor indexes
+//
+bool Hypervisor::RunExitBenchmarkScale( BENCH_WORKLOAD Workload, UINT32 Threads, BenchRun* Run )
+{
+	BenchmarkThread* Contexts;
+	PKTHREAD* Handles;
+	HANDLE ThreadHandle;
+	NTSTATUS status = STATUS_SUCCESS;
+	volatile LONG Ready = 0;
+	UINT32 Started = 0;
+
+	Contexts = ( BenchmarkThread* ) ExAllocatePoolWithTag( NonPagedPool, sizeof( BenchmarkThread ) * Threads, GESTALT_POOL_TAG );
+	Handles = ( PKTHREAD* ) ExAllocatePoolWithTag( NonPagedPool, sizeof( PKTHREAD ) * Threads, GESTALT_POOL_TAG );
+
+	if ( !Contexts || !Handles )
+	{
+		if ( Contexts ) ExFreePoolWithTag( Contexts, GESTALT_POOL_TAG );
+		if ( Handles ) ExFreePoolWithTag( Handles, GESTALT_POOL_TAG );
+		return false;
+	}
+
+	for ( UINT32 i = 0; i < Threads; i++ )
+	{
+		Contexts[i].Ready = &Ready;
+		Contexts[i].Threads = ( LONG ) Threads;
+		Contexts[i].ProcessorIndex = i;
+		Contexts[i].Workload = Workload;
+		Contexts[i].Iterations = BenchIterations;
+		Contexts[i].Cycles = 0;
+		bench::ResetHistogram( &Contexts[i].Latency );
+	}
+
+	for ( ; Started < Threads; Started++ )
+	{
+		status = PsCreateSystemThread( &ThreadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, BenchmarkWorker, &Contexts[Started] );
+
+		if ( !NT_SUCCESS( status ) )
+			break;
+
+		status = ObReferenceObjectByHandle( ThreadHandle, SYNCHRONIZE, *PsThreadType, KernelMode, ( PVOID* ) &Handles[Started], NULL );
+		ZwClose( ThreadHandle );
+
+		if ( !NT_SUCCESS( status ) )
+			break;
+	}
+
+	if ( Started < Threads )
+	{
+		//
+		// Release the threads waiting for the missing ones
+		//
+		InterlockedAdd( &Ready, ( LONG ) ( Threads - Started ) );
+	}
+
+	for ( UINT32 i = 0; i < Started; i++ )
+	{
+		KeWaitForSingleObject( Handles[i], Executive, KernelMode, FALSE, NULL );
+		ObDereferenceObject( Handles[i] );
+	}
+
+	if ( NT_SUCCESS( status ) )
+	{
+		Run->Threads = Threads;
+		bench::ResetHistogram( &Run->Latency );
+
+		for ( UINT32 i = 0; i < Threads; i++ )
+		{
+			bench::MergeHistogram( &Run->Latency, &Contexts[i].Latency );
+			Run->Cycles += Contexts[i].Cycles;
+		}
+
+		Run->Operations = Run->Latency.Count;
+	}
+	else
+	{
+		DbgInfo( "Unable to create the benchmark threads (0x%x)", status );
+	}
+
+	ExFreePoolWithTag( Contexts, GESTALT_POOL_TAG );
+	ExFreePoolWithTag( Handles, GESTALT_POOL_TAG );
+
+	return NT_SUCCESS( status );
+}
+
+
+void Hypervisor::BenchmarkWorker( PVOID Context )
+{
+	BenchmarkThread* Thread = ( BenchmarkThread* ) Context;
+	PROCESSOR_NUMBER Processor;
+	GROUP_AFFINITY Affinity = { 0 };
+	GROUP_AFFINITY PreviousAffinity;
+	KIRQL OldIrql;
+
+	KeGetProcessorNumberFromIndex( Thread->ProcessorIndex, &Processor );
+	Affinity.Group = Processor.Group;
+	Affinity.Mask = AFFINITY_MASK( Processor.Number );
+	KeSetSystemGroupAffinityThread( &Affinity, &PreviousAffinity );
+
+	InterlockedIncrement( Thread->Ready );
+
+	while ( *Thread->Ready < Thread->Threads )
+		YieldProcessor();
+
+	for ( UINT32 Done = 0; Done < Thread->Iterations; Done += BENCH_BATCH )
+	{
+		UINT32 Batch = min( BENCH_BATCH, Thread->Iterations - Done );
+
+		KeRaiseIrql( DISPATCH_LEVEL, &OldIrql );
+		Thread->Cycles += bench::Run( Thread->Workload, Batch, &Thread->Latency );
+		KeLowerIrql( OldIrql );
+	}
+
+	KeRevertToUserGroupAffinityThread( &PreviousAffinity );
+
+	PsTerminateSystemThread( STATUS_SUCCESS );
+}
+
+
+//
+// Write the JSON report and release it
+//
+bool Hypervisor::WriteExitBenchmark( PCWSTR Path )
+{
+	UNICODE_STRING FileName;
+	OBJECT_ATTRIBUTES Attributes;
+	IO_STATUS_BLOCK IoStatus;
+	HANDLE File;
+	NTSTATUS status;
+	SIZE_T Length;
+	char* Json;
+
+	PAGED_CODE();
+
+	if ( !Bench )
+		return false;
+
+	Length = bench::FormatJson( Bench, nullptr, 0 ) + 1;
+	Json = ( char* ) ExAllocatePoolWithTag( PagedPool, Length, GESTALT_POOL_TAG );
+	status = STATUS_INSUFFICIENT_RESOURCES;
+
+	if ( Json )
+	{
+		bench::FormatJson( Bench, Json, Length );
+
+		RtlInitUnicodeString( &FileName, Path );
+		InitializeObjectAttributes( &Attributes, &FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL );
+
+		status = ZwCreateFile( &File, GENERIC_WRITE, &Attributes, &IoStatus, NULL, FILE_ATTRIBUTE_NORMAL, 0,
+			FILE_OVERWRITE_IF, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, NULL, 0 );
+
+		if ( NT_SUCCESS( status ) )
+		{
+			status = ZwWriteFile( File, NULL, NULL, NULL, &IoStatus, Json, ( ULONG ) ( Length - 1 ), NULL, NULL );
+			ZwClose( File );
+		}
+
+		ExFreePoolWithTag( Json, GESTALT_POOL_TAG );
+	}
+
+	ExFreePoolWithTag( Bench, GESTALT_POOL_TAG );
+	Bench = nullptr;
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to write the benchmark report (0x%x)", status );
+		return false;
+	}
+
+	return true;
+}
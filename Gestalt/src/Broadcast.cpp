@@ -0,0 +1,95 @@
+#include "Hypervisor.h"
+
+//
+// Spins before a kick that wasn't handled is sent again
+//
+#define KICK_RESEND_SPINS 10000
+
+
+//
+// The xAPIC registers are MMIO, the x2APIC ones are MSRs and need nothing
+//
+bool Hypervisor::MapApic()
+{
+	IA32_APIC_BASE_REGISTER ApicBase;
+	PHYSICAL_ADDRESS Address;
+
+	ApicBase.AsUInt = __readmsr( IA32_APIC_BASE );
+
+	if ( ApicBase.EnableX2ApicMode )
+		return true;
+
+	Address.QuadPart = ApicBase.ApicBase * PAGE_SIZE;
+	VirtualMachineMonitor.state.ApicMmio = MmMapIoSpace( Address, PAGE_SIZE, MmNonCached );
+
+	return VirtualMachineMonitor.state.ApicMmio != nullptr;
+}
+
+
+void Hypervisor::UnmapApic()
+{
+	if ( !VirtualMachineMonitor.state.ApicMmio )
+		return;
+
+	MmUnmapIoSpace( VirtualMachineMonitor.state.ApicMmio, PAGE_SIZE );
+	VirtualMachineMonitor.state.ApicMmio = nullptr;
+}
+
+
+//
+// Kick every launched vCPU, the calling processor included, and return how many were kicked.
+// With Wait, returns once all of them went through root mode and handled Requests. A kick that lands in root mode
+// after the exit handler looked for kicks is only handled on the next exit, so its NMI is sent again after a while
+//
+ULONG Hypervisor::KickAll( LONG Requests, bool Wait )
+{
+	ULONG Kicked = 0;
+
+	if ( !Virtualized )
+		return 0;
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; Group->vcpu && j < Group->Count; j++ )
+		{
+			if ( Group->vcpu[j] && vmx::kick::Send( Group->vcpu[j], Requests ) )
+				Kicked++;
+		}
+	}
+
+	if ( !Wait )
+		return Kicked;
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; Group->vcpu && j < Group->Count; j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+			LONG64 Ticket;
+
+			if ( !vcpu )
+				continue;
+
+			Ticket = vcpu->Kick.Sent;
+
+			for ( ULONG Spins = 0; vcpu->Launched && vcpu->Kick.Completed < Ticket; Spins++ )
+			{
+				if ( Spins == KICK_RESEND_SPINS )
+				{
+					if ( !vmx::kick::Resend( vcpu ) )
+						break;
+
+					Spins = 0;
+				}
+
+				YieldProcessor();
+			}
+		}
+	}
+
+	return Kicked;
+}
@@ -0,0 +1,550 @@
+#include "Hypervisor.h"
+#include <wdmsec.h>
+
+//
+// Pending trace reads are checked at this period
+//
+#define TRACE_WAIT_PERIOD_MS 10
+
+//
+// SYSTEM and administrators only
+//
+DECLARE_CONST_UNICODE_STRING( ControlDeviceSddl, L"D:P(A;;GA;;;SY)(A;;GA;;;BA)" );
+
+// {5B0C3D52-8E3A-4F77-9C1E-2E6A1D7B4A10}
+static const GUID GestaltControlClassGuid = { 0x5b0c3d52, 0x8e3a, 0x4f77, { 0x9c, 0x1e, 0x2e, 0x6a, 0x1d, 0x7b, 0x4a, 0x10 } };
+
+
+//
+// Cancel-safe queue of the pending IOCTL_GESTALT_READ_EXIT_TRACE requests.
+// A non-null peek context only returns the requests that can be completed now
+//
+// Under the queue lock: once DeleteControlDevice has set Closing nothing is queued, and the timer is armed before it
+// can be cancelled
+//
+static NTSTATUS TraceQueueInsertIrp( PIO_CSQ Csq, PIRP Irp, PVOID InsertContext )
+{
+	TraceWaitQueue* Queue = ( TraceWaitQueue* ) Csq;
+	LARGE_INTEGER DueTime;
+
+	UNREFERENCED_PARAMETER( InsertContext );
+
+	if ( Queue->Closing )
+		return STATUS_DEVICE_NOT_READY;
+
+	InsertTailList( &Queue->Irps, &Irp->Tail.Overlay.ListEntry );
+
+	DueTime.QuadPart = -10000LL * TRACE_WAIT_PERIOD_MS;
+	KeSetTimer( &Queue->Timer, DueTime, &Queue->Dpc );
+
+	return STATUS_SUCCESS;
+}
+
+static void TraceQueueRemoveIrp( PIO_CSQ Csq, PIRP Irp )
+{
+	UNREFERENCED_PARAMETER( Csq );
+
+	RemoveEntryList( &Irp->Tail.Overlay.ListEntry );
+}
+
+PIRP Hypervisor::TraceQueuePeekNextIrp( PIO_CSQ Csq, PIRP Irp, PVOID PeekContext )
+{
+	TraceWaitQueue* Queue = ( TraceWaitQueue* ) Csq;
+	PLIST_ENTRY Entry = Irp ? Irp->Tail.Overlay.ListEntry.Flink : Queue->Irps.Flink;
+
+	for ( ; Entry != &Queue->Irps; Entry = Entry->Flink )
+	{
+		PIRP Next = CONTAINING_RECORD( Entry, IRP, Tail.Overlay.ListEntry );
+
+		if ( !PeekContext || Queue->hv->IsTraceReadReady( Next ) )
+			return Next;
+	}
+
+	return nullptr;
+}
+
+static void TraceQueueAcquireLock( PIO_CSQ Csq, PKIRQL Irql )
+{
+	KeAcquireSpinLock( &( ( TraceWaitQueue* ) Csq )->Lock, Irql );
+}
+
+static void TraceQueueReleaseLock( PIO_CSQ Csq, KIRQL Irql )
+{
+	KeReleaseSpinLock( &( ( TraceWaitQueue* ) Csq )->Lock, Irql );
+}
+
+static void TraceQueueCompleteCanceledIrp( PIO_CSQ Csq, PIRP Irp )
+{
+	UNREFERENCED_PARAMETER( Csq );
+
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest( Irp, IO_NO_INCREMENT );
+}
+
+
+//
+// \\.\Gestalt, it exists whether the processors are virtualized or not so the capabilities can be queried
+//
+bool Hypervisor::CreateControlDevice( PDRIVER_OBJECT DriverObject )
+{
+	UNICODE_STRING DeviceName;
+	UNICODE_STRING LinkName;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	RtlInitUnicodeString( &DeviceName, GESTALT_DEVICE_NAME );
+	RtlInitUnicodeString( &LinkName, GESTALT_SYMBOLIC_LINK );
+
+	status = IoCreateDeviceSecure( DriverObject, sizeof( Hypervisor* ), &DeviceName, FILE_DEVICE_GESTALT, FILE_DEVICE_SECURE_OPEN,
+		FALSE, &ControlDeviceSddl, &GestaltControlClassGuid, &ControlDevice );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to create the control device (0x%x)", status );
+		ControlDevice = nullptr;
+		return false;
+	}
+
+	status = IoCreateSymbolicLink( &LinkName, &DeviceName );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to create the control device link (0x%x)", status );
+		IoDeleteDevice( ControlDevice );
+		ControlDevice = nullptr;
+		return false;
+	}
+
+	*( Hypervisor** ) ControlDevice->DeviceExtension = this;
+
+	InitializeListHead( &TraceWaiters.Irps );
+	KeInitializeSpinLock( &TraceWaiters.Lock );
+	KeInitializeTimer( &TraceWaiters.Timer );
+	KeInitializeDpc( &TraceWaiters.Dpc, TraceWaitDpc, this );
+	TraceWaiters.hv = this;
+	TraceWaiters.Closing = false;
+
+	IoCsqInitializeEx( &TraceWaiters.Csq, TraceQueueInsertIrp, TraceQueueRemoveIrp, TraceQueuePeekNextIrp,
+		TraceQueueAcquireLock, TraceQueueReleaseLock, TraceQueueCompleteCanceledIrp );
+
+	DriverObject->MajorFunction[IRP_MJ_CREATE] = DispatchCreateClose;
+	DriverObject->MajorFunction[IRP_MJ_CLOSE] = DispatchCreateClose;
+	DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DispatchDeviceControl;
+
+	ControlDevice->Flags &= ~DO_DEVICE_INITIALIZING;
+
+	return true;
+}
+
+
+//
+// Must run before the vCPUs are released, the pending trace reads point into their buffers
+//
+void Hypervisor::DeleteControlDevice()
+{
+	UNICODE_STRING LinkName;
+	KIRQL Irql;
+	PIRP Irp;
+
+	PAGED_CODE();
+
+	if ( !ControlDevice )
+		return;
+
+	//
+	// No request is queued once Closing is set. The DPC doesn't re-arm the timer either, the second cancel catches a
+	// timer armed just before
+	//
+	KeAcquireSpinLock( &TraceWaiters.Lock, &Irql );
+	TraceWaiters.Closing = true;
+	KeReleaseSpinLock( &TraceWaiters.Lock, Irql );
+
+	KeCancelTimer( &TraceWaiters.Timer );
+	KeFlushQueuedDpcs();
+	KeCancelTimer( &TraceWaiters.Timer );
+
+	while ( ( Irp = IoCsqRemoveNextIrp( &TraceWaiters.Csq, NULL ) ) != nullptr )
+		TraceQueueCompleteCanceledIrp( &TraceWaiters.Csq, Irp );
+
+	RtlInitUnicodeString( &LinkName, GESTALT_SYMBOLIC_LINK );
+	IoDeleteSymbolicLink( &LinkName );
+	IoDeleteDevice( ControlDevice );
+	ControlDevice = nullptr;
+}
+
+
+NTSTATUS Hypervisor::DispatchCreateClose( PDEVICE_OBJECT DeviceObject, PIRP Irp )
+{
+	UNREFERENCED_PARAMETER( DeviceObject );
+
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest( Irp, IO_NO_INCREMENT );
+
+	return STATUS_SUCCESS;
+}
+
+
+NTSTATUS Hypervisor::DispatchDeviceControl( PDEVICE_OBJECT DeviceObject, PIRP Irp )
+{
+	Hypervisor* hv = *( Hypervisor** ) DeviceObject->DeviceExtension;
+	PIO_STACK_LOCATION Stack = IoGetCurrentIrpStackLocation( Irp );
+	ULONG InputLength = Stack->Parameters.DeviceIoControl.InputBufferLength;
+	ULONG OutputLength = Stack->Parameters.DeviceIoControl.OutputBufferLength;
+	UINT32 Tracked;
+	NTSTATUS status;
+
+	Irp->IoStatus.Information = 0;
+
+	switch ( Stack->Parameters.DeviceIoControl.IoControlCode )
+	{
+	case IOCTL_GESTALT_QUERY_CAPABILITIES:
+		if ( OutputLength < sizeof( GestaltCapabilities ) )
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		status = hv->QueryCapabilities( ( GestaltCapabilities* ) Irp->AssociatedIrp.SystemBuffer );
+
+		if ( NT_SUCCESS( status ) )
+			Irp->IoStatus.Information = sizeof( GestaltCapabilities );
+		break;
+	case IOCTL_GESTALT_SET_MSR_INTERCEPT:
+		if ( InputLength < sizeof( GestaltMsrIntercept ) )
+		{
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		status = hv->ControlMsrIntercept( ( const GestaltMsrIntercept* ) Irp->AssociatedIrp.SystemBuffer );
+		break;
+	case IOCTL_GESTALT_READ_EXIT_TRACE:
+		//
+		// Completes the request itself, now or later
+		//
+		return hv->ReadExitTrace( Irp );
+	case IOCTL_GESTALT_TRACK_WRITES:
+		if ( InputLength < sizeof( GestaltPhysicalRange ) || OutputLength < sizeof( UINT32 ) )
+		{
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		status = hv->ControlTrackWrites( ( const GestaltPhysicalRange* ) Irp->AssociatedIrp.SystemBuffer, &Tracked );
+
+		if ( NT_SUCCESS( status ) )
+		{
+			*( UINT32* ) Irp->AssociatedIrp.SystemBuffer = Tracked;
+			Irp->IoStatus.Information = sizeof( UINT32 );
+		}
+		break;
+	case IOCTL_GESTALT_READ_DIRTY_PAGES:
+		status = hv->ReadDirtyPages( Irp );
+		break;
+	default:
+		status = STATUS_INVALID_DEVICE_REQUEST;
+		break;
+	}
+
+	Irp->IoStatus.Status = status;
+	IoCompleteRequest( Irp, IO_NO_INCREMENT );
+
+	return status;
+}
+
+
+NTSTATUS Hypervisor::QueryCapabilities( GestaltCapabilities* Capabilities ) const
+{
+	IA32_VMX_PROCBASED_CTLS_REGISTER ProcBased;
+	IA32_VMX_PROCBASED_CTLS2_REGISTER ProcBased2;
+
+	RtlSecureZeroMemory( Capabilities, sizeof( GestaltCapabilities ) );
+
+	Capabilities->Version = GESTALT_CONTROL_VERSION;
+	Capabilities->Virtualized = Virtualized;
+	Capabilities->ActiveProcessors = KeQueryActiveProcessorCountEx( ALL_PROCESSOR_GROUPS );
+	Capabilities->MaximumProcessors = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+	Capabilities->ExitTraceRecords = ExitTraceRecords;
+	Capabilities->StatsCpuCount = StatsRegion ? ( ( StatsHeader* ) StatsRegion )->CpuCount : 0;
+
+	if ( !vmx::IsSupported() )
+		return STATUS_SUCCESS;
+
+	//
+	// Secondary controls and EPT/VPID capabilities only exist when the allowed-1 settings say so
+	//
+	Capabilities->VmxBasic = __readmsr( IA32_VMX_BASIC );
+	Capabilities->PinBasedControls = __readmsr( IA32_VMX_PINBASED_CTLS );
+	Capabilities->ProcBasedControls = __readmsr( IA32_VMX_PROCBASED_CTLS );
+	Capabilities->ExitControls = __readmsr( IA32_VMX_EXIT_CTLS );
+	Capabilities->EntryControls = __readmsr( IA32_VMX_ENTRY_CTLS );
+
+	ProcBased.AsUInt = Capabilities->ProcBasedControls >> 32;
+
+	if ( ProcBased.ActivateSecondaryControls )
+	{
+		Capabilities->ProcBasedControls2 = __readmsr( IA32_VMX_PROCBASED_CTLS2 );
+		ProcBased2.AsUInt = Capabilities->ProcBasedControls2 >> 32;
+
+		if ( ProcBased2.EnableEpt || ProcBased2.EnableVpid )
+			Capabilities->EptVpidCapabilities = __readmsr( IA32_VMX_EPT_VPID_CAP );
+	}
+
+	return STATUS_SUCCESS;
+}
+
+
+//
+// An intercepted RDMSR/WRMSR is replayed on the real MSR from the exit handler, a #GP there goes back to the guest.
+// Only the ranges the bitmap covers are accepted, and the MSR is read here first to refuse the ones that don't exist
+//
+NTSTATUS Hypervisor::ControlMsrIntercept( const GestaltMsrIntercept* Intercept )
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+
+	if ( Intercept->Msr > MSR_ID_LOW_MAX && ( Intercept->Msr < MSR_ID_HIGH_MIN || Intercept->Msr > MSR_ID_HIGH_MAX ) )
+		return STATUS_INVALID_PARAMETER;
+
+	//
+	// The hypervisor's own intercepts can't be changed: the benchmark MSR, and with an offset guest TSC the deadline
+	// that has to be translated on every write, the TSC and IA32_TSC_ADJUST, whose writes go to the offset
+	//
+	if ( Intercept->Msr == BENCH_MSR || ( VirtualMachineMonitor.state.TscOffsetting && ( Intercept->Msr == IA32_TSC_DEADLINE ||
+		Intercept->Msr == IA32_TIME_STAMP_COUNTER || Intercept->Msr == IA32_TSC_ADJUST ) ) )
+		return STATUS_ACCESS_DENIED;
+
+	__try
+	{
+		__readmsr( Intercept->Msr );
+	}
+	__except ( EXCEPTION_EXECUTE_HANDLER )
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	//
+	// The bitmap is rebuilt when the processors are virtualized, the lock keeps them from going while it changes.
+	// Every processor goes through root mode before the request completes, none runs with the old bitmap anymore
+	//
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	if ( !Virtualized )
+		Status = STATUS_DEVICE_NOT_READY;
+	else if ( !vmx::SetMsrIntercept( &VirtualMachineMonitor.state, Intercept->Msr, Intercept->Read != 0, Intercept->Write != 0 ) )
+		Status = STATUS_NOT_SUPPORTED;
+	else
+		KickAll( KICK_SYNC, true );
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	if ( NT_SUCCESS( Status ) )
+		DbgInfo( "MSR 0x%x intercept: read %d, write %d", Intercept->Msr, ( int ) Intercept->Read, ( int ) Intercept->Write );
+
+	return Status;
+}
+
+
+//
+// The traced vCPU of a read request, nullptr when the processor doesn't exist or isn't traced
+//
+vCPU* Hypervisor::GetTracedVCPU( PIRP Irp ) const
+{
+	GestaltTraceRequest* Request = ( GestaltTraceRequest* ) Irp->AssociatedIrp.SystemBuffer;
+	PROCESSOR_NUMBER Processor;
+	vCPU* vcpu;
+
+	if ( !NT_SUCCESS( KeGetProcessorNumberFromIndex( Request->CpuNumber, &Processor ) ) )
+		return nullptr;
+
+	vcpu = GetVCPU( Processor );
+
+	return vcpu && vcpu->Trace.Records ? vcpu : nullptr;
+}
+
+
+//
+// Ready once enough records are past StartRecord, or when no more will ever come. Any IRQL up to DISPATCH_LEVEL
+//
+bool Hypervisor::IsTraceReadReady( PIRP Irp ) const
+{
+	GestaltTraceRequest* Request = ( GestaltTraceRequest* ) Irp->AssociatedIrp.SystemBuffer;
+	vCPU* vcpu = GetTracedVCPU( Irp );
+	UINT64 Count;
+
+	if ( !vcpu )
+		return true;
+
+	Count = *( volatile UINT64* ) &vcpu->Trace.Count;
+
+	return Count >= Request->StartRecord + Request->MinimumRecords || Count >= vcpu->Trace.Capacity;
+}
+
+
+//
+// Copy straight to the caller's pages: the header, then the records from StartRecord on.
+// Records bellow Count are never written again, they can be read while the processor keeps tracing
+//
+void Hypervisor::CompleteTraceRead( PIRP Irp )
+{
+	GestaltTraceRequest* Request = ( GestaltTraceRequest* ) Irp->AssociatedIrp.SystemBuffer;
+	ULONG OutputLength = IoGetCurrentIrpStackLocation( Irp )->Parameters.DeviceIoControl.OutputBufferLength;
+	vCPU* vcpu = GetTracedVCPU( Irp );
+	ExitTraceHeader* Header;
+	UINT64 Count;
+	UINT64 Available;
+
+	Irp->IoStatus.Information = 0;
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+
+	Header = ( ExitTraceHeader* ) MmGetSystemAddressForMdlSafe( Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute );
+
+	if ( !vcpu || !Header )
+	{
+		Irp->IoStatus.Status = vcpu ? STATUS_INSUFFICIENT_RESOURCES : STATUS_INVALID_PARAMETER;
+		IoCompleteRequest( Irp, IO_NO_INCREMENT );
+		return;
+	}
+
+	Count = *( volatile UINT64* ) &vcpu->Trace.Count;
+	KeMemoryBarrierWithoutFence();
+
+	Available = Count > Request->StartRecord ? Count - Request->StartRecord : 0;
+	Available = min( Available, ( OutputLength - sizeof( ExitTraceHeader ) ) / sizeof( ExitTraceRecord ) );
+
+	vmx::trace::FillHeader( &vcpu->Trace, vcpu->CpuNumber, Header );
+	Header->RecordCount = Available;
+
+	if ( Available )
+		RtlCopyMemory( Header + 1, &vcpu->Trace.Records[Request->StartRecord], ( SIZE_T ) Available * sizeof( ExitTraceRecord ) );
+
+	Irp->IoStatus.Information = sizeof( ExitTraceHeader ) + ( ULONG_PTR ) Available * sizeof( ExitTraceRecord );
+	IoCompleteRequest( Irp, IO_NO_INCREMENT );
+}
+
+
+NTSTATUS Hypervisor::ReadExitTrace( PIRP Irp )
+{
+	PIO_STACK_LOCATION Stack = IoGetCurrentIrpStackLocation( Irp );
+	NTSTATUS status = STATUS_SUCCESS;
+
+	if ( Stack->Parameters.DeviceIoControl.InputBufferLength < sizeof( GestaltTraceRequest ) ||
+		Stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof( ExitTraceHeader ) || !Irp->MdlAddress )
+		status = STATUS_INVALID_PARAMETER;
+	else if ( !GetTracedVCPU( Irp ) )
+		status = STATUS_NOT_SUPPORTED;
+	else if ( TraceWaiters.Closing )
+		status = STATUS_DEVICE_NOT_READY;
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		Irp->IoStatus.Status = status;
+		Irp->IoStatus.Information = 0;
+		IoCompleteRequest( Irp, IO_NO_INCREMENT );
+		return status;
+	}
+
+	if ( IsTraceReadReady( Irp ) )
+	{
+		CompleteTraceRead( Irp );
+		return STATUS_SUCCESS;
+	}
+
+	//
+	// Marks the request pending, the timer DPC completes it once the records are there. Refused when the device is
+	// going away
+	//
+	status = IoCsqInsertIrpEx( &TraceWaiters.Csq, Irp, NULL, NULL );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		Irp->IoStatus.Status = status;
+		Irp->IoStatus.Information = 0;
+		IoCompleteRequest( Irp, IO_NO_INCREMENT );
+		return status;
+	}
+
+	return STATUS_PENDING;
+}
+
+
+//
+// The range is checked here, the pages are left to the coverage view: the ones it doesn't map writable aren't tracked
+//
+NTSTATUS Hypervisor::ControlTrackWrites( const GestaltPhysicalRange* Range, UINT32* Tracked )
+{
+	if ( !Range->Size || Range->Size > ( UINT64 ) GESTALT_MAX_TRACKED_PAGES * PAGE_SIZE || Range->Base + Range->Size < Range->Base )
+		return STATUS_INVALID_PARAMETER;
+
+	if ( !Virtualized || !VirtualMachineMonitor.state.Coverage.View )
+		return STATUS_DEVICE_NOT_READY;
+
+	*Tracked = TrackWrites( Range->Base, Range->Size );
+
+	if ( *Tracked )
+		DbgInfo( "Tracking writes to %u pages from 0x%llx", *Tracked, Range->Base );
+
+	return STATUS_SUCCESS;
+}
+
+
+//
+// Straight to the caller's pages, like the trace reads. It doesn't pend: the processors are kicked to take write away,
+// which can't be done from the DPC
+//
+NTSTATUS Hypervisor::ReadDirtyPages( PIRP Irp )
+{
+	ULONG OutputLength = IoGetCurrentIrpStackLocation( Irp )->Parameters.DeviceIoControl.OutputBufferLength;
+	GestaltDirtyPages* Header;
+	SIZE_T Max;
+
+	if ( OutputLength < sizeof( GestaltDirtyPages ) || !Irp->MdlAddress )
+		return STATUS_INVALID_PARAMETER;
+
+	if ( !Virtualized || !VirtualMachineMonitor.state.Coverage.View )
+		return STATUS_DEVICE_NOT_READY;
+
+	Header = ( GestaltDirtyPages* ) MmGetSystemAddressForMdlSafe( Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute );
+
+	if ( !Header )
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	Max = ( OutputLength - sizeof( GestaltDirtyPages ) ) / sizeof( UINT64 );
+
+	Header->Count = DrainDirtyPages( ( UINT64* ) ( Header + 1 ), ( ULONG ) min( Max, ( SIZE_T ) GESTALT_MAX_TRACKED_PAGES ) );
+	Header->Reserved = 0;
+
+	Irp->IoStatus.Information = sizeof( GestaltDirtyPages ) + ( ULONG_PTR ) Header->Count * sizeof( UINT64 );
+
+	return STATUS_SUCCESS;
+}
+
+
+void Hypervisor::TraceWaitDpc( PKDPC Dpc, PVOID Context, PVOID Argument1, PVOID Argument2 )
+{
+	Hypervisor* hv = ( Hypervisor* ) Context;
+	TraceWaitQueue* Queue = &hv->TraceWaiters;
+	LARGE_INTEGER DueTime;
+	KIRQL Irql;
+	bool Empty;
+	PIRP Irp;
+
+	UNREFERENCED_PARAMETER( Dpc );
+	UNREFERENCED_PARAMETER( Argument1 );
+	UNREFERENCED_PARAMETER( Argument2 );
+
+	while ( ( Irp = IoCsqRemoveNextIrp( &Queue->Csq, ( PVOID ) 1 ) ) != nullptr )
+		hv->CompleteTraceRead( Irp );
+
+	KeAcquireSpinLock( &Queue->Lock, &Irql );
+	Empty = IsListEmpty( &Queue->Irps );
+	KeReleaseSpinLock( &Queue->Lock, Irql );
+
+	if ( !Empty && !Queue->Closing )
+	{
+		DueTime.QuadPart = -10000LL * TRACE_WAIT_PERIOD_MS;
+		KeSetTimer( &Queue->Timer, DueTime, &Queue->Dpc );
+	}
+}
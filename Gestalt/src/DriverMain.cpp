@@ -3,24 +3,91 @@
 
 Hypervisor hv;
 
+//
+// REG_DWORD parameters in the service key, 0 when missing:
+//  ExitTraceRecords: enables the exit trace, with that many records per processor
+//  ExitBenchmarkIterations: runs the exit latency benchmark before and after virtualizing, samples per workload and thread
+//  TranslationCache: non-zero to cache guest translations, MOV to CR3, INVLPG and INVPCID exit then
+//  ProfileSamples: enables the guest RIP profiler, with a ring of that many samples per processor
+//  ProfileRate: samples per second and processor, 0 to start with the profiler stopped
+//  ProfileOverhead: non-zero to measure the profiler overhead once virtualized
+//  TscCompensation: TSC_POLICY, 0 leaves the guest TSC alone
+//  IoWatchPorts: counts the exits of the I/O ports First - Last, packed as First | Last << 16
+//  DescriptorTableExits: non-zero to emulate SGDT, SIDT, LGDT, LIDT, SLDT, STR, LLDT and LTR in root mode
+//  TrackProcesses: non-zero to follow the guest context switches, MOV to CR3 exits then
+//  EptViews: EPT views besides the identity map, EPT stays off with 0
+//  ViewSwitchOverhead: non-zero to measure the EPT view switches once virtualized
+//  VeDelivery: non-zero to take the EPT violations of convertible pages as #VE in the guest
+//  ExecutionCoverage: non-zero to reserve an EPT view recording the first execution of covered pages
+//
+ULONG QueryParameter( PUNICODE_STRING RegistryPath, PCWSTR Name )
+{
+	RTL_QUERY_REGISTRY_TABLE Query[2];
+	ULONG Value = 0;
+
+	RtlZeroMemory( Query, sizeof( Query ) );
+	Query[0].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	Query[0].Name = const_cast< PWSTR >( Name );
+	Query[0].EntryContext = &Value;
+	Query[0].DefaultType = ( REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT ) | REG_NONE;
+
+	RtlQueryRegistryValues( RTL_REGISTRY_ABSOLUTE, RegistryPath->Buffer, Query, NULL, NULL );
+
+	return Value;
+}
+
 void DriverUnload(PDRIVER_OBJECT DriverObject)
 {
 	UNREFERENCED_PARAMETER( DriverObject );
 	//
+	// No request may be left pointing into the vCPUs when they are released
+	//
+	hv.DeleteControlDevice();
+
 	if (hv.IsVirtualized())
 		hv.Stop();
 }
 
 extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
 {
-	UNREFERENCED_PARAMETER( RegistryPath );
-
 	DriverObject->DriverUnload = DriverUnload;
+
+	hv.SetExitTrace( QueryParameter( RegistryPath, L"ExitTraceRecords" ) );
+	hv.SetExitBenchmark( QueryParameter( RegistryPath, L"ExitBenchmarkIterations" ) );
+	hv.SetTranslationCache( QueryParameter( RegistryPath, L"TranslationCache" ) );
+	hv.SetProfiler( QueryParameter( RegistryPath, L"ProfileRate" ), QueryParameter( RegistryPath, L"ProfileSamples" ) );
+	hv.SetTscCompensation( QueryParameter( RegistryPath, L"TscCompensation" ) );
+	hv.SetIoWatch( QueryParameter( RegistryPath, L"IoWatchPorts" ) );
+	hv.SetDescriptorTableExits( QueryParameter( RegistryPath, L"DescriptorTableExits" ) );
+	hv.SetProcessTracking( QueryParameter( RegistryPath, L"TrackProcesses" ) );
+	hv.SetEptViews( QueryParameter( RegistryPath, L"EptViews" ) );
+	hv.SetVeDelivery( QueryParameter( RegistryPath, L"VeDelivery" ), nullptr, nullptr );
+	hv.SetExecutionCoverage( QueryParameter( RegistryPath, L"ExecutionCoverage" ) );
+
+	//
+	// The driver keeps running without its control surface
+	//
+	hv.CreateControlDevice( DriverObject );
 	
 	
 	if ( hv.Enable() )
 	{
-		hv.Start();
+		hv.CalibrateTsc( BenchBaseline );
+		hv.RunExitBenchmark( BenchBaseline );
+
+		if ( hv.Start() )
+		{
+			hv.CalibrateTsc( BenchVirtualized );
+			hv.RunExitBenchmark( BenchVirtualized );
+
+			if ( QueryParameter( RegistryPath, L"ProfileOverhead" ) )
+				hv.MeasureProfileOverhead();
+
+			if ( QueryParameter( RegistryPath, L"ViewSwitchOverhead" ) )
+				hv.MeasureViewSwitches();
+		}
+
+		hv.WriteExitBenchmark( EXIT_BENCH_FILE );
 	}
 
 	//
@@ -0,0 +1,371 @@
+#include "Hypervisor.h"
+
+//
+// View switch measurement: switches per batch, and remaps of one page with the kick of every processor
+//
+#define VIEW_SWITCH_ROUNDS 10000
+#define VIEW_REMAP_ROUNDS 100
+//
+// Write faults on one page, taken as exits then as #VE
+//
+#define VIEW_FAULT_ROUNDS 10000
+
+//
+// SYSTEM_KERNEL_VA_SHADOW_INFORMATION, bit 0 of the flags is KvaShadowEnabled
+//
+#define SYSTEM_KERNEL_VA_SHADOW_INFORMATION 196
+
+extern "C" NTSTATUS NTAPI ZwQuerySystemInformation( ULONG SystemInformationClass, PVOID SystemInformation,
+	ULONG SystemInformationLength, PULONG ReturnLength );
+
+extern Hypervisor hv;
+
+//
+// __vmx_ve_isr, any IRQL with interrupts disabled
+//
+extern "C" void vmx::GuestVeHandler()
+{
+	vCPU* vcpu = hv.GetCurrentVCPU();
+
+	if ( vcpu )
+		vmx::ept::HandleVe( vcpu );
+}
+
+
+//
+// EPT views besides the identity map, 0 runs without EPT
+//
+void Hypervisor::SetEptViews( ULONG Views )
+{
+	EptViewCount = Views < MAX_EPT_VIEWS ? Views : MAX_EPT_VIEWS - 1;
+}
+
+
+//
+// Non-zero to take the violations of convertible pages as #VE in the guest. Handler picks the view the access goes on
+// in, without one the processor goes back to view 0
+//
+void Hypervisor::SetVeDelivery( ULONG Enabled, EPT_VE_HANDLER Handler, void* Context )
+{
+	VeDeliveryEnabled = Enabled != 0;
+	VeHandler = Handler;
+	VeContext = Context;
+}
+
+
+//
+// The IDT copy with the #VE gate lives in the vCPU, outside of what the user-mode page tables of KVA shadowing map:
+// an interrupt from user mode wouldn't find it
+//
+bool Hypervisor::KvaShadowEnabled()
+{
+	ULONG Flags = 0;
+
+	return NT_SUCCESS( ZwQuerySystemInformation( SYSTEM_KERNEL_VA_SHADOW_INFORMATION, &Flags, sizeof( Flags ), NULL ) ) &&
+		( Flags & 1 );
+}
+
+
+//
+// Before the host address space is built, it maps the tables. The identity map goes up to MAXPHYADDR so device memory
+// past the last RAM range is reached too, with the memory types of the MTRRs
+//
+bool Hypervisor::BuildEpt()
+{
+	EptState* Ept = &VirtualMachineMonitor.state.Ept;
+	PHYSICAL_ADDRESS Lowest = { 0 };
+	PHYSICAL_ADDRESS High;
+	PHYSICAL_ADDRESS Boundary = { 0 };
+	UINT64 Limit;
+	bool Pages1Gb;
+
+	PAGED_CODE();
+
+	if ( !EptViewCount && !CoverageEnabled )
+		return true;
+
+	//
+	// The coverage view comes on top of the others, the last of them gives way when all are asked for
+	//
+	if ( CoverageEnabled && EptViewCount == MAX_EPT_VIEWS - 1 )
+	{
+		EptViewCount--;
+		DbgInfo( "EPT views: %lu views besides the execution coverage one", EptViewCount );
+	}
+
+	if ( !vmx::ept::Supported( &Pages1Gb ) )
+	{
+		DbgInfo( "EPT is not supported, running without views" );
+		return false;
+	}
+
+	Limit = vmx::ept::MapLimit( Pages1Gb );
+	EptTablesSize = vmx::ept::TablesSize( Limit, Pages1Gb, EptViewCount, CoverageEnabled ? vmx::coverage::Tables( Limit ) : 0 );
+	High.QuadPart = MAXUINT64;
+
+	EptTables = MmAllocateContiguousMemorySpecifyCache( EptTablesSize, Lowest, High, Boundary, MmCached );
+
+	if ( !EptTables )
+	{
+		DbgInfo( "Unable to allocate %llu KB of EPT tables, running without views", ( UINT64 ) EptTablesSize >> 10 );
+		EptTablesSize = 0;
+		return false;
+	}
+
+	if ( !vmx::ept::Build( Ept, EptTables, EptTablesSize, Limit, Pages1Gb ) )
+	{
+		DbgInfo( "Unable to build the EPT identity map, running without views" );
+		FreeEpt();
+		return false;
+	}
+
+	for ( ULONG i = 0; i < EptViewCount + ( CoverageEnabled ? 1 : 0 ); i++ )
+	{
+		if ( vmx::ept::CreateView( Ept ) == EPT_NO_VIEW )
+		{
+			DbgInfo( "Unable to create EPT view %lu, running without views", i + 1 );
+			FreeEpt();
+			return false;
+		}
+	}
+
+	DbgInfo( "EPT: %llu GB identity mapped with %s pages in %u tables, %u views switched with %s", Limit >> 30,
+		Pages1Gb ? "1 GB" : "2 MB", Ept->Views[0].Tables, Ept->ViewCount, Ept->VmfuncSwitching ? "VMFUNC" : "VMCALL" );
+
+	SetupCoverage();
+
+	if ( VeDeliveryEnabled )
+	{
+		if ( KvaShadowEnabled() )
+			DbgInfo( "KVA shadowing is on, EPT violations stay exits" );
+		else if ( !vmx::ept::EnableVe( Ept, VeHandler, VeContext ) )
+			DbgInfo( "EPT violations can't be converted to #VE, they stay exits" );
+		else
+			DbgInfo( "EPT: violations of convertible pages are #VE" );
+	}
+
+	return true;
+}
+
+
+//
+// Only once no processor runs with EPT
+//
+void Hypervisor::FreeEpt()
+{
+	if ( EptTables )
+		MmFreeContiguousMemory( EptTables );
+
+	RtlSecureZeroMemory( &VirtualMachineMonitor.state.Ept, sizeof( EptState ) );
+	RtlSecureZeroMemory( &VirtualMachineMonitor.state.Coverage, sizeof( ExecutionCoverage ) );
+	EptTables = nullptr;
+	EptTablesSize = 0;
+}
+
+
+//
+// Every processor drops the translations of the old mapping before this returns. The coverage view can't be changed
+//
+bool Hypervisor::SetEptPage( UINT32 View, UINT64 GuestPhysical, UINT64 Physical, UINT32 Access )
+{
+	bool Set;
+
+	PAGED_CODE();
+
+	//
+	// The coverage view belongs to the coverage, its pages only lose and get back execute
+	//
+	if ( View && View == VirtualMachineMonitor.state.Coverage.View )
+		return false;
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	Set = Virtualized && vmx::ept::SetPage( &VirtualMachineMonitor.state.Ept, View, GuestPhysical, Physical, Access );
+
+	if ( Set )
+		KickAll( KICK_EPT, true );
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	return Set;
+}
+
+
+//
+// The view of the calling processor only, the caller keeps running on it (DISPATCH_LEVEL or an affinity of one).
+// An access the view doesn't allow brings it back to view 0
+//
+bool Hypervisor::SwitchEptView( UINT32 View )
+{
+	const EptState* Ept = &VirtualMachineMonitor.state.Ept;
+
+	if ( !Virtualized || View >= Ept->ViewCount )
+		return false;
+
+	if ( Ept->VmfuncSwitching )
+	{
+		vmx::__vmfunc( 0, View );
+		return true;
+	}
+
+	return vmx::__vmcall( VMCALL_SWITCH_VIEW, View, 0 ) == 0;
+}
+
+
+//
+// Cycles of a view switch with VMFUNC, with the hypercall fallback and of a remap of the view instead (SetPage and
+// the INVEPT of every processor). Needs a view besides the identity map and the coverage view, which SetEptPage can't
+// change: view 1, the coverage view being the last one
+//
+void Hypervisor::MeasureViewSwitches()
+{
+	EptState* Ept = &VirtualMachineMonitor.state.Ept;
+	UINT64 Vmfunc = 0;
+	UINT64 Hypercall = 0;
+	UINT64 Remap = 0;
+	UINT64 Start;
+	UINT64 Page;
+	KIRQL Irql;
+	volatile UINT64* Target;
+	UINT64 Faults[2] = { 0 };
+
+	PAGED_CODE();
+
+	if ( !Virtualized || Ept->ViewCount < 2 || VirtualMachineMonitor.state.Coverage.View == 1 )
+	{
+		DbgInfo( "No EPT view to switch to, the view switches can't be measured" );
+		return;
+	}
+
+	KeRaiseIrql( DISPATCH_LEVEL, &Irql );
+
+	if ( Ept->VmfuncSwitching )
+	{
+		Start = __rdtsc();
+
+		for ( ULONG i = 0; i < VIEW_SWITCH_ROUNDS; i++ )
+		{
+			vmx::__vmfunc( 0, 1 );
+			vmx::__vmfunc( 0, 0 );
+		}
+
+		Vmfunc = ( __rdtsc() - Start ) / ( VIEW_SWITCH_ROUNDS * 2 );
+	}
+
+	Start = __rdtsc();
+
+	for ( ULONG i = 0; i < VIEW_SWITCH_ROUNDS; i++ )
+	{
+		vmx::__vmcall( VMCALL_SWITCH_VIEW, 1, 0 );
+		vmx::__vmcall( VMCALL_SWITCH_VIEW, 0, 0 );
+	}
+
+	Hypercall = ( __rdtsc() - Start ) / ( VIEW_SWITCH_ROUNDS * 2 );
+
+	KeLowerIrql( Irql );
+
+	//
+	// The page of the EPTP list, mapped to itself: only the cost of the change is left
+	//
+	Page = VIRTUAL_TO_PHYSICAL( Ept->EptpList );
+	Start = __rdtsc();
+
+	for ( ULONG i = 0; i < VIEW_REMAP_ROUNDS; i++ )
+		SetEptPage( 1, Page, Page, EPT_ACCESS_ALL );
+
+	Remap = ( __rdtsc() - Start ) / VIEW_REMAP_ROUNDS;
+
+	if ( Ept->VmfuncSwitching )
+		DbgInfo( "EPT view switch: %llu cycles with VMFUNC, %llu with VMCALL, %llu for a remap", Vmfunc, Hypercall, Remap );
+	else
+		DbgInfo( "EPT view switch: no VMFUNC, %llu cycles with VMCALL, %llu for a remap", Hypercall, Remap );
+
+	if ( !Ept->VeDelivery )
+		return;
+
+	//
+	// A read-only page of view 1 written from view 1: the fault goes back to view 0, first through the exit then as
+	// #VE. The page is only touched from kernel mode
+	//
+	Target = ( volatile UINT64* ) ExAllocatePoolWithTag( NonPagedPoolNx, PAGE_SIZE, GESTALT_POOL_TAG );
+
+	if ( !Target )
+		return;
+
+	Page = VIRTUAL_TO_PHYSICAL( ( void* ) Target );
+
+	for ( ULONG Pass = 0; Pass < 2; Pass++ )
+	{
+		if ( !SetEptPage( 1, Page, Page, EPT_READ | ( Pass ? EPT_CONVERTIBLE : 0 ) ) )
+			break;
+
+		KeRaiseIrql( DISPATCH_LEVEL, &Irql );
+		Start = __rdtsc();
+
+		for ( ULONG i = 0; i < VIEW_FAULT_ROUNDS; i++ )
+		{
+			SwitchEptView( 1 );
+			*Target = i;
+		}
+
+		Faults[Pass] = ( __rdtsc() - Start ) / VIEW_FAULT_ROUNDS;
+		KeLowerIrql( Irql );
+	}
+
+	SetEptPage( 1, Page, Page, EPT_ACCESS_ALL );
+	ExFreePoolWithTag( ( void* ) Target, GESTALT_POOL_TAG );
+
+	DbgInfo( "EPT write fault with the view switch: %llu cycles as an exit, %llu as #VE", Faults[0], Faults[1] );
+}
+
+
+//
+// Counters of every processor together, then the pages each view changed
+//
+void Hypervisor::ReportEptViews() const
+{
+	const EptState* Ept = &VirtualMachineMonitor.state.Ept;
+	UINT64 Hypercalls = 0;
+	UINT64 Vmfuncs = 0;
+	UINT64 Violations = 0;
+	UINT64 Invalidations = 0;
+	UINT64 VeDelivered = 0;
+	UINT64 VeUnresolved = 0;
+	UINT64 VeIdtReloads = 0;
+	UINT64 VeIdtLost = 0;
+
+	if ( !Ept->Enabled )
+		return;
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; Group->vcpu && j < Group->Count; j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( !vcpu )
+				continue;
+
+			Hypercalls += vcpu->Ept.HypercallSwitches;
+			Vmfuncs += vcpu->Ept.FailedVmfuncs;
+			Violations += vcpu->Ept.Violations;
+			Invalidations += vcpu->Ept.Invalidations;
+			VeDelivered += vcpu->Ept.VeDelivered;
+			VeUnresolved += vcpu->Ept.VeUnresolved;
+			VeIdtReloads += vcpu->Ept.VeIdtReloads;
+			VeIdtLost += vcpu->Ept.VeIdtLost;
+		}
+	}
+
+	DbgInfo( "EPT views: %llu hypercall switches, %llu failed VMFUNCs, %llu violations, %llu invalidations", Hypercalls,
+		Vmfuncs, Violations, Invalidations );
+
+	if ( Ept->VeDelivery )
+		DbgInfo( "EPT #VE: %llu delivered, %llu left to the hypervisor, IDT copy rebuilt %llu times, lost %llu times", VeDelivered,
+			VeUnresolved, VeIdtReloads, VeIdtLost );
+
+	for ( UINT32 i = 1; i < Ept->ViewCount; i++ )
+		DbgInfo( "EPT view %u: %llu pages changed, %u tables of its own", i, Ept->Views[i].Pages, Ept->Views[i].Tables );
+}
@@ -0,0 +1,195 @@
+#include "Hypervisor.h"
+
+
+//
+// Non-zero to reserve an EPT view for the execution coverage, on top of the EptViews ones. BuildEpt takes one of those
+// when all the views are asked for
+//
+void Hypervisor::SetExecutionCoverage( ULONG Enabled )
+{
+	CoverageEnabled = Enabled != 0;
+}
+
+
+//
+// From BuildEpt, once the views are created: the last one is the coverage view
+//
+void Hypervisor::SetupCoverage()
+{
+	GlobalState* state = &VirtualMachineMonitor.state;
+
+	if ( !CoverageEnabled )
+		return;
+
+	if ( state->Ept.ViewCount < 2 || !vmx::coverage::Setup( state, state->Ept.ViewCount - 1 ) )
+	{
+		DbgInfo( "No EPT view left for the execution coverage" );
+		return;
+	}
+
+	DbgInfo( "Execution coverage in EPT view %u, up to %u pages", state->Coverage.View, MAX_COVERED_PAGES );
+}
+
+
+//
+// The resident pages of a non-paged range, a driver image for instance. Returns the pages covered: the range may be
+// larger than the coverage, or have pages that can't be covered. Every processor is in the coverage view afterwards
+//
+ULONG Hypervisor::CoverRange( PVOID Base, SIZE_T Size )
+{
+	GlobalState* state = &VirtualMachineMonitor.state;
+	BYTE* Page = ( BYTE* ) PAGE_ALIGN( Base );
+	BYTE* End = ( BYTE* ) Base + Size;
+	ULONG Covered = 0;
+
+	PAGED_CODE();
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	if ( Virtualized && state->Coverage.View )
+	{
+		for ( ; Page < End; Page += PAGE_SIZE )
+		{
+			PHYSICAL_ADDRESS Physical = MmGetPhysicalAddress( Page );
+
+			if ( Physical.QuadPart && vmx::coverage::Cover( state, ( UINT64 ) Physical.QuadPart ) )
+				Covered++;
+		}
+
+		//
+		// One INVEPT for every page that lost execute
+		//
+		KickAll( KICK_EPT | KICK_COVERAGE, true );
+	}
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	return Covered;
+}
+
+
+//
+// Batched: every executed page loses execute again, then a single kick flushes them all. Processors that fell back to
+// view 0 since go back to the coverage view with the same kick. Returns the pages taken back
+//
+ULONG Hypervisor::ResetCoverage()
+{
+	GlobalState* state = &VirtualMachineMonitor.state;
+	ULONG Count = 0;
+
+	PAGED_CODE();
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	if ( Virtualized && state->Coverage.View )
+	{
+		Count = vmx::coverage::Reset( state );
+		KickAll( KICK_EPT | KICK_COVERAGE, true );
+	}
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	return Count;
+}
+
+
+//
+// The pages of a guest-physical range lose write in the coverage view, so their first write is recorded. Returns the
+// pages tracked: some may be tracked already, or not mapped writable. Every processor is in the coverage view afterwards
+//
+ULONG Hypervisor::TrackWrites( UINT64 GuestPhysical, UINT64 Size )
+{
+	GlobalState* state = &VirtualMachineMonitor.state;
+	UINT64 Page = GuestPhysical & ~( ( UINT64 ) PAGE_SIZE - 1 );
+	UINT64 End = GuestPhysical + Size;
+	ULONG Tracked = 0;
+
+	PAGED_CODE();
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	if ( Virtualized && state->Coverage.View )
+	{
+		for ( ; Page < End; Page += PAGE_SIZE )
+		{
+			if ( vmx::coverage::TrackWrites( state, Page ) )
+				Tracked++;
+		}
+
+		KickAll( KICK_EPT | KICK_COVERAGE, true );
+	}
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	return Tracked;
+}
+
+
+//
+// The pages written since the last drain, up to Max, which lose write again. No processor has a writable translation of
+// them left when it returns, the writes from then on are in the next drain
+//
+ULONG Hypervisor::DrainDirtyPages( UINT64* Pages, ULONG Max )
+{
+	GlobalState* state = &VirtualMachineMonitor.state;
+	ULONG Count = 0;
+
+	PAGED_CODE();
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	if ( Virtualized && state->Coverage.View )
+	{
+		Count = vmx::coverage::Drain( state, Pages, Max );
+
+		if ( Count )
+			KickAll( KICK_EPT, true );
+	}
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	return Count;
+}
+
+
+//
+// Lock-free, at any IRQL: the guest-physical pages executed since the last reset
+//
+ULONG Hypervisor::CollectCoverage( UINT64* Pages, ULONG Max ) const
+{
+	if ( !Virtualized )
+		return 0;
+
+	return vmx::coverage::Collect( &VirtualMachineMonitor.state.Coverage, Pages, Max );
+}
+
+
+void Hypervisor::ReportCoverage() const
+{
+	const ExecutionCoverage* Coverage = &VirtualMachineMonitor.state.Coverage;
+	UINT64 Hits = 0;
+	UINT64 Writes = 0;
+
+	if ( !Coverage->View )
+		return;
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; Group->vcpu && j < Group->Count; j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( vcpu )
+			{
+				Hits += vcpu->Ept.CoverageHits;
+				Writes += vcpu->Ept.DirtyHits;
+			}
+		}
+	}
+
+	DbgInfo( "Execution coverage: %u pages covered, %u executed since the last of %llu resets, %llu first executions",
+		Coverage->Count, vmx::coverage::Collect( Coverage, nullptr, 0 ), Coverage->Resets, Hits );
+	DbgInfo( "Dirty pages: %llu first writes, %llu drains", Writes, Coverage->Drains );
+}
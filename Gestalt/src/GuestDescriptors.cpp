@@ -0,0 +1,80 @@
+#include "Hypervisor.h"
+
+
+//
+// Non-zero to make the descriptor-table instructions exit. They are emulated through the direct map, without it
+// they keep running natively
+//
+void Hypervisor::SetDescriptorTableExits( ULONG Enabled )
+{
+	DescriptorTableExits = Enabled != 0;
+}
+
+
+//
+// What SGDT (Idt false) or SIDT on the calling processor return from now on, until the guest loads a new table.
+// The exit handler of this processor can't run while the guest side does, interrupts are only kept off
+// so the thread doesn't move in the middle. With #VE delivery the IDT shadow hides the IDT copy, it can't be changed
+//
+bool Hypervisor::ShadowDescriptorTable( bool Idt, UINT64 Base, UINT16 Limit, bool Active )
+{
+	vCPU* vcpu;
+
+	if ( !Virtualized || !VirtualMachineMonitor.state.DescriptorTableExiting || ( Idt && VirtualMachineMonitor.state.Ept.VeDelivery ) )
+		return false;
+
+	_disable();
+
+	vcpu = GetCurrentVCPU();
+
+	if ( vcpu )
+		vmx::dt::SetShadow( Idt ? &vcpu->DescriptorTables.Idt : &vcpu->DescriptorTables.Gdt, Base, Limit, Active );
+
+	_enable();
+
+	return vcpu != nullptr;
+}
+
+
+//
+// Exits and root mode cycles of every instruction, all processors together
+//
+void Hypervisor::ReportDescriptorTableExits() const
+{
+	UINT64 Exits[DescriptorInstructionCount] = {};
+	UINT64 Cycles[DescriptorInstructionCount] = {};
+	UINT64 Faults = 0;
+
+	if ( !VirtualMachineMonitor.state.DescriptorTableExiting )
+		return;
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; Group->vcpu && j < Group->Count; j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( !vcpu )
+				continue;
+
+			for ( ULONG k = 0; k < DescriptorInstructionCount; k++ )
+			{
+				Exits[k] += vcpu->DescriptorTables.Exits[k];
+				Cycles[k] += vcpu->DescriptorTables.Cycles[k];
+			}
+
+			Faults += vcpu->DescriptorTables.Faults;
+		}
+	}
+
+	for ( ULONG k = 0; k < DescriptorInstructionCount; k++ )
+	{
+		if ( Exits[k] )
+			DbgInfo( "%s: %llu exits, %llu root mode cycles per exit", vmx::dt::InstructionName( ( DESCRIPTOR_INSTRUCTION ) k ),
+				Exits[k], Cycles[k] / Exits[k] );
+	}
+
+	DbgInfo( "Descriptor-table instructions: %llu faults given to the guest", Faults );
+}
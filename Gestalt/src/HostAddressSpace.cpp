@@ -0,0 +1,207 @@
+#include "Hypervisor.h"
+#include <ntimage.h>
+
+extern "C" IMAGE_DOS_HEADER __ImageBase;
+
+
+//
+// RAM ranges as the memory manager sees them, adjacent ones merged
+//
+static UINT32 GetPhysicalRanges( PhysicalRange* Ranges )
+{
+	PPHYSICAL_MEMORY_RANGE MemoryRanges = MmGetPhysicalMemoryRanges();
+	UINT32 Count = 0;
+
+	if ( !MemoryRanges )
+		return 0;
+
+	for ( PPHYSICAL_MEMORY_RANGE Range = MemoryRanges; Range->BaseAddress.QuadPart || Range->NumberOfBytes.QuadPart; Range++ )
+	{
+		if ( Count && Ranges[Count - 1].Base + Ranges[Count - 1].Size == ( UINT64 ) Range->BaseAddress.QuadPart )
+		{
+			Ranges[Count - 1].Size += Range->NumberOfBytes.QuadPart;
+			continue;
+		}
+
+		if ( Count == DIRECT_MAP_MAX_RANGES )
+		{
+			Count = 0;
+			break;
+		}
+
+		Ranges[Count].Base = Range->BaseAddress.QuadPart;
+		Ranges[Count].Size = Range->NumberOfBytes.QuadPart;
+		Count++;
+	}
+
+	ExFreePool( MemoryRanges );
+
+	return Count;
+}
+
+
+//
+// Mirror nonpaged memory into the host address space at its system address. The pages don't have to be
+// physically contiguous, each contiguous run is one MapRange call
+//
+bool Hypervisor::MapHostRegion( PVOID Address, SIZE_T Size, UINT32 Flags )
+{
+	HostAddressSpace* Host = &VirtualMachineMonitor.state.Host;
+	UINT64 Start = ( UINT64 ) Address & ~( PAGE_SIZE - 1ULL );
+	UINT64 End = ALIGN_TO_PAGE( ( UINT64 ) Address + Size );
+	UINT64 RunVirtual = Start;
+	UINT64 RunPhysical = VIRTUAL_TO_PHYSICAL( Start );
+
+	for ( UINT64 Page = Start + PAGE_SIZE; Page <= End; Page += PAGE_SIZE )
+	{
+		UINT64 Physical = Page < End ? VIRTUAL_TO_PHYSICAL( Page ) : 0;
+
+		if ( Page < End && Physical == RunPhysical + ( Page - RunVirtual ) )
+			continue;
+
+		if ( !RunPhysical || !vmx::host::MapRange( Host, RunVirtual, RunPhysical, Page - RunVirtual, Flags ) )
+			return false;
+
+		RunVirtual = Page;
+		RunPhysical = Physical;
+	}
+
+	return true;
+}
+
+
+//
+// The driver image the exit handlers run from. Discardable and pageable sections are left out,
+// root mode never runs code that can be paged
+//
+bool Hypervisor::MapHostImage()
+{
+	BYTE* ImageBase = ( BYTE* ) &__ImageBase;
+	PIMAGE_NT_HEADERS Headers = ( PIMAGE_NT_HEADERS ) ( ImageBase + __ImageBase.e_lfanew );
+	PIMAGE_SECTION_HEADER Section = IMAGE_FIRST_SECTION( Headers );
+
+	for ( USHORT i = 0; i < Headers->FileHeader.NumberOfSections; i++, Section++ )
+	{
+		UINT32 Flags = 0;
+
+		if ( Section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE || !strncmp( ( const char* ) Section->Name, "PAGE", 4 ) )
+			continue;
+
+		if ( Section->Characteristics & IMAGE_SCN_MEM_EXECUTE )
+			Flags |= HOST_MAP_EXECUTE;
+		else if ( Section->Characteristics & IMAGE_SCN_MEM_WRITE )
+			Flags |= HOST_MAP_WRITE;
+
+		if ( !MapHostRegion( ImageBase + Section->VirtualAddress, Section->Misc.VirtualSize, Flags ) )
+			return false;
+	}
+
+	return true;
+}
+
+
+//
+// Build the root mode page tables, before any processor is configured. The processors keep running on the system CR3
+// in root mode when this fails
+//
+bool Hypervisor::BuildHostAddressSpace()
+{
+	PhysicalRange Ranges[DIRECT_MAP_MAX_RANGES];
+	HostAddressSpace* Host = &VirtualMachineMonitor.state.Host;
+	PHYSICAL_ADDRESS Pml4Address;
+	UINT32 RangeCount;
+	bool LargePages1Gb;
+	CR3 Cr3;
+	CR4 Cr4;
+
+	PAGED_CODE();
+
+	Cr4.AsUInt = __readcr4();
+
+	if ( Cr4.LinearAddresses57Bit )
+	{
+		DbgInfo( "5-level paging is not supported by the direct map" );
+		return false;
+	}
+
+	RangeCount = GetPhysicalRanges( Ranges );
+
+	if ( !RangeCount )
+	{
+		DbgInfo( "Unable to get the physical memory ranges" );
+		return false;
+	}
+
+	Cr3.AsUInt = __readcr3();
+	Pml4Address.QuadPart = Cr3.AddressOfPageDirectory << PAGE_SHIFT;
+	SystemPml4 = ( PML4E_64* ) MmGetVirtualForPhysical( Pml4Address );
+
+	LargePages1Gb = vmx::host::LargePages1GbSupported();
+	HostTablesSize = vmx::host::TablesSize( Ranges, RangeCount, LargePages1Gb );
+	//
+	// Room for the image, the statistics, the EPT tables and every processor that can ever be added
+	//
+	HostTablesSize += vmx::host::MapTablesSize( ( ( PIMAGE_NT_HEADERS ) ( ( BYTE* ) &__ImageBase + __ImageBase.e_lfanew ) )->OptionalHeader.SizeOfImage );
+	HostTablesSize += StatsMdl ? vmx::host::MapTablesSize( MmGetMdlByteCount( StatsMdl ) ) : 0;
+	HostTablesSize += EptTables ? vmx::host::MapTablesSize( EptTablesSize ) : 0;
+	HostTablesSize += KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS ) *
+		( vmx::host::MapTablesSize( sizeof( vCPU ) ) + vmx::host::MapTablesSize( ( SIZE_T ) ExitTraceRecords * sizeof( ExitTraceRecord ) ) +
+		vmx::host::MapTablesSize( ( SIZE_T ) ProfileSamples * sizeof( ProfileSample ) ) );
+
+	//
+	// Page aligned, allocations of a page or more always are
+	//
+	HostTables = ExAllocatePoolWithTag( NonPagedPoolNx, HostTablesSize, GESTALT_POOL_TAG );
+
+	if ( !SystemPml4 || !HostTables )
+	{
+		DbgInfo( "Unable to allocate the host page tables, system is out-of-memory!" );
+		FreeHostAddressSpace();
+		return false;
+	}
+
+	if ( !vmx::host::BuildAddressSpace( Host, SystemPml4, Ranges, RangeCount, HostTables, HostTablesSize, LargePages1Gb ) )
+	{
+		DbgInfo( "No room for the direct map in the kernel address space" );
+		FreeHostAddressSpace();
+		return false;
+	}
+
+	//
+	// The vCPUs and their trace buffers are added as they are allocated
+	//
+	if ( !MapHostImage() || ( StatsRegion && !MapHostRegion( StatsRegion, MmGetMdlByteCount( StatsMdl ), HOST_MAP_WRITE ) ) ||
+		( EptTables && !MapHostRegion( EptTables, EptTablesSize, HOST_MAP_WRITE ) ) )
+	{
+		DbgInfo( "Unable to map the driver in the host address space" );
+		FreeHostAddressSpace();
+		return false;
+	}
+
+	DbgInfo( "Direct map: %llu GB of physical memory at 0x%llx with %s pages, %d RAM ranges, %u page tables", Host->DirectMapSize >> 30,
+		( UINT64 ) Host->DirectMapBase, LargePages1Gb ? "1 GB" : "2 MB", ( int ) RangeCount, Host->DirectMapTables );
+	DbgInfo( "Host address space: %llu pages of driver memory", Host->MappedPages );
+
+	return true;
+}
+
+
+//
+// Only once no processor runs on the host page tables
+//
+void Hypervisor::FreeHostAddressSpace()
+{
+	if ( HostTables )
+		ExFreePoolWithTag( HostTables, GESTALT_POOL_TAG );
+
+	RtlSecureZeroMemory( &VirtualMachineMonitor.state.Host, sizeof( HostAddressSpace ) );
+	HostTables = nullptr;
+	HostTablesSize = 0;
+	SystemPml4 = nullptr;
+}
+
+
+void Hypervisor::SetTranslationCache( ULONG Enabled )
+{
+	TranslationCacheEnabled = Enabled != 0;
+}
@@ -19,7 +19,19 @@ bool Hypervisor::Start()
 	{
 	*/
 	IsVMX = true;
-	return VMXVirtualize();
+	KeInitializeMutex( &BringUpLock, 0 );
+
+	if ( !VMXVirtualize() )
+		return false;
+	//
+	// Follow hot-added processors and sleep/resume transitions from now on, the exit of the watched processes and the
+	// TSC offsets
+	//
+	RegisterProcessorEvents();
+	RegisterProcessNotify();
+	StartTscResync();
+
+	return true;
 	/*  }
 	else
 	{
@@ -41,136 +53,643 @@ bool Hypervisor::Enable()
 	return ( vmx::IsSupported() && vmx::Enable() ) /* || ( svm::IsSupported() && svm::Enable() )*/;
 }
 
+//
+// Leave VMX operation on every processor and release the vCPUs
+//
 bool Hypervisor::Stop()
 {
-	__vmx_off();
-	return false;
+	bool Succeeded;
+
+	UnregisterProcessorEvents();
+	UnregisterProcessNotify();
+	StopTscResync();
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	Succeeded = DeVirtualize();
+
+	if ( Succeeded )
+	{
+		if ( ExitTraceRecords )
+			WriteExitTrace( EXIT_TRACE_FILE );
+
+		if ( ProfileSamples )
+			WriteProfile( PROFILE_FILE );
+
+		ReportTscCompensation();
+		ReportIoRanges();
+		ReportDescriptorTableExits();
+		ReportProcessTracking();
+		ReportEptViews();
+		ReportCoverage();
+
+		VMXFreeGroups();
+		DeleteStatsRegion();
+		FreeHostAddressSpace();
+		FreeEpt();
+		UnmapApic();
+	}
+
+	Virtualized = false;
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	return Succeeded;
 }
 
 
 //
-// Virtualize all the processors using Intel-VTx
+// Per group bring-up context, every processor group is virtualized by its own system thread
+//
+struct GroupBringUp
+{
+	Hypervisor* hv;
+	ProcessorGroup* Group;
+	bool Succeeded;
+};
+
+
+//
+// Virtualize all the processors of all processor groups using Intel-VTx
 //
-#pragma optimize("", off)
 bool Hypervisor::VMXVirtualize()
 {
-	if ( KeGetCurrentIrql() > DISPATCH_LEVEL )
-		KeRaiseIrqlToDpcLevel();
-	
 	PAGED_CODE();
 
-	PHYSICAL_ADDRESS High = { 0 };
-	High.QuadPart = MAXUINT64;
+	USHORT GroupCount;
+
 	Virtualized = false;
-	int status;
-	this->NumberOfCpus = KeQueryActiveProcessors();
-	this->VirtualMachineMonitor.vcpu = ( vCPU* ) MmAllocateContiguousMemory( sizeof( vCPU ) * NumberOfCpus, High );
+	NumberOfCpus = KeQueryActiveProcessorCountEx( ALL_PROCESSOR_GROUPS );
+	//
+	// Size the group array by the maximum, processors can be hot-added to groups that are empty now
+	//
+	GroupCount = KeQueryMaximumGroupCount();
 
-	if ( !VirtualMachineMonitor.vcpu )
+	VirtualMachineMonitor.Groups = ( ProcessorGroup* ) ExAllocatePoolWithTag( NonPagedPool, sizeof( ProcessorGroup ) * GroupCount, GESTALT_POOL_TAG );
+
+	if ( !VirtualMachineMonitor.Groups )
 	{
-		DbgInfo( "Unable to allocate vcpu structures, system is out-of-memory!" );
+		DbgInfo( "Unable to allocate processor group structures, system is out-of-memory!" );
 		return false;
 	}
 
 	//
 	// Zero-out important structures
 	//
-	RtlSecureZeroMemory( VirtualMachineMonitor.vcpu, sizeof( vCPU ) * NumberOfCpus );
-	RtlSecureZeroMemory( &VirtualMachineMonitor.state.MSRBitMap, sizeof( VMX_MSR_BITMAP ) );
+	RtlSecureZeroMemory( VirtualMachineMonitor.Groups, sizeof( ProcessorGroup ) * GroupCount );
 	RtlSecureZeroMemory( &VirtualMachineMonitor.state, sizeof( GlobalState ) );
-	RtlSecureZeroMemory( VmExitBitMap, MAX_EVENT_FILTERS_COUNT );
+	RtlSecureZeroMemory( VmExitBitMap, sizeof( VmExitBitMap ) );
+	VirtualMachineMonitor.GroupCount = GroupCount;
+	//
+	// The RDMSR/WRMSR benchmark workloads need their MSR to exit
+	//
+	if ( BenchIterations || TscPolicy == TscHideCalibrated )
+		vmx::SetMsrIntercept( &VirtualMachineMonitor.state, BENCH_MSR, true, true );
+
 	//
-	// The only information that we need to care here is the stack size/allocation
-	// the vmx library has it's own custom vm_exit handler that will call ours when calling the VMLaunch function
+	// The APIC timer deadline is written in guest TSC time once the guest TSC is offset. A calibrated policy starts
+	// counting only, CalibrateTsc applies it
 	//
-	VirtualMachineMonitor.state.HostState.StackSize = PAGE_SIZE;
-	VirtualMachineMonitor.state.HostState.RSP = (UINT64) MmAllocateContiguousMemory( PAGE_SIZE, High );
+	VirtualMachineMonitor.state.TscOffsetting = TscPolicy != TscAccountOnly;
+	VirtualMachineMonitor.state.TscPolicy = TscPolicy == TscHideCalibrated ? TscAccountOnly : TscPolicy;
 
-	if ( !VirtualMachineMonitor.state.HostState.RSP )
+	//
+	// The guest TSC and IA32_TSC_ADJUST are written through the offset too, the real TSC of the processor stays in
+	// step with the others
+	//
+	VirtualMachineMonitor.state.TscOffset = 0;
+
+	if ( VirtualMachineMonitor.state.TscOffsetting )
 	{
-		DbgInfo( "Unable to allocate Host stack, system is out-of-memory!" );
-		MmFreeContiguousMemory( VirtualMachineMonitor.vcpu );
-		return false;
+		vmx::SetMsrIntercept( &VirtualMachineMonitor.state, IA32_TSC_DEADLINE, true, true );
+		vmx::SetMsrIntercept( &VirtualMachineMonitor.state, IA32_TIME_STAMP_COUNTER, false, true );
+		vmx::SetMsrIntercept( &VirtualMachineMonitor.state, IA32_TSC_ADJUST, true, true );
 	}
+
+	AddIoWatch();
+	AddCr3Targets();
+
+	DbgInfo( "Virtualizing %d processors in %d groups", ( int ) NumberOfCpus, ( int ) KeQueryActiveGroupCount() );
+
+	//
+	// Statistics are optional, the processors run without a slot when the section can't be created
+	//
+	if ( !CreateStatsRegion() )
+		DbgInfo( "Unable to create the statistics region, running without it" );
+
+	//
+	// The views are optional too, the processors run without EPT when the tables can't be built
+	//
+	BuildEpt();
+
+	//
+	// Without the direct map the root mode runs on the system page tables, and has no access to guest memory
+	//
+	if ( !BuildHostAddressSpace() )
+		DbgInfo( "Unable to build the host address space, running without it" );
+
+	//
+	// The guest page walker reads through the direct map. Keeping its cache coherent costs an exit per MOV to CR3
+	//
+	VirtualMachineMonitor.state.TrackTranslations = TranslationCacheEnabled && VirtualMachineMonitor.state.Host.Cr3;
+
 	//
-	// Enter in VMX operation in each processor and configure the VMCS
+	// The descriptor-table handlers read and write their memory operands through the direct map too. #VE delivery
+	// needs them to hide the IDT copy, it is turned off when they can't run
 	//
-	for ( SIZE_T i = 0; i < NumberOfCpus; i ++ )
+	VirtualMachineMonitor.state.DescriptorTableExiting = ( DescriptorTableExits || VirtualMachineMonitor.state.Ept.VeDelivery ) &&
+		VirtualMachineMonitor.state.Host.Cr3;
+
+	if ( VirtualMachineMonitor.state.Ept.VeDelivery && !VirtualMachineMonitor.state.DescriptorTableExiting )
 	{
-		KeSetSystemAffinityThread( i );
-		DbgInfo( "Entering VMX operation on processor %d\n", ( int ) i );
+		DbgInfo( "#VE delivery needs descriptor-table exiting and the direct map, EPT violations stay exits" );
+		VirtualMachineMonitor.state.Ept.VeDelivery = false;
+	}
+
+	//
+	// Without the local APIC registers the processors can't be kicked, real NMIs still go to the guest
+	//
+	if ( !MapApic() )
+		DbgInfo( "Unable to map the local APIC, vCPU kicks are disabled" );
+
+	//
+	// The sampling period is in the VMCS of every processor from its launch
+	//
+	InitializeProfiler();
 
-		VirtualMachineMonitor.vcpu[i].state = &VirtualMachineMonitor.state;
+	//
+	// Memory is sized per group, using the real active processor mask of each one
+	//
+	for ( USHORT i = 0; i < GroupCount; i++ )
+	{
+		VirtualMachineMonitor.Groups[i].Group = i;
 
-		if ( !vmx::StartVMX( &VirtualMachineMonitor.vcpu[i] ) )
+		if ( !VMXAllocateGroup( &VirtualMachineMonitor.Groups[i] ) )
 		{
-			DbgInfo( "Unable to start VMX on logical processor %d! Aborting...\n", ( int ) i );
+			DbgInfo( "Unable to allocate vcpu structures for group %d, system is out-of-memory!", ( int ) i );
+			VMXFreeGroups();
+			DeleteStatsRegion();
+			FreeHostAddressSpace();
+			FreeEpt();
+			UnmapApic();
 			return false;
 		}
+	}
 
-		DbgInfo( "VMX Operation enabled on %d processor!\n", ( int ) i );
-		DbgInfo( "Configuring VMCS..." );
+	//
+	// Enable VMExits that we want to handle, it must be done before any processor is launched
+	//
+	VmExitBitMap[vmexit_cpuid] = true;
+	VmExitBitMap[vmexit_control_register_access] = true; // Handle CR access to detect SMEP disable
 
-		if ( !vmx::ConfigureVMCS( &VirtualMachineMonitor.vcpu[i] ) )
+	if ( !VMXBringUp() )
+	{
+		//
+		// Roll back the processors that made it, so nothing is left running with a half configured hypervisor. The ones
+		// that failed already left VMX operation
+		//
+		DeVirtualize();
+		VMXFreeGroups();
+		DeleteStatsRegion();
+		FreeHostAddressSpace();
+		FreeEpt();
+		UnmapApic();
+		return false;
+	}
+
+	Virtualized = true;
+	DbgInfo( "System Virtualized!\n" );
+	ReportFootprint();
+
+	return true;
+}
+
+
+//
+// Launch every allocated processor that is not running under the hypervisor yet.
+// Groups are brought up in parallel, processors inside a group are virtualized in order by the group thread
+//
+bool Hypervisor::VMXBringUp()
+{
+	GroupBringUp* BringUp;
+	PKTHREAD* Threads;
+	HANDLE ThreadHandle;
+	NTSTATUS status;
+	USHORT GroupCount = VirtualMachineMonitor.GroupCount;
+	bool Succeeded = true;
+
+	BringUp = ( GroupBringUp* ) ExAllocatePoolWithTag( NonPagedPool, sizeof( GroupBringUp ) * GroupCount, GESTALT_POOL_TAG );
+	Threads = ( PKTHREAD* ) ExAllocatePoolWithTag( NonPagedPool, sizeof( PKTHREAD ) * GroupCount, GESTALT_POOL_TAG );
+
+	if ( !BringUp || !Threads )
+	{
+		DbgInfo( "Unable to allocate the bring-up structures, system is out-of-memory!" );
+		if ( BringUp ) ExFreePoolWithTag( BringUp, GESTALT_POOL_TAG );
+		if ( Threads ) ExFreePoolWithTag( Threads, GESTALT_POOL_TAG );
+		return false;
+	}
+
+	for ( USHORT i = 0; i < GroupCount; i++ )
+	{
+		BringUp[i].hv = this;
+		BringUp[i].Group = &VirtualMachineMonitor.Groups[i];
+		BringUp[i].Succeeded = true;
+		Threads[i] = nullptr;
+
+		if ( !VirtualMachineMonitor.Groups[i].ActiveMask )
+			continue;
+
+		status = PsCreateSystemThread( &ThreadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, VMXGroupWorker, &BringUp[i] );
+
+		if ( NT_SUCCESS( status ) )
 		{
-			DbgInfo( "Unable to configure the VMCS on logical processor %d! Aborting...\n", ( int ) i );
-			return false;
+			status = ObReferenceObjectByHandle( ThreadHandle, SYNCHRONIZE, *PsThreadType, KernelMode, ( PVOID* ) &Threads[i], NULL );
+			ZwClose( ThreadHandle );
+		}
+
+		if ( !NT_SUCCESS( status ) )
+		{
+			DbgInfo( "Unable to create the bring-up thread of group %d (0x%x), running it inline", ( int ) i, status );
+			BringUp[i].Succeeded = VMXVirtualizeGroup( &VirtualMachineMonitor.Groups[i] );
+		}
+	}
+
+	for ( USHORT i = 0; i < GroupCount; i++ )
+	{
+		if ( Threads[i] )
+		{
+			KeWaitForSingleObject( Threads[i], Executive, KernelMode, FALSE, NULL );
+			ObDereferenceObject( Threads[i] );
+		}
+
+		if ( !BringUp[i].Succeeded )
+		{
+			DbgInfo( "Unable to virtualize processor group %d!", ( int ) i );
+			Succeeded = false;
+		}
+	}
+
+	ExFreePoolWithTag( BringUp, GESTALT_POOL_TAG );
+	ExFreePoolWithTag( Threads, GESTALT_POOL_TAG );
+
+	return Succeeded;
+}
+
+
+//
+// Ask every launched processor to leave VMX operation, processors that are not running under the hypervisor are skipped
+//
+bool Hypervisor::DeVirtualize()
+{
+	GROUP_AFFINITY Affinity = { 0 };
+	GROUP_AFFINITY PreviousAffinity;
+	bool Succeeded = true;
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; j < Group->Count; j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( !vcpu || !vcpu->Launched )
+				continue;
+
+			Affinity.Group = Group->Group;
+			Affinity.Mask = AFFINITY_MASK( j );
+			KeSetSystemGroupAffinityThread( &Affinity, &PreviousAffinity );
+
+			if ( !vmx::StopVMX( vcpu ) )
+			{
+				DbgInfo( "Unable to leave VMX operation on processor %d!", vcpu->CpuNumber );
+				Succeeded = false;
+			}
+
+			KeRevertToUserGroupAffinityThread( &PreviousAffinity );
 		}
+	}
+
+	return Succeeded;
+}
+
+
+//
+// Find the NUMA node of a processor by walking the node affinities
+//
+USHORT Hypervisor::GetProcessorNode( const PROCESSOR_NUMBER& Processor )
+{
+	GROUP_AFFINITY NodeAffinity;
+	USHORT HighestNode = KeQueryHighestNodeNumber();
 
-		DbgInfo( "VMCS configured on logical processor %d\n", i );
+	for ( USHORT Node = 0; Node <= HighestNode; Node++ )
+	{
+		KeQueryNodeActiveAffinity( Node, &NodeAffinity, NULL );
+
+		if ( NodeAffinity.Group == Processor.Group && ( NodeAffinity.Mask & AFFINITY_MASK( Processor.Number ) ) )
+			return Node;
 	}
 
+	return 0;
+}
+
+
+//
+// Allocate the vCPU slots of a group, one per processor the group can ever hold so hot-added processors have room.
+// Only the active processors get a vCPU now
+//
+bool Hypervisor::VMXAllocateGroup( ProcessorGroup* Group )
+{
+	Group->ActiveMask = KeQueryGroupAffinity( Group->Group );
+	Group->Count = KeQueryMaximumProcessorCountEx( Group->Group );
+
+	if ( !Group->Count )
+		return true;
+
+	Group->vcpu = ( vCPU** ) ExAllocatePoolWithTag( NonPagedPool, sizeof( vCPU* ) * Group->Count, GESTALT_POOL_TAG );
+
+	if ( !Group->vcpu )
+		return false;
+
+	RtlSecureZeroMemory( Group->vcpu, sizeof( vCPU* ) * Group->Count );
+
+	for ( ULONG i = 0; i < Group->Count; i++ )
+	{
+		if ( !( Group->ActiveMask & AFFINITY_MASK( i ) ) )
+			continue;
+
+		if ( !VMXAllocateProcessor( Group, i ) )
+			return false;
+	}
+
+	return true;
+}
+
+
+//
+// Each vCPU is a separated allocation from the memory of the processor's NUMA node, an existing one is reused
+//
+bool Hypervisor::VMXAllocateProcessor( ProcessorGroup* Group, ULONG Number )
+{
+	PHYSICAL_ADDRESS Lowest = { 0 };
+	PHYSICAL_ADDRESS High = { 0 };
+	PHYSICAL_ADDRESS Boundary = { 0 };
+	PROCESSOR_NUMBER Processor = { 0 };
+	vCPU* vcpu;
+	USHORT Node;
+
+	if ( Number >= Group->Count )
+		return false;
+
+	if ( Group->vcpu[Number] )
+		return true;
+
+	High.QuadPart = MAXUINT64;
+	Processor.Group = Group->Group;
+	Processor.Number = ( UCHAR ) Number;
+	Node = GetProcessorNode( Processor );
+
+	vcpu = ( vCPU* ) MmAllocateContiguousNodeMemory( sizeof( vCPU ), Lowest, High, Boundary, PAGE_READWRITE, Node );
+
+	if ( !vcpu )
+		return false;
+
+	RtlSecureZeroMemory( vcpu, sizeof( vCPU ) );
+
+	vcpu->ProcessorNumber = Processor;
+	vcpu->CpuNumber = ( int ) KeGetProcessorIndexFromNumber( &Processor );
+	vcpu->Node = Node;
+	vcpu->state = &VirtualMachineMonitor.state;
 	//
-	// Enable VMExits that we want to handle
+	// The host stack is part of the vCPU, so the exit context is on the same node as the VMCS
 	//
-	VmExitBitMap[vmexit_cpuid] = true;
-	VmExitBitMap[vmexit_control_register_access] = true; // Handle CR access to detect SMEP disable
-	VmExitBitMap[vmexit_access_to_gdtr_or_idtr] = true; // Detect access to the IDTR (Research that, maybe some syscall hooking approach here ?)
+	vcpu->HostState.StackSize = HOST_STACK_SIZE;
+	vcpu->HostState.RSP = ( UINT64 ) vcpu->HostStack;
+
+	//
+	// Tracing is optional, a processor without a trace buffer runs anyway
+	//
+	if ( ExitTraceRecords && !AllocateExitTrace( vcpu ) )
+		DbgInfo( "Unable to allocate the exit trace of processor %d", vcpu->CpuNumber );
+
+	if ( ProfileSamples && !AllocateProfile( vcpu ) )
+		DbgInfo( "Unable to allocate the profile ring of processor %d", vcpu->CpuNumber );
+
+	vcpu->Stats = vmx::stats::Slot( StatsRegion, ( UINT32 ) vcpu->CpuNumber );
+
 	//
-	// Time to fly - Guest switch
+	// Root mode runs on the vCPU (host stack included) and writes its trace, both must be in the host address space.
+	// The stale mappings of a freed vCPU are never used
 	//
+	if ( VirtualMachineMonitor.state.Host.Cr3 && ( !MapHostRegion( vcpu, sizeof( vCPU ), HOST_MAP_WRITE ) ||
+		( vcpu->Trace.Records && !MapHostRegion( vcpu->Trace.Records, vcpu->Trace.Capacity * sizeof( ExitTraceRecord ), HOST_MAP_WRITE ) ) ||
+		( vcpu->Profile.Samples && !MapHostRegion( vcpu->Profile.Samples, vcpu->Profile.Capacity * sizeof( ProfileSample ), HOST_MAP_WRITE ) ) ) )
+	{
+		DbgInfo( "Unable to map processor %d in the host address space", vcpu->CpuNumber );
+		FreeExitTrace( vcpu );
+		FreeProfile( vcpu );
+		MmFreeContiguousMemory( vcpu );
+		return false;
+	}
 
-	VirtualMachineMonitor.state.GuestState.RSP = __get_rsp(); // Save guest RSP
-	VirtualMachineMonitor.state.GuestState.RIP = __get_rip(); // Guest will start from here, but will not repeat the code bellow since we will flip the "Virtualized" boolean
+	Group->vcpu[Number] = vcpu;
+
+	return true;
+}
+
+
+//
+// Release the vCPUs, only valid while no processor was launched
+//
+void Hypervisor::VMXFreeGroups()
+{
+	if ( !VirtualMachineMonitor.Groups )
+		return;
 
-	if ( !Virtualized )
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
 	{
-		DbgInfo( "Lanching VM!" );
-		Virtualized = true;
-		__try
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		if ( !Group->vcpu )
+			continue;
+
+		for ( ULONG j = 0; j < Group->Count; j++ )
 		{
-			//
-			// Entering in the virtualized world
-			//
-			status = vmx::VMLaunch( VirtualMachineMonitor.state.GuestState.RIP, VirtualMachineMonitor.state.GuestState.RSP, VMXExitHandler, this, VmExitBitMap );
-			//
-			// If we reach here, an instruction error has happened
-			//
-			if ( status )
+			if ( Group->vcpu[j] )
 			{
-				KD_DEBUG_BREAK();
-				DbgInfo( "Error on virtualize, exited with: %d -> %d\n", status, vmx::GetVMXErrorCode() );
+				FreeExitTrace( Group->vcpu[j] );
+				FreeProfile( Group->vcpu[j] );
+				MmFreeContiguousMemory( Group->vcpu[j] );
 			}
-
-			return false;
 		}
-		__except ( EXCEPTION_EXECUTE_HANDLER )
+
+		ExFreePoolWithTag( Group->vcpu, GESTALT_POOL_TAG );
+	}
+
+	ExFreePoolWithTag( VirtualMachineMonitor.Groups, GESTALT_POOL_TAG );
+	VirtualMachineMonitor.Groups = nullptr;
+	VirtualMachineMonitor.GroupCount = 0;
+}
+
+
+//
+// Print the memory used by each vCPU and where it lives
+//
+void Hypervisor::ReportFootprint() const
+{
+	DbgInfo( "vCPU footprint: %d bytes (VMCS %d, VMXON %d, host stack %d, counters %d)",
+		( int ) sizeof( vCPU ), ( int ) sizeof( VMCS ), ( int ) sizeof( VMXON ), ( int ) HOST_STACK_SIZE, ( int ) sizeof( vCPUCounters ) );
+	DbgInfo( "Shared state: %d bytes", ( int ) sizeof( GlobalState ) );
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; j < Group->Count; j++ )
 		{
-			DbgInfo( "Exception when executing the __vmx_launch instruction, aborting!" );
-			KD_DEBUG_BREAK();
-			return false;
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( !vcpu )
+				continue;
+
+			DbgInfo( "Processor %d (group %d, number %d): node %d, vCPU at 0x%llx (phys 0x%llx)",
+				vcpu->CpuNumber, ( int ) i, ( int ) j, ( int ) vcpu->Node, ( UINT64 ) vcpu, VIRTUAL_TO_PHYSICAL( vcpu ) );
 		}
+	}
+}
+
+
+//
+// System thread entry, virtualize every active processor of one group
+//
+void Hypervisor::VMXGroupWorker( PVOID Context )
+{
+	GroupBringUp* BringUp = ( GroupBringUp* ) Context;
+
+	BringUp->Succeeded = BringUp->hv->VMXVirtualizeGroup( BringUp->Group );
+
+	PsTerminateSystemThread( STATUS_SUCCESS );
+}
+
+
+bool Hypervisor::VMXVirtualizeGroup( ProcessorGroup* Group )
+{
+	GROUP_AFFINITY Affinity = { 0 };
+	GROUP_AFFINITY PreviousAffinity;
+	bool Succeeded = true;
+
+	Affinity.Group = Group->Group;
+
+	for ( ULONG i = 0; i < Group->Count && Succeeded; i++ )
+	{
+		//
+		// Processors that are already running under the hypervisor are left alone
+		//
+		if ( !( Group->ActiveMask & AFFINITY_MASK( i ) ) || !Group->vcpu[i] || Group->vcpu[i]->Launched )
+			continue;
+
+		Affinity.Mask = AFFINITY_MASK( i );
+		KeSetSystemGroupAffinityThread( &Affinity, &PreviousAffinity );
+
+		Succeeded = VMXVirtualizeProcessor( Group->vcpu[i] );
 
+		KeRevertToUserGroupAffinityThread( &PreviousAffinity );
 	}
-	else
+
+	return Succeeded;
+}
+
+
+//
+// Enter in VMX operation, configure the VMCS and launch the current processor, must run pinned to it.
+// A processor that doesn't launch is out of VMX operation again, its vCPU can be freed
+//
+bool Hypervisor::VMXVirtualizeProcessor( vCPU* vcpu )
+{
+	int status;
+
+	DbgInfo( "Entering VMX operation on processor %d (group %d, number %d)", vcpu->CpuNumber, ( int ) vcpu->ProcessorNumber.Group, ( int ) vcpu->ProcessorNumber.Number );
+
+	if ( !vmx::StartVMX( vcpu ) )
+	{
+		DbgInfo( "Unable to start VMX on logical processor %d! Aborting...\n", vcpu->CpuNumber );
+		return false;
+	}
+
+	DbgInfo( "VMX Operation enabled on %d processor!\n", vcpu->CpuNumber );
+	DbgInfo( "Configuring VMCS..." );
+
+	if ( !vmx::ConfigureVMCS( vcpu ) )
+	{
+		DbgInfo( "Unable to configure the VMCS on logical processor %d! Aborting...\n", vcpu->CpuNumber );
+		vmx::AbortVMX( vcpu );
+		return false;
+	}
+
+	DbgInfo( "VMCS configured on logical processor %d\n", vcpu->CpuNumber );
+
+	//
+	// Time to fly - Guest switch. The trampoline comes back here as the guest with a normal return
+	//
+	vcpu->Launched = true;
+	__try
+	{
+		status = vmx::VMLaunch( vcpu, VMXExitHandler, this, VmExitBitMap );
+	}
+	__except ( EXCEPTION_EXECUTE_HANDLER )
 	{
-		DbgInfo( "System Virtualized!\n" );
+		DbgInfo( "Exception when executing the __vmx_launch instruction, aborting!" );
+		KD_DEBUG_BREAK();
+		vcpu->Launched = false;
+		vmx::AbortVMX( vcpu );
+		return false;
+	}
+
+	if ( status )
+	{
+		//
+		// If we reach here, an instruction error has happened
+		//
+		KD_DEBUG_BREAK();
+		DbgInfo( "Error on virtualize, exited with: %d -> %d\n", status, vmx::GetVMXErrorCode() );
+		vcpu->Launched = false;
+		vmx::AbortVMX( vcpu );
+		return false;
 	}
 
+	DbgInfo( "Processor %d virtualized!", vcpu->CpuNumber );
 
 	return true;
 }
-#pragma optimize("", on)
+
+
+//
+// Per-CPU indexing, processors are addressed by (group, number) so it works beyond 64 logical processors
+//
+vCPU* Hypervisor::GetVCPU( const PROCESSOR_NUMBER& Processor ) const
+{
+	ProcessorGroup* Group;
+
+	if ( Processor.Group >= VirtualMachineMonitor.GroupCount )
+		return nullptr;
+
+	Group = &VirtualMachineMonitor.Groups[Processor.Group];
+
+	if ( Processor.Number >= Group->Count )
+		return nullptr;
+
+	return Group->vcpu[Processor.Number];
+}
+
+
+vCPU* Hypervisor::GetCurrentVCPU() const
+{
+	PROCESSOR_NUMBER Processor;
+
+	KeGetCurrentProcessorNumberEx( &Processor );
+
+	return GetVCPU( Processor );
+}
 
 
 
@@ -189,18 +708,17 @@ int Hypervisor::VMXExitHandler( GCPUContext* context, void* HypervisorPtr, VMX_V
 		vmx::vm::HandleCPUID( context, true ); // Hide our hypervisor
 		status = 1;
 		break;
+	case vmexit_control_register_access:
+		status = vmx::vm::HandleCRAccess( context );
+		break;
 	default:
 		status = 0;
 		break;
 	}
 
-	if ( !status )
-	{
-		DbgInfo( "VMMM: VMExit unhandled: %d\nRIP: 0x%x\n", ExitReason.BasicExitReason, context->ExtRegs.rip );
-		KD_DEBUG_BREAK();
-	}
-
-
+	//
+	// Unhandled exits are reported by vmx::VMExitHandler, once it's back on the system address space
+	//
 	return status;
 }
 
@@ -0,0 +1,106 @@
+#include "Hypervisor.h"
+
+
+//
+// Ports First - Last counted by the driver itself, the accesses go on to the real ports. Packed as First | Last << 16,
+// a Last bellow First watches First alone
+//
+void Hypervisor::SetIoWatch( ULONG Ports )
+{
+	IoWatchFirst = ( UINT16 ) Ports;
+	IoWatchLast = ( UINT16 ) ( Ports >> 16 );
+	IoWatch = Ports != 0;
+
+	if ( IoWatchLast < IoWatchFirst )
+		IoWatchLast = IoWatchFirst;
+}
+
+
+//
+// The range counts the exits, the handler has nothing left to do
+//
+static int IoWatchHandler( GCPUContext* context, const IoAccess* Access, void* Context )
+{
+	UNREFERENCED_PARAMETER( context );
+	UNREFERENCED_PARAMETER( Access );
+	UNREFERENCED_PARAMETER( Context );
+
+	return -1;
+}
+
+//
+// Before the launch, with the global state just cleared
+//
+void Hypervisor::AddIoWatch()
+{
+	if ( IoWatch && !vmx::io::AddRange( &VirtualMachineMonitor.state, IoWatchFirst, IoWatchLast, IoWatchHandler, nullptr ) )
+		DbgInfo( "Unable to watch I/O ports 0x%x - 0x%x", IoWatchFirst, IoWatchLast );
+}
+
+
+//
+// The bitmaps are rebuilt when the processors are virtualized, ranges only exist while they are.
+// Handler and Context have to stay valid until the range is unregistered
+//
+bool Hypervisor::RegisterIoRange( UINT16 First, UINT16 Last, IO_INTERCEPT_HANDLER Handler, void* Context )
+{
+	bool Added;
+
+	PAGED_CODE();
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	Added = Virtualized && vmx::io::AddRange( &VirtualMachineMonitor.state, First, Last, Handler, Context );
+
+	//
+	// Every processor goes through root mode before this returns, none runs with the old bitmaps anymore
+	//
+	if ( Added )
+		KickAll( KICK_SYNC, true );
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	if ( Added )
+		DbgInfo( "I/O ports 0x%x - 0x%x intercepted", First, Last );
+
+	return Added;
+}
+
+
+//
+// Once this returns no processor runs the handler anymore, an exit taken before the bits were cleared is done with it
+//
+bool Hypervisor::UnregisterIoRange( UINT16 First )
+{
+	bool Removed;
+
+	PAGED_CODE();
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	Removed = Virtualized && vmx::io::RemoveRange( &VirtualMachineMonitor.state, First );
+
+	if ( Removed )
+		KickAll( KICK_SYNC, true );
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	return Removed;
+}
+
+
+//
+// Exits of every range still registered when the processors leave VMX operation
+//
+void Hypervisor::ReportIoRanges() const
+{
+	const IoIntercepts* Io = &VirtualMachineMonitor.state.Io;
+
+	for ( ULONG i = 0; i < MAX_IO_RANGES; i++ )
+	{
+		const IoRange* Range = &Io->Ranges[i];
+
+		if ( Range->Active )
+			DbgInfo( "I/O ports 0x%x - 0x%x: %llu exits", Range->First, Range->Last, Range->Exits );
+	}
+}
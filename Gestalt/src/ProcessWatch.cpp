@@ -0,0 +1,301 @@
+#include "Hypervisor.h"
+
+//
+// KPROCESS.UserDirectoryTableBase of x64 Windows, not exported: by build, from 1709 (build 16299) where KVA shadowing
+// came in. An entry holds for the builds from Build to Last. Without KVA shadowing, or for a process it is off for, the
+// field holds 0 or 1
+//
+struct UserDirectoryTableBaseOffset
+{
+	ULONG Build;
+	ULONG Last;
+	ULONG Offset;
+};
+
+static const UserDirectoryTableBaseOffset UserDirectoryTableBaseOffsets[] =
+{
+	{ 16299, 16299, 0x278 },	// 1709
+	{ 17134, 17134, 0x278 },	// 1803
+	{ 17763, 17763, 0x278 },	// 1809
+	{ 18362, 18363, 0x280 },	// 1903, 1909
+	{ 19041, 26100, 0x388 },	// 2004 to Windows 11 24H2
+};
+
+//
+// STATUS_PENDING until the process starts exiting
+//
+extern "C" NTKERNELAPI NTSTATUS PsGetProcessExitStatus( PEPROCESS Process );
+
+extern Hypervisor hv;
+
+
+//
+// Non-zero to follow the guest context switches, every MOV to CR3 but the ones to the System process exits then
+//
+void Hypervisor::SetProcessTracking( ULONG Enabled )
+{
+	ProcessTrackingEnabled = Enabled != 0;
+}
+
+
+//
+// Before the launch, from the System process. Its CR3 is the one idle and system threads run with, the hottest one.
+// The targets are compared with the whole MOV operand, with PCIDs the kernel loads it with and without bit 63
+//
+void Hypervisor::AddCr3Targets()
+{
+	ProcessTracking* Tracking = &VirtualMachineMonitor.state.Processes;
+	UINT64 Cr3 = __readcr3();
+	CR4 cr4;
+
+	cr4.AsUInt = __readcr4();
+
+	VirtualMachineMonitor.state.TrackProcesses = ProcessTrackingEnabled;
+
+	if ( !ProcessTrackingEnabled )
+		return;
+
+	Tracking->Targets[Tracking->TargetCount++] = Cr3;
+
+	if ( cr4.PcidEnable )
+		Tracking->Targets[Tracking->TargetCount++] = Cr3 | GUEST_CR3_NO_FLUSH;
+}
+
+
+//
+// With KVA shadowing user mode runs on its own directory base, which only the KPROCESS has. 0 when there is none, or
+// when the build isn't known: only the kernel directory base is watched then, and it says so
+//
+static UINT64 ReadUserCr3( PEPROCESS Process, UINT64 Cr3 )
+{
+	RTL_OSVERSIONINFOW Version = { sizeof( RTL_OSVERSIONINFOW ) };
+	UINT64 UserCr3;
+	ULONG Offset = 0;
+
+	if ( !Hypervisor::KvaShadowEnabled() )
+		return 0;
+
+	if ( NT_SUCCESS( RtlGetVersion( &Version ) ) )
+	{
+		for ( ULONG i = 0; i < ARRAYSIZE( UserDirectoryTableBaseOffsets ); i++ )
+		{
+			if ( Version.dwBuildNumber >= UserDirectoryTableBaseOffsets[i].Build && Version.dwBuildNumber <= UserDirectoryTableBaseOffsets[i].Last )
+				Offset = UserDirectoryTableBaseOffsets[i].Offset;
+		}
+	}
+
+	if ( !Offset )
+	{
+		DbgInfo( "KVA shadowing on build %u, whose user directory base isn't known: process %p is only watched in kernel mode",
+			Version.dwBuildNumber, Process );
+		return 0;
+	}
+
+	UserCr3 = *( UINT64* ) ( ( BYTE* ) Process + Offset ) & PROCESS_CR3_MASK;
+
+	//
+	// The kernel base there means the offset is wrong for this build
+	//
+	if ( UserCr3 == ( Cr3 & PROCESS_CR3_MASK ) )
+	{
+		DbgInfo( "Unexpected user directory base of process %p on build %u, it is only watched in kernel mode", Process,
+			Version.dwBuildNumber );
+		return 0;
+	}
+
+	return UserCr3;
+}
+
+
+//
+// The directory base is read attached to the process, the user-mode one from the process. Returns the index of the
+// watched process, PROCESS_NOT_WATCHED when it can't be watched. The intercepts of Policy, if any, are only active
+// while the process runs. The process stops being watched when it exits
+//
+INT32 Hypervisor::WatchProcess( PEPROCESS Process, const ProcessPolicy* Policy )
+{
+	KAPC_STATE ApcState;
+	UINT64 Cr3;
+	UINT64 UserCr3;
+	INT32 Index;
+
+	PAGED_CODE();
+
+	KeStackAttachProcess( Process, &ApcState );
+	Cr3 = __readcr3();
+	KeUnstackDetachProcess( &ApcState );
+
+	UserCr3 = ReadUserCr3( Process, Cr3 );
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	//
+	// Past the exit notification it would stay watched, its directory bases going to the next processes
+	//
+	Index = Virtualized && VirtualMachineMonitor.state.TrackProcesses && ProcessNotifyRegistered &&
+		PsGetProcessExitStatus( Process ) == STATUS_PENDING ?
+		vmx::process::Watch( &VirtualMachineMonitor.state, Cr3, UserCr3, Policy ) : PROCESS_NOT_WATCHED;
+
+	//
+	// A processor running the process right now sees it as watched once this returns
+	//
+	if ( Index != PROCESS_NOT_WATCHED )
+	{
+		WatchedIds[Index] = PsGetProcessId( Process );
+		KickAll( KICK_PROCESSES, true );
+	}
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	if ( Index != PROCESS_NOT_WATCHED )
+		DbgInfo( "Process %p watched, CR3 0x%llx, user CR3 0x%llx", Process, Cr3 & PROCESS_CR3_MASK, UserCr3 );
+
+	return Index;
+}
+
+
+bool Hypervisor::UnwatchProcess( INT32 Index )
+{
+	bool Removed;
+
+	PAGED_CODE();
+
+	KeWaitForSingleObject( &BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	Removed = Virtualized && vmx::process::Unwatch( &VirtualMachineMonitor.state, Index );
+
+	if ( Removed )
+	{
+		WatchedIds[Index] = NULL;
+		KickAll( KICK_PROCESSES, true );
+	}
+
+	KeReleaseMutex( &BringUpLock, FALSE );
+
+	return Removed;
+}
+
+
+//
+// Once a process is gone its directory bases are freed and can be any other process's, it stops being watched.
+// PASSIVE_LEVEL, in the context of the exiting process
+//
+void Hypervisor::ProcessNotify( HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create )
+{
+	INT32 Index = PROCESS_NOT_WATCHED;
+
+	UNREFERENCED_PARAMETER( ParentId );
+
+	if ( Create )
+		return;
+
+	KeWaitForSingleObject( &hv.BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	for ( INT32 i = 0; i < MAX_WATCHED_PROCESSES && Index == PROCESS_NOT_WATCHED; i++ )
+	{
+		if ( hv.WatchedIds[i] == ProcessId )
+			Index = i;
+	}
+
+	if ( Index != PROCESS_NOT_WATCHED )
+	{
+		hv.WatchedIds[Index] = NULL;
+
+		if ( hv.Virtualized && vmx::process::Unwatch( &hv.VirtualMachineMonitor.state, Index ) )
+			hv.KickAll( KICK_PROCESSES, true );
+	}
+
+	KeReleaseMutex( &hv.BringUpLock, FALSE );
+
+	if ( Index != PROCESS_NOT_WATCHED )
+		DbgInfo( "Process %p exited, no longer watched", ProcessId );
+}
+
+
+//
+// With process tracking, after the launch. WatchProcess refuses processes without it
+//
+void Hypervisor::RegisterProcessNotify()
+{
+	NTSTATUS status;
+
+	if ( !VirtualMachineMonitor.state.TrackProcesses )
+		return;
+
+	status = PsSetCreateProcessNotifyRoutine( ProcessNotify, FALSE );
+	ProcessNotifyRegistered = NT_SUCCESS( status );
+
+	if ( !ProcessNotifyRegistered )
+		DbgInfo( "Unable to register the process notification (0x%x), no process can be watched", status );
+}
+
+
+//
+// Before BringUpLock is taken to devirtualize, the notification takes it. Removing it waits for the running ones
+//
+void Hypervisor::UnregisterProcessNotify()
+{
+	if ( !ProcessNotifyRegistered )
+		return;
+
+	PsSetCreateProcessNotifyRoutine( ProcessNotify, TRUE );
+	ProcessNotifyRegistered = false;
+	RtlSecureZeroMemory( WatchedIds, sizeof( WatchedIds ) );
+}
+
+
+//
+// Lock-free, from any processor at any IRQL
+//
+bool Hypervisor::GetCurrentProcess( const PROCESSOR_NUMBER& Processor, UINT64* Cr3, INT32* Watched ) const
+{
+	vCPU* vcpu = GetVCPU( Processor );
+
+	return vcpu && vcpu->Launched && vcpu->Processes.Enabled && vmx::process::Read( &vcpu->Processes.Current, Cr3, Watched );
+}
+
+
+//
+// Switch counts of every processor together, then the watched processes still registered
+//
+void Hypervisor::ReportProcessTracking() const
+{
+	const ProcessTracking* Tracking = &VirtualMachineMonitor.state.Processes;
+	UINT64 Loads = 0;
+	UINT64 Cycles = 0;
+	UINT64 Swaps = 0;
+	UINT64 Views = 0;
+
+	if ( !VirtualMachineMonitor.state.TrackProcesses )
+		return;
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; Group->vcpu && j < Group->Count; j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( !vcpu )
+				continue;
+
+			Loads += vcpu->Processes.Loads;
+			Cycles += vcpu->Processes.Cycles;
+			Swaps += vcpu->Processes.ControlSwaps;
+			Views += vcpu->Processes.ViewSwitches;
+		}
+	}
+
+	DbgInfo( "Process tracking: %llu CR3-load exits, %llu root mode cycles per exit to follow them, %u CR3 targets, "
+		"%llu control set swaps, %llu policy view switches", Loads, Loads ? Cycles / Loads : 0, Tracking->TargetCount, Swaps, Views );
+
+	for ( ULONG i = 0; i < MAX_WATCHED_PROCESSES; i++ )
+	{
+		const WatchedProcess* Process = &Tracking->Watched[i];
+
+		if ( Process->Active )
+			DbgInfo( "Watched CR3 0x%llx: %llu switches, %llu cycles running, %llu intercepts", Process->Cr3, Process->Switches,
+				Process->Cycles, Process->Intercepts );
+	}
+}
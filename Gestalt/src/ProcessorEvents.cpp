@@ -0,0 +1,172 @@
+#include "Hypervisor.h"
+
+
+//
+// Register the processor change (hot-add) and power state (sleep/resume) callbacks
+//
+bool Hypervisor::RegisterProcessorEvents()
+{
+	OBJECT_ATTRIBUTES Attributes;
+	UNICODE_STRING PowerStateName = RTL_CONSTANT_STRING( L"\\Callback\\PowerState" );
+	NTSTATUS status;
+
+	Suspended = false;
+	ProcessorChangeHandle = KeRegisterProcessorChangeCallback( ProcessorChangeCallback, this, 0 );
+
+	if ( !ProcessorChangeHandle )
+		DbgInfo( "Unable to register the processor change callback, hot-added processors will not be virtualized" );
+
+	InitializeObjectAttributes( &Attributes, &PowerStateName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL );
+	status = ExCreateCallback( &PowerStateObject, &Attributes, FALSE, TRUE );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to open the PowerState callback object (0x%x), processors will not be restored on resume", status );
+		PowerStateObject = nullptr;
+		return false;
+	}
+
+	PowerStateHandle = ExRegisterCallback( PowerStateObject, PowerStateCallback, this );
+
+	if ( !PowerStateHandle )
+	{
+		DbgInfo( "Unable to register the PowerState callback, processors will not be restored on resume" );
+		ObDereferenceObject( PowerStateObject );
+		PowerStateObject = nullptr;
+		return false;
+	}
+
+	return ProcessorChangeHandle != nullptr;
+}
+
+
+void Hypervisor::UnregisterProcessorEvents()
+{
+	if ( ProcessorChangeHandle )
+	{
+		KeDeregisterProcessorChangeCallback( ProcessorChangeHandle );
+		ProcessorChangeHandle = nullptr;
+	}
+
+	if ( PowerStateHandle )
+	{
+		ExUnregisterCallback( PowerStateHandle );
+		PowerStateHandle = nullptr;
+	}
+
+	if ( PowerStateObject )
+	{
+		ObDereferenceObject( PowerStateObject );
+		PowerStateObject = nullptr;
+	}
+}
+
+
+//
+// A hot-added processor gets its vCPU allocated while it's being started, and is launched once it's running.
+// Every other processor is left as it is
+//
+void Hypervisor::ProcessorChangeCallback( PVOID Context, PKE_PROCESSOR_CHANGE_NOTIFY_CONTEXT ChangeContext, PNTSTATUS OperationStatus )
+{
+	Hypervisor* hv = ( Hypervisor* ) Context;
+	PROCESSOR_NUMBER Processor = ChangeContext->ProcNumber;
+	GROUP_AFFINITY Affinity = { 0 };
+	GROUP_AFFINITY PreviousAffinity;
+	ProcessorGroup* Group;
+	vCPU* vcpu;
+
+	UNREFERENCED_PARAMETER( OperationStatus );
+
+	if ( Processor.Group >= hv->VirtualMachineMonitor.GroupCount )
+		return;
+
+	Group = &hv->VirtualMachineMonitor.Groups[Processor.Group];
+
+	KeWaitForSingleObject( &hv->BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	switch ( ChangeContext->State )
+	{
+	case KeProcessorAddStartNotify:
+		//
+		// A failure here must not block the hot-add, the processor would just run without the hypervisor
+		//
+		if ( !hv->VMXAllocateProcessor( Group, Processor.Number ) )
+			DbgInfo( "Unable to allocate the vCPU of hot-added processor %d:%d", ( int ) Processor.Group, ( int ) Processor.Number );
+		break;
+
+	case KeProcessorAddCompleteNotify:
+		vcpu = hv->GetVCPU( Processor );
+
+		if ( !vcpu || vcpu->Launched || hv->Suspended )
+			break;
+
+		Group->ActiveMask |= AFFINITY_MASK( Processor.Number );
+		hv->NumberOfCpus++;
+
+		Affinity.Group = Processor.Group;
+		Affinity.Mask = AFFINITY_MASK( Processor.Number );
+		KeSetSystemGroupAffinityThread( &Affinity, &PreviousAffinity );
+
+		//
+		// On failure the processor has left VMX operation, it runs without the hypervisor and its vCPU stays for a retry
+		//
+		if ( !hv->VMXVirtualizeProcessor( vcpu ) )
+			DbgInfo( "Unable to virtualize hot-added processor %d:%d", ( int ) Processor.Group, ( int ) Processor.Number );
+
+		KeRevertToUserGroupAffinityThread( &PreviousAffinity );
+		break;
+
+	case KeProcessorAddFailureNotify:
+		//
+		// The vCPU is kept in its slot, it's reused if the processor is added again
+		//
+		break;
+	}
+
+	KeReleaseMutex( &hv->BringUpLock, FALSE );
+}
+
+
+//
+// Leave VMX operation before a sleep transition and restore it on resume.
+// Only the processors that were stopped are launched again, their vCPU memory and counters are reused
+//
+void Hypervisor::PowerStateCallback( PVOID Context, PVOID Argument1, PVOID Argument2 )
+{
+	Hypervisor* hv = ( Hypervisor* ) Context;
+
+	if ( Argument1 != ( PVOID ) PO_CB_SYSTEM_STATE_LOCK )
+		return;
+
+	KeWaitForSingleObject( &hv->BringUpLock, Executive, KernelMode, FALSE, NULL );
+
+	if ( Argument2 == ( PVOID ) 0 )
+	{
+		//
+		// Entering a sleep state, the VMX state will not survive it
+		//
+		if ( hv->Virtualized && !hv->Suspended )
+		{
+			DbgInfo( "Entering sleep, leaving VMX operation" );
+			hv->DeVirtualize();
+			hv->Suspended = true;
+		}
+	}
+	else if ( Argument2 == ( PVOID ) 1 )
+	{
+		//
+		// Back from sleep
+		//
+		if ( hv->Suspended )
+		{
+			DbgInfo( "Resumed from sleep, restoring VMX operation" );
+
+			if ( !hv->VMXBringUp() )
+				DbgInfo( "Unable to restore VMX operation on every processor after resume!" );
+
+			hv->Suspended = false;
+		}
+	}
+
+	KeReleaseMutex( &hv->BringUpLock, FALSE );
+}
@@ -0,0 +1,232 @@
+#include "Hypervisor.h"
+
+//
+// The overhead measurement reads the TSC in a loop with interrupts off, any gap longer than this is time the
+// processor spent outside the guest. Batches are short enough to stay far from the DPC watchdog
+//
+#define PROFILE_GAP_CYCLES 200
+#define PROFILE_BATCH_MS 10
+#define PROFILE_BATCHES 20
+
+
+//
+// Sample Rate times per second on every processor, keeping the last SamplesPerCpu samples (rounded down to a power of two).
+// Only the processors allocated after this call get a ring
+//
+void Hypervisor::SetProfiler( ULONG Rate, ULONG SamplesPerCpu )
+{
+	ProfileRate = Rate;
+	ProfileSamples = SamplesPerCpu;
+
+	while ( ProfileSamples & ( ProfileSamples - 1 ) )
+		ProfileSamples &= ProfileSamples - 1;
+}
+
+
+//
+// The preemption timer counts at the TSC rate divided by 2^IA32_VMX_MISC[4:0], the TSC rate is measured once
+//
+void Hypervisor::InitializeProfiler()
+{
+	IA32_VMX_MISC_REGISTER Misc;
+	LARGE_INTEGER Frequency;
+	LARGE_INTEGER Start;
+	LARGE_INTEGER End;
+	UINT64 Tsc;
+
+	if ( !ProfileSamples )
+		return;
+
+	Misc.AsUInt = __readmsr( IA32_VMX_MISC );
+	PreemptionTimerShift = ( UINT32 ) Misc.PreemptionTimerTscRelationship;
+
+	Start = KeQueryPerformanceCounter( &Frequency );
+	Tsc = __rdtsc();
+	KeStallExecutionProcessor( 10000 );
+	End = KeQueryPerformanceCounter( NULL );
+	Tsc = __rdtsc() - Tsc;
+
+	TscFrequency = Tsc * Frequency.QuadPart / ( End.QuadPart - Start.QuadPart );
+	VirtualMachineMonitor.state.ProfilePeriod = vmx::profile::PeriodFromRate( TscFrequency, ProfileRate, PreemptionTimerShift );
+
+	DbgInfo( "Profiler: %lu samples per processor, %lu Hz, TSC at %llu Hz", ProfileSamples, ProfileRate, TscFrequency );
+}
+
+
+//
+// The ring is written from the exit handler, it must be non-paged
+//
+bool Hypervisor::AllocateProfile( vCPU* vcpu )
+{
+	SIZE_T Size = ( SIZE_T ) ProfileSamples * sizeof( ProfileSample );
+
+	vcpu->Profile.Samples = ( ProfileSample* ) ExAllocatePoolWithTag( NonPagedPoolNx, Size, GESTALT_POOL_TAG );
+
+	if ( !vcpu->Profile.Samples )
+		return false;
+
+	vcpu->Profile.Capacity = ProfileSamples;
+
+	return true;
+}
+
+
+void Hypervisor::FreeProfile( vCPU* vcpu )
+{
+	if ( !vcpu->Profile.Samples )
+		return;
+
+	ExFreePoolWithTag( vcpu->Profile.Samples, GESTALT_POOL_TAG );
+	vcpu->Profile.Samples = nullptr;
+	vcpu->Profile.Capacity = 0;
+}
+
+
+//
+// Change the sampling rate of every processor, 0 stops it. Returns once all the vCPUs applied it
+//
+bool Hypervisor::SetProfileRate( ULONG Rate )
+{
+	if ( !Virtualized || !ProfileSamples )
+		return false;
+
+	ProfileRate = Rate;
+	VirtualMachineMonitor.state.ProfilePeriod = vmx::profile::PeriodFromRate( TscFrequency, Rate, PreemptionTimerShift );
+
+	return KickAll( KICK_PROFILE, true ) != 0;
+}
+
+
+//
+// Time taken from the guest on the current processor with no sampling, then at 1, 10 and 100 kHz. The exit count
+// includes the ones that aren't samples, like SMIs, the run without sampling shows them
+//
+void Hypervisor::MeasureProfileOverhead()
+{
+	static const ULONG Rates[] = { 0, 1000, 10000, 100000 };
+	ULONG Configured = ProfileRate;
+
+	PAGED_CODE();
+
+	for ( ULONG r = 0; r < ARRAYSIZE( Rates ); r++ )
+	{
+		UINT64 Stolen = 0;
+		UINT64 Elapsed = 0;
+		UINT64 Gaps = 0;
+
+		if ( !SetProfileRate( Rates[r] ) )
+		{
+			DbgInfo( "Unable to change the profiler rate, the overhead can't be measured" );
+			break;
+		}
+
+		for ( ULONG b = 0; b < PROFILE_BATCHES; b++ )
+		{
+			UINT64 Start;
+			UINT64 Last;
+			UINT64 End;
+			KIRQL Irql;
+
+			KeRaiseIrql( DISPATCH_LEVEL, &Irql );
+			_disable();
+
+			Start = __rdtsc();
+			Last = Start;
+			End = Start + TscFrequency * PROFILE_BATCH_MS / 1000;
+
+			while ( Last < End )
+			{
+				UINT64 Now = __rdtsc();
+
+				if ( Now - Last > PROFILE_GAP_CYCLES )
+				{
+					Stolen += Now - Last;
+					Gaps++;
+				}
+
+				Last = Now;
+			}
+
+			Elapsed += Last - Start;
+
+			_enable();
+			KeLowerIrql( Irql );
+		}
+
+		DbgInfo( "Profiler at %lu Hz: %llu exits, %llu cycles each, %llu.%02llu%% of the processor", Rates[r], Gaps,
+			Gaps ? Stolen / Gaps : 0, Stolen * 100 / Elapsed, Stolen * 10000 / Elapsed % 100 );
+	}
+
+	SetProfileRate( Configured );
+}
+
+
+//
+// Write one block per profiled processor (ProfileHeader followed by its samples, oldest first), must run at PASSIVE_LEVEL
+// once the processors stopped sampling
+//
+bool Hypervisor::WriteProfile( PCWSTR Path ) const
+{
+	UNICODE_STRING FileName;
+	OBJECT_ATTRIBUTES Attributes;
+	IO_STATUS_BLOCK IoStatus;
+	ProfileHeader Header;
+	HANDLE File;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	RtlInitUnicodeString( &FileName, Path );
+	InitializeObjectAttributes( &Attributes, &FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL );
+
+	status = ZwCreateFile( &File, GENERIC_WRITE, &Attributes, &IoStatus, NULL, FILE_ATTRIBUTE_NORMAL, 0,
+		FILE_OVERWRITE_IF, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, NULL, 0 );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to create the profile file (0x%x)", status );
+		return false;
+	}
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount && NT_SUCCESS( status ); i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; j < Group->Count && NT_SUCCESS( status ); j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+			UINT64 First;
+			UINT64 Wrapped;
+
+			if ( !vcpu || !vcpu->Profile.Samples )
+				continue;
+
+			vmx::profile::FillHeader( &vcpu->Profile, vcpu->CpuNumber, &Header, &First );
+			Wrapped = First + Header.SampleCount > vcpu->Profile.Capacity ? First + Header.SampleCount - vcpu->Profile.Capacity : 0;
+
+			status = ZwWriteFile( File, NULL, NULL, NULL, &IoStatus, &Header, sizeof( Header ), NULL, NULL );
+
+			if ( NT_SUCCESS( status ) && Header.SampleCount )
+				status = ZwWriteFile( File, NULL, NULL, NULL, &IoStatus, &vcpu->Profile.Samples[First],
+					( ULONG ) ( ( Header.SampleCount - Wrapped ) * sizeof( ProfileSample ) ), NULL, NULL );
+
+			if ( NT_SUCCESS( status ) && Wrapped )
+				status = ZwWriteFile( File, NULL, NULL, NULL, &IoStatus, vcpu->Profile.Samples,
+					( ULONG ) ( Wrapped * sizeof( ProfileSample ) ), NULL, NULL );
+
+			if ( vcpu->Profile.Head )
+				DbgInfo( "Processor %d: %llu samples, %llu root cycles each", vcpu->CpuNumber, vcpu->Profile.Head,
+					vcpu->Profile.Cycles / vcpu->Profile.Head );
+		}
+	}
+
+	ZwClose( File );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to write the profile (0x%x)", status );
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,150 @@
+#include "Hypervisor.h"
+
+
+//
+// SYSTEM gets full access, administrators can only map it for reading
+//
+static PSECURITY_DESCRIPTOR CreateStatsSecurityDescriptor()
+{
+	PSECURITY_DESCRIPTOR Descriptor;
+	PACL Dacl;
+	ULONG DaclSize;
+
+	DaclSize = sizeof( ACL ) + 2 * FIELD_OFFSET( ACCESS_ALLOWED_ACE, SidStart ) +
+		RtlLengthSid( SeExports->SeLocalSystemSid ) + RtlLengthSid( SeExports->SeAliasAdminsSid );
+
+	Descriptor = ( PSECURITY_DESCRIPTOR ) ExAllocatePoolWithTag( PagedPool, sizeof( SECURITY_DESCRIPTOR ) + DaclSize, GESTALT_POOL_TAG );
+
+	if ( !Descriptor )
+		return nullptr;
+
+	Dacl = ( PACL ) ( ( BYTE* ) Descriptor + sizeof( SECURITY_DESCRIPTOR ) );
+
+	if ( !NT_SUCCESS( RtlCreateSecurityDescriptor( Descriptor, SECURITY_DESCRIPTOR_REVISION ) ) ||
+		!NT_SUCCESS( RtlCreateAcl( Dacl, DaclSize, ACL_REVISION ) ) ||
+		!NT_SUCCESS( RtlAddAccessAllowedAce( Dacl, ACL_REVISION, SECTION_ALL_ACCESS, SeExports->SeLocalSystemSid ) ) ||
+		!NT_SUCCESS( RtlAddAccessAllowedAce( Dacl, ACL_REVISION, SECTION_MAP_READ | SECTION_QUERY, SeExports->SeAliasAdminsSid ) ) ||
+		!NT_SUCCESS( RtlSetDaclSecurityDescriptor( Descriptor, TRUE, Dacl, FALSE ) ) )
+	{
+		ExFreePoolWithTag( Descriptor, GESTALT_POOL_TAG );
+		return nullptr;
+	}
+
+	return Descriptor;
+}
+
+
+//
+// The statistics live in a named pagefile-backed section so monitors can map them with OpenFileMapping(Global\GestaltStats).
+// The exit handler can't take page faults: the pages are locked and written through their own MDL mapping,
+// the system view only exists to lock them
+//
+bool Hypervisor::CreateStatsRegion()
+{
+	UNICODE_STRING SectionName;
+	OBJECT_ATTRIBUTES Attributes;
+	LARGE_INTEGER MaximumSize;
+	PSECURITY_DESCRIPTOR Descriptor;
+	SIZE_T ViewSize = 0;
+	UINT32 CpuCount;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	//
+	// Room for every processor that can be hot-added, slots are indexed by processor index
+	//
+	CpuCount = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+	MaximumSize.QuadPart = ( LONGLONG ) vmx::stats::RegionSize( CpuCount );
+
+	Descriptor = CreateStatsSecurityDescriptor();
+
+	if ( !Descriptor )
+		return false;
+
+	RtlInitUnicodeString( &SectionName, STATS_SECTION_NAME );
+	InitializeObjectAttributes( &Attributes, &SectionName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, Descriptor );
+
+	status = ZwCreateSection( &StatsSection, SECTION_ALL_ACCESS, &Attributes, &MaximumSize, PAGE_READWRITE, SEC_COMMIT, NULL );
+
+	ExFreePoolWithTag( Descriptor, GESTALT_POOL_TAG );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to create the statistics section (0x%x)", status );
+		StatsSection = nullptr;
+		return false;
+	}
+
+	status = ObReferenceObjectByHandle( StatsSection, SECTION_MAP_READ | SECTION_MAP_WRITE, NULL, KernelMode, &StatsSectionObject, NULL );
+
+	if ( NT_SUCCESS( status ) )
+		status = MmMapViewInSystemSpace( StatsSectionObject, &StatsView, &ViewSize );
+
+	if ( NT_SUCCESS( status ) )
+	{
+		StatsMdl = IoAllocateMdl( StatsView, ( ULONG ) MaximumSize.QuadPart, FALSE, FALSE, NULL );
+		status = StatsMdl ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if ( NT_SUCCESS( status ) )
+	{
+		__try
+		{
+			MmProbeAndLockPages( StatsMdl, KernelMode, IoWriteAccess );
+		}
+		__except ( EXCEPTION_EXECUTE_HANDLER )
+		{
+			status = GetExceptionCode();
+			IoFreeMdl( StatsMdl );
+			StatsMdl = nullptr;
+		}
+	}
+
+	if ( NT_SUCCESS( status ) )
+	{
+		StatsRegion = MmGetSystemAddressForMdlSafe( StatsMdl, NormalPagePriority | MdlMappingNoExecute );
+		status = StatsRegion ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to map the statistics section (0x%x)", status );
+		DeleteStatsRegion();
+		return false;
+	}
+
+	vmx::stats::Initialize( StatsRegion, CpuCount );
+
+	return true;
+}
+
+
+//
+// Only valid once no processor runs the exit handler anymore. Monitors that still map the section keep it alive
+//
+void Hypervisor::DeleteStatsRegion()
+{
+	if ( StatsMdl )
+	{
+		if ( StatsMdl->MdlFlags & MDL_PAGES_LOCKED )
+			MmUnlockPages( StatsMdl );
+
+		IoFreeMdl( StatsMdl );
+	}
+
+	if ( StatsView )
+		MmUnmapViewInSystemSpace( StatsView );
+
+	if ( StatsSectionObject )
+		ObDereferenceObject( StatsSectionObject );
+
+	if ( StatsSection )
+		ZwClose( StatsSection );
+
+	StatsMdl = nullptr;
+	StatsView = nullptr;
+	StatsSectionObject = nullptr;
+	StatsSection = nullptr;
+	StatsRegion = nullptr;
+}
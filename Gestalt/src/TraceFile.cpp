@@ -0,0 +1,104 @@
+#include "Hypervisor.h"
+
+
+//
+// Capture up to RecordsPerCpu exits per processor, only the processors allocated after this call get a buffer
+//
+void Hypervisor::SetExitTrace( ULONG RecordsPerCpu )
+{
+	ExitTraceRecords = RecordsPerCpu;
+}
+
+
+//
+// The trace buffer is touched on every exit, it must be non-paged
+//
+bool Hypervisor::AllocateExitTrace( vCPU* vcpu )
+{
+	SIZE_T Size = ( SIZE_T ) ExitTraceRecords * sizeof( ExitTraceRecord );
+
+	vcpu->Trace.Records = ( ExitTraceRecord* ) ExAllocatePoolWithTag( NonPagedPoolNx, Size, GESTALT_POOL_TAG );
+
+	if ( !vcpu->Trace.Records )
+		return false;
+
+	vcpu->Trace.Capacity = ExitTraceRecords;
+	vcpu->Trace.Count = 0;
+	vcpu->Trace.Dropped = 0;
+
+	return true;
+}
+
+
+void Hypervisor::FreeExitTrace( vCPU* vcpu )
+{
+	if ( !vcpu->Trace.Records )
+		return;
+
+	ExFreePoolWithTag( vcpu->Trace.Records, GESTALT_POOL_TAG );
+	vcpu->Trace.Records = nullptr;
+	vcpu->Trace.Capacity = 0;
+}
+
+
+//
+// Write one block per traced processor (ExitTraceHeader followed by its records), must run at PASSIVE_LEVEL.
+// The records bellow each Count are complete, so this can run while the processors are still tracing
+//
+bool Hypervisor::WriteExitTrace( PCWSTR Path ) const
+{
+	UNICODE_STRING FileName;
+	OBJECT_ATTRIBUTES Attributes;
+	IO_STATUS_BLOCK IoStatus;
+	ExitTraceHeader Header;
+	HANDLE File;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	RtlInitUnicodeString( &FileName, Path );
+	InitializeObjectAttributes( &Attributes, &FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL );
+
+	status = ZwCreateFile( &File, GENERIC_WRITE, &Attributes, &IoStatus, NULL, FILE_ATTRIBUTE_NORMAL, 0,
+		FILE_OVERWRITE_IF, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, NULL, 0 );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to create the exit trace file (0x%x)", status );
+		return false;
+	}
+
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount && NT_SUCCESS( status ); i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; j < Group->Count && NT_SUCCESS( status ); j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( !vcpu || !vcpu->Trace.Records )
+				continue;
+
+			vmx::trace::FillHeader( &vcpu->Trace, vcpu->CpuNumber, &Header );
+
+			status = ZwWriteFile( File, NULL, NULL, NULL, &IoStatus, &Header, sizeof( Header ), NULL, NULL );
+
+			if ( NT_SUCCESS( status ) && Header.RecordCount )
+				status = ZwWriteFile( File, NULL, NULL, NULL, &IoStatus, vcpu->Trace.Records,
+					( ULONG ) ( Header.RecordCount * sizeof( ExitTraceRecord ) ), NULL, NULL );
+
+			if ( Header.Dropped )
+				DbgInfo( "Processor %d: %llu exits were not traced, the buffer was full", vcpu->CpuNumber, Header.Dropped );
+		}
+	}
+
+	ZwClose( File );
+
+	if ( !NT_SUCCESS( status ) )
+	{
+		DbgInfo( "Unable to write the exit trace (0x%x)", status );
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,198 @@
+#include "Hypervisor.h"
+
+//
+// Samples per workload, the least one is kept: anything longer was disturbed
+//
+#define TSC_CALIBRATION_SAMPLES 1000
+
+//
+// Milliseconds between two refreshes of the highest vCPU TSC offset
+//
+#define TSC_RESYNC_PERIOD 10
+
+//
+// Workloads the calibration times, with the exit each one causes
+//
+static const struct
+{
+	BENCH_WORKLOAD Workload;
+	UINT32 Reason;
+} TscCalibrationWorkloads[] =
+{
+	{ BenchCpuidBasic, vmexit_cpuid },
+	{ BenchRdmsr, vmexit_rdmsr },
+	{ BenchWrmsr, vmexit_wrmsr },
+	{ BenchVmcall, vmexit_vmcall },
+};
+
+
+//
+// TSC_POLICY of every processor. Anything but TscAccountOnly turns TSC offsetting on from the next launch
+//
+void Hypervisor::SetTscCompensation( ULONG Policy )
+{
+	TscPolicy = Policy < TscPolicyCount ? Policy : TscAccountOnly;
+}
+
+
+//
+// Least cycles of one sample on the current processor, without the root mode cycles of its exit when vcpu is set
+//
+static UINT64 MinimumSample( BENCH_WORKLOAD Workload, const vCPU* vcpu )
+{
+	LatencyHistogram Histogram;
+	UINT64 Minimum = MAXUINT64;
+
+	for ( ULONG i = 0; i < TSC_CALIBRATION_SAMPLES; i++ )
+	{
+		UINT64 RootCycles = vcpu ? vcpu->Counters.RootCycles : 0;
+		UINT64 Cycles = bench::Run( Workload, 1, &Histogram );
+
+		if ( vcpu )
+			Cycles -= vcpu->Counters.RootCycles - RootCycles;
+
+		if ( Cycles < Minimum )
+			Minimum = Cycles;
+	}
+
+	return Minimum;
+}
+
+//
+// With TscHideCalibrated, called once before the processors are virtualized for the bare metal cost of each
+// workload, then once after for the part of their exits the exit handler doesn't measure (the VM exit and entry
+// themselves). What the guest sees is then close to the bare metal cost. The policy applies once this is done
+//
+void Hypervisor::CalibrateTsc( BENCH_PHASE Phase )
+{
+	GlobalState* state = &VirtualMachineMonitor.state;
+	vCPU* vcpu = nullptr;
+	UINT64 Timer;
+	KIRQL Irql;
+
+	if ( TscPolicy != TscHideCalibrated )
+		return;
+
+	if ( Phase == BenchVirtualized && ( !Virtualized || !( vcpu = GetCurrentVCPU() ) ) )
+		return;
+
+	KeRaiseIrql( DISPATCH_LEVEL, &Irql );
+	_disable();
+
+	Timer = MinimumSample( BenchTimer, nullptr );
+
+	for ( ULONG i = 0; i < ARRAYSIZE( TscCalibrationWorkloads ); i++ )
+	{
+		BENCH_WORKLOAD Workload = TscCalibrationWorkloads[i].Workload;
+		INT64 Cycles;
+
+		if ( Phase == BenchBaseline )
+		{
+			TscNativeCycles[i] = bench::NeedsVMX( Workload ) ? 0 : MinimumSample( Workload, nullptr ) - Timer;
+			continue;
+		}
+
+		Cycles = ( INT64 ) MinimumSample( Workload, vcpu ) - ( INT64 ) Timer - ( INT64 ) TscNativeCycles[i];
+		state->TscExitCost[TscCalibrationWorkloads[i].Reason] = ( INT32 ) Cycles;
+	}
+
+	_enable();
+	KeLowerIrql( Irql );
+
+	if ( Phase == BenchBaseline )
+		return;
+
+	for ( ULONG i = 0; i < ARRAYSIZE( TscCalibrationWorkloads ); i++ )
+	{
+		DbgInfo( "TSC calibration, %s: %llu cycles on bare metal, %d more per exit than the exit handler measures",
+			bench::WorkloadName( TscCalibrationWorkloads[i].Workload ), TscNativeCycles[i],
+			state->TscExitCost[TscCalibrationWorkloads[i].Reason] );
+	}
+
+	state->TscPolicy = TscHideCalibrated;
+}
+
+
+//
+// The highest TSC offset of the vCPUs, they hide root mode time down to TSC_MAX_SKEW below it. Offsets only go
+// down: one read while it changes is still one it was, and the result is never below the real highest
+//
+void Hypervisor::TscResyncDpc( PKDPC Dpc, PVOID Context, PVOID Argument1, PVOID Argument2 )
+{
+	Hypervisor* hv = ( Hypervisor* ) Context;
+	INT64 Highest = MINLONG64;
+
+	UNREFERENCED_PARAMETER( Dpc );
+	UNREFERENCED_PARAMETER( Argument1 );
+	UNREFERENCED_PARAMETER( Argument2 );
+
+	for ( USHORT i = 0; i < hv->VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &hv->VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; Group->vcpu && j < Group->Count; j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( vcpu && vcpu->Launched && vcpu->Tsc.Offset > Highest )
+				Highest = vcpu->Tsc.Offset;
+		}
+	}
+
+	if ( Highest != MINLONG64 )
+		hv->VirtualMachineMonitor.state.TscOffset = Highest;
+}
+
+
+//
+// After the launch, with TSC offsetting. Before the vCPUs are freed the timer is cancelled and its DPC waited for
+//
+void Hypervisor::StartTscResync()
+{
+	LARGE_INTEGER DueTime;
+
+	if ( !VirtualMachineMonitor.state.TscOffsetting )
+		return;
+
+	KeInitializeTimerEx( &TscResyncTimer, NotificationTimer );
+	KeInitializeDpc( &TscResyncTimerDpc, TscResyncDpc, this );
+
+	DueTime.QuadPart = -( LONGLONG ) TSC_RESYNC_PERIOD * 10000;
+	KeSetTimerEx( &TscResyncTimer, DueTime, TSC_RESYNC_PERIOD, &TscResyncTimerDpc );
+	TscResyncStarted = true;
+}
+
+
+void Hypervisor::StopTscResync()
+{
+	if ( !TscResyncStarted )
+		return;
+
+	KeCancelTimer( &TscResyncTimer );
+	KeFlushQueuedDpcs();
+	TscResyncStarted = false;
+}
+
+
+//
+// Root mode time of each processor and how much of it the guest TSC doesn't show
+//
+void Hypervisor::ReportTscCompensation() const
+{
+	for ( USHORT i = 0; i < VirtualMachineMonitor.GroupCount; i++ )
+	{
+		ProcessorGroup* Group = &VirtualMachineMonitor.Groups[i];
+
+		for ( ULONG j = 0; Group->vcpu && j < Group->Count; j++ )
+		{
+			vCPU* vcpu = Group->vcpu[j];
+
+			if ( !vcpu || !vcpu->Counters.Exits )
+				continue;
+
+			DbgInfo( "Processor %d: %llu exits, %llu root mode cycles, %llu hidden from the guest TSC, %llu not hidden to stay "
+				"within %d cycles of the other processors", vcpu->CpuNumber, vcpu->Counters.Exits, vcpu->Counters.RootCycles,
+				vcpu->Tsc.Hidden, vcpu->Tsc.Capped, TSC_MAX_SKEW );
+		}
+	}
+}
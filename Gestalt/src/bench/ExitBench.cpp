@@ -0,0 +1,329 @@
+#include "bench/ExitBench.h"
+
+
+static const char* WorkloadNames[BenchWorkloadCount] =
+{
+	"timer",
+	"cpuid_0",
+	"cpuid_1",
+	"cpuid_40000000",
+	"rdmsr",
+	"wrmsr",
+	"vmcall",
+	"cr_read",
+};
+
+static const char* PhaseNames[BenchPhaseCount] =
+{
+	"baseline",
+	"virtualized",
+};
+
+
+const char* bench::WorkloadName( BENCH_WORKLOAD Workload )
+{
+	return Workload < BenchWorkloadCount ? WorkloadNames[Workload] : "unknown";
+}
+
+//
+// VMCALL raises #UD outside VMX non-root operation, it has no bare metal baseline
+//
+bool bench::NeedsVMX( BENCH_WORKLOAD Workload )
+{
+	return Workload == BenchVmcall;
+}
+
+
+//
+// Each sample is fenced on both sides so the instruction under test can't overlap the TSC reads
+//
+UINT64 bench::Run( BENCH_WORKLOAD Workload, UINT32 Iterations, LatencyHistogram* Histogram )
+{
+	int regs[4];
+	UINT64 MsrValue = 0;
+	UINT64 Total = 0;
+	UINT64 Start;
+	UINT64 End;
+
+	if ( Workload == BenchRdmsr || Workload == BenchWrmsr )
+		MsrValue = __readmsr( BENCH_MSR );
+
+	for ( UINT32 i = 0; i < Iterations; i++ )
+	{
+		_mm_lfence();
+		Start = __rdtsc();
+		_mm_lfence();
+
+		switch ( Workload )
+		{
+		case BenchCpuidBasic:
+			__cpuidex( regs, 0, 0 );
+			break;
+		case BenchCpuidFeatures:
+			__cpuidex( regs, CPUID_VERSION_INFORMATION, 0 );
+			break;
+		case BenchCpuidHypervisor:
+			__cpuidex( regs, CPUID_HV_VENDOR_INFORMATION, 0 );
+			break;
+		case BenchRdmsr:
+			MsrValue = __readmsr( BENCH_MSR );
+			break;
+		case BenchWrmsr:
+			__writemsr( BENCH_MSR, MsrValue );
+			break;
+		case BenchVmcall:
+			vmx::__vmcall( 0, 0, 0 );
+			break;
+		case BenchCrRead:
+			MsrValue = __readcr4();
+			break;
+		default:
+			break;
+		}
+
+		_mm_lfence();
+		End = __rdtsc();
+
+		AddSample( Histogram, End - Start );
+		Total += End - Start;
+	}
+
+	return Total;
+}
+
+
+void bench::ResetHistogram( LatencyHistogram* Histogram )
+{
+	RtlSecureZeroMemory( Histogram, sizeof( LatencyHistogram ) );
+	Histogram->Min = MAXUINT64;
+}
+
+static UINT32 BucketIndex( UINT64 Cycles )
+{
+	UINT32 Msb = 0;
+	UINT32 Shift;
+	UINT32 Index;
+
+	if ( Cycles < BENCH_SUB_BUCKETS )
+		return ( UINT32 ) Cycles;
+
+	for ( UINT64 Value = Cycles; Value > 1; Value >>= 1 )
+		Msb++;
+
+	Shift = Msb - BENCH_SUB_BUCKET_BITS;
+	Index = ( Shift + 1 ) * BENCH_SUB_BUCKETS + ( UINT32 ) ( ( Cycles >> Shift ) & ( BENCH_SUB_BUCKETS - 1 ) );
+
+	return Index < BENCH_BUCKETS ? Index : BENCH_BUCKETS - 1;
+}
+
+//
+// Middle of the bucket, the exact value for the small ones
+//
+static UINT64 BucketValue( UINT32 Index )
+{
+	UINT32 Shift;
+
+	if ( Index < BENCH_SUB_BUCKETS )
+		return Index;
+
+	Shift = Index / BENCH_SUB_BUCKETS - 1;
+
+	return ( ( UINT64 ) ( BENCH_SUB_BUCKETS + Index % BENCH_SUB_BUCKETS ) << Shift ) + ( ( 1ULL << Shift ) >> 1 );
+}
+
+void bench::AddSample( LatencyHistogram* Histogram, UINT64 Cycles )
+{
+	Histogram->Buckets[BucketIndex( Cycles )]++;
+	Histogram->Count++;
+	Histogram->Sum += Cycles;
+
+	if ( Cycles < Histogram->Min )
+		Histogram->Min = Cycles;
+
+	if ( Cycles > Histogram->Max )
+		Histogram->Max = Cycles;
+}
+
+void bench::MergeHistogram( LatencyHistogram* Destination, const LatencyHistogram* Source )
+{
+	for ( UINT32 i = 0; i < BENCH_BUCKETS; i++ )
+		Destination->Buckets[i] += Source->Buckets[i];
+
+	Destination->Count += Source->Count;
+	Destination->Sum += Source->Sum;
+
+	if ( Source->Min < Destination->Min )
+		Destination->Min = Source->Min;
+
+	if ( Source->Max > Destination->Max )
+		Destination->Max = Source->Max;
+}
+
+UINT64 bench::Percentile( const LatencyHistogram* Histogram, UINT64 Numerator, UINT64 Denominator )
+{
+	UINT64 Rank;
+	UINT64 Seen = 0;
+
+	if ( !Histogram->Count )
+		return 0;
+
+	Rank = ( Histogram->Count * Numerator + Denominator - 1 ) / Denominator;
+
+	for ( UINT32 i = 0; i < BENCH_BUCKETS; i++ )
+	{
+		Seen += Histogram->Buckets[i];
+
+		if ( Seen >= Rank )
+			return BucketValue( i );
+	}
+
+	return Histogram->Max;
+}
+
+
+UINT32 bench::GetScales( UINT32 Processors, UINT32* Scales )
+{
+	UINT32 Count = 0;
+
+	for ( UINT32 Threads = 1; Threads < Processors && Count < BENCH_MAX_SCALES - 1; Threads *= 2 )
+		Scales[Count++] = Threads;
+
+	Scales[Count++] = Processors ? Processors : 1;
+
+	return Count;
+}
+
+
+//
+// Minimal JSON output, no printf so it builds the same in the kernel and in user-mode
+//
+struct JsonWriter
+{
+	char* Buffer;
+	SIZE_T Size;
+	SIZE_T Length;
+};
+
+static void JsonAppend( JsonWriter* Writer, const char* Text )
+{
+	for ( ; *Text; Text++, Writer->Length++ )
+	{
+		if ( Writer->Length + 1 < Writer->Size )
+			Writer->Buffer[Writer->Length] = *Text;
+	}
+}
+
+static void JsonAppendNumber( JsonWriter* Writer, UINT64 Value )
+{
+	char Digits[24];
+	int i = sizeof( Digits ) - 1;
+
+	Digits[i] = 0;
+
+	do
+	{
+		Digits[--i] = ( char ) ( '0' + Value % 10 );
+		Value /= 10;
+	} while ( Value );
+
+	JsonAppend( Writer, &Digits[i] );
+}
+
+//
+// Thousandths as a decimal number
+//
+static void JsonAppendFixed( JsonWriter* Writer, UINT64 Thousandths )
+{
+	char Fraction[5] = { '.', 0, 0, 0, 0 };
+
+	JsonAppendNumber( Writer, Thousandths / 1000 );
+
+	Fraction[1] = ( char ) ( '0' + Thousandths / 100 % 10 );
+	Fraction[2] = ( char ) ( '0' + Thousandths / 10 % 10 );
+	Fraction[3] = ( char ) ( '0' + Thousandths % 10 );
+
+	JsonAppend( Writer, Fraction );
+}
+
+static void JsonAppendField( JsonWriter* Writer, const char* Name, UINT64 Value )
+{
+	JsonAppend( Writer, ", \"" );
+	JsonAppend( Writer, Name );
+	JsonAppend( Writer, "\": " );
+	JsonAppendNumber( Writer, Value );
+}
+
+//
+// Cycles per operation of one thread, in thousandths
+//
+static UINT64 CyclesPerOperation( const BenchRun* Run )
+{
+	return Run->Operations ? Run->Cycles * 1000 / Run->Operations : 0;
+}
+
+SIZE_T bench::FormatJson( const BenchReport* Report, char* Buffer, SIZE_T BufferSize )
+{
+	JsonWriter Writer = { Buffer, BufferSize, 0 };
+	bool FirstWorkload = true;
+
+	JsonAppend( &Writer, "{\"processors\": " );
+	JsonAppendNumber( &Writer, Report->Processors );
+	JsonAppend( &Writer, ", \"iterations\": " );
+	JsonAppendNumber( &Writer, Report->Iterations );
+	JsonAppend( &Writer, ", \"unit\": \"tsc_cycles\", \"workloads\": [" );
+
+	for ( int w = 0; w < BenchWorkloadCount; w++ )
+	{
+		bool FirstRun = true;
+
+		JsonAppend( &Writer, FirstWorkload ? "\n  {\"name\": \"" : ",\n  {\"name\": \"" );
+		JsonAppend( &Writer, WorkloadNames[w] );
+		JsonAppend( &Writer, "\", \"runs\": [" );
+		FirstWorkload = false;
+
+		for ( int p = 0; p < BenchPhaseCount; p++ )
+		{
+			const BenchRun* Single = &Report->Runs[w][p][0];
+
+			for ( UINT32 s = 0; s < Report->Scales[p]; s++ )
+			{
+				const BenchRun* Run = &Report->Runs[w][p][s];
+				const LatencyHistogram* Latency = &Run->Latency;
+				UINT64 PerOperation = CyclesPerOperation( Run );
+
+				if ( !Latency->Count )
+					continue;
+
+				JsonAppend( &Writer, FirstRun ? "\n    {\"phase\": \"" : ",\n    {\"phase\": \"" );
+				JsonAppend( &Writer, PhaseNames[p] );
+				JsonAppend( &Writer, "\"" );
+				FirstRun = false;
+
+				JsonAppendField( &Writer, "threads", Run->Threads );
+				JsonAppendField( &Writer, "operations", Run->Operations );
+				JsonAppendField( &Writer, "cycles", Run->Cycles );
+				JsonAppendField( &Writer, "min", Latency->Min );
+				JsonAppendField( &Writer, "mean", Latency->Sum / Latency->Count );
+				JsonAppendField( &Writer, "p50", Percentile( Latency, 50, 100 ) );
+				JsonAppendField( &Writer, "p99", Percentile( Latency, 99, 100 ) );
+				JsonAppendField( &Writer, "p999", Percentile( Latency, 999, 1000 ) );
+				JsonAppendField( &Writer, "max", Latency->Max );
+				//
+				// Per thread throughput against the single thread run of the same phase
+				//
+				JsonAppend( &Writer, ", \"scaling_efficiency\": " );
+				JsonAppendFixed( &Writer, PerOperation ? CyclesPerOperation( Single ) * 1000 / PerOperation : 0 );
+				JsonAppend( &Writer, "}" );
+			}
+		}
+
+		JsonAppend( &Writer, "]}" );
+	}
+
+	JsonAppend( &Writer, "\n]}\n" );
+
+	if ( BufferSize )
+		Buffer[Writer.Length < BufferSize ? Writer.Length : BufferSize - 1] = 0;
+
+	return Writer.Length;
+}
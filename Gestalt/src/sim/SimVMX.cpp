@@ -0,0 +1,1070 @@
+#include "sim/SimVMX.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+
+#define SIM_RFLAGS_CF ( 1ULL << 0 )
+#define SIM_RFLAGS_PF ( 1ULL << 2 )
+#define SIM_RFLAGS_ZF ( 1ULL << 6 )
+#define SIM_RFLAGS_SF ( 1ULL << 7 )
+#define SIM_RFLAGS_OF ( 1ULL << 11 )
+#define SIM_RFLAGS_STATUS ( SIM_RFLAGS_CF | SIM_RFLAGS_PF | SIM_RFLAGS_ZF | SIM_RFLAGS_SF | SIM_RFLAGS_OF )
+
+#define SIM_CR4_VMXE ( 1ULL << 13 )
+
+#define SIM_CTLS2_EPT ( 1ULL << 1 )
+#define SIM_CTLS2_VMFUNC ( 1ULL << 13 )
+#define SIM_CTLS2_VE ( 1ULL << 18 )
+#define SIM_EPT_SUPPRESS_VE ( 1ULL << 63 )
+#define SIM_EPT_LARGE ( 1ULL << 7 )
+#define SIM_EPT_ADDRESS 0x000FFFFFFFFFF000ULL
+
+namespace
+{
+	//
+	// Every VMCS encoding (width, type, index) maps to one slot, the access type bit only selects the high half of 64-bit fields
+	//
+	constexpr size_t VmcsFieldCount = 0x4000;
+
+	struct FieldStore
+	{
+		bool Launched;
+		UINT64 Fields[VmcsFieldCount];
+	};
+
+	struct Processor
+	{
+		int Index;
+		bool VmxOn;
+		FieldStore* Current;
+		UINT64 Cr0;
+		UINT64 Cr2;
+		UINT64 Cr3;
+		UINT64 Cr4;
+		UINT64 Rflags;
+		SEGMENT_DESCRIPTOR_REGISTER_64 Gdtr;
+		SEGMENT_DESCRIPTOR_REGISTER_64 Idtr;
+		UINT64 Gdt[16];
+		UINT64 Idt[512];
+		UINT8 Tss[0x68];
+		std::unordered_map<UINT32, UINT64> Msrs;
+	};
+
+	struct Platform
+	{
+		std::mutex Lock;
+		std::unordered_map<UINT32, UINT64> Msrs;
+		std::map<std::pair<int, int>, std::array<int, 4>> Cpuid;
+		std::unordered_map<UINT64, FieldStore*> Vmcs;
+		std::unordered_map<UINT16, UINT32> Ports;
+		std::atomic<UINT64> Inveptions { 0 };
+		BYTE ExitBitMap[MAX_VMEXIT_REASON_FILTER] = {};
+		bool Logging = true;
+
+		Platform();
+	};
+
+	//
+	// Capabilities of a typical VMX-capable client part, with the TRUE_* controls reported
+	//
+	Platform::Platform()
+	{
+		Msrs[IA32_FEATURE_CONTROL] = 0x5;
+		Msrs[IA32_VMX_BASIC] = 0x00DA040000000001ULL;
+		Msrs[IA32_VMX_PINBASED_CTLS] = 0x0000007F00000016ULL;
+		Msrs[IA32_VMX_PROCBASED_CTLS] = 0xFFF9FFFE0401E172ULL;
+		Msrs[IA32_VMX_EXIT_CTLS] = 0x01FFFFFF00036DFFULL;
+		Msrs[IA32_VMX_ENTRY_CTLS] = 0x0003FFFF000011FFULL;
+		Msrs[IA32_VMX_PROCBASED_CTLS2] = 0x00553CFE00000000ULL;
+		Msrs[IA32_VMX_TRUE_PINBASED_CTLS] = 0x0000007F00000016ULL;
+		Msrs[IA32_VMX_TRUE_PROCBASED_CTLS] = 0xFFF9FFFE04006172ULL;
+		Msrs[IA32_VMX_TRUE_EXIT_CTLS] = 0x01FFFFFF00036DFBULL;
+		Msrs[IA32_VMX_TRUE_ENTRY_CTLS] = 0x0003FFFF000011FBULL;
+		Msrs[IA32_VMX_MISC] = 0x000000007004C1E5ULL;
+		Msrs[IA32_VMX_CR0_FIXED0] = 0x80000021ULL;
+		Msrs[IA32_VMX_CR0_FIXED1] = 0xFFFFFFFFULL;
+		Msrs[IA32_VMX_CR4_FIXED0] = 0x2000ULL;
+		Msrs[IA32_VMX_CR4_FIXED1] = 0x3767FFULL;
+		Msrs[IA32_EFER] = 0xD01ULL;
+		Msrs[IA32_PAT] = 0x0007010600070106ULL;
+		Msrs[IA32_DEBUGCTL] = 0;
+		Msrs[IA32_SYSENTER_CS] = 0;
+		Msrs[IA32_SYSENTER_ESP] = 0;
+		Msrs[IA32_SYSENTER_EIP] = 0;
+		Msrs[IA32_FS_BASE] = 0;
+		Msrs[IA32_GS_BASE] = 0;
+		Msrs[IA32_TSC_ADJUST] = 0;
+		//
+		// EPT with execute-only pages, 2 MB and 1 GB pages and every INVEPT type. VMFUNC 0 only
+		//
+		Msrs[IA32_VMX_EPT_VPID_CAP] = 0x00000F0106734141ULL;
+		Msrs[IA32_VMX_VMFUNC] = 0x1;
+		//
+		// Write-back memory with the legacy video range uncacheable and a 512 MB uncacheable hole under 4 GB
+		//
+		Msrs[IA32_MTRR_CAPABILITIES] = 0xD0A;
+		Msrs[IA32_MTRR_DEF_TYPE] = 0xC06;
+		Msrs[IA32_MTRR_FIX64K_00000] = 0x0606060606060606ULL;
+		Msrs[IA32_MTRR_FIX16K_80000] = 0x0606060606060606ULL;
+		Msrs[IA32_MTRR_FIX16K_A0000] = 0;
+
+		for ( UINT32 i = IA32_MTRR_FIX4K_C0000; i <= IA32_MTRR_FIX4K_F8000; i++ )
+			Msrs[i] = 0x0606060606060606ULL;
+
+		Msrs[IA32_MTRR_PHYSBASE0] = 0xE0000000ULL;
+		Msrs[IA32_MTRR_PHYSMASK0] = 0x7FE0000800ULL;
+		//
+		// x2APIC mode, kicks are WRMSRs to the ICR
+		//
+		Msrs[IA32_APIC_BASE] = 0xFEE00D00ULL;
+
+		//
+		// "GenuineIntel", leaf 1 reports VMX (ECX bit 5) and no hypervisor
+		//
+		Cpuid[{ 0, -1 }] = { 0x16, 0x756E6547, 0x6C65746E, 0x49656E69 };
+		Cpuid[{ 1, -1 }] = { 0x000906EA, 0x00100800, 0x7FFAFBBF, ( int ) 0xBFEBFBFF };
+		//
+		// 39 physical address bits, 48 linear
+		//
+		Cpuid[{ ( int ) 0x80000000, -1 }] = { ( int ) 0x80000008, 0, 0, 0 };
+		Cpuid[{ ( int ) 0x80000008, -1 }] = { 0x3027, 0, 0, 0 };
+
+		//
+		// The exits Hypervisor::VMXVirtualize sends to its own handler
+		//
+		ExitBitMap[vmexit_cpuid] = true;
+		ExitBitMap[vmexit_control_register_access] = true;
+	}
+
+	Platform& Sim()
+	{
+		static Platform platform;
+		return platform;
+	}
+
+	thread_local Processor Cpu;
+
+	size_t FieldIndex( size_t Encoding )
+	{
+		return ( ( ( Encoding >> 13 ) & 3 ) << 12 ) | ( ( ( Encoding >> 10 ) & 3 ) << 10 ) | ( Encoding & 0x3FF );
+	}
+
+	UINT64& Field( FieldStore* Vmcs, size_t Encoding )
+	{
+		return Vmcs->Fields[FieldIndex( Encoding )];
+	}
+
+	FieldStore* LookupVmcs( UINT64 PhysicalAddress )
+	{
+		Platform& platform = Sim();
+		std::lock_guard<std::mutex> guard( platform.Lock );
+		FieldStore*& Vmcs = platform.Vmcs[PhysicalAddress];
+
+		if ( !Vmcs )
+			Vmcs = new FieldStore();
+
+		return Vmcs;
+	}
+
+	//
+	// VMX instruction outcomes, reported through RFLAGS like the hardware and with the intrinsics return convention
+	//
+	unsigned char Succeed()
+	{
+		Cpu.Rflags &= ~SIM_RFLAGS_STATUS;
+		return 0;
+	}
+
+	unsigned char FailInvalid()
+	{
+		Cpu.Rflags = ( Cpu.Rflags & ~SIM_RFLAGS_STATUS ) | SIM_RFLAGS_CF;
+		return 2;
+	}
+
+	unsigned char FailValid( UINT64 Error )
+	{
+		if ( !Cpu.Current )
+			return FailInvalid();
+
+		Field( Cpu.Current, VMCS_VM_INSTRUCTION_ERROR ) = Error;
+		Cpu.Rflags = ( Cpu.Rflags & ~SIM_RFLAGS_STATUS ) | SIM_RFLAGS_ZF;
+		return 1;
+	}
+
+	UINT64 TssDescriptorLow( UINT64 Base, UINT32 Limit )
+	{
+		return ( Limit & 0xFFFF ) | ( ( Base & 0xFFFFFF ) << 16 ) | ( 0x8BULL << 40 ) | ( ( UINT64 ) ( ( Limit >> 16 ) & 0xF ) << 48 ) | ( ( ( Base >> 24 ) & 0xFF ) << 56 );
+	}
+
+	UINT64 ReadDescriptor( UINT16 Selector )
+	{
+		UINT16 Index = Selector >> 3;
+
+		if ( !Index || ( Selector & 4 ) || Index * 8 + 7 > Cpu.Gdtr.Limit )
+			return 0;
+
+		return ( ( UINT64* ) Cpu.Gdtr.BaseAddress )[Index];
+	}
+}
+
+
+//
+// Model configuration
+//
+void sim::SetMsr( UINT32 Msr, UINT64 Value )
+{
+	Platform& platform = Sim();
+	std::lock_guard<std::mutex> guard( platform.Lock );
+
+	platform.Msrs[Msr] = Value;
+}
+
+void sim::SetCpuid( int Leaf, int SubLeaf, const int Regs[4] )
+{
+	Platform& platform = Sim();
+	std::lock_guard<std::mutex> guard( platform.Lock );
+
+	platform.Cpuid[{ Leaf, SubLeaf }] = { Regs[0], Regs[1], Regs[2], Regs[3] };
+}
+
+void sim::SetLogging( bool Enabled )
+{
+	Sim().Logging = Enabled;
+}
+
+void sim::SetPort( UINT16 Port, UINT32 Value )
+{
+	Platform& platform = Sim();
+	std::lock_guard<std::mutex> guard( platform.Lock );
+
+	platform.Ports[Port] = Value;
+}
+
+UINT32 sim::GetPort( UINT16 Port )
+{
+	Platform& platform = Sim();
+	std::lock_guard<std::mutex> guard( platform.Lock );
+	auto Latch = platform.Ports.find( Port );
+
+	return Latch != platform.Ports.end() ? Latch->second : 0;
+}
+
+
+//
+// A fresh processor as Windows leaves it: flat 64-bit GDT with a busy TSS at 0x40, paging on and CR4.VMXE clear
+//
+void sim::AttachProcessor( int Index )
+{
+	Platform& platform = Sim();
+
+	Cpu.Index = Index;
+	Cpu.VmxOn = false;
+	Cpu.Current = nullptr;
+	Cpu.Cr0 = 0x80050033;
+	Cpu.Cr2 = 0;
+	Cpu.Cr3 = 0x1AD000 + ( ( UINT64 ) Index << 12 );
+	Cpu.Cr4 = 0x370678 & ~SIM_CR4_VMXE;
+	Cpu.Rflags = 0x202;
+
+	memset( Cpu.Gdt, 0, sizeof( Cpu.Gdt ) );
+	memset( Cpu.Idt, 0, sizeof( Cpu.Idt ) );
+	memset( Cpu.Tss, 0, sizeof( Cpu.Tss ) );
+
+	Cpu.Gdt[2] = 0x00209B0000000000ULL;		// 0x10 kernel code
+	Cpu.Gdt[3] = 0x00CF93000000FFFFULL;		// 0x18 kernel data
+	Cpu.Gdt[4] = 0x00CFFB000000FFFFULL;		// 0x20 user compatibility code
+	Cpu.Gdt[5] = 0x00CFF3000000FFFFULL;		// 0x28 user data
+	Cpu.Gdt[6] = 0x0020FB0000000000ULL;		// 0x30 user code
+	Cpu.Gdt[8] = TssDescriptorLow( ( UINT64 ) Cpu.Tss, sizeof( Cpu.Tss ) - 1 );
+	Cpu.Gdt[9] = ( UINT64 ) Cpu.Tss >> 32;
+	Cpu.Gdt[10] = 0x0040F30000003C00ULL;	// 0x50 user compatibility TEB
+
+	Cpu.Gdtr.BaseAddress = ( UINT64 ) Cpu.Gdt;
+	Cpu.Gdtr.Limit = sizeof( Cpu.Gdt ) - 1;
+	Cpu.Idtr.BaseAddress = ( UINT64 ) Cpu.Idt;
+	Cpu.Idtr.Limit = sizeof( Cpu.Idt ) - 1;
+
+	std::lock_guard<std::mutex> guard( platform.Lock );
+	Cpu.Msrs = platform.Msrs;
+	Cpu.Msrs[IA32_GS_BASE] = 0xFFFFF80000000000ULL + ( ( UINT64 ) Index << 16 );
+}
+
+void sim::DetachProcessor()
+{
+	Cpu.VmxOn = false;
+	Cpu.Current = nullptr;
+	Cpu.Msrs.clear();
+}
+
+bool sim::InVmxOperation()
+{
+	return Cpu.VmxOn;
+}
+
+bool sim::IsLaunched()
+{
+	return Cpu.VmxOn && Cpu.Current && Cpu.Current->Launched;
+}
+
+UINT64 sim::ReadField( size_t Field )
+{
+	return Cpu.Current ? ::Field( Cpu.Current, Field ) : 0;
+}
+
+
+//
+// What the processor and __vmx_default_exit_handler do around VMExitHandler: save the guest state in the VMCS,
+// push the GPRs right bellow the host RSP and then either resume or leave VMX operation depending on the status
+//
+int sim::InjectExit( ExitEvent* Exit )
+{
+	FieldStore* Vmcs = Cpu.Current;
+	GuestRegisters* Regs = &Exit->Regs;
+	GCPUContext* Context;
+	int status;
+
+	if ( !Cpu.VmxOn || !Vmcs || !Vmcs->Launched )
+		return -1;
+
+	Field( Vmcs, VMCS_EXIT_REASON ) = Exit->Reason;
+	Field( Vmcs, VMCS_EXIT_QUALIFICATION ) = Exit->Qualification;
+	Field( Vmcs, VMCS_VMEXIT_INSTRUCTION_LENGTH ) = Exit->InstructionLength;
+	Field( Vmcs, VMCS_VMEXIT_INTERRUPTION_INFORMATION ) = Exit->InterruptionInfo;
+	Field( Vmcs, VMCS_EXIT_GUEST_LINEAR_ADDRESS ) = Exit->GuestLinearAddress;
+	Field( Vmcs, VMCS_VMEXIT_INSTRUCTION_INFO ) = Exit->InstructionInfo;
+	Field( Vmcs, VMCS_GUEST_PHYSICAL_ADDRESS ) = Exit->GuestPhysicalAddress;
+	Field( Vmcs, VMCS_GUEST_RIP ) = Regs->rip;
+	Field( Vmcs, VMCS_GUEST_RSP ) = Regs->rsp;
+	Field( Vmcs, VMCS_GUEST_RFLAGS ) = Regs->rflags;
+	//
+	// The event injected by the previous entry was delivered
+	//
+	Field( Vmcs, VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD ) &= ~( 1ULL << 31 );
+
+	Context = ( GCPUContext* ) ( Field( Vmcs, VMCS_HOST_RSP ) - FIELD_OFFSET( GCPUContext, ExtRegs ) );
+
+	Context->rax = Regs->rax;
+	Context->rcx = Regs->rcx;
+	Context->rdx = Regs->rdx;
+	Context->rbx = Regs->rbx;
+	Context->rbp = Regs->rbp;
+	Context->rsi = Regs->rsi;
+	Context->rdi = Regs->rdi;
+	Context->r8 = Regs->r8;
+	Context->r9 = Regs->r9;
+	Context->r10 = Regs->r10;
+	Context->r11 = Regs->r11;
+	Context->r12 = Regs->r12;
+	Context->r13 = Regs->r13;
+	Context->r14 = Regs->r14;
+	Context->r15 = Regs->r15;
+
+	status = vmx::VMExitHandler( Context );
+
+	Regs->rax = Context->rax;
+	Regs->rcx = Context->rcx;
+	Regs->rdx = Context->rdx;
+	Regs->rbx = Context->rbx;
+	Regs->rbp = Context->rbp;
+	Regs->rsi = Context->rsi;
+	Regs->rdi = Context->rdi;
+	Regs->r8 = Context->r8;
+	Regs->r9 = Context->r9;
+	Regs->r10 = Context->r10;
+	Regs->r11 = Context->r11;
+	Regs->r12 = Context->r12;
+	Regs->r13 = Context->r13;
+	Regs->r14 = Context->r14;
+	Regs->r15 = Context->r15;
+
+	if ( status )
+	{
+		//
+		// vmresume
+		//
+		Regs->rip = Field( Vmcs, VMCS_GUEST_RIP );
+		Regs->rsp = Field( Vmcs, VMCS_GUEST_RSP );
+		Regs->rflags = Field( Vmcs, VMCS_GUEST_RFLAGS );
+	}
+	else
+	{
+		//
+		// vmxoff, then RFLAGS from R8, RSP from RDX and jump to RCX
+		//
+		__vmx_off();
+		Regs->rip = Context->rcx;
+		Regs->rsp = Context->rdx;
+		Regs->rflags = Context->r8;
+		Cpu.Rflags = Context->r8;
+	}
+
+	return status;
+}
+
+
+//
+// The processor compares the operand with the first CR3-target count values, one that matches completes in the guest
+//
+int sim::MovToCr3( ExitEvent* Exit, bool* Exited )
+{
+	FieldStore* Vmcs = Cpu.Current;
+	UINT64 Count;
+
+	if ( !Cpu.VmxOn || !Vmcs || !Vmcs->Launched )
+		return -1;
+
+	*Exited = ( Field( Vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & ( 1ULL << 15 ) ) != 0;
+	Count = Field( Vmcs, VMCS_CTRL_CR3_TARGET_COUNT );
+
+	for ( UINT64 i = 0; *Exited && i < Count && i < MAX_CR3_TARGETS; i++ )
+	{
+		if ( Field( Vmcs, VMCS_CTRL_CR3_TARGET_VALUE_0 + i * 2 ) == Exit->Regs.rcx )
+			*Exited = false;
+	}
+
+	if ( !*Exited )
+	{
+		Field( Vmcs, VMCS_GUEST_CR3 ) = Exit->Regs.rcx & ~GUEST_CR3_NO_FLUSH;
+		Exit->Regs.rip += 3;
+
+		return 1;
+	}
+
+	Exit->Reason = vmexit_control_register_access;
+	Exit->InstructionLength = 3;
+	Exit->Qualification = VMX_EXIT_QUALIFICATION_REGISTER_CR3 | ( 1 << 8 );
+
+	return InjectExit( Exit );
+}
+
+
+//
+// The rights of every level of the walk of the current EPTP together, Last is the entry the walk stopped at
+//
+static UINT64 WalkEpt( FieldStore* Vmcs, UINT64 GuestPhysical, UINT64* Last )
+{
+	UINT64 Table = Field( Vmcs, VMCS_CTRL_EPT_POINTER ) & SIM_EPT_ADDRESS;
+	UINT64 Allowed = EPT_ACCESS_ALL;
+
+	for ( int Level = 4; Level > 0; Level-- )
+	{
+		UINT64 Entry = ( ( UINT64* ) Table )[( GuestPhysical >> ( PAGE_SHIFT + 9 * ( Level - 1 ) ) ) & 511];
+
+		Allowed &= Entry;
+		*Last = Entry;
+
+		if ( !( Entry & EPT_ACCESS_ALL ) || ( Entry & SIM_EPT_LARGE ) )
+			break;
+
+		Table = Entry & SIM_EPT_ADDRESS;
+	}
+
+	return Allowed;
+}
+
+
+//
+// A violation is a #VE with the control on, the suppress bit of the last entry clear and the semaphore of the
+// information page clear. The delivery goes through gate 20 of the guest IDT, which must be __vmx_ve_isr
+//
+static bool DeliverVe( FieldStore* Vmcs, UINT64 Qualification, UINT64 GuestPhysical, UINT64 Last )
+{
+	VMX_VIRTUALIZATION_EXCEPTION_INFORMATION* Info;
+	const SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64* Gate;
+
+	if ( !( Field( Vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & SIM_CTLS2_VE ) || ( Last & SIM_EPT_SUPPRESS_VE ) )
+		return false;
+
+	Info = ( VMX_VIRTUALIZATION_EXCEPTION_INFORMATION* ) Field( Vmcs, VMCS_CTRL_VIRTUALIZATION_EXCEPTION_INFORMATION_ADDRESS );
+
+	if ( !Info || Info->ExceptionMask )
+		return false;
+
+	Gate = &( ( const SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64* ) Field( Vmcs, VMCS_GUEST_IDTR_BASE ) )[VirtualizationException];
+
+	if ( !Gate->Present || ( ( UINT64 ) Gate->OffsetHigh << 32 | ( UINT64 ) Gate->OffsetMiddle << 16 | Gate->OffsetLow ) != ( UINT64 ) vmx::__vmx_ve_isr )
+		return false;
+
+	Info->Reason = vmexit_ept_violation;
+	Info->ExceptionMask = MAXUINT32;
+	Info->Exit = Qualification;
+	Info->GuestLinearAddress = 0;
+	Info->GuestPhysicalAddress = GuestPhysical;
+	Info->CurrentEptpIndex = ( UINT16 ) Field( Vmcs, VMCS_CTRL_EPTP_INDEX );
+
+	vmx::__vmx_ve_isr();
+
+	return true;
+}
+
+
+//
+// Without EPT the access goes through. After a #VE the access is done again, in the view the handler left
+//
+int sim::GuestAccess( ExitEvent* Exit, UINT64 GuestPhysical, UINT32 Access, bool* Exited )
+{
+	FieldStore* Vmcs = Cpu.Current;
+	UINT64 Allowed;
+	UINT64 Last = 0;
+
+	if ( !Cpu.VmxOn || !Vmcs || !Vmcs->Launched )
+		return -1;
+
+	*Exited = false;
+
+	if ( !( Field( Vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & SIM_CTLS2_EPT ) )
+		return 1;
+
+	for ( ;; )
+	{
+		Allowed = WalkEpt( Vmcs, GuestPhysical, &Last );
+
+		if ( !( Access & ~Allowed ) )
+			return 1;
+
+		if ( !DeliverVe( Vmcs, Access | ( Allowed << 3 ), GuestPhysical, Last ) )
+			break;
+	}
+
+	*Exited = true;
+	Exit->Reason = vmexit_ept_violation;
+	Exit->InstructionLength = 0;
+	Exit->Qualification = Access | ( Allowed << 3 );
+	Exit->GuestPhysicalAddress = GuestPhysical;
+
+	return InjectExit( Exit );
+}
+
+UINT64 sim::InveptCount()
+{
+	return Sim().Inveptions;
+}
+
+
+//
+// Same policy as Hypervisor::VMXExitHandler
+//
+static int HostExitHandler( GCPUContext* context, void* Args, VMX_VMEXIT_REASON ExitReason )
+{
+	UNREFERENCED_PARAMETER( Args );
+
+	switch ( ExitReason.BasicExitReason )
+	{
+	case vmexit_cpuid:
+		vmx::vm::HandleCPUID( context, true );
+		return 1;
+	case vmexit_control_register_access:
+		return vmx::vm::HandleCRAccess( context );
+	}
+
+	return 0;
+}
+
+
+vCPU* sim::AllocateVCPU( int Index, GlobalState* State )
+{
+	vCPU* vcpu = new ( std::align_val_t( PAGE_SIZE ) ) vCPU;
+
+	memset( vcpu, 0, sizeof( vCPU ) );
+	vcpu->CpuNumber = Index;
+	vcpu->ProcessorNumber.Number = ( UCHAR ) Index;
+	vcpu->HostState.StackSize = HOST_STACK_SIZE;
+	vcpu->HostState.RSP = ( UINT64 ) vcpu->HostStack;
+	vcpu->state = State;
+
+	return vcpu;
+}
+
+void sim::FreeVCPU( vCPU* vcpu )
+{
+	operator delete( vcpu, std::align_val_t( PAGE_SIZE ) );
+}
+
+bool sim::Virtualize( vCPU* vcpu )
+{
+	if ( !vmx::Enable() || !vmx::StartVMX( vcpu ) )
+		return false;
+
+	if ( !vmx::ConfigureVMCS( vcpu ) )
+	{
+		vmx::AbortVMX( vcpu );
+		return false;
+	}
+
+	vcpu->Launched = true;
+
+	if ( vmx::VMLaunch( vcpu, HostExitHandler, nullptr, Sim().ExitBitMap ) )
+	{
+		vcpu->Launched = false;
+		vmx::AbortVMX( vcpu );
+		return false;
+	}
+
+	return true;
+}
+
+
+//
+// Kernel routines
+//
+ULONG DbgPrint( const char* Format, ... )
+{
+	va_list Args;
+
+	if ( !Sim().Logging )
+		return 0;
+
+	va_start( Args, Format );
+	vfprintf( stderr, Format, Args );
+	va_end( Args );
+
+	return 0;
+}
+
+PHYSICAL_ADDRESS MmGetPhysicalAddress( PVOID BaseAddress )
+{
+	PHYSICAL_ADDRESS Address;
+
+	Address.QuadPart = ( long long ) BaseAddress;
+
+	return Address;
+}
+
+
+//
+// VMX instructions, physical addresses are identity mapped
+//
+unsigned char __vmx_on( UINT64* VmsSupportPhysicalAddress )
+{
+	VMXON* Region = ( VMXON* ) *VmsSupportPhysicalAddress;
+	IA32_VMX_BASIC_REGISTER Basic;
+
+	if ( Cpu.VmxOn )
+		return FailValid( VMX_ERROR_VMXON_IN_VMX_ROOT_OP );
+
+	Basic.AsUInt = __readmsr( IA32_VMX_BASIC );
+
+	if ( !( Cpu.Cr4 & SIM_CR4_VMXE ) || !Region || Region->RevisionId != Basic.VmcsRevisionId )
+		return FailInvalid();
+
+	Cpu.VmxOn = true;
+	Cpu.Current = nullptr;
+
+	return Succeed();
+}
+
+void __vmx_off()
+{
+	Cpu.VmxOn = false;
+	Cpu.Current = nullptr;
+	Succeed();
+}
+
+unsigned char __vmx_vmclear( UINT64* VmcsPhysicalAddress )
+{
+	FieldStore* Vmcs;
+
+	if ( !Cpu.VmxOn || !*VmcsPhysicalAddress )
+		return FailInvalid();
+
+	Vmcs = LookupVmcs( *VmcsPhysicalAddress );
+	Vmcs->Launched = false;
+
+	if ( Cpu.Current == Vmcs )
+		Cpu.Current = nullptr;
+
+	return Succeed();
+}
+
+unsigned char __vmx_vmptrld( UINT64* VmcsPhysicalAddress )
+{
+	VMCS* Region = ( VMCS* ) *VmcsPhysicalAddress;
+	IA32_VMX_BASIC_REGISTER Basic;
+
+	if ( !Cpu.VmxOn || !Region )
+		return FailInvalid();
+
+	Basic.AsUInt = __readmsr( IA32_VMX_BASIC );
+
+	if ( Region->RevisionId != Basic.VmcsRevisionId )
+		return FailValid( VMX_ERROR_VMPTRLD_INCORRECT_VMCS_REVISION_ID );
+
+	Cpu.Current = LookupVmcs( *VmcsPhysicalAddress );
+
+	return Succeed();
+}
+
+unsigned char __vmx_vmread( size_t Field, unsigned long long* FieldValue )
+{
+	if ( !Cpu.VmxOn || !Cpu.Current )
+		return FailInvalid();
+
+	*FieldValue = ::Field( Cpu.Current, Field );
+
+	return Succeed();
+}
+
+unsigned char __vmx_vmread( size_t Field, unsigned long* FieldValue )
+{
+	unsigned long long Value = 0;
+	unsigned char status = __vmx_vmread( Field, &Value );
+
+	*FieldValue = ( unsigned long ) Value;
+
+	return status;
+}
+
+unsigned char __vmx_vmwrite( size_t Field, size_t FieldValue )
+{
+	if ( !Cpu.VmxOn || !Cpu.Current )
+		return FailInvalid();
+
+	//
+	// Type 1 fields are the read-only exit information
+	//
+	if ( ( ( Field >> 10 ) & 3 ) == 1 )
+		return FailValid( VMX_ERROR_VMWRITE_READONLY_COMPONENT );
+
+	::Field( Cpu.Current, Field ) = FieldValue;
+
+	return Succeed();
+}
+
+
+//
+// The guest starts right after the __vmx_launch call, like the asm version does through launch_resume
+//
+extern "C" int vmx::__vmx_launch( LaunchContext* Context )
+{
+	FieldStore* Vmcs = Cpu.Current;
+
+	if ( !Cpu.VmxOn || !Vmcs )
+	{
+		FailInvalid();
+		return 1;
+	}
+
+	if ( Vmcs->Launched )
+	{
+		FailValid( VMX_ERROR_VMLAUCH_NON_CLEAR_VMCS );
+		return 2;
+	}
+
+	if ( Field( Vmcs, VMCS_GUEST_VMCS_LINK_POINTER ) != MAXUINT64 )
+	{
+		FailValid( VMX_ERROR_VMENTRY_INVALID_CONTROL_FIELDS );
+		return 2;
+	}
+
+	if ( !Field( Vmcs, VMCS_HOST_RSP ) || Field( Vmcs, VMCS_HOST_RIP ) != ( UINT64 ) vmx::__vmx_default_exit_handler )
+	{
+		FailValid( VMX_ERROR_VMENTRY_INVALID_HOST_STATE );
+		return 2;
+	}
+
+	Context->rsp = ( UINT64 ) __builtin_frame_address( 0 );
+	Context->rflags = Cpu.Rflags;
+
+	Field( Vmcs, VMCS_GUEST_RSP ) = Context->rsp;
+	Field( Vmcs, VMCS_GUEST_RIP ) = ( UINT64 ) __builtin_return_address( 0 );
+	Field( Vmcs, VMCS_GUEST_RFLAGS ) = Context->rflags;
+	Vmcs->Launched = true;
+
+	Succeed();
+
+	return 0;
+}
+
+//
+// Only its address is used, as VMCS_HOST_RIP. Exits are delivered by sim::InjectExit
+//
+extern "C" int vmx::__vmx_default_exit_handler()
+{
+	__builtin_trap();
+}
+
+//
+// Only their addresses are used, in the host IDT gates. Nothing raises exceptions in root mode here
+//
+static void HostIsr()
+{
+	__builtin_trap();
+}
+
+#define HOST_ISR ( UINT64 ) &HostIsr
+
+extern "C" const UINT64 vmx::__vmx_host_isr_table[HOST_EXCEPTION_VECTORS + 1] =
+{
+	HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR,
+	HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR,
+	HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR,
+	HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR, HOST_ISR,
+	HOST_ISR,
+};
+
+extern "C" void vmx::__vmx_host_fault_resume()
+{
+	__builtin_trap();
+}
+
+//
+// The sim has no task register, the descriptor is still checked and marked busy like LTR does
+//
+extern "C" void vmx::__load_tr( UINT16 Selector )
+{
+	if ( ( ReadDescriptor( Selector ) >> 40 & 0xF ) != SEGMENT_DESCRIPTOR_TYPE_TSS_AVAILABLE )
+		__builtin_trap();
+
+	( ( UINT64* ) Cpu.Gdtr.BaseAddress )[Selector >> 3] |= 2ULL << 40;
+}
+
+//
+// The sim doesn't model NMI blocking
+//
+extern "C" void vmx::__unblock_nmi()
+{
+}
+
+extern "C" UINT64 vmx::__vmcall( UINT64 Hypercall, UINT64 Arg1, UINT64 Arg2 )
+{
+	sim::ExitEvent Exit = {};
+
+	//
+	// Outside VMX non-root operation VMCALL raises #UD, reported as an invalid hypercall
+	//
+	if ( !sim::IsLaunched() )
+		return MAXUINT64;
+
+	Exit.Reason = vmexit_vmcall;
+	Exit.InstructionLength = 3;
+	Exit.Regs.rcx = Hypercall;
+	Exit.Regs.rdx = Arg1;
+	Exit.Regs.r8 = Arg2;
+	Exit.Regs.rip = ( UINT64 ) __builtin_return_address( 0 );
+	Exit.Regs.rsp = ( UINT64 ) __builtin_frame_address( 0 );
+	Exit.Regs.rflags = Cpu.Rflags;
+
+	sim::InjectExit( &Exit );
+
+	return Exit.Regs.rax;
+}
+
+//
+// Only the type and the descriptor are checked, the sim has no translation to flush
+//
+extern "C" unsigned char vmx::__invept( UINT64 Type, const INVEPT_DESCRIPTOR* Descriptor )
+{
+	if ( !Cpu.VmxOn )
+		return FailInvalid();
+
+	if ( ( Type != InveptSingleContext && Type != InveptAllContext ) || ( Type == InveptSingleContext && !Descriptor->EptPointer ) )
+		return FailValid( VMX_ERROR_INVEPT_INVVPID_INVALID_OPERAND );
+
+	Sim().Inveptions++;
+
+	return Succeed();
+}
+
+//
+// VMFUNC 0 with a valid list entry switches the EPTP without an exit, anything else exits. Without the VM functions
+// control it raises #UD, not modelled: nothing happens
+//
+extern "C" void vmx::__vmfunc( UINT32 Function, UINT32 Index )
+{
+	FieldStore* Vmcs = Cpu.Current;
+	sim::ExitEvent Exit = {};
+
+	if ( !sim::IsLaunched() || !( Field( Vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & SIM_CTLS2_VMFUNC ) )
+		return;
+
+	if ( Function == 0 && ( Field( Vmcs, VMCS_CTRL_VMFUNC_CONTROLS ) & IA32_VMX_VMFUNC_EPTP_SWITCHING_FLAG ) && Index < EPTP_LIST_ENTRIES )
+	{
+		EPT_POINTER Eptp;
+
+		Eptp.AsUInt = ( ( UINT64* ) Field( Vmcs, VMCS_CTRL_EPT_POINTER_LIST_ADDRESS ) )[Index];
+
+		if ( Eptp.AsUInt && Eptp.PageWalkLength == 3 )
+		{
+			Field( Vmcs, VMCS_CTRL_EPT_POINTER ) = Eptp.AsUInt;
+
+			if ( Field( Vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & SIM_CTLS2_VE )
+				Field( Vmcs, VMCS_CTRL_EPTP_INDEX ) = Index;
+
+			return;
+		}
+	}
+
+	Exit.Reason = vmexit_vmfunc;
+	Exit.InstructionLength = 3;
+	Exit.Regs.rax = Function;
+	Exit.Regs.rcx = Index;
+	Exit.Regs.rip = ( UINT64 ) __builtin_return_address( 0 );
+	Exit.Regs.rsp = ( UINT64 ) __builtin_frame_address( 0 );
+	Exit.Regs.rflags = Cpu.Rflags;
+
+	sim::InjectExit( &Exit );
+}
+
+//
+// The #VE handler runs on the thread of the guest, the vCPU is found from the host stack like in InjectExit
+//
+extern "C" void vmx::__vmx_ve_isr()
+{
+	GCPUContext* Context = ( GCPUContext* ) ( Field( Cpu.Current, VMCS_HOST_RSP ) - FIELD_OFFSET( GCPUContext, ExtRegs ) );
+
+	vmx::ept::HandleVe( Context->vcpu );
+}
+
+
+//
+// MSRs and CPUID
+//
+UINT64 __readmsr( ULONG Register )
+{
+	auto Msr = Cpu.Msrs.find( Register );
+
+	return Msr != Cpu.Msrs.end() ? Msr->second : 0;
+}
+
+void __writemsr( ULONG Register, UINT64 Value )
+{
+	Cpu.Msrs[Register] = Value;
+}
+
+//
+// An MSR the platform doesn't have raises #GP, the sim returns through the fixup right away
+//
+extern "C" unsigned char vmx::__vmx_rdmsr_safe( UINT32 Msr, UINT64* Value )
+{
+	auto Entry = Cpu.Msrs.find( Msr );
+
+	if ( Entry == Cpu.Msrs.end() )
+		return 1;
+
+	*Value = Entry->second;
+
+	return 0;
+}
+
+extern "C" unsigned char vmx::__vmx_wrmsr_safe( UINT32 Msr, UINT64 Value )
+{
+	if ( Cpu.Msrs.find( Msr ) == Cpu.Msrs.end() )
+		return 1;
+
+	Cpu.Msrs[Msr] = Value;
+
+	return 0;
+}
+
+extern "C" const BYTE vmx::__vmx_msr_read[1] = { 0 };
+extern "C" const BYTE vmx::__vmx_msr_write[1] = { 0 };
+extern "C" void vmx::__vmx_msr_fault() {}
+
+void __cpuidex( int CpuInfo[4], int FunctionId, int SubFunctionId )
+{
+	Platform& platform = Sim();
+	std::lock_guard<std::mutex> guard( platform.Lock );
+	auto Leaf = platform.Cpuid.find( { FunctionId, SubFunctionId } );
+
+	if ( Leaf == platform.Cpuid.end() )
+		Leaf = platform.Cpuid.find( { FunctionId, -1 } );
+
+	for ( int i = 0; i < 4; i++ )
+		CpuInfo[i] = Leaf != platform.Cpuid.end() ? Leaf->second[i] : 0;
+}
+
+void __cpuid( int CpuInfo[4], int FunctionId )
+{
+	__cpuidex( CpuInfo, FunctionId, 0 );
+}
+
+
+//
+// Port I/O, on the platform latches
+//
+unsigned char __inbyte( unsigned short Port ) { return ( unsigned char ) sim::GetPort( Port ); }
+unsigned short __inword( unsigned short Port ) { return ( unsigned short ) sim::GetPort( Port ); }
+unsigned long __indword( unsigned short Port ) { return ( unsigned long ) sim::GetPort( Port ); }
+void __outbyte( unsigned short Port, unsigned char Data ) { sim::SetPort( Port, Data ); }
+void __outword( unsigned short Port, unsigned short Data ) { sim::SetPort( Port, Data ); }
+void __outdword( unsigned short Port, unsigned long Data ) { sim::SetPort( Port, ( UINT32 ) Data ); }
+
+
+//
+// Control registers, flags and descriptor tables of the current processor
+//
+UINT64 __readcr0() { return Cpu.Cr0; }
+UINT64 __readcr2() { return Cpu.Cr2; }
+UINT64 __readcr3() { return Cpu.Cr3; }
+UINT64 __readcr4() { return Cpu.Cr4; }
+void __writecr0( UINT64 Data ) { Cpu.Cr0 = Data; }
+void __writecr2( UINT64 Data ) { Cpu.Cr2 = Data; }
+void __writecr3( UINT64 Data ) { Cpu.Cr3 = Data; }
+void __writecr4( UINT64 Data ) { Cpu.Cr4 = Data; }
+UINT64 __readeflags() { return Cpu.Rflags; }
+void _disable() { Cpu.Rflags &= ~RFLAGS_INTERRUPT_ENABLE_FLAG_FLAG; }
+void _enable() { Cpu.Rflags |= RFLAGS_INTERRUPT_ENABLE_FLAG_FLAG; }
+
+UINT64 __rdtsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+}
+
+void _lgdt( void* Source ) { memcpy( &Cpu.Gdtr, Source, sizeof( Cpu.Gdtr ) ); }
+void _sgdt( void* Destination ) { memcpy( Destination, &Cpu.Gdtr, sizeof( Cpu.Gdtr ) ); }
+void __lidt( void* Source ) { memcpy( &Cpu.Idtr, Source, sizeof( Cpu.Idtr ) ); }
+void __sidt( void* Destination ) { memcpy( Destination, &Cpu.Idtr, sizeof( Cpu.Idtr ) ); }
+
+
+//
+// Same output as the asm version: selectors, LAR/LSL of each (0 when not valid), descriptor tables, CRs and MSRs
+//
+extern "C" void __capture_cpu_snapshot( CpuSnapshot* Snapshot )
+{
+	static const UINT16 Selectors[SnapshotSegmentCount] = { 0x2B, 0x10, 0x18, 0x2B, 0x53, 0x2B, 0x00, 0x40 };
+
+	for ( int i = 0; i < SnapshotSegmentCount; i++ )
+	{
+		SegmentSnapshot* Segment = &Snapshot->Segments[i];
+		UINT64 Descriptor = ReadDescriptor( Selectors[i] );
+		UINT32 Limit = ( UINT32 ) ( ( Descriptor & 0xFFFF ) | ( ( Descriptor >> 32 ) & 0xF0000 ) );
+
+		if ( Descriptor & ( 1ULL << 55 ) )
+			Limit = ( Limit << 12 ) | 0xFFF;
+
+		Segment->Selector = Selectors[i];
+		Segment->AccessRights = Descriptor ? ( UINT32 ) ( ( Descriptor >> 32 ) & 0x00F0FF00 ) : 0;
+		Segment->Limit = Descriptor ? Limit : 0;
+	}
+
+	Snapshot->GDTR.Limit = Cpu.Gdtr.Limit;
+	Snapshot->GDTR.Base = Cpu.Gdtr.BaseAddress;
+	Snapshot->IDTR.Limit = Cpu.Idtr.Limit;
+	Snapshot->IDTR.Base = Cpu.Idtr.BaseAddress;
+
+	Snapshot->Cr0 = Cpu.Cr0;
+	Snapshot->Cr3 = Cpu.Cr3;
+	Snapshot->Cr4 = Cpu.Cr4;
+	Snapshot->Dr7 = 0x400;
+	Snapshot->Rflags = Cpu.Rflags;
+
+	Snapshot->DebugCtl = __readmsr( IA32_DEBUGCTL );
+	Snapshot->SysenterCs = __readmsr( IA32_SYSENTER_CS );
+	Snapshot->SysenterEsp = __readmsr( IA32_SYSENTER_ESP );
+	Snapshot->SysenterEip = __readmsr( IA32_SYSENTER_EIP );
+	Snapshot->FsBase = __readmsr( IA32_FS_BASE );
+	Snapshot->GsBase = __readmsr( IA32_GS_BASE );
+	Snapshot->Efer = __readmsr( IA32_EFER );
+	Snapshot->Pat = __readmsr( IA32_PAT );
+}
@@ -0,0 +1,287 @@
+#include "vmx/vmx.h"
+
+
+static UINT32 HashPage( UINT64 Page )
+{
+	return ( UINT32 ) ( ( Page * 0x9E3779B97F4A7C15ULL ) >> 51 ) & ( COVERAGE_SLOTS - 1 );
+}
+
+static_assert( COVERAGE_SLOTS == 8192, "HashPage takes 13 bits" );
+
+
+static INT32 Lookup( const ExecutionCoverage* Coverage, UINT64 GuestPhysical )
+{
+	UINT64 Page = ( GuestPhysical >> PAGE_SHIFT ) + 1;
+
+	for ( UINT32 i = HashPage( Page ); Coverage->Pages[i]; i = ( i + 1 ) & ( COVERAGE_SLOTS - 1 ) )
+	{
+		if ( Coverage->Pages[i] == Page )
+			return ( INT32 ) i;
+	}
+
+	return COVERAGE_NO_SLOT;
+}
+
+
+UINT32 vmx::coverage::Tables( UINT64 PhysicalLimit )
+{
+	UINT64 Directories = ( PhysicalLimit + ( 1ULL << 30 ) - 1 ) >> 30;
+	UINT64 Pdpts = ( PhysicalLimit + ( 1ULL << 39 ) - 1 ) >> 39;
+
+	return ( UINT32 ) ( 1 + MAX_COVERED_PAGES + ( Directories < MAX_COVERED_PAGES ? Directories : MAX_COVERED_PAGES ) +
+		( Pdpts < MAX_COVERED_PAGES ? Pdpts : MAX_COVERED_PAGES ) );
+}
+
+
+bool vmx::coverage::Setup( GlobalState* state, UINT32 View )
+{
+	ExecutionCoverage* Coverage = &state->Coverage;
+
+	if ( !View || View >= state->Ept.ViewCount || Coverage->View )
+		return false;
+
+	Coverage->View = View;
+
+	return true;
+}
+
+
+//
+// The slot and its right are in the table before the page loses the right, the first access always finds them. A page
+// SetPage couldn't change keeps its slot, removed, so the probes of the others go on past it
+//
+static bool Track( GlobalState* state, UINT64 GuestPhysical, UINT32 Right )
+{
+	ExecutionCoverage* Coverage = &state->Coverage;
+	UINT64 Page = ( GuestPhysical >> PAGE_SHIFT ) + 1;
+	UINT64 Physical;
+	UINT64 Size;
+	UINT32 Access;
+	UINT32 Type;
+	INT32 Slot;
+	bool Shared;
+
+	if ( !Coverage->View )
+		return false;
+
+	GuestPhysical &= ~( ( UINT64 ) PAGE_SIZE - 1 );
+
+	if ( !vmx::ept::GetPage( &state->Ept, Coverage->View, GuestPhysical, &Physical, &Access, &Type, &Size ) ||
+		( Access & ( EPT_READ | Right ) ) != ( EPT_READ | Right ) )
+		return false;
+
+	Slot = Lookup( Coverage, GuestPhysical );
+	Shared = Slot != COVERAGE_NO_SLOT;
+
+	if ( Shared && ( Coverage->Rights[Slot] & Right ) )
+		return false;
+
+	if ( !Shared )
+	{
+		if ( Coverage->Count == MAX_COVERED_PAGES )
+			return false;
+
+		for ( Slot = HashPage( Page ); Coverage->Pages[Slot]; Slot = ( Slot + 1 ) & ( COVERAGE_SLOTS - 1 ) )
+			;
+
+		Coverage->Pages[Slot] = Page;
+		Coverage->Count++;
+	}
+
+	Coverage->Rights[Slot] |= ( UINT8 ) Right;
+	KeMemoryBarrier();
+
+	//
+	// Not convertible: the access has to exit, a #VE would only take the processor out of the view
+	//
+	if ( !vmx::ept::SetPage( &state->Ept, Coverage->View, GuestPhysical, Physical, Access & EPT_ACCESS_ALL & ~Right ) )
+	{
+		Coverage->Rights[Slot] &= ( UINT8 ) ~Right;
+
+		if ( !Shared )
+			Coverage->Pages[Slot] = COVERAGE_SLOT_REMOVED;
+
+		return false;
+	}
+
+	return true;
+}
+
+
+bool vmx::coverage::Cover( GlobalState* state, UINT64 GuestPhysical )
+{
+	return Track( state, GuestPhysical, EPT_EXECUTE );
+}
+
+
+bool vmx::coverage::TrackWrites( GlobalState* state, UINT64 GuestPhysical )
+{
+	return Track( state, GuestPhysical, EPT_WRITE );
+}
+
+
+//
+// A word of bits at a time: the bits are cleared before the pages lose execute, a page fetched in between is either
+// recorded again or still executable with its bit set
+//
+UINT32 vmx::coverage::Reset( GlobalState* state )
+{
+	ExecutionCoverage* Coverage = &state->Coverage;
+	UINT32 Count = 0;
+
+	if ( !Coverage->View )
+		return 0;
+
+	for ( UINT32 i = 0; i < COVERAGE_SLOTS / 64; i++ )
+	{
+		UINT64 Bits = ( UINT64 ) InterlockedExchange64( &Coverage->Executed[i], 0 );
+
+		for ( UINT32 Bit = 0; Bits; Bit++, Bits >>= 1 )
+		{
+			UINT64* Entry;
+
+			if ( !( Bits & 1 ) )
+				continue;
+
+			Entry = vmx::ept::PageEntry( &state->Ept, Coverage->View, ( Coverage->Pages[i * 64 + Bit] - 1 ) << PAGE_SHIFT );
+
+			if ( Entry )
+				InterlockedAnd64( ( volatile LONG64* ) Entry, ~( LONG64 ) EPT_EXECUTE );
+
+			Count++;
+		}
+	}
+
+	Coverage->Resets++;
+
+	return Count;
+}
+
+
+//
+// Only the bits reported are cleared, a page written after its word was read keeps its bit for the next drain. The bit
+// goes before write does: a write in between went through a translation the kick flushes, and the caller reads the
+// page after the kick
+//
+UINT32 vmx::coverage::Drain( GlobalState* state, UINT64* Pages, UINT32 Max )
+{
+	ExecutionCoverage* Coverage = &state->Coverage;
+	UINT32 Count = 0;
+
+	if ( !Coverage->View )
+		return 0;
+
+	for ( UINT32 i = 0; i < COVERAGE_SLOTS / 64 && Count < Max; i++ )
+	{
+		UINT64 Bits = ( UINT64 ) Coverage->Written[i];
+		UINT64 Taken = 0;
+
+		for ( UINT32 Bit = 0; Bits && Count < Max; Bit++, Bits >>= 1 )
+		{
+			if ( !( Bits & 1 ) )
+				continue;
+
+			Pages[Count++] = ( Coverage->Pages[i * 64 + Bit] - 1 ) << PAGE_SHIFT;
+			Taken |= 1ULL << Bit;
+		}
+
+		if ( !Taken )
+			continue;
+
+		InterlockedAnd64( &Coverage->Written[i], ~( LONG64 ) Taken );
+
+		for ( UINT32 Bit = 0; Taken; Bit++, Taken >>= 1 )
+		{
+			UINT64* Entry;
+
+			if ( !( Taken & 1 ) )
+				continue;
+
+			Entry = vmx::ept::PageEntry( &state->Ept, Coverage->View, ( Coverage->Pages[i * 64 + Bit] - 1 ) << PAGE_SHIFT );
+
+			if ( Entry )
+				InterlockedAnd64( ( volatile LONG64* ) Entry, ~( LONG64 ) EPT_WRITE );
+		}
+	}
+
+	Coverage->Drains++;
+
+	return Count;
+}
+
+
+UINT32 vmx::coverage::Collect( const ExecutionCoverage* Coverage, UINT64* Pages, UINT32 Max )
+{
+	UINT32 Count = 0;
+
+	for ( UINT32 i = 0; i < COVERAGE_SLOTS / 64; i++ )
+	{
+		UINT64 Bits = ( UINT64 ) Coverage->Executed[i];
+
+		for ( UINT32 Bit = 0; Bits; Bit++, Bits >>= 1 )
+		{
+			if ( !( Bits & 1 ) )
+				continue;
+
+			if ( Count < Max )
+				Pages[Count] = ( Coverage->Pages[i * 64 + Bit] - 1 ) << PAGE_SHIFT;
+
+			Count++;
+		}
+	}
+
+	return Count;
+}
+
+
+//
+// A vCPU in another view was put there on purpose and stays, one back in view 0 after a violation rejoins
+//
+void vmx::coverage::Apply( vCPU* vcpu )
+{
+	UINT32 View = vcpu->state->Coverage.View;
+
+	if ( View && vmx::ept::CurrentView( vcpu ) == 0 )
+		vmx::ept::SwitchView( vcpu, View );
+}
+
+
+//
+// The right comes back before the bit is set, see Reset and Drain. The violation dropped the translations of the page
+// on this processor, the others fault at most once more on a stale one and find the bit set
+//
+bool vmx::coverage::Record( vCPU* vcpu, UINT64 GuestPhysical, UINT32 Right )
+{
+	ExecutionCoverage* Coverage = &vcpu->state->Coverage;
+	volatile LONG64* Bits = Right == EPT_WRITE ? Coverage->Written : Coverage->Executed;
+	UINT64* Entry;
+	LONG64 Bit;
+	INT32 Slot;
+
+	if ( !Coverage->View || vmx::ept::CurrentView( vcpu ) != ( INT32 ) Coverage->View )
+		return false;
+
+	Slot = Lookup( Coverage, GuestPhysical );
+
+	if ( Slot == COVERAGE_NO_SLOT || !( Coverage->Rights[Slot] & Right ) )
+		return false;
+
+	Entry = vmx::ept::PageEntry( &vcpu->state->Ept, Coverage->View, GuestPhysical );
+
+	if ( !Entry )
+		return false;
+
+	InterlockedOr64( ( volatile LONG64* ) Entry, Right );
+
+	Bit = ( LONG64 ) ( 1ULL << ( Slot % 64 ) );
+
+	if ( InterlockedOr64( &Bits[Slot / 64], Bit ) & Bit )
+		return true;
+
+	if ( Right == EPT_WRITE )
+		vcpu->Ept.DirtyHits++;
+	else
+		vcpu->Ept.CoverageHits++;
+
+	return true;
+}
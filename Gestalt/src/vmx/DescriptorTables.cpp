@@ -0,0 +1,315 @@
+#include "vmx/vmx.h"
+
+
+static const char* DescriptorInstructionNames[DescriptorInstructionCount] =
+{
+	"SGDT", "SIDT", "LGDT", "LIDT", "SLDT", "STR", "LLDT", "LTR"
+};
+
+const char* vmx::dt::InstructionName( DESCRIPTOR_INSTRUCTION Instruction )
+{
+	return Instruction < DescriptorInstructionCount ? DescriptorInstructionNames[Instruction] : "?";
+}
+
+
+void vmx::dt::SetShadow( DescriptorShadow* Shadow, UINT64 Base, UINT16 Limit, bool Active )
+{
+	Shadow->Base = Base;
+	Shadow->Limit = Limit;
+	Shadow->Active = Active;
+}
+
+
+//
+// The instruction faults instead of completing, RIP stays on it
+//
+static int Fault( GCPUContext* context, UINT32 Vector, UINT32 ErrorCode )
+{
+	context->vcpu->DescriptorTables.Faults++;
+	vmx::events::QueueException( &context->vcpu->Injection, Vector, true, ErrorCode );
+
+	return -1;
+}
+
+
+//
+// Read or write Size bytes of guest memory with the rights of the guest CPL (as with CR0.WP set). Every page is checked
+// before anything is written, the guest gets the #PF of the first one it can't access.
+// Returns 1 when done, -1 when a fault is queued and 0 without a direct map to reach guest memory
+//
+static int AccessOperand( GCPUContext* context, UINT64 Address, void* Buffer, SIZE_T Size, bool Write )
+{
+	vCPU* vcpu = context->vcpu;
+	GuestTranslation Translation;
+	PAGE_FAULT_EXCEPTION ErrorCode;
+	VMX_SEGMENT_ACCESS_RIGHTS Ss;
+	size_t Cr3;
+	size_t Cr4;
+	size_t Value;
+	UINT64 Page = Address;
+	bool User;
+	bool Done;
+
+	if ( !vcpu->state->Host.Cr3 )
+		return 0;
+
+	__vmx_vmread( VMCS_GUEST_CR3, &Cr3 );
+	__vmx_vmread( VMCS_GUEST_CR4, &Cr4 );
+	__vmx_vmread( VMCS_GUEST_SS_ACCESS_RIGHTS, &Value );
+	Ss.AsUInt = ( UINT32 ) Value;
+	User = Ss.DescriptorPrivilegeLevel == 3;
+
+	do
+	{
+		GUEST_WALK_STATUS Status = vmx::guest::Translate( &vcpu->Translations, &vcpu->state->Host, Cr3, Cr4, Page, &Translation );
+
+		if ( Status == GuestWalkNonCanonical )
+			return Fault( context, GeneralProtection, 0 );
+
+		if ( Status != GuestWalkOk || ( Write && !Translation.Writable ) || ( User && !Translation.User ) )
+		{
+			ErrorCode.AsUInt = 0;
+			ErrorCode.Present = Status == GuestWalkOk;
+			ErrorCode.Write = Write;
+			ErrorCode.UserModeAccess = User;
+
+			//
+			// VMX doesn't switch CR2, the guest sees this value
+			//
+			__writecr2( Page );
+
+			return Fault( context, PageFault, ErrorCode.AsUInt );
+		}
+
+		Done = ( Page | ( PAGE_SIZE - 1 ) ) >= Address + Size - 1;
+		Page = ( Page & ~( UINT64 ) ( PAGE_SIZE - 1 ) ) + PAGE_SIZE;
+	} while ( !Done );
+
+	if ( Write )
+		Done = vmx::guest::WriteVirtual( &vcpu->Translations, &vcpu->state->Host, Cr3, Cr4, Address, Buffer, Size );
+	else
+		Done = vmx::guest::ReadVirtual( &vcpu->Translations, &vcpu->state->Host, Cr3, Cr4, Address, Buffer, Size );
+
+	return Done ? 1 : 0;
+}
+
+
+//
+// SGDT/SIDT store the limit and a 64-bit base in 64-bit mode, a 32-bit base otherwise (24 bits with a 16-bit operand for
+// LGDT/LIDT). The shadow, when there is one, is what SGDT/SIDT see
+//
+int vmx::dt::HandleGdtrIdtrAccess( GCPUContext* context )
+{
+	DescriptorTableExits* Exits = &context->vcpu->DescriptorTables;
+	VMX_VMEXIT_INSTRUCTION_INFO_GDTR_IDTR_ACCESS Info;
+	VMX_SEGMENT_ACCESS_RIGHTS Cs;
+	DescriptorShadow* Shadow;
+	BYTE Operand[10];
+	UINT64 Start = __rdtsc();
+	UINT64 Address;
+	UINT64 Base;
+	size_t Value;
+	size_t Limit;
+	SIZE_T Size;
+	bool Idt;
+	int status;
+
+	__vmx_vmread( VMCS_VMEXIT_INSTRUCTION_INFO, &Value );
+	Info.AsUInt = Value;
+	__vmx_vmread( VMCS_GUEST_CS_ACCESS_RIGHTS, &Value );
+	Cs.AsUInt = ( UINT32 ) Value;
+
+	Idt = Info.Instruction == DescriptorSidt || Info.Instruction == DescriptorLidt;
+	Shadow = Idt ? &Exits->Idt : &Exits->Gdt;
+	Address = vmx::vm::OperandAddress( context, Info.AsUInt );
+	Size = Cs.LongMode ? sizeof( Operand ) : 6;
+
+	if ( Info.Instruction == DescriptorSgdt || Info.Instruction == DescriptorSidt )
+	{
+		if ( Shadow->Active )
+		{
+			Base = Shadow->Base;
+			Limit = Shadow->Limit;
+		}
+		else
+		{
+			__vmx_vmread( Idt ? VMCS_GUEST_IDTR_BASE : VMCS_GUEST_GDTR_BASE, &Value );
+			Base = Value;
+			__vmx_vmread( Idt ? VMCS_GUEST_IDTR_LIMIT : VMCS_GUEST_GDTR_LIMIT, &Limit );
+		}
+
+		*( UINT16* ) Operand = ( UINT16 ) Limit;
+		RtlCopyMemory( Operand + 2, &Base, sizeof( Base ) );
+
+		status = AccessOperand( context, Address, Operand, Size, true );
+	}
+	else
+	{
+		status = AccessOperand( context, Address, Operand, Size, false );
+
+		if ( status > 0 )
+		{
+			RtlCopyMemory( &Base, Operand + 2, sizeof( Base ) );
+
+			if ( !Cs.LongMode )
+				Base &= Info.OperandSize ? MAXUINT32 : 0xFFFFFF;
+
+			//
+			// With #VE the guest keeps running on a copy, of the table it loads now
+			//
+			if ( Idt && context->vcpu->state->Ept.VeDelivery )
+			{
+				vmx::ept::ReloadVe( context->vcpu, Base, *( UINT16* ) Operand );
+			}
+			else
+			{
+				__vmx_vmwrite( Idt ? VMCS_GUEST_IDTR_BASE : VMCS_GUEST_GDTR_BASE, Base );
+				__vmx_vmwrite( Idt ? VMCS_GUEST_IDTR_LIMIT : VMCS_GUEST_GDTR_LIMIT, *( UINT16* ) Operand );
+				Shadow->Active = false;
+			}
+		}
+	}
+
+	if ( status > 0 )
+		vmx::vm::NextInstruction( context );
+
+	Exits->Exits[Info.Instruction]++;
+	Exits->Cycles[Info.Instruction] += __rdtsc() - Start;
+
+	return status ? 1 : 0;
+}
+
+
+//
+// LLDT/LTR: the system descriptor comes from the guest GDT, LTR marks it busy like the processor does.
+// A null selector leaves LDTR unusable, it is a #GP for LTR
+//
+static int LoadSystemSegment( GCPUContext* context, UINT16 Selector, bool Tss )
+{
+	SEGMENT_DESCRIPTOR_64 Descriptor;
+	VMX_SEGMENT_ACCESS_RIGHTS AccessRights;
+	UINT32 ErrorCode = MASK_SELECTOR( Selector );
+	UINT64 Address;
+	UINT64 Base;
+	UINT32 Limit;
+	size_t GdtBase;
+	size_t GdtLimit;
+	int status;
+
+	if ( !ErrorCode && !Tss )
+	{
+		AccessRights.AsUInt = 0;
+		AccessRights.Unusable = 1;
+
+		__vmx_vmwrite( VMCS_GUEST_LDTR_SELECTOR, Selector );
+		__vmx_vmwrite( VMCS_GUEST_LDTR_ACCESS_RIGHTS, AccessRights.AsUInt );
+
+		return 1;
+	}
+
+	__vmx_vmread( VMCS_GUEST_GDTR_BASE, &GdtBase );
+	__vmx_vmread( VMCS_GUEST_GDTR_LIMIT, &GdtLimit );
+
+	if ( !ErrorCode || ( Selector & SEGMENT_SELECTOR_TABLE_FLAG ) || ErrorCode + sizeof( Descriptor ) - 1 > GdtLimit )
+		return Fault( context, GeneralProtection, ErrorCode );
+
+	Address = GdtBase + ErrorCode;
+	status = AccessOperand( context, Address, &Descriptor, sizeof( Descriptor ), false );
+
+	if ( status <= 0 )
+		return status;
+
+	if ( Descriptor.DescriptorType || Descriptor.Type != ( Tss ? SEGMENT_DESCRIPTOR_TYPE_TSS_AVAILABLE : SEGMENT_DESCRIPTOR_TYPE_LDT ) )
+		return Fault( context, GeneralProtection, ErrorCode );
+
+	if ( !Descriptor.Present )
+		return Fault( context, SegmentNotPresent, ErrorCode );
+
+	if ( Tss )
+	{
+		Descriptor.Type = SEGMENT_DESCRIPTOR_TYPE_TSS_BUSY;
+		status = AccessOperand( context, Address, &Descriptor, sizeof( UINT64 ), true );
+
+		if ( status <= 0 )
+			return status;
+	}
+
+	Base = Descriptor.BaseAddressLow | ( ( UINT64 ) Descriptor.BaseAddressMiddle << 16 ) |
+		( ( UINT64 ) Descriptor.BaseAddressHigh << 24 ) | ( ( UINT64 ) Descriptor.BaseAddressUpper << 32 );
+	Limit = Descriptor.SegmentLimitLow | ( Descriptor.SegmentLimitHigh << 16 );
+
+	if ( Descriptor.Granularity )
+		Limit = ( Limit << 12 ) | 0xFFF;
+
+	//
+	// Type, S, DPL and P, then AVL, L, D/B and G: the access rights format is bits 8 - 23 of the second dword
+	//
+	AccessRights.AsUInt = ( Descriptor.AsUInt >> 8 ) & 0xF0FF;
+
+	__vmx_vmwrite( Tss ? VMCS_GUEST_TR_SELECTOR : VMCS_GUEST_LDTR_SELECTOR, Selector );
+	__vmx_vmwrite( Tss ? VMCS_GUEST_TR_BASE : VMCS_GUEST_LDTR_BASE, Base );
+	__vmx_vmwrite( Tss ? VMCS_GUEST_TR_LIMIT : VMCS_GUEST_LDTR_LIMIT, Limit );
+	__vmx_vmwrite( Tss ? VMCS_GUEST_TR_ACCESS_RIGHTS : VMCS_GUEST_LDTR_ACCESS_RIGHTS, AccessRights.AsUInt );
+
+	return 1;
+}
+
+
+//
+// SLDT/STR to a register zero-extend the selector to the full register, whatever the operand size
+//
+int vmx::dt::HandleLdtrTrAccess( GCPUContext* context )
+{
+	DescriptorTableExits* Exits = &context->vcpu->DescriptorTables;
+	VMX_VMEXIT_INSTRUCTION_INFO_LDTR_TR_ACCESS Info;
+	DESCRIPTOR_INSTRUCTION Instruction;
+	UINT64 Start = __rdtsc();
+	UINT64* Register = nullptr;
+	UINT16 Selector;
+	size_t Value;
+	int status = 1;
+
+	__vmx_vmread( VMCS_VMEXIT_INSTRUCTION_INFO, &Value );
+	Info.AsUInt = Value;
+
+	Instruction = ( DESCRIPTOR_INSTRUCTION ) ( DescriptorSldt + Info.Instruction );
+
+	if ( Info.MemoryRegister )
+		Register = vmx::vm::GetRegister( context, ( UINT32 ) Info.Reg1 );
+
+	if ( Instruction == DescriptorSldt || Instruction == DescriptorStr )
+	{
+		__vmx_vmread( Instruction == DescriptorStr ? VMCS_GUEST_TR_SELECTOR : VMCS_GUEST_LDTR_SELECTOR, &Value );
+		Selector = ( UINT16 ) Value;
+
+		if ( Register )
+		{
+			*Register = Selector;
+
+			if ( Register == &context->ExtRegs.rsp )
+				__vmx_vmwrite( VMCS_GUEST_RSP, Selector );
+		}
+		else
+		{
+			status = AccessOperand( context, vmx::vm::OperandAddress( context, Info.AsUInt ), &Selector, sizeof( Selector ), true );
+		}
+	}
+	else
+	{
+		if ( Register )
+			Selector = ( UINT16 ) *Register;
+		else
+			status = AccessOperand( context, vmx::vm::OperandAddress( context, Info.AsUInt ), &Selector, sizeof( Selector ), false );
+
+		if ( status > 0 )
+			status = LoadSystemSegment( context, Selector, Instruction == DescriptorLtr );
+	}
+
+	if ( status > 0 )
+		vmx::vm::NextInstruction( context );
+
+	Exits->Exits[Instruction]++;
+	Exits->Cycles[Instruction] += __rdtsc() - Start;
+
+	return status ? 1 : 0;
+}
@@ -0,0 +1,417 @@
+#include "vmx/vmx.h"
+
+#define PML4_ENTRIES 512
+#define PML4_KERNEL_HALF 256
+#define LARGE_PAGE_1GB ( 1ULL << 30 )
+#define LARGE_PAGE_2MB ( 1ULL << 21 )
+
+//
+// Sign-extended address of a kernel half PML4 slot
+//
+#define PML4_SLOT_ADDRESS( SLOT ) ( ( BYTE* ) ( 0xFFFF000000000000ULL | ( ( UINT64 ) ( SLOT ) << 39 ) ) )
+
+
+static UINT32 SlotsFor( UINT64 PhysicalLimit )
+{
+	return ( UINT32 ) ( ( PhysicalLimit + DIRECT_MAP_SLOT_SIZE - 1 ) / DIRECT_MAP_SLOT_SIZE );
+}
+
+
+bool vmx::host::LargePages1GbSupported()
+{
+	CPUID_EAX_80000001 cpuid = { 0 };
+
+	__cpuid( ( int* ) &cpuid, CPUID_EXTENDED_CPU_SIGNATURE );
+
+	return cpuid.Edx.Pages1GbAvailable;
+}
+
+
+//
+// The direct map goes in the highest run of free kernel half slots, away from the low ones the kernel fills first
+//
+static bool FindFreeSlots( const PML4E_64* SystemPml4, UINT32 Count, UINT32* FirstSlot )
+{
+	UINT32 Run = 0;
+
+	for ( UINT32 Slot = PML4_ENTRIES - 1; Slot >= PML4_KERNEL_HALF; Slot-- )
+	{
+		Run = SystemPml4[Slot].Present ? 0 : Run + 1;
+
+		if ( Run == Count )
+		{
+			*FirstSlot = Slot;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+//
+// Zeroed page from the tables buffer, nullptr once it's exhausted
+//
+static void* AllocateTable( HostAddressSpace* Host )
+{
+	BYTE* Page = Host->TablesNext;
+
+	if ( Page + PAGE_SIZE > Host->TablesEnd )
+		return nullptr;
+
+	Host->TablesNext += PAGE_SIZE;
+	RtlSecureZeroMemory( Page, PAGE_SIZE );
+
+	return Page;
+}
+
+
+//
+// Direct map being built, or only counted when Host is null
+//
+struct DirectMapBuild
+{
+	HostAddressSpace* Host;
+	const PhysicalRange* Ranges;
+	UINT32 RangeCount;
+	Mtrrs Types;
+	bool LargePages1Gb;
+	UINT32 Count;
+};
+
+//
+// Bytes of [Base, Base + Size) that are RAM, the ranges don't overlap
+//
+static UINT64 RamBytes( const DirectMapBuild* Map, UINT64 Base, UINT64 Size )
+{
+	UINT64 Bytes = 0;
+
+	for ( UINT32 i = 0; i < Map->RangeCount && Map->Ranges[i].Base < Base + Size; i++ )
+	{
+		UINT64 First = Map->Ranges[i].Base > Base ? Map->Ranges[i].Base : Base;
+		UINT64 Last = Map->Ranges[i].Base + Map->Ranges[i].Size < Base + Size ? Map->Ranges[i].Base + Map->Ranges[i].Size : Base + Size;
+
+		if ( Last > First )
+			Bytes += Last - First;
+	}
+
+	return Bytes;
+}
+
+//
+// Table of the direct map, with its entry in Parent. Counting only, it's null and the count goes up anyway
+//
+static bool NewTable( DirectMapBuild* Map, PT_ENTRY_64* Parent, PT_ENTRY_64** Table )
+{
+	Map->Count++;
+	*Table = nullptr;
+
+	if ( !Map->Host )
+		return true;
+
+	*Table = ( PT_ENTRY_64* ) AllocateTable( Map->Host );
+
+	if ( !*Table )
+		return false;
+
+	Parent->Present = 1;
+	Parent->Write = 1;
+	Parent->PageFrameNumber = VIRTUAL_TO_PHYSICAL( *Table ) >> PAGE_SHIFT;
+	Map->Host->DirectMapTables++;
+
+	return true;
+}
+
+
+//
+// Entries of a Level table (3 for a PDPT, 1 for a PT) mapping the physical addresses from Base. A large page needs RAM
+// all over and a single MTRR memory type, a page of mixed types is undefined behaviour and one reaching into MMIO lets
+// the processor fetch from the device. Holes stay not present, only RAM is ever read through the map
+//
+static bool FillTable( DirectMapBuild* Map, PT_ENTRY_64* Table, int Level, UINT64 Base )
+{
+	UINT64 Size = 1ULL << ( PAGE_SHIFT + 9 * ( Level - 1 ) );
+
+	for ( UINT32 i = 0; i < 512; i++ )
+	{
+		UINT64 Address = Base + i * Size;
+		UINT64 Ram = RamBytes( Map, Address, Size );
+		PT_ENTRY_64 Scratch = { 0 };
+		PT_ENTRY_64* Next;
+
+		if ( !Ram )
+			continue;
+
+		if ( Level == 1 || ( Ram == Size && ( Level == 2 || Map->LargePages1Gb ) &&
+			vmx::mtrr::RangeType( &Map->Types, Address, Size ) != MEMORY_TYPE_INVALID ) )
+		{
+			//
+			// Write-back in the PAT, the MTRR type of the page is the one that applies
+			//
+			if ( Table )
+			{
+				Table[i].Present = 1;
+				Table[i].Write = 1;
+				Table[i].LargePage = Level > 1;
+				Table[i].Global = 1;
+				Table[i].ExecuteDisable = 1;
+				Table[i].PageFrameNumber = Address >> PAGE_SHIFT;
+			}
+
+			continue;
+		}
+
+		if ( !NewTable( Map, Table ? &Table[i] : &Scratch, &Next ) || !FillTable( Map, Next, Level - 1, Address ) )
+			return false;
+	}
+
+	return true;
+}
+
+
+//
+// One PDPT per 512 GB slot, then the tables of the pages that had to be split. Supervisor only, not executable and global
+//
+static bool MapPhysical( DirectMapBuild* Map, UINT32 SlotCount, UINT32 FirstSlot )
+{
+	for ( UINT32 Slot = 0; Slot < SlotCount; Slot++ )
+	{
+		PT_ENTRY_64 Scratch = { 0 };
+		PT_ENTRY_64* Pdpt;
+
+		if ( !NewTable( Map, Map->Host ? ( PT_ENTRY_64* ) &Map->Host->Pml4[FirstSlot + Slot] : &Scratch, &Pdpt ) ||
+			!FillTable( Map, Pdpt, 3, Slot * DIRECT_MAP_SLOT_SIZE ) )
+			return false;
+	}
+
+	return true;
+}
+
+
+//
+// The PML4, plus what MapPhysical takes for the ranges with the MTRRs of the current processor
+//
+SIZE_T vmx::host::TablesSize( const PhysicalRange* Ranges, UINT32 RangeCount, bool LargePages1Gb )
+{
+	DirectMapBuild Map;
+
+	if ( !RangeCount )
+		return PAGE_SIZE;
+
+	RtlSecureZeroMemory( &Map, sizeof( Map ) );
+	vmx::mtrr::Read( &Map.Types );
+	Map.Ranges = Ranges;
+	Map.RangeCount = RangeCount;
+	Map.LargePages1Gb = LargePages1Gb;
+
+	MapPhysical( &Map, SlotsFor( Ranges[RangeCount - 1].Base + Ranges[RangeCount - 1].Size ), 0 );
+
+	return ( SIZE_T ) ( 1 + Map.Count ) * PAGE_SIZE;
+}
+
+
+//
+// Three levels bellow a PML4 entry: PDPT, PD and PT. Every range can start and end in the middle of each of them
+//
+SIZE_T vmx::host::MapTablesSize( UINT64 Size )
+{
+	return ( ( Size >> 39 ) + 2 + ( Size >> 30 ) + 2 + ( Size >> 21 ) + 2 ) * PAGE_SIZE;
+}
+
+
+bool vmx::host::BuildAddressSpace( HostAddressSpace* Host, const PML4E_64* SystemPml4, const PhysicalRange* Ranges, UINT32 RangeCount,
+	void* Tables, SIZE_T Size, bool LargePages1Gb )
+{
+	DirectMapBuild Map;
+	UINT64 PhysicalLimit;
+
+	if ( !RangeCount || RangeCount > DIRECT_MAP_MAX_RANGES )
+		return false;
+
+	PhysicalLimit = Ranges[RangeCount - 1].Base + Ranges[RangeCount - 1].Size;
+
+	if ( Size < TablesSize( Ranges, RangeCount, LargePages1Gb ) )
+		return false;
+
+	RtlSecureZeroMemory( Host, sizeof( HostAddressSpace ) );
+
+	Host->SlotCount = SlotsFor( PhysicalLimit );
+
+	if ( !FindFreeSlots( SystemPml4, Host->SlotCount, &Host->FirstSlot ) )
+		return false;
+
+	Host->TablesNext = ( BYTE* ) Tables;
+	Host->TablesEnd = ( BYTE* ) Tables + Size;
+	Host->Pml4 = ( PML4E_64* ) AllocateTable( Host );
+	Host->Cr3 = VIRTUAL_TO_PHYSICAL( Host->Pml4 );
+	Host->DirectMapBase = PML4_SLOT_ADDRESS( Host->FirstSlot );
+	Host->DirectMapSize = ( UINT64 ) Host->SlotCount * DIRECT_MAP_SLOT_SIZE;
+	Host->LargePages1Gb = LargePages1Gb;
+	Host->RangeCount = RangeCount;
+	RtlCopyMemory( Host->Ranges, Ranges, RangeCount * sizeof( PhysicalRange ) );
+
+	RtlSecureZeroMemory( &Map, sizeof( Map ) );
+	vmx::mtrr::Read( &Map.Types );
+	Map.Host = Host;
+	Map.Ranges = Host->Ranges;
+	Map.RangeCount = RangeCount;
+	Map.LargePages1Gb = LargePages1Gb;
+
+	return Host->Pml4 && MapPhysical( &Map, Host->SlotCount, Host->FirstSlot );
+}
+
+
+//
+// The tables buffer is only virtually contiguous, the newest tables (the MapRange ones) are searched first
+//
+static PT_ENTRY_64* FindTable( HostAddressSpace* Host, UINT64 PageFrameNumber )
+{
+	for ( BYTE* Page = Host->TablesNext - PAGE_SIZE; Page >= ( BYTE* ) Host->Pml4; Page -= PAGE_SIZE )
+	{
+		if ( ( UINT64 ) VIRTUAL_TO_PHYSICAL( Page ) >> PAGE_SHIFT == PageFrameNumber )
+			return ( PT_ENTRY_64* ) Page;
+	}
+
+	return nullptr;
+}
+
+
+//
+// Entry mapping VirtualAddress at the level of Shift (21 for a PD entry, 12 for a PT entry), missing tables are created.
+// The intermediate entries allow everything, the leaf decides
+//
+static PT_ENTRY_64* GetEntry( HostAddressSpace* Host, UINT64 VirtualAddress, int Shift )
+{
+	PT_ENTRY_64* Table = ( PT_ENTRY_64* ) Host->Pml4;
+
+	for ( int Level = 39; ; Level -= 9 )
+	{
+		PT_ENTRY_64* Entry = &Table[( VirtualAddress >> Level ) & 0x1FF];
+
+		if ( Level == Shift )
+			return Entry;
+
+		if ( !Entry->Present )
+		{
+			void* Next = AllocateTable( Host );
+			PT_ENTRY_64 Value = { 0 };
+
+			if ( !Next )
+				return nullptr;
+
+			Value.Present = 1;
+			Value.Write = 1;
+			Value.PageFrameNumber = VIRTUAL_TO_PHYSICAL( Next ) >> PAGE_SHIFT;
+			//
+			// Single store, other processors may be walking this table
+			//
+			*( volatile UINT64* ) &Entry->AsUInt = Value.AsUInt;
+		}
+		else if ( Entry->LargePage )
+		{
+			return nullptr;
+		}
+
+		Table = FindTable( Host, Entry->PageFrameNumber );
+
+		if ( !Table )
+			return nullptr;
+	}
+}
+
+
+bool vmx::host::MapRange( HostAddressSpace* Host, UINT64 VirtualAddress, UINT64 PhysicalAddress, UINT64 Size, UINT32 Flags )
+{
+	UINT64 End = ( VirtualAddress + Size + PAGE_SIZE - 1 ) & ~( PAGE_SIZE - 1ULL );
+	UINT32 Slot;
+
+	VirtualAddress &= ~( PAGE_SIZE - 1ULL );
+	PhysicalAddress &= ~( PAGE_SIZE - 1ULL );
+
+	while ( VirtualAddress < End )
+	{
+		bool Large = !( ( VirtualAddress | PhysicalAddress ) & ( LARGE_PAGE_2MB - 1 ) ) && End - VirtualAddress >= LARGE_PAGE_2MB;
+		UINT64 PageSize = Large ? LARGE_PAGE_2MB : PAGE_SIZE;
+		PT_ENTRY_64 Value = { 0 };
+		PT_ENTRY_64* Entry;
+
+		Slot = ( UINT32 ) ( ( VirtualAddress >> 39 ) & 0x1FF );
+
+		if ( Slot >= Host->FirstSlot && Slot < Host->FirstSlot + Host->SlotCount )
+			return false;
+
+		Entry = GetEntry( Host, VirtualAddress, Large ? 21 : 12 );
+
+		if ( !Entry )
+			return false;
+
+		Value.Present = 1;
+		Value.Write = ( Flags & HOST_MAP_WRITE ) != 0;
+		Value.LargePage = Large;
+		Value.Global = 1;
+		Value.ExecuteDisable = !( Flags & HOST_MAP_EXECUTE );
+		Value.PageFrameNumber = PhysicalAddress >> PAGE_SHIFT;
+
+		*( volatile UINT64* ) &Entry->AsUInt = Value.AsUInt;
+
+		Host->MappedPages += PageSize / PAGE_SIZE;
+		VirtualAddress += PageSize;
+		PhysicalAddress += PageSize;
+	}
+
+	return true;
+}
+
+
+void* vmx::mem::PhysicalToHost( const HostAddressSpace* Host, UINT64 Address, SIZE_T Size )
+{
+	UINT32 Low = 0;
+	UINT32 High = Host->RangeCount;
+
+	if ( !Host->DirectMapBase || Address + Size < Address )
+		return nullptr;
+
+	//
+	// Last range starting at or bellow Address
+	//
+	while ( Low < High )
+	{
+		UINT32 Middle = ( Low + High ) / 2;
+
+		if ( Host->Ranges[Middle].Base <= Address )
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if ( !Low || Address + Size > Host->Ranges[Low - 1].Base + Host->Ranges[Low - 1].Size )
+		return nullptr;
+
+	return Host->DirectMapBase + Address;
+}
+
+
+bool vmx::mem::ReadPhysical( const HostAddressSpace* Host, UINT64 Address, void* Buffer, SIZE_T Size )
+{
+	void* Source = PhysicalToHost( Host, Address, Size );
+
+	if ( !Source )
+		return false;
+
+	RtlCopyMemory( Buffer, Source, Size );
+
+	return true;
+}
+
+
+bool vmx::mem::WritePhysical( const HostAddressSpace* Host, UINT64 Address, const void* Buffer, SIZE_T Size )
+{
+	void* Destination = PhysicalToHost( Host, Address, Size );
+
+	if ( !Destination )
+		return false;
+
+	RtlCopyMemory( Destination, Buffer, Size );
+
+	return true;
+}
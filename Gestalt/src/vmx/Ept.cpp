@@ -0,0 +1,744 @@
+#include "vmx/vmx.h"
+
+#define EPT_ENTRIES 512
+#define EPT_PML4E_SIZE ( 512ULL << 30 )
+#define EPT_MAX_LIMIT ( 1ULL << 48 )
+#define EPT_PAGE_WALK_4_LEVELS 3
+#define EPT_ENTRY_LARGE ( 1ULL << 7 )
+#define EPT_ENTRY_TYPE_SHIFT 3
+#define EPT_ENTRY_ADDRESS 0x000FFFFFFFFFF000ULL
+#define EPT_SUPPRESS_VE ( 1ULL << 63 )
+
+//
+// Bytes mapped by one entry of a level: 1 for a PT, 4 for the PML4
+//
+#define EPT_ENTRY_SIZE( LEVEL ) ( 1ULL << ( PAGE_SHIFT + 9 * ( ( LEVEL ) - 1 ) ) )
+
+//
+// Identity map being built, or only counted when Tables is null
+//
+struct IdentityMap
+{
+	EptTables* Tables;
+	Mtrrs Types;
+	UINT64 Limit;
+	bool Pages1Gb;
+	UINT32 Count;
+};
+
+
+static UINT64 TablePhysical( const EptTables* Tables, const void* Table )
+{
+	return Tables->BasePhysical + ( ( const BYTE* ) Table - Tables->Base );
+}
+
+static UINT64* TableAt( const EptTables* Tables, UINT64 Entry )
+{
+	return ( UINT64* ) ( Tables->Base + ( ( Entry & EPT_ENTRY_ADDRESS ) - Tables->BasePhysical ) );
+}
+
+static UINT8 TableOwner( const EptTables* Tables, UINT64 Entry )
+{
+	return Tables->Owners[( ( Entry & EPT_ENTRY_ADDRESS ) - Tables->BasePhysical ) >> PAGE_SHIFT];
+}
+
+
+//
+// Zeroed table owned by View, nullptr once the buffer is exhausted
+//
+static UINT64* AllocateTable( EptTables* Tables, UINT32 View )
+{
+	BYTE* Table;
+
+	if ( Tables->Used == Tables->Count )
+		return nullptr;
+
+	Table = Tables->Base + ( ( SIZE_T ) Tables->Used << PAGE_SHIFT );
+	Tables->Owners[Tables->Used++] = ( UINT8 ) View;
+	RtlSecureZeroMemory( Table, PAGE_SIZE );
+
+	return ( UINT64* ) Table;
+}
+
+
+//
+// Table for the identity map, with its entry in Parent. Counting only, it's null and the count goes up anyway
+//
+static bool NewTable( IdentityMap* Map, UINT64* Parent, UINT64** Table )
+{
+	Map->Count++;
+	*Table = nullptr;
+
+	if ( !Map->Tables )
+		return true;
+
+	*Table = AllocateTable( Map->Tables, 0 );
+
+	if ( !*Table )
+		return false;
+
+	*Parent = TablePhysical( Map->Tables, *Table ) | EPT_ACCESS_ALL;
+
+	return true;
+}
+
+
+//
+// Entries of a Level table mapping the guest-physical addresses from Base one to one, with a large page wherever the
+// memory type is the same all over. Entries past the limit are not present. No violation of the identity map is
+// convertible, not even of a missing entry: the suppress #VE bit is set everywhere
+//
+static bool FillTable( IdentityMap* Map, UINT64* Table, int Level, UINT64 Base )
+{
+	UINT64 Size = EPT_ENTRY_SIZE( Level );
+
+	for ( UINT32 i = 0; i < EPT_ENTRIES; i++ )
+	{
+		UINT64 Address = Base + i * Size;
+		UINT8 Type = MEMORY_TYPE_INVALID;
+		UINT64 Scratch;
+		UINT64* Next;
+
+		if ( Address >= Map->Limit )
+		{
+			if ( Table )
+				Table[i] = EPT_SUPPRESS_VE;
+
+			continue;
+		}
+
+		if ( Level < 3 || Map->Pages1Gb )
+			Type = vmx::mtrr::RangeType( &Map->Types, Address, Size );
+
+		if ( Type != MEMORY_TYPE_INVALID )
+		{
+			if ( Table )
+				Table[i] = Address | EPT_ACCESS_ALL | ( ( UINT64 ) Type << EPT_ENTRY_TYPE_SHIFT ) | ( Level > 1 ? EPT_ENTRY_LARGE : 0 ) |
+					EPT_SUPPRESS_VE;
+
+			continue;
+		}
+
+		if ( !NewTable( Map, Table ? &Table[i] : &Scratch, &Next ) || !FillTable( Map, Next, Level - 1, Address ) )
+			return false;
+	}
+
+	return true;
+}
+
+
+static bool MapIdentity( IdentityMap* Map, UINT64* Pml4 )
+{
+	for ( UINT32 i = 0; i < EPT_ENTRIES; i++ )
+	{
+		UINT64 Base = i * EPT_PML4E_SIZE;
+		UINT64 Scratch;
+		UINT64* Pdpt;
+
+		if ( Base >= Map->Limit )
+		{
+			if ( Pml4 )
+				Pml4[i] = EPT_SUPPRESS_VE;
+
+			continue;
+		}
+
+		if ( !NewTable( Map, Pml4 ? &Pml4[i] : &Scratch, &Pdpt ) || !FillTable( Map, Pdpt, 3, Base ) )
+			return false;
+	}
+
+	return true;
+}
+
+
+bool vmx::ept::Supported( bool* Pages1Gb )
+{
+	IA32_VMX_PROCBASED_CTLS2_REGISTER Allowed;
+	IA32_VMX_EPT_VPID_CAP_REGISTER Capabilities;
+
+	//
+	// Allowed 1-settings of the secondary controls, in the high half
+	//
+	Allowed.AsUInt = __readmsr( IA32_VMX_PROCBASED_CTLS2 ) >> 32;
+
+	if ( !Allowed.EnableEpt )
+		return false;
+
+	Capabilities.AsUInt = __readmsr( IA32_VMX_EPT_VPID_CAP );
+	*Pages1Gb = Capabilities.Pdpte1GbPages;
+
+	return Capabilities.PageWalkLength4 && Capabilities.Pde2MbPages && ( Capabilities.MemoryTypeWriteBack ||
+		Capabilities.MemoryTypeUncacheable ) && Capabilities.Invept && ( Capabilities.InveptSingleContext || Capabilities.InveptAllContexts );
+}
+
+
+UINT64 vmx::ept::MapLimit( bool Pages1Gb )
+{
+	CPUID_EAX_80000000 Extended = { 0 };
+	CPUID_EAX_80000008 Sizes = { 0 };
+	UINT64 Limit = 1ULL << 36;
+
+	__cpuid( ( int* ) &Extended, CPUID_EXTENDED_FUNCTION_INFORMATION );
+
+	if ( Extended.Eax.MaxExtendedFunctions >= CPUID_EXTENDED_VIRTUAL_PHYSICAL_ADDRESS_SIZE )
+	{
+		__cpuid( ( int* ) &Sizes, CPUID_EXTENDED_VIRTUAL_PHYSICAL_ADDRESS_SIZE );
+		Limit = 1ULL << Sizes.Eax.NumberOfPhysicalAddressBits;
+	}
+
+	if ( Limit > EPT_MAX_LIMIT )
+		Limit = EPT_MAX_LIMIT;
+
+	//
+	// 512 page directories already for 512 GB of 2 MB pages
+	//
+	if ( !Pages1Gb && Limit > EPT_PML4E_SIZE )
+		Limit = EPT_PML4E_SIZE;
+
+	return Limit;
+}
+
+
+//
+// The owner bytes take the first pages, one page of them covers 4096 tables
+//
+SIZE_T vmx::ept::TablesSize( UINT64 PhysicalLimit, bool Pages1Gb, UINT32 Views, UINT32 ExtraTables )
+{
+	IdentityMap Map;
+	UINT32 Count;
+
+	RtlSecureZeroMemory( &Map, sizeof( Map ) );
+	vmx::mtrr::Read( &Map.Types );
+	Map.Limit = PhysicalLimit;
+	Map.Pages1Gb = Pages1Gb;
+	Map.Count = 1;
+
+	MapIdentity( &Map, nullptr );
+
+	Count = Map.Count + Views * EPT_TABLES_PER_VIEW + ExtraTables;
+
+	return ( SIZE_T ) ( Count + Count / ( PAGE_SIZE - 1 ) + 1 ) << PAGE_SHIFT;
+}
+
+
+bool vmx::ept::Build( EptState* Ept, void* Tables, SIZE_T Size, UINT64 PhysicalLimit, bool Pages1Gb )
+{
+	IA32_VMX_PROCBASED_CTLS2_REGISTER Allowed;
+	IA32_VMX_EPT_VPID_CAP_REGISTER Capabilities;
+	IA32_VMX_VMFUNC_REGISTER Functions;
+	EPT_POINTER Eptp;
+	IdentityMap Map;
+	UINT64* Pml4;
+	UINT32 OwnerPages;
+
+	RtlSecureZeroMemory( Ept, sizeof( EptState ) );
+
+	Ept->Tables.Base = ( BYTE* ) Tables;
+	Ept->Tables.BasePhysical = VIRTUAL_TO_PHYSICAL( Tables );
+	Ept->Tables.Owners = ( UINT8* ) Tables;
+	Ept->Tables.Count = ( UINT32 ) ( Size >> PAGE_SHIFT );
+
+	OwnerPages = ( Ept->Tables.Count + PAGE_SIZE - 1 ) / PAGE_SIZE;
+
+	if ( OwnerPages >= Ept->Tables.Count )
+		return false;
+
+	RtlSecureZeroMemory( Tables, ( SIZE_T ) OwnerPages << PAGE_SHIFT );
+	Ept->Tables.Used = OwnerPages;
+
+	RtlSecureZeroMemory( &Map, sizeof( Map ) );
+	vmx::mtrr::Read( &Map.Types );
+	Map.Tables = &Ept->Tables;
+	Map.Limit = PhysicalLimit;
+	Map.Pages1Gb = Pages1Gb;
+
+	Pml4 = AllocateTable( &Ept->Tables, 0 );
+
+	if ( !Pml4 || !MapIdentity( &Map, Pml4 ) )
+		return false;
+
+	Capabilities.AsUInt = __readmsr( IA32_VMX_EPT_VPID_CAP );
+
+	Eptp.AsUInt = 0;
+	Eptp.MemoryType = Capabilities.MemoryTypeWriteBack ? MEMORY_TYPE_WRITE_BACK : MEMORY_TYPE_UNCACHEABLE;
+	Eptp.PageWalkLength = EPT_PAGE_WALK_4_LEVELS;
+	Eptp.PageFrameNumber = TablePhysical( &Ept->Tables, Pml4 ) >> PAGE_SHIFT;
+
+	Ept->Views[0].Eptp = Eptp.AsUInt;
+	Ept->Views[0].Pml4 = ( EPT_PML4E* ) Pml4;
+	Ept->Views[0].Tables = Ept->Tables.Used - OwnerPages;
+	Ept->EptpList[0] = Eptp.AsUInt;
+	Ept->ViewCount = 1;
+	Ept->PhysicalLimit = PhysicalLimit;
+	Ept->Pages1Gb = Pages1Gb;
+	Ept->ExecuteOnly = Capabilities.ExecuteOnlyPages;
+	Ept->InveptAllContexts = Capabilities.InveptAllContexts;
+
+	Allowed.AsUInt = __readmsr( IA32_VMX_PROCBASED_CTLS2 ) >> 32;
+	Functions.AsUInt = Allowed.EnableVmFunctions ? __readmsr( IA32_VMX_VMFUNC ) : 0;
+	Ept->VmfuncSwitching = Functions.EptpSwitching;
+	Ept->Enabled = true;
+
+	return true;
+}
+
+
+bool vmx::ept::EnableVe( EptState* Ept, EPT_VE_HANDLER Handler, void* Context )
+{
+	IA32_VMX_PROCBASED_CTLS2_REGISTER Allowed;
+
+	Allowed.AsUInt = __readmsr( IA32_VMX_PROCBASED_CTLS2 ) >> 32;
+
+	if ( !Ept->Enabled || !Allowed.EptViolation )
+		return false;
+
+	Ept->VeHandler = Handler;
+	Ept->VeContext = Context;
+	Ept->VeDelivery = true;
+
+	return true;
+}
+
+
+INT32 vmx::ept::CreateView( EptState* Ept )
+{
+	UINT32 View = Ept->ViewCount;
+	EPT_POINTER Eptp;
+	UINT64* Pml4;
+
+	if ( !Ept->Enabled || View == MAX_EPT_VIEWS )
+		return EPT_NO_VIEW;
+
+	Pml4 = AllocateTable( &Ept->Tables, View );
+
+	if ( !Pml4 )
+		return EPT_NO_VIEW;
+
+	RtlCopyMemory( Pml4, Ept->Views[0].Pml4, PAGE_SIZE );
+
+	Eptp.AsUInt = Ept->Views[0].Eptp;
+	Eptp.PageFrameNumber = TablePhysical( &Ept->Tables, Pml4 ) >> PAGE_SHIFT;
+
+	Ept->Views[View].Eptp = Eptp.AsUInt;
+	Ept->Views[View].Pml4 = ( EPT_PML4E* ) Pml4;
+	Ept->Views[View].Tables = 1;
+	Ept->Views[View].Pages = 0;
+	Ept->EptpList[View] = Eptp.AsUInt;
+
+	KeMemoryBarrier();
+	Ept->ViewCount = View + 1;
+
+	return ( INT32 ) View;
+}
+
+
+//
+// The table Entry points to, made View's own: a shared table is copied, a large page becomes a table of the next level
+// down mapping the same memory. The entry only changes once the new table is complete, both map the same way so
+// processors walking the view meanwhile see no difference
+//
+static UINT64* OwnTable( EptState* Ept, UINT32 View, UINT64* Entry, int Level )
+{
+	EptTables* Tables = &Ept->Tables;
+	UINT64* Table;
+
+	if ( !( *Entry & EPT_ENTRY_LARGE ) && TableOwner( Tables, *Entry ) == View )
+		return TableAt( Tables, *Entry );
+
+	Table = AllocateTable( Tables, View );
+
+	if ( !Table )
+		return nullptr;
+
+	if ( *Entry & EPT_ENTRY_LARGE )
+	{
+		UINT64 Size = EPT_ENTRY_SIZE( Level - 1 );
+		UINT64 Flags = *Entry & ~EPT_ENTRY_ADDRESS & ( Level - 1 > 1 ? ~0ULL : ~EPT_ENTRY_LARGE );
+
+		for ( UINT32 i = 0; i < EPT_ENTRIES; i++ )
+			Table[i] = ( ( *Entry & EPT_ENTRY_ADDRESS ) + i * Size ) | Flags;
+	}
+	else
+	{
+		RtlCopyMemory( Table, TableAt( Tables, *Entry ), PAGE_SIZE );
+	}
+
+	Ept->Views[View].Tables++;
+	KeMemoryBarrier();
+	InterlockedExchange64( ( volatile LONG64* ) Entry, ( LONG64 ) ( TablePhysical( Tables, Table ) | EPT_ACCESS_ALL ) );
+
+	return Table;
+}
+
+
+//
+// The memory type and the other attributes of the entry stay, they belong to the guest-physical page. Write without
+// read is a misconfiguration, execute alone needs execute-only support
+//
+bool vmx::ept::SetPage( EptState* Ept, UINT32 View, UINT64 GuestPhysical, UINT64 Physical, UINT32 Access )
+{
+	UINT32 Rights = Access & EPT_ACCESS_ALL;
+	UINT64 Suppress = Access & EPT_CONVERTIBLE ? 0 : EPT_SUPPRESS_VE;
+	UINT64* Table;
+	UINT64* Entry;
+
+	if ( !View || View >= Ept->ViewCount || GuestPhysical >= Ept->PhysicalLimit || ( Access & ~( EPT_ACCESS_ALL | EPT_CONVERTIBLE ) ) )
+		return false;
+
+	if ( ( ( Rights & EPT_WRITE ) && !( Rights & EPT_READ ) ) || ( Rights == EPT_EXECUTE && !Ept->ExecuteOnly ) )
+		return false;
+
+	Table = ( UINT64* ) Ept->Views[View].Pml4;
+
+	for ( int Level = 4; Level > 1; Level-- )
+	{
+		Entry = &Table[( GuestPhysical / EPT_ENTRY_SIZE( Level ) ) % EPT_ENTRIES];
+		Table = OwnTable( Ept, View, Entry, Level );
+
+		if ( !Table )
+			return false;
+	}
+
+	Entry = &Table[( GuestPhysical >> PAGE_SHIFT ) % EPT_ENTRIES];
+	InterlockedExchange64( ( volatile LONG64* ) Entry, ( LONG64 ) ( ( *Entry & ~( EPT_ENTRY_ADDRESS | EPT_ACCESS_ALL | EPT_SUPPRESS_VE ) ) |
+		( Physical & EPT_ENTRY_ADDRESS ) | Rights | Suppress ) );
+
+	Ept->Views[View].Pages++;
+
+	return true;
+}
+
+
+UINT64* vmx::ept::PageEntry( EptState* Ept, UINT32 View, UINT64 GuestPhysical )
+{
+	UINT64* Table;
+
+	if ( !View || View >= Ept->ViewCount || GuestPhysical >= Ept->PhysicalLimit )
+		return nullptr;
+
+	Table = ( UINT64* ) Ept->Views[View].Pml4;
+
+	for ( int Level = 4; Level > 1; Level-- )
+	{
+		UINT64 Entry = Table[( GuestPhysical / EPT_ENTRY_SIZE( Level ) ) % EPT_ENTRIES];
+
+		if ( !( Entry & EPT_ACCESS_ALL ) || ( Entry & EPT_ENTRY_LARGE ) || TableOwner( &Ept->Tables, Entry ) != View )
+			return nullptr;
+
+		Table = TableAt( &Ept->Tables, Entry );
+	}
+
+	return &Table[( GuestPhysical >> PAGE_SHIFT ) % EPT_ENTRIES];
+}
+
+
+bool vmx::ept::GetPage( const EptState* Ept, UINT32 View, UINT64 GuestPhysical, UINT64* Physical, UINT32* Access,
+	UINT32* MemoryType, UINT64* Size )
+{
+	const UINT64* Table;
+
+	if ( View >= Ept->ViewCount || GuestPhysical >= Ept->PhysicalLimit )
+		return false;
+
+	Table = ( const UINT64* ) Ept->Views[View].Pml4;
+
+	for ( int Level = 4; Level > 0; Level-- )
+	{
+		UINT64 Entry = Table[( GuestPhysical / EPT_ENTRY_SIZE( Level ) ) % EPT_ENTRIES];
+
+		if ( !( Entry & EPT_ACCESS_ALL ) )
+			return false;
+
+		if ( Level == 1 || ( Entry & EPT_ENTRY_LARGE ) )
+		{
+			*Size = EPT_ENTRY_SIZE( Level );
+			*Physical = ( Entry & EPT_ENTRY_ADDRESS ) + ( GuestPhysical & ( *Size - 1 ) );
+			*Access = ( UINT32 ) ( Entry & EPT_ACCESS_ALL ) | ( Entry & EPT_SUPPRESS_VE ? 0 : EPT_CONVERTIBLE );
+			*MemoryType = ( UINT32 ) ( Entry >> EPT_ENTRY_TYPE_SHIFT ) & 7;
+
+			return true;
+		}
+
+		Table = TableAt( &Ept->Tables, Entry );
+	}
+
+	return false;
+}
+
+
+//
+// One INVEPT for every view, or one per view when all-context isn't supported
+//
+static void Flush( const EptState* Ept )
+{
+	INVEPT_DESCRIPTOR Descriptor = { 0 };
+
+	if ( Ept->InveptAllContexts )
+	{
+		vmx::__invept( InveptAllContext, &Descriptor );
+		return;
+	}
+
+	for ( UINT32 i = 0; i < Ept->ViewCount; i++ )
+	{
+		Descriptor.EptPointer = Ept->Views[i].Eptp;
+		vmx::__invept( InveptSingleContext, &Descriptor );
+	}
+}
+
+
+void vmx::ept::Reset( vCPU* vcpu, bool Enabled, bool Vmfunc )
+{
+	EptState* Ept = &vcpu->state->Ept;
+
+	RtlSecureZeroMemory( &vcpu->Ept, sizeof( EptCounters ) );
+
+	if ( !Enabled )
+		return;
+
+	__vmx_vmwrite( VMCS_CTRL_EPT_POINTER, Ept->Views[0].Eptp );
+
+	//
+	// The EPTP index only exists with VM functions or #VE, the processor keeps it in step on a VMFUNC
+	//
+	if ( Vmfunc || Ept->VeDelivery )
+		__vmx_vmwrite( VMCS_CTRL_EPTP_INDEX, 0 );
+
+	if ( Vmfunc )
+	{
+		__vmx_vmwrite( VMCS_CTRL_VMFUNC_CONTROLS, IA32_VMX_VMFUNC_EPTP_SWITCHING_FLAG );
+		__vmx_vmwrite( VMCS_CTRL_EPT_POINTER_LIST_ADDRESS, VIRTUAL_TO_PHYSICAL( Ept->EptpList ) );
+	}
+
+	//
+	// Translations tagged with these EPTPs may be left from an earlier run of the hypervisor
+	//
+	Flush( Ept );
+}
+
+
+//
+// The guest runs on the copy from now on, SIDT shows the table it was made from
+//
+static void InstallVeIdt( vCPU* vcpu, UINT16 CsSelector, UINT64 Base, UINT16 Limit )
+{
+	SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64* Gate = &vcpu->Ve.Idt[VirtualizationException];
+	UINT64 Isr = ( UINT64 ) vmx::__vmx_ve_isr;
+
+	Gate->OffsetLow = ( UINT16 ) Isr;
+	Gate->OffsetMiddle = ( UINT16 ) ( Isr >> 16 );
+	Gate->OffsetHigh = ( UINT32 ) ( Isr >> 32 );
+	Gate->SegmentSelector = CsSelector;
+	Gate->InterruptStackTable = 0;
+	Gate->Type = SEGMENT_DESCRIPTOR_TYPE_INTERRUPT_GATE;
+	Gate->DescriptorPrivilegeLevel = 0;
+	Gate->Present = 1;
+
+	__vmx_vmwrite( VMCS_GUEST_IDTR_BASE, ( UINT64 ) vcpu->Ve.Idt );
+	__vmx_vmwrite( VMCS_GUEST_IDTR_LIMIT, sizeof( vcpu->Ve.Idt ) - 1 );
+
+	vmx::dt::SetShadow( &vcpu->DescriptorTables.Idt, Base, Limit, true );
+}
+
+
+void vmx::ept::ResetVe( vCPU* vcpu, const CpuSnapshot* snapshot, bool Enabled )
+{
+	VeDelivery* Ve = &vcpu->Ve;
+	UINT32 Size = ( UINT32 ) snapshot->IDTR.Limit + 1;
+
+	if ( !Enabled )
+		return;
+
+	//
+	// The semaphore is clear, the first convertible violation is delivered
+	//
+	RtlSecureZeroMemory( &Ve->Info, sizeof( Ve->Info ) );
+	RtlSecureZeroMemory( Ve->Idt, sizeof( Ve->Idt ) );
+	RtlCopyMemory( Ve->Idt, ( const void* ) snapshot->IDTR.Base, Size < sizeof( Ve->Idt ) ? Size : sizeof( Ve->Idt ) );
+
+	__vmx_vmwrite( VMCS_CTRL_VIRTUALIZATION_EXCEPTION_INFORMATION_ADDRESS, VIRTUAL_TO_PHYSICAL( &Ve->Info ) );
+
+	InstallVeIdt( vcpu, MASK_SELECTOR( snapshot->Segments[SnapshotCs].Selector ), snapshot->IDTR.Base, snapshot->IDTR.Limit );
+}
+
+
+bool vmx::ept::ReloadVe( vCPU* vcpu, UINT64 Base, UINT16 Limit )
+{
+	VeDelivery* Ve = &vcpu->Ve;
+	UINT16 CsSelector = Ve->Idt[VirtualizationException].SegmentSelector;
+	UINT32 Size = ( UINT32 ) Limit + 1;
+	size_t Cr3;
+	size_t Cr4;
+
+	__vmx_vmread( VMCS_GUEST_CR3, &Cr3 );
+	__vmx_vmread( VMCS_GUEST_CR4, &Cr4 );
+
+	RtlSecureZeroMemory( Ve->Idt, sizeof( Ve->Idt ) );
+
+	if ( !vmx::guest::ReadVirtual( &vcpu->Translations, &vcpu->state->Host, Cr3, Cr4, Base, Ve->Idt,
+		Size < sizeof( Ve->Idt ) ? Size : sizeof( Ve->Idt ) ) )
+	{
+		__vmx_vmwrite( VMCS_GUEST_IDTR_BASE, Base );
+		__vmx_vmwrite( VMCS_GUEST_IDTR_LIMIT, Limit );
+		vmx::dt::SetShadow( &vcpu->DescriptorTables.Idt, 0, 0, false );
+		vcpu->Ept.VeIdtLost++;
+
+		return false;
+	}
+
+	InstallVeIdt( vcpu, CsSelector, Base, Limit );
+	vcpu->Ept.VeIdtReloads++;
+
+	return true;
+}
+
+
+bool vmx::ept::SwitchView( vCPU* vcpu, UINT32 View )
+{
+	EptState* Ept = &vcpu->state->Ept;
+
+	if ( !Ept->Enabled || View >= Ept->ViewCount )
+		return false;
+
+	__vmx_vmwrite( VMCS_CTRL_EPT_POINTER, Ept->EptpList[View] );
+
+	if ( Ept->VmfuncSwitching || Ept->VeDelivery )
+		__vmx_vmwrite( VMCS_CTRL_EPTP_INDEX, View );
+
+	return true;
+}
+
+
+//
+// VMFUNC changes the EPTP in the VMCS, that is where the current view is
+//
+INT32 vmx::ept::CurrentView( vCPU* vcpu )
+{
+	EptState* Ept = &vcpu->state->Ept;
+	size_t Eptp;
+
+	if ( !Ept->Enabled )
+		return EPT_NO_VIEW;
+
+	__vmx_vmread( VMCS_CTRL_EPT_POINTER, &Eptp );
+
+	for ( UINT32 i = 0; i < Ept->ViewCount; i++ )
+	{
+		if ( Ept->EptpList[i] == Eptp )
+			return ( INT32 ) i;
+	}
+
+	return EPT_NO_VIEW;
+}
+
+
+void vmx::ept::Invalidate( vCPU* vcpu )
+{
+	if ( !vcpu->state->Ept.Enabled )
+		return;
+
+	Flush( &vcpu->state->Ept );
+	vcpu->Ept.Invalidations++;
+}
+
+
+//
+// View 0 maps everything the guest can reach, a violation there is a guest-physical address past the map
+//
+static bool Fallback( vCPU* vcpu, UINT64 GuestPhysical )
+{
+	INT32 View = vmx::ept::CurrentView( vcpu );
+
+	vcpu->Ept.Violations++;
+	vcpu->Ept.LastViolation = GuestPhysical;
+
+	return View != EPT_NO_VIEW && View != 0 && vmx::ept::SwitchView( vcpu, 0 );
+}
+
+
+int vmx::ept::HandleViolation( GCPUContext* context )
+{
+	vCPU* vcpu = context->vcpu;
+	VMX_EXIT_QUALIFICATION_EPT_VIOLATION Qualification;
+	UINT32 Right;
+	size_t Value;
+
+	__vmx_vmread( VMCS_EXIT_QUALIFICATION, &Value );
+	Qualification.AsUInt = Value;
+	__vmx_vmread( VMCS_GUEST_PHYSICAL_ADDRESS, &Value );
+
+	Right = Qualification.ExecuteAccess ? EPT_EXECUTE : Qualification.WriteAccess ? EPT_WRITE : 0;
+
+	if ( !( Right && vmx::coverage::Record( vcpu, Value, Right ) ) && !Fallback( vcpu, Value ) )
+		return 0;
+
+	//
+	// The access is done again, in view 0 or with the right given back. When it was in an IRET that unblocked NMIs, the blocking comes back first,
+	// unless the exit came in the middle of an event delivery
+	//
+	if ( Qualification.NmiUnblocking )
+	{
+		VMX_INTERRUPTIBILITY_STATE Interruptibility;
+		VMEXIT_INTERRUPT_INFORMATION Vectoring;
+
+		__vmx_vmread( VMCS_IDT_VECTORING_INFORMATION, &Value );
+		Vectoring.AsUInt = ( UINT32 ) Value;
+
+		if ( !Vectoring.Valid )
+		{
+			__vmx_vmread( VMCS_GUEST_INTERRUPTIBILITY_STATE, &Value );
+			Interruptibility.AsUInt = ( UINT32 ) Value;
+			Interruptibility.BlockingByNmi = 1;
+			__vmx_vmwrite( VMCS_GUEST_INTERRUPTIBILITY_STATE, Interruptibility.AsUInt );
+		}
+	}
+
+	return 1;
+}
+
+
+int vmx::ept::HandleVmfunc( GCPUContext* context )
+{
+	context->vcpu->Ept.FailedVmfuncs++;
+	vmx::events::QueueException( &context->vcpu->Injection, InvalidOpcode, false, 0 );
+
+	return 1;
+}
+
+
+//
+// The processor set the semaphore when it delivered the #VE, clearing it is the last thing before IRET: a violation
+// until then exits instead of nesting a #VE
+//
+void vmx::ept::HandleVe( vCPU* vcpu )
+{
+	EptState* Ept = &vcpu->state->Ept;
+	VMX_VIRTUALIZATION_EXCEPTION_INFORMATION* Info = &vcpu->Ve.Info;
+	INT32 View = 0;
+
+	vcpu->Ept.VeDelivered++;
+
+	if ( Ept->VeHandler )
+		View = Ept->VeHandler( Info, Ept->VeContext );
+
+	if ( View < 0 || ( UINT32 ) View >= Ept->ViewCount )
+		vmx::__vmcall( VMCALL_VE_UNRESOLVED, 0, 0 );
+	else if ( Ept->VmfuncSwitching )
+		vmx::__vmfunc( 0, ( UINT32 ) View );
+	else
+		vmx::__vmcall( VMCALL_SWITCH_VIEW, ( UINT64 ) View, 0 );
+
+	KeMemoryBarrier();
+	Info->ExceptionMask = 0;
+}
+
+
+bool vmx::ept::HandleUnresolvedVe( vCPU* vcpu )
+{
+	if ( !vcpu->state->Ept.VeDelivery )
+		return false;
+
+	vcpu->Ept.VeUnresolved++;
+
+	return Fallback( vcpu, vcpu->Ve.Info.GuestPhysicalAddress );
+}
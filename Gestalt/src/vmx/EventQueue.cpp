@@ -0,0 +1,337 @@
+#include "vmx/vmx.h"
+
+//
+// VM-entry interruption information bits 30:12 are reserved, the IDT-vectoring information uses bit 12
+//
+#define INTERRUPTION_INFO_MASK 0x80000FFF
+
+
+void vmx::events::Reset( EventQueue* Queue, UINT32 ProcBasedControls, bool NmiWindowSupported )
+{
+	RtlSecureZeroMemory( Queue, sizeof( EventQueue ) );
+	Queue->ProcBasedControls = ProcBasedControls;
+	Queue->NmiWindowSupported = NmiWindowSupported;
+}
+
+
+bool vmx::events::Queue( EventQueue* Queue, UINT32 Vector, UINT32 Type, bool HasErrorCode, UINT32 ErrorCode, UINT32 InstructionLength )
+{
+	VMENTRY_INTERRUPT_INFORMATION Info;
+	PendingEvent* Event;
+
+	if ( Queue->Count == EVENT_QUEUE_SIZE )
+	{
+		Queue->Dropped++;
+		return false;
+	}
+
+	Info.AsUInt = 0;
+	Info.Vector = Vector;
+	Info.InterruptionType = Type;
+	Info.DeliverErrorCode = HasErrorCode;
+	Info.Valid = 1;
+
+	Event = &Queue->Events[Queue->Count++];
+	Event->Info = Info.AsUInt;
+	Event->ErrorCode = ErrorCode;
+	Event->InstructionLength = InstructionLength;
+
+	return true;
+}
+
+bool vmx::events::QueueException( EventQueue* Queue, UINT32 Vector, bool HasErrorCode, UINT32 ErrorCode )
+{
+	return vmx::events::Queue( Queue, Vector, HardwareException, HasErrorCode, ErrorCode, 0 );
+}
+
+bool vmx::events::QueueNmi( EventQueue* Queue )
+{
+	return vmx::events::Queue( Queue, Nmi, NonMaskableInterrupt, false, 0, 0 );
+}
+
+bool vmx::events::QueueInterrupt( EventQueue* Queue, UINT32 Vector )
+{
+	return vmx::events::Queue( Queue, Vector, ExternalInterrupt, false, 0, 0 );
+}
+
+
+//
+// Exceptions first, then NMIs, then external interrupts, like the processor orders them
+//
+static UINT32 Priority( UINT32 Type )
+{
+	switch ( Type )
+	{
+	case NonMaskableInterrupt:
+		return 1;
+	case ExternalInterrupt:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static bool CanInject( UINT32 Type, VMX_INTERRUPTIBILITY_STATE Interruptibility, RFLAGS Rflags )
+{
+	switch ( Type )
+	{
+	case NonMaskableInterrupt:
+		//
+		// Some processors block NMIs after STI too
+		//
+		return !Interruptibility.BlockingByNmi && !Interruptibility.BlockingByMovSs && !Interruptibility.BlockingBySti;
+	case ExternalInterrupt:
+		return Rflags.InterruptEnableFlag && !Interruptibility.BlockingByMovSs && !Interruptibility.BlockingBySti;
+	default:
+		return true;
+	}
+}
+
+static void WriteEvent( UINT32 Info, UINT32 ErrorCode, UINT32 InstructionLength )
+{
+	VMENTRY_INTERRUPT_INFORMATION Entry;
+
+	Entry.AsUInt = Info & INTERRUPTION_INFO_MASK;
+
+	if ( Entry.DeliverErrorCode )
+		__vmx_vmwrite( VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE, ErrorCode );
+
+	if ( Entry.InterruptionType == SoftwareInterrupt || Entry.InterruptionType == PrivilegedSoftwareException ||
+		Entry.InterruptionType == SoftwareException )
+		__vmx_vmwrite( VMCS_CTRL_VMENTRY_INSTRUCTION_LENGTH, InstructionLength );
+
+	__vmx_vmwrite( VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, Entry.AsUInt );
+}
+
+//
+// The controls are only written when a window changes. A waiting exception uses the interrupt window too,
+// it can go in on any entry and that's the soonest exit there is
+//
+static void UpdateWindows( EventQueue* Queue )
+{
+	IA32_VMX_PROCBASED_CTLS_REGISTER Controls;
+	bool InterruptWindow = false;
+	bool NmiWindow = false;
+
+	for ( UINT32 i = 0; i < Queue->Count; i++ )
+	{
+		VMENTRY_INTERRUPT_INFORMATION Info;
+
+		Info.AsUInt = Queue->Events[i].Info;
+
+		if ( Info.InterruptionType == NonMaskableInterrupt && Queue->NmiWindowSupported )
+			NmiWindow = true;
+		else
+			InterruptWindow = true;
+	}
+
+	if ( InterruptWindow == Queue->InterruptWindow && NmiWindow == Queue->NmiWindow )
+		return;
+
+	Controls.AsUInt = Queue->ProcBasedControls;
+	Controls.InterruptWindowExiting = InterruptWindow;
+	Controls.NmiWindowExiting = NmiWindow;
+	__vmx_vmwrite( VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, Controls.AsUInt );
+
+	Queue->InterruptWindow = InterruptWindow;
+	Queue->NmiWindow = NmiWindow;
+}
+
+
+void vmx::events::Inject( vCPU* vcpu, const GCPUContext* context )
+{
+	EventQueue* Queue = &vcpu->Injection;
+	VMEXIT_INTERRUPT_INFORMATION Vectoring;
+	VMX_INTERRUPTIBILITY_STATE Interruptibility;
+	size_t Value;
+	size_t ErrorCode = 0;
+	size_t InstructionLength = 0;
+	UINT32 Best = EVENT_QUEUE_SIZE;
+	bool VectoringHandled;
+
+	//
+	// NMIs and machine checks that hit root mode during this exit, see vmx::HostExceptionHandler
+	//
+	if ( vcpu->Events.PendingMachineCheck )
+	{
+		vcpu->Events.PendingMachineCheck = false;
+		QueueException( Queue, MachineCheck, false, 0 );
+	}
+
+	if ( vcpu->Events.PendingNmi )
+	{
+		vcpu->Events.PendingNmi = false;
+		QueueNmi( Queue );
+	}
+
+	__vmx_vmread( VMCS_IDT_VECTORING_INFORMATION, &Value );
+	Vectoring.AsUInt = ( UINT32 ) Value;
+	VectoringHandled = Queue->VectoringHandled;
+	Queue->VectoringHandled = false;
+
+	if ( Vectoring.Valid && !VectoringHandled )
+	{
+		//
+		// The exit interrupted the delivery of an event, it goes in again as it was
+		//
+		if ( Vectoring.ErrorCodeValid )
+			__vmx_vmread( VMCS_IDT_VECTORING_ERROR_CODE, &ErrorCode );
+
+		__vmx_vmread( VMCS_VMEXIT_INSTRUCTION_LENGTH, &InstructionLength );
+		WriteEvent( Vectoring.AsUInt, ( UINT32 ) ErrorCode, ( UINT32 ) InstructionLength );
+		UpdateWindows( Queue );
+		return;
+	}
+
+	if ( !Queue->Count )
+	{
+		UpdateWindows( Queue );
+		return;
+	}
+
+	__vmx_vmread( VMCS_GUEST_INTERRUPTIBILITY_STATE, &Value );
+	Interruptibility.AsUInt = ( UINT32 ) Value;
+
+	for ( UINT32 i = 0; i < Queue->Count; i++ )
+	{
+		VMENTRY_INTERRUPT_INFORMATION Info;
+
+		Info.AsUInt = Queue->Events[i].Info;
+
+		if ( !CanInject( Info.InterruptionType, Interruptibility, context->ExtRegs.rflags ) )
+			continue;
+
+		if ( Best == EVENT_QUEUE_SIZE ||
+			Priority( Info.InterruptionType ) < Priority( ( ( VMENTRY_INTERRUPT_INFORMATION* ) &Queue->Events[Best].Info )->InterruptionType ) )
+			Best = i;
+	}
+
+	if ( Best != EVENT_QUEUE_SIZE )
+	{
+		PendingEvent* Event = &Queue->Events[Best];
+
+		WriteEvent( Event->Info, Event->ErrorCode, Event->InstructionLength );
+		Queue->Injected++;
+
+		//
+		// Keep the arrival order of the others
+		//
+		for ( UINT32 i = Best + 1; i < Queue->Count; i++ )
+			Queue->Events[i - 1] = Queue->Events[i];
+
+		Queue->Count--;
+	}
+
+	UpdateWindows( Queue );
+}
+
+
+static bool IsContributory( UINT32 Vector )
+{
+	return Vector == DivideError || Vector == InvalidTss || Vector == SegmentNotPresent || Vector == StackSegmentFault ||
+		Vector == GeneralProtection;
+}
+
+//
+// The exception exited while the guest was delivering another event. Two faults that can't be handled serially
+// make a double fault; otherwise the new exception goes first, and an interrupted NMI or external interrupt waits
+// behind it (a faulting instruction or a software interrupt just runs again)
+//
+static bool CombineWithVectoring( EventQueue* Queue, UINT32 Vector )
+{
+	VMEXIT_INTERRUPT_INFORMATION Vectoring;
+	size_t Value;
+
+	__vmx_vmread( VMCS_IDT_VECTORING_INFORMATION, &Value );
+	Vectoring.AsUInt = ( UINT32 ) Value;
+
+	if ( !Vectoring.Valid )
+		return false;
+
+	Queue->VectoringHandled = true;
+
+	if ( Vectoring.InterruptionType == HardwareException &&
+		( ( IsContributory( Vectoring.Vector ) && IsContributory( Vector ) ) ||
+		( Vectoring.Vector == PageFault && ( Vector == PageFault || IsContributory( Vector ) ) ) ) )
+	{
+		vmx::events::QueueException( Queue, DoubleFault, true, 0 );
+		return true;
+	}
+
+	if ( Vectoring.InterruptionType == NonMaskableInterrupt )
+		vmx::events::QueueNmi( Queue );
+	else if ( Vectoring.InterruptionType == ExternalInterrupt )
+		vmx::events::QueueInterrupt( Queue, Vectoring.Vector );
+
+	return false;
+}
+
+int vmx::events::HandleExceptionOrNmi( GCPUContext* context )
+{
+	EventQueue* Queue = &context->vcpu->Injection;
+	VMEXIT_INTERRUPT_INFORMATION Info;
+	size_t Value;
+	size_t ErrorCode = 0;
+
+	__vmx_vmread( VMCS_VMEXIT_INTERRUPTION_INFORMATION, &Value );
+	Info.AsUInt = ( UINT32 ) Value;
+
+	if ( !Info.Valid )
+		return 0;
+
+	//
+	// A fault in an IRET that unblocked NMIs, the guest gets the blocking back before it sees the fault
+	//
+	if ( Info.NmiUnblocking && Info.Vector != DoubleFault )
+	{
+		VMX_INTERRUPTIBILITY_STATE Interruptibility;
+
+		__vmx_vmread( VMCS_GUEST_INTERRUPTIBILITY_STATE, &Value );
+		Interruptibility.AsUInt = ( UINT32 ) Value;
+		Interruptibility.BlockingByNmi = 1;
+		__vmx_vmwrite( VMCS_GUEST_INTERRUPTIBILITY_STATE, Interruptibility.AsUInt );
+	}
+
+	switch ( Info.InterruptionType )
+	{
+	case NonMaskableInterrupt:
+		//
+		// With NMI exiting the NMI stays blocked in root mode until an IRET
+		//
+		__unblock_nmi();
+
+		if ( !vmx::kick::IsKick( &context->vcpu->Kick ) )
+			QueueNmi( Queue );
+		break;
+	case HardwareException:
+		//
+		// A page fault that exits doesn't load CR2, VMX doesn't switch CR2 so the guest sees this value
+		//
+		if ( Info.Vector == PageFault )
+		{
+			__vmx_vmread( VMCS_EXIT_QUALIFICATION, &Value );
+			__writecr2( Value );
+		}
+
+		if ( Info.ErrorCodeValid )
+			__vmx_vmread( VMCS_VMEXIT_INTERRUPTION_ERROR_CODE, &ErrorCode );
+
+		if ( CombineWithVectoring( Queue, Info.Vector ) )
+			break;
+
+		//
+		// Ahead of the interrupted event CombineWithVectoring may have queued
+		//
+		QueueException( Queue, Info.Vector, Info.ErrorCodeValid, ( UINT32 ) ErrorCode );
+		break;
+	case SoftwareException:
+	case PrivilegedSoftwareException:
+		__vmx_vmread( VMCS_VMEXIT_INSTRUCTION_LENGTH, &Value );
+		vmx::events::Queue( Queue, Info.Vector, Info.InterruptionType, false, 0, ( UINT32 ) Value );
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+}
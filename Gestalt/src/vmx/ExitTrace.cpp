@@ -0,0 +1,77 @@
+#include "vmx/vmx.h"
+
+
+static_assert( FIELD_OFFSET( GCPUContext, rax ) - FIELD_OFFSET( GCPUContext, r15 ) == ( EXIT_TRACE_GPR_COUNT - 1 ) * sizeof( UINT64 ),
+	"ExitTraceRecord::Gpr is copied straight from GCPUContext" );
+
+
+//
+// Take a record of the current exit, called from the exit handler with the guest RIP/RSP/RFLAGS already read
+//
+void vmx::trace::Record( ExitTrace* Trace, const GCPUContext* context, UINT32 Reason, UINT64 Tsc )
+{
+	ExitTraceRecord* Record;
+	size_t InstructionLength;
+
+	if ( Trace->Count >= Trace->Capacity )
+	{
+		Trace->Dropped++;
+		return;
+	}
+
+	Record = &Trace->Records[Trace->Count];
+
+	__vmx_vmread( VMCS_VMEXIT_INSTRUCTION_LENGTH, &InstructionLength );
+	__vmx_vmread( VMCS_EXIT_QUALIFICATION, &Record->Qualification );
+
+	Record->Tsc = Tsc;
+	Record->Reason = Reason;
+	Record->InstructionLength = ( UINT32 ) InstructionLength;
+	Record->Rip = context->ExtRegs.rip;
+	Record->Rsp = context->ExtRegs.rsp;
+	Record->Rflags = context->ExtRegs.rflags.AsUInt;
+	RtlCopyMemory( Record->Gpr, &context->r15, sizeof( Record->Gpr ) );
+
+	//
+	// Readers only look at records bellow Count, publish it once the record is complete
+	//
+	KeMemoryBarrierWithoutFence();
+	Trace->Count++;
+}
+
+
+void vmx::trace::FillHeader( const ExitTrace* Trace, int CpuNumber, ExitTraceHeader* Header )
+{
+	RtlSecureZeroMemory( Header, sizeof( ExitTraceHeader ) );
+
+	Header->Magic = EXIT_TRACE_MAGIC;
+	Header->Version = EXIT_TRACE_VERSION;
+	Header->RecordSize = sizeof( ExitTraceRecord );
+	Header->CpuNumber = ( UINT32 ) CpuNumber;
+	Header->RecordCount = Trace->Count;
+	Header->Dropped = Trace->Dropped;
+}
+
+
+//
+// Validate the block at the start of the buffer, returns its records and the size of the whole block
+//
+const ExitTraceRecord* vmx::trace::ParseBlock( const void* Buffer, SIZE_T BufferSize, ExitTraceHeader* Header, SIZE_T* BlockSize )
+{
+	if ( BufferSize < sizeof( ExitTraceHeader ) )
+		return nullptr;
+
+	RtlCopyMemory( Header, Buffer, sizeof( ExitTraceHeader ) );
+
+	if ( Header->Magic != EXIT_TRACE_MAGIC ||
+		Header->Version != EXIT_TRACE_VERSION ||
+		Header->RecordSize != sizeof( ExitTraceRecord ) ||
+		Header->RecordCount > ( BufferSize - sizeof( ExitTraceHeader ) ) / sizeof( ExitTraceRecord ) )
+	{
+		return nullptr;
+	}
+
+	*BlockSize = sizeof( ExitTraceHeader ) + ( SIZE_T ) Header->RecordCount * sizeof( ExitTraceRecord );
+
+	return ( const ExitTraceRecord* ) ( ( const BYTE* ) Buffer + sizeof( ExitTraceHeader ) );
+}
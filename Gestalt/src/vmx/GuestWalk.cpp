@@ -0,0 +1,259 @@
+#include "vmx/vmx.h"
+
+//
+// Bits 51:12 of CR3 and of the paging structure entries
+//
+#define PAGING_ADDRESS_MASK 0x000FFFFFFFFFF000ULL
+#define PAGING_ENTRIES_SHIFT 9
+#define PAGING_INDEX( ADDRESS, SHIFT ) ( ( ( ADDRESS ) >> ( SHIFT ) ) & 0x1FF )
+
+
+UINT64 vmx::guest::AddressSpaceTag( UINT64 Cr3, UINT64 Cr4 )
+{
+	CR4 cr4;
+
+	cr4.AsUInt = Cr4;
+
+	return ( Cr3 & PAGING_ADDRESS_MASK ) | ( cr4.PcidEnable ? Cr3 & GUEST_CR3_PCID_MASK : 0 );
+}
+
+
+//
+// Bits 63:47 (63:56 with 5-level paging) must all be copies of the highest translated bit
+//
+static bool IsCanonical( UINT64 Address, bool FiveLevel )
+{
+	int Bits = FiveLevel ? 57 : 48;
+
+	return ( UINT64 ) ( ( INT64 ) ( Address << ( 64 - Bits ) ) >> ( 64 - Bits ) ) == Address;
+}
+
+
+GUEST_WALK_STATUS vmx::guest::Walk( const HostAddressSpace* Host, UINT64 Cr3, UINT64 Cr4, UINT64 Address, GuestTranslation* Translation )
+{
+	CR4 cr4;
+	PT_ENTRY_64 Entry;
+	UINT64 Table = Cr3 & PAGING_ADDRESS_MASK;
+	int Shift;
+	bool Writable = true;
+	bool User = true;
+	bool Executable = true;
+
+	cr4.AsUInt = Cr4;
+	Shift = cr4.LinearAddresses57Bit ? 48 : 39;
+
+	if ( !IsCanonical( Address, cr4.LinearAddresses57Bit ) )
+		return GuestWalkNonCanonical;
+
+	//
+	// PML5 (5-level only), PML4, PDPT, PD and PT. PS stops the walk at the PDPT (1 GB) or at the PD (2 MB)
+	//
+	for ( ;; Shift -= PAGING_ENTRIES_SHIFT )
+	{
+		if ( !vmx::mem::ReadPhysical( Host, Table + PAGING_INDEX( Address, Shift ) * sizeof( UINT64 ), &Entry.AsUInt, sizeof( UINT64 ) ) )
+			return GuestWalkUnreadable;
+
+		if ( !Entry.Present )
+			return GuestWalkNotPresent;
+
+		Writable &= Entry.Write;
+		User &= Entry.Supervisor;
+		Executable &= !Entry.ExecuteDisable;
+
+		if ( Shift == GUEST_PAGE_SHIFT_4KB ||
+			( Entry.LargePage && ( Shift == GUEST_PAGE_SHIFT_2MB || Shift == GUEST_PAGE_SHIFT_1GB ) ) )
+			break;
+
+		Table = Entry.AsUInt & PAGING_ADDRESS_MASK;
+	}
+
+	//
+	// Bit 12 of a large page entry is its PAT bit, the frame starts at the page size
+	//
+	Translation->PhysicalAddress = ( Entry.AsUInt & PAGING_ADDRESS_MASK & ~( ( 1ULL << Shift ) - 1 ) ) | ( Address & ( ( 1ULL << Shift ) - 1 ) );
+	Translation->PageShift = ( UINT8 ) Shift;
+	Translation->Writable = Writable;
+	Translation->User = User;
+	Translation->Executable = Executable;
+	Translation->Global = cr4.PageGlobalEnable && Entry.Global;
+
+	return GuestWalkOk;
+}
+
+
+//
+// Global translations are shared by every address space, like the processor does, so the slot only depends on the address
+//
+GUEST_WALK_STATUS vmx::guest::Translate( TranslationCache* Cache, const HostAddressSpace* Host, UINT64 Cr3, UINT64 Cr4, UINT64 Address,
+	GuestTranslation* Translation )
+{
+	GUEST_WALK_STATUS status;
+	TranslationCacheEntry* Entry;
+	UINT64 Tag;
+	UINT64 VirtualPage = Address >> PAGE_SHIFT;
+	UINT64 Start;
+
+	if ( !Cache->Enabled )
+		return Walk( Host, Cr3, Cr4, Address, Translation );
+
+	Tag = AddressSpaceTag( Cr3, Cr4 );
+	Entry = &Cache->Entries[VirtualPage & ( TRANSLATION_CACHE_ENTRIES - 1 )];
+
+	if ( Entry->Valid && Entry->VirtualPage == VirtualPage && ( Entry->Tag == Tag || Entry->Global ) )
+	{
+		Cache->Hits++;
+
+		Translation->PhysicalAddress = ( Entry->PhysicalPage << PAGE_SHIFT ) | ( Address & ( PAGE_SIZE - 1 ) );
+		Translation->PageShift = Entry->PageShift;
+		Translation->Writable = Entry->Writable;
+		Translation->User = Entry->User;
+		Translation->Executable = Entry->Executable;
+		Translation->Global = Entry->Global;
+
+		return GuestWalkOk;
+	}
+
+	Start = __rdtsc();
+	status = Walk( Host, Cr3, Cr4, Address, Translation );
+	Cache->WalkCycles += __rdtsc() - Start;
+	Cache->Misses++;
+
+	//
+	// Failed walks aren't cached, the processor doesn't cache not-present translations either
+	//
+	if ( status == GuestWalkOk )
+	{
+		Entry->Tag = Tag;
+		Entry->VirtualPage = VirtualPage;
+		Entry->PhysicalPage = Translation->PhysicalAddress >> PAGE_SHIFT;
+		Entry->PageShift = Translation->PageShift;
+		Entry->Writable = Translation->Writable;
+		Entry->User = Translation->User;
+		Entry->Executable = Translation->Executable;
+		Entry->Global = Translation->Global;
+		Entry->Valid = true;
+	}
+
+	return status;
+}
+
+
+bool vmx::guest::ReadVirtual( TranslationCache* Cache, const HostAddressSpace* Host, UINT64 Cr3, UINT64 Cr4, UINT64 Address,
+	void* Buffer, SIZE_T Size )
+{
+	GuestTranslation Translation;
+	BYTE* Destination = ( BYTE* ) Buffer;
+
+	while ( Size )
+	{
+		SIZE_T Chunk = PAGE_SIZE - ( Address & ( PAGE_SIZE - 1 ) );
+
+		if ( Chunk > Size )
+			Chunk = Size;
+
+		if ( Translate( Cache, Host, Cr3, Cr4, Address, &Translation ) != GuestWalkOk ||
+			!vmx::mem::ReadPhysical( Host, Translation.PhysicalAddress, Destination, Chunk ) )
+			return false;
+
+		Destination += Chunk;
+		Address += Chunk;
+		Size -= Chunk;
+	}
+
+	return true;
+}
+
+bool vmx::guest::WriteVirtual( TranslationCache* Cache, const HostAddressSpace* Host, UINT64 Cr3, UINT64 Cr4, UINT64 Address,
+	const void* Buffer, SIZE_T Size )
+{
+	GuestTranslation Translation;
+	const BYTE* Source = ( const BYTE* ) Buffer;
+
+	while ( Size )
+	{
+		SIZE_T Chunk = PAGE_SIZE - ( Address & ( PAGE_SIZE - 1 ) );
+
+		if ( Chunk > Size )
+			Chunk = Size;
+
+		if ( Translate( Cache, Host, Cr3, Cr4, Address, &Translation ) != GuestWalkOk || !Translation.Writable ||
+			!vmx::mem::WritePhysical( Host, Translation.PhysicalAddress, Source, Chunk ) )
+			return false;
+
+		Source += Chunk;
+		Address += Chunk;
+		Size -= Chunk;
+	}
+
+	return true;
+}
+
+
+void vmx::guest::ResetCache( TranslationCache* Cache, bool Enabled )
+{
+	RtlSecureZeroMemory( Cache, sizeof( TranslationCache ) );
+	Cache->Enabled = Enabled;
+}
+
+void vmx::guest::FlushAll( TranslationCache* Cache, bool Globals )
+{
+	for ( UINT32 i = 0; i < TRANSLATION_CACHE_ENTRIES; i++ )
+	{
+		if ( Globals || !Cache->Entries[i].Global )
+			Cache->Entries[i].Valid = false;
+	}
+
+	Cache->Flushes++;
+}
+
+//
+// A large page is cached once per 4 KB page used, every entry inside it goes. Entries of every address space are dropped,
+// INVLPG only has to drop the current one but doing more is always allowed
+//
+void vmx::guest::FlushAddress( TranslationCache* Cache, UINT64 Address )
+{
+	for ( UINT32 i = 0; i < TRANSLATION_CACHE_ENTRIES; i++ )
+	{
+		TranslationCacheEntry* Entry = &Cache->Entries[i];
+
+		if ( ( Entry->VirtualPage << PAGE_SHIFT ) >> Entry->PageShift == Address >> Entry->PageShift )
+			Entry->Valid = false;
+	}
+
+	Cache->Flushes++;
+}
+
+//
+// INVPCID individual-address and single-context, global translations are kept
+//
+void vmx::guest::FlushPcid( TranslationCache* Cache, UINT64 Pcid, bool SingleAddress, UINT64 Address )
+{
+	for ( UINT32 i = 0; i < TRANSLATION_CACHE_ENTRIES; i++ )
+	{
+		TranslationCacheEntry* Entry = &Cache->Entries[i];
+
+		if ( Entry->Global || ( Entry->Tag & GUEST_CR3_PCID_MASK ) != ( Pcid & GUEST_CR3_PCID_MASK ) )
+			continue;
+
+		if ( !SingleAddress || ( Entry->VirtualPage << PAGE_SHIFT ) >> Entry->PageShift == Address >> Entry->PageShift )
+			Entry->Valid = false;
+	}
+
+	Cache->Flushes++;
+}
+
+//
+// MOV to CR3: without PCIDs every non-global translation goes. With PCIDs only the ones of the new PCID,
+// and none when bit 63 of the source operand is set
+//
+void vmx::guest::LoadCr3( TranslationCache* Cache, UINT64 Cr3, UINT64 Cr4 )
+{
+	CR4 cr4;
+
+	cr4.AsUInt = Cr4;
+
+	if ( !cr4.PcidEnable )
+		FlushAll( Cache, false );
+	else if ( !( Cr3 & GUEST_CR3_NO_FLUSH ) )
+		FlushPcid( Cache, Cr3, false, 0 );
+}
@@ -0,0 +1,162 @@
+#include "vmx/vmx.h"
+
+
+static UINT8 StackFor( UINT32 Vector )
+{
+	switch ( Vector )
+	{
+	case Nmi:
+		return HOST_IST_NMI;
+	case DoubleFault:
+		return HOST_IST_DOUBLE_FAULT;
+	case MachineCheck:
+		return HOST_IST_MACHINE_CHECK;
+	default:
+		return 0;
+	}
+}
+
+
+bool vmx::host::BuildDescriptors( HostDescriptors* Descriptors, const SEGMENT_DESCRIPTOR_REGISTER_64* SystemGdtr, UINT16 CsSelector,
+	UINT16 TrSelector )
+{
+	SEGMENT_DESCRIPTOR_64* Tss;
+	UINT64 TssBase = ( UINT64 ) &Descriptors->Tss;
+	UINT32 TrIndex = TrSelector >> 3;
+
+	if ( ( UINT32 ) SystemGdtr->Limit + 1 > sizeof( Descriptors->Gdt ) || !TrIndex || ( TrIndex + 1 ) * 8 + 7 > SystemGdtr->Limit )
+		return false;
+
+	RtlSecureZeroMemory( Descriptors, FIELD_OFFSET( HostDescriptors, IstStacks ) );
+	RtlCopyMemory( Descriptors->Gdt, ( const void* ) SystemGdtr->BaseAddress, SystemGdtr->Limit + 1 );
+
+	Tss = ( SEGMENT_DESCRIPTOR_64* ) &Descriptors->Gdt[TrIndex];
+
+	if ( Tss->DescriptorType || ( Tss->Type != SEGMENT_DESCRIPTOR_TYPE_TSS_AVAILABLE && Tss->Type != SEGMENT_DESCRIPTOR_TYPE_TSS_BUSY ) )
+		return false;
+
+	Tss->SegmentLimitLow = sizeof( TASK_STATE_SEGMENT_64 ) - 1;
+	Tss->SegmentLimitHigh = 0;
+	Tss->Granularity = 0;
+	Tss->BaseAddressLow = ( UINT16 ) TssBase;
+	Tss->BaseAddressMiddle = ( TssBase >> 16 ) & 0xFF;
+	Tss->BaseAddressHigh = ( TssBase >> 24 ) & 0xFF;
+	Tss->BaseAddressUpper = ( UINT32 ) ( TssBase >> 32 );
+
+	//
+	// Stacks grow down, each IST entry is the top of its own stack. No I/O permission bitmap
+	//
+	Descriptors->Tss.Ist1 = ( UINT64 ) Descriptors->IstStacks[HOST_IST_NMI - 1] + HOST_IST_STACK_SIZE;
+	Descriptors->Tss.Ist2 = ( UINT64 ) Descriptors->IstStacks[HOST_IST_DOUBLE_FAULT - 1] + HOST_IST_STACK_SIZE;
+	Descriptors->Tss.Ist3 = ( UINT64 ) Descriptors->IstStacks[HOST_IST_MACHINE_CHECK - 1] + HOST_IST_STACK_SIZE;
+	Descriptors->Tss.IoMapBase = sizeof( TASK_STATE_SEGMENT_64 );
+
+	for ( UINT32 Vector = 0; Vector < HOST_IDT_ENTRIES; Vector++ )
+	{
+		SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64* Gate = &Descriptors->Idt[Vector];
+		UINT64 Stub = __vmx_host_isr_table[Vector < HOST_EXCEPTION_VECTORS ? Vector : HOST_VECTOR_UNEXPECTED];
+
+		Gate->OffsetLow = ( UINT16 ) Stub;
+		Gate->OffsetMiddle = ( UINT16 ) ( Stub >> 16 );
+		Gate->OffsetHigh = ( UINT32 ) ( Stub >> 32 );
+		Gate->SegmentSelector = CsSelector;
+		Gate->InterruptStackTable = Vector < HOST_EXCEPTION_VECTORS ? StackFor( Vector ) : 0;
+		Gate->Type = SEGMENT_DESCRIPTOR_TYPE_INTERRUPT_GATE;
+		Gate->Present = 1;
+	}
+
+	return true;
+}
+
+
+//
+// Exit context of the exit being handled, at the top of the host stack
+//
+static GCPUContext* GetExitContext( vCPU* vcpu )
+{
+	return ( GCPUContext* ) ( vcpu->HostState.RSP + vcpu->HostState.StackSize - sizeof( HostStackTop ) - FIELD_OFFSET( GCPUContext, ExtRegs ) );
+}
+
+//
+// Called by the host interrupt stubs. The vCPU is found through the host TR base, which points inside it
+//
+extern "C" void vmx::HostExceptionHandler( HostTrapFrame* Frame )
+{
+	IA32_MCG_STATUS_REGISTER McgStatus;
+	size_t TrBase;
+	vCPU* vcpu;
+	HostEvents* Events;
+
+	__vmx_vmread( VMCS_HOST_TR_BASE, &TrBase );
+	vcpu = CONTAINING_RECORD( TrBase, vCPU, Descriptors.Tss );
+	Events = &vcpu->Events;
+
+	switch ( Frame->Vector )
+	{
+	case Nmi:
+		if ( vmx::kick::IsKick( &vcpu->Kick ) )
+			return;
+
+		Events->PendingNmi = true;
+		Events->Nmis++;
+		return;
+	case MachineCheck:
+		McgStatus.AsUInt = __readmsr( IA32_MCG_STATUS );
+
+		//
+		// Execution can only continue where it was interrupted when the processor says so
+		//
+		if ( McgStatus.Ripv )
+		{
+			Events->PendingMachineCheck = true;
+			Events->MachineChecks++;
+			return;
+		}
+		break;
+	case GeneralProtection:
+		//
+		// An MSR the guest named doesn't exist, the exit handler gives the #GP to the guest
+		//
+		if ( Frame->rip == ( UINT64 ) __vmx_msr_read || Frame->rip == ( UINT64 ) __vmx_msr_write )
+		{
+			Events->MsrFaults++;
+			Frame->rip = ( UINT64 ) __vmx_msr_fault;
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+
+	Events->FaultVector = Frame->Vector;
+	Events->FaultErrorCode = Frame->ErrorCode;
+	Events->FaultRip = Frame->rip;
+	Events->FaultAddress = Frame->Vector == PageFault ? __readcr2() : 0;
+
+	//
+	// Return into __vmx_host_fault_resume, on the host stack right at the context of the exit
+	//
+	Frame->rip = ( UINT64 ) __vmx_host_fault_resume;
+	Frame->rsp = ( UINT64 ) GetExitContext( vcpu );
+}
+
+
+//
+// The exit handler didn't finish, the guest resumes without the hypervisor at the instruction that caused the exit,
+// which runs again natively
+//
+extern "C" void vmx::HostFaultResume( GCPUContext* context )
+{
+	HostEvents* Events = &context->vcpu->Events;
+
+	__vmx_vmread( VMCS_GUEST_RIP, &context->ExtRegs.rip );
+	__vmx_vmread( VMCS_GUEST_RSP, &context->ExtRegs.rsp );
+	__vmx_vmread( VMCS_GUEST_RFLAGS, &context->ExtRegs.rflags.AsUInt );
+
+	vmx::PrepareDevirtualize( context );
+	context->rcx = context->ExtRegs.rip;
+
+	DbgInfo( "Exception %llu in root mode at 0x%llx (error code 0x%llx, address 0x%llx), processor %d leaves VMX operation",
+		Events->FaultVector, Events->FaultRip, Events->FaultErrorCode, Events->FaultAddress, context->vcpu->CpuNumber );
+}
+
@@ -0,0 +1,298 @@
+#include "vmx/vmx.h"
+
+
+//
+// One bit per port, a set bit makes every access touching the port exit
+//
+static void SetIntercept( IoIntercepts* Io, UINT16 First, UINT16 Last, bool Intercept )
+{
+	for ( UINT32 Port = First; Port <= Last; Port++ )
+	{
+		UINT8* BitMap = Port < IO_BITMAP_PORTS ? Io->BitMapA : Io->BitMapB;
+		UINT32 Bit = Port % IO_BITMAP_PORTS;
+
+		if ( Intercept )
+			InterlockedOr8( ( char* ) &BitMap[Bit / 8], ( char ) ( 1 << ( Bit % 8 ) ) );
+		else
+			InterlockedAnd8( ( char* ) &BitMap[Bit / 8], ( char ) ~( 1 << ( Bit % 8 ) ) );
+	}
+}
+
+
+bool vmx::io::AddRange( GlobalState* state, UINT16 First, UINT16 Last, IO_INTERCEPT_HANDLER Handler, void* Context )
+{
+	IoIntercepts* Io = &state->Io;
+	IoRange* Free = nullptr;
+
+	if ( First > Last || !Handler )
+		return false;
+
+	for ( UINT32 i = 0; i < MAX_IO_RANGES; i++ )
+	{
+		IoRange* Range = &Io->Ranges[i];
+
+		if ( !Range->Active )
+		{
+			if ( !Free )
+				Free = Range;
+		}
+		else if ( First <= Range->Last && Last >= Range->First )
+		{
+			return false;
+		}
+	}
+
+	if ( !Free )
+		return false;
+
+	Free->First = First;
+	Free->Last = Last;
+	Free->Handler = Handler;
+	Free->Context = Context;
+	Free->Exits = 0;
+
+	KeMemoryBarrier();
+	Free->Active = true;
+
+	SetIntercept( Io, First, Last, true );
+
+	return true;
+}
+
+
+//
+// The handler and its context stay in the slot, an exit taken before the bits were cleared may still be using them
+//
+bool vmx::io::RemoveRange( GlobalState* state, UINT16 First )
+{
+	IoIntercepts* Io = &state->Io;
+
+	for ( UINT32 i = 0; i < MAX_IO_RANGES; i++ )
+	{
+		IoRange* Range = &Io->Ranges[i];
+
+		if ( !Range->Active || Range->First != First )
+			continue;
+
+		SetIntercept( Io, Range->First, Range->Last, false );
+		Range->Active = false;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+int vmx::io::HandleIo( GCPUContext* context )
+{
+	IoIntercepts* Io = &context->vcpu->state->Io;
+	VMX_EXIT_QUALIFICATION_IO_INSTRUCTION Qualification;
+	IoAccess Access;
+	size_t Value;
+	int status = -1;
+
+	__vmx_vmread( VMCS_EXIT_QUALIFICATION, &Value );
+	Qualification.AsUInt = Value;
+
+	//
+	// The size is encoded as 0, 1 or 3
+	//
+	Access.Port = ( UINT16 ) Qualification.PortNumber;
+	Access.Size = ( UINT8 ) ( Qualification.SizeOfAccess + 1 );
+	Access.In = Qualification.DirectionOfAccess != 0;
+	Access.String = Qualification.StringInstruction != 0;
+	Access.Rep = Qualification.RepPrefixed != 0;
+	Access.Immediate = Qualification.OperandEncoding != 0;
+	Access.LinearAddress = 0;
+	Access.Count = Access.Rep ? context->rcx : 1;
+
+	if ( Access.String )
+		__vmx_vmread( VMCS_EXIT_GUEST_LINEAR_ADDRESS, &Access.LinearAddress );
+
+	//
+	// A word or dword access exits when any of its ports is intercepted, the range of the first such port claims it,
+	// and its handler alone decides
+	//
+	for ( UINT32 i = 0; i < MAX_IO_RANGES; i++ )
+	{
+		IoRange* Range = &Io->Ranges[i];
+
+		if ( !Range->Active || Access.Port > Range->Last || Access.Port + Access.Size - 1 < Range->First )
+			continue;
+
+		InterlockedIncrement64( &Range->Exits );
+		status = Range->Handler( context, &Access, Range->Context );
+		break;
+	}
+
+	//
+	// Passed on, or removed while this exit was on its way
+	//
+	if ( status < 0 )
+		status = vmx::io::PassThrough( context, &Access );
+
+	if ( status == 1 )
+		vmx::vm::NextInstruction( context );
+
+	return status;
+}
+
+
+static UINT32 ReadPort( UINT16 Port, UINT8 Size )
+{
+	switch ( Size )
+	{
+	case 1:
+		return __inbyte( Port );
+	case 2:
+		return __inword( Port );
+	default:
+		return __indword( Port );
+	}
+}
+
+static void WritePort( UINT16 Port, UINT8 Size, UINT32 Value )
+{
+	switch ( Size )
+	{
+	case 1:
+		__outbyte( Port, ( UINT8 ) Value );
+		break;
+	case 2:
+		__outword( Port, ( UINT16 ) Value );
+		break;
+	default:
+		__outdword( Port, Value );
+		break;
+	}
+}
+
+
+//
+// The element at Address, as the guest at its CPL would access it (CR0.WP set). When it can't, the #PF (or the #GP of a
+// non-canonical address) is queued with CR2 set, as the processor would deliver it
+//
+static bool CheckElement( GCPUContext* context, UINT64 Cr3, UINT64 Cr4, bool User, UINT64 Address, UINT8 Size, bool Write )
+{
+	vCPU* vcpu = context->vcpu;
+	GuestTranslation Translation;
+	PAGE_FAULT_EXCEPTION ErrorCode;
+	UINT64 Page = Address;
+
+	for ( ;; )
+	{
+		GUEST_WALK_STATUS Status = vmx::guest::Translate( &vcpu->Translations, &vcpu->state->Host, Cr3, Cr4, Page, &Translation );
+
+		if ( Status == GuestWalkNonCanonical )
+		{
+			vmx::events::QueueException( &vcpu->Injection, GeneralProtection, true, 0 );
+			return false;
+		}
+
+		if ( Status != GuestWalkOk || ( Write && !Translation.Writable ) || ( User && !Translation.User ) )
+		{
+			ErrorCode.AsUInt = 0;
+			ErrorCode.Present = Status == GuestWalkOk;
+			ErrorCode.Write = Write;
+			ErrorCode.UserModeAccess = User;
+
+			__writecr2( Page );
+			vmx::events::QueueException( &vcpu->Injection, PageFault, true, ErrorCode.AsUInt );
+
+			return false;
+		}
+
+		//
+		// An element across a page boundary needs the next page too
+		//
+		if ( ( Page | ( PAGE_SIZE - 1 ) ) >= Address + Size - 1 )
+			return true;
+
+		Page = ( Page & ~( UINT64 ) ( PAGE_SIZE - 1 ) ) + PAGE_SIZE;
+	}
+}
+
+
+//
+// IN to AL and AX keeps the rest of RAX, IN to EAX zero-extends like any 32-bit write.
+// String instructions are done with a 64-bit address size, one element at a time. RDI/RSI and RCX always show the
+// iterations done, so the guest can take a fault or an interrupt and run the instruction again for the rest
+//
+int vmx::io::PassThrough( GCPUContext* context, const IoAccess* Access )
+{
+	vCPU* vcpu = context->vcpu;
+	UINT64 Mask = Access->Size == 4 ? MAXUINT64 : ( 1ULL << ( Access->Size * 8 ) ) - 1;
+	UINT64 Address = Access->LinearAddress;
+	INT64 Step = context->ExtRegs.rflags.DirectionFlag ? -( INT64 ) Access->Size : Access->Size;
+	UINT64 Count = Access->Count < MAX_IO_STRING_ITERATIONS ? Access->Count : MAX_IO_STRING_ITERATIONS;
+	VMX_SEGMENT_ACCESS_RIGHTS Ss;
+	size_t Value;
+	size_t Cr3;
+	size_t Cr4;
+	UINT64 Done = 0;
+	UINT32 Data;
+	bool User;
+	int status = 1;
+
+	if ( !Access->String )
+	{
+		if ( Access->In )
+			context->rax = ( context->rax & ~Mask ) | ReadPort( Access->Port, Access->Size );
+		else
+			WritePort( Access->Port, Access->Size, ( UINT32 ) context->rax );
+
+		return 1;
+	}
+
+	if ( !vcpu->state->Host.Cr3 )
+		return 0;
+
+	__vmx_vmread( VMCS_GUEST_CR3, &Cr3 );
+	__vmx_vmread( VMCS_GUEST_CR4, &Cr4 );
+	__vmx_vmread( VMCS_GUEST_SS_ACCESS_RIGHTS, &Value );
+	Ss.AsUInt = ( UINT32 ) Value;
+	User = Ss.DescriptorPrivilegeLevel == 3;
+
+	//
+	// The port is read only once the element is known to be writable, an IN is never lost
+	//
+	for ( ; Done < Count; Done++, Address += Step )
+	{
+		if ( !CheckElement( context, Cr3, Cr4, User, Address, Access->Size, Access->In ) )
+		{
+			status = IO_RESTART;
+			break;
+		}
+
+		if ( Access->In )
+		{
+			Data = ReadPort( Access->Port, Access->Size );
+
+			if ( !vmx::guest::WriteVirtual( &vcpu->Translations, &vcpu->state->Host, Cr3, Cr4, Address, &Data, Access->Size ) )
+				return 0;
+		}
+		else
+		{
+			if ( !vmx::guest::ReadVirtual( &vcpu->Translations, &vcpu->state->Host, Cr3, Cr4, Address, &Data, Access->Size ) )
+				return 0;
+
+			WritePort( Access->Port, Access->Size, Data );
+		}
+	}
+
+	if ( Access->In )
+		context->rdi += Step * ( INT64 ) Done;
+	else
+		context->rsi += Step * ( INT64 ) Done;
+
+	if ( Access->Rep )
+	{
+		context->rcx -= Done;
+
+		if ( context->rcx )
+			status = IO_RESTART;
+	}
+
+	return status;
+}
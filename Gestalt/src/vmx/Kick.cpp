@@ -0,0 +1,144 @@
+#include "vmx/vmx.h"
+
+
+UINT32 vmx::kick::CurrentApicId()
+{
+	IA32_APIC_BASE_REGISTER ApicBase;
+	int regs[4];
+
+	ApicBase.AsUInt = __readmsr( IA32_APIC_BASE );
+
+	if ( ApicBase.EnableX2ApicMode )
+		return ( UINT32 ) __readmsr( IA32_X2APIC_APICID );
+
+	__cpuid( regs, CPUID_VERSION_INFORMATION );
+
+	return ( UINT32 ) regs[vm::ebx] >> 24;
+}
+
+
+static bool CanSendNmi( const GlobalState* state )
+{
+	IA32_APIC_BASE_REGISTER ApicBase;
+
+	ApicBase.AsUInt = __readmsr( IA32_APIC_BASE );
+
+	return ApicBase.EnableX2ApicMode || state->ApicMmio;
+}
+
+//
+// The xAPIC ICR is two registers, nothing else on this processor may write them in between
+//
+static void SendNmi( const GlobalState* state, UINT32 ApicId )
+{
+	IA32_APIC_BASE_REGISTER ApicBase;
+	volatile UINT32* Low = ( volatile UINT32* ) ( ( BYTE* ) state->ApicMmio + APIC_ICR_LOW );
+	volatile UINT32* High = ( volatile UINT32* ) ( ( BYTE* ) state->ApicMmio + APIC_ICR_HIGH );
+	UINT64 Flags;
+
+	ApicBase.AsUInt = __readmsr( IA32_APIC_BASE );
+
+	if ( ApicBase.EnableX2ApicMode )
+	{
+		__writemsr( IA32_X2APIC_ICR, ( ( UINT64 ) ApicId << 32 ) | APIC_ICR_NMI );
+		return;
+	}
+
+	Flags = __readeflags();
+	_disable();
+
+	while ( *Low & APIC_ICR_DELIVERY_PENDING )
+		_mm_pause();
+
+	*High = ApicId << 24;
+	*Low = APIC_ICR_NMI;
+
+	if ( Flags & RFLAGS_INTERRUPT_ENABLE_FLAG_FLAG )
+		_enable();
+}
+
+
+LONG64 vmx::kick::Send( vCPU* vcpu, LONG Requests )
+{
+	KickState* Kick = &vcpu->Kick;
+	LONG64 Ticket;
+
+	if ( !vcpu->Launched || !Kick->Enabled || !CanSendNmi( vcpu->state ) )
+		return 0;
+
+	//
+	// Requests and ticket first, they must be visible once the NMI is consumed. A kick NMI still in flight carries this
+	// one too, it isn't consumed yet so Process will see the ticket
+	//
+	InterlockedOr( &Kick->Requests, Requests );
+	Ticket = InterlockedIncrement64( &Kick->Sent );
+
+	if ( !InterlockedExchange( &Kick->Pending, 1 ) )
+		SendNmi( vcpu->state, Kick->ApicId );
+
+	return Ticket;
+}
+
+
+bool vmx::kick::Resend( vCPU* vcpu )
+{
+	KickState* Kick = &vcpu->Kick;
+
+	if ( !vcpu->Launched || !Kick->Enabled || !CanSendNmi( vcpu->state ) )
+		return false;
+
+	if ( !InterlockedExchange( &Kick->Pending, 1 ) )
+		SendNmi( vcpu->state, Kick->ApicId );
+
+	return true;
+}
+
+
+//
+// A real NMI that arrives while a kick is pending is taken for the kick, and the kick NMI is then given to the guest
+// in its place: the guest sees as many NMIs as there were. One that coalesced with the kick NMI is lost, like any
+// two NMIs the processor merges
+//
+bool vmx::kick::IsKick( KickState* Kick )
+{
+	if ( InterlockedExchange( &Kick->Pending, 0 ) )
+	{
+		Kick->Claimed = true;
+		return true;
+	}
+
+	Kick->RealNmis++;
+
+	return false;
+}
+
+
+void vmx::kick::Process( vCPU* vcpu )
+{
+	KickState* Kick = &vcpu->Kick;
+	LONG64 Ticket;
+	LONG Requests;
+
+	//
+	// Every ticket up to this one has its requests in already. KICK_SYNC needs nothing else
+	//
+	Kick->Claimed = false;
+	Ticket = Kick->Sent;
+	KeMemoryBarrier();
+	Requests = InterlockedExchange( &Kick->Requests, 0 );
+
+	if ( Requests & KICK_PROFILE )
+		vmx::profile::Apply( vcpu );
+
+	if ( Requests & KICK_PROCESSES )
+		vmx::process::Apply( vcpu );
+
+	if ( Requests & KICK_EPT )
+		vmx::ept::Invalidate( vcpu );
+
+	if ( Requests & KICK_COVERAGE )
+		vmx::coverage::Apply( vcpu );
+
+	KeMemoryBarrier();
+	Kick->Completed = Ticket;
+}
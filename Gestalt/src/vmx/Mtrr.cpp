@@ -0,0 +1,112 @@
+#include "vmx/vmx.h"
+
+
+void vmx::mtrr::Read( Mtrrs* Types )
+{
+	static const UINT32 FixedMsrs[MTRR_FIXED_REGISTERS] =
+	{
+		IA32_MTRR_FIX64K_00000, IA32_MTRR_FIX16K_80000, IA32_MTRR_FIX16K_A0000, IA32_MTRR_FIX4K_C0000, IA32_MTRR_FIX4K_C8000,
+		IA32_MTRR_FIX4K_D0000, IA32_MTRR_FIX4K_D8000, IA32_MTRR_FIX4K_E0000, IA32_MTRR_FIX4K_E8000, IA32_MTRR_FIX4K_F0000,
+		IA32_MTRR_FIX4K_F8000,
+	};
+	IA32_MTRR_CAPABILITIES_REGISTER Capabilities;
+	IA32_MTRR_DEF_TYPE_REGISTER DefType;
+
+	RtlSecureZeroMemory( Types, sizeof( Mtrrs ) );
+
+	Capabilities.AsUInt = __readmsr( IA32_MTRR_CAPABILITIES );
+	DefType.AsUInt = __readmsr( IA32_MTRR_DEF_TYPE );
+
+	Types->Enabled = DefType.MtrrEnable;
+	Types->FixedEnabled = DefType.FixedRangeMtrrEnable && Capabilities.FixedRangeSupported;
+	Types->DefaultType = ( UINT8 ) DefType.DefaultMemoryType;
+
+	for ( UINT32 i = 0; i < Capabilities.VariableRangeCount && i < IA32_MTRR_VARIABLE_COUNT; i++ )
+	{
+		IA32_MTRR_PHYSBASE_REGISTER Base;
+		IA32_MTRR_PHYSMASK_REGISTER Mask;
+		MtrrRange* Range;
+
+		Base.AsUInt = __readmsr( IA32_MTRR_PHYSBASE0 + i * 2 );
+		Mask.AsUInt = __readmsr( IA32_MTRR_PHYSMASK0 + i * 2 );
+
+		if ( !Mask.Valid )
+			continue;
+
+		Range = &Types->Variable[Types->VariableCount++];
+		Range->Base = Base.PageFrameNumber << PAGE_SHIFT;
+		Range->Mask = Mask.PageFrameNumber << PAGE_SHIFT;
+		Range->Type = ( UINT8 ) Base.Type;
+	}
+
+	for ( UINT32 i = 0; Types->FixedEnabled && i < MTRR_FIXED_REGISTERS; i++ )
+		Types->Fixed[i] = __readmsr( FixedMsrs[i] );
+}
+
+
+//
+// First MB: 8 ranges of 64 KB, 16 of 16 KB and 64 of 4 KB, one byte each
+//
+static UINT8 FixedType( const Mtrrs* Types, UINT64 Address )
+{
+	UINT32 Register;
+	UINT32 Byte;
+
+	if ( Address < 0x80000 )
+	{
+		Register = 0;
+		Byte = ( UINT32 ) ( Address >> 16 );
+	}
+	else if ( Address < 0xC0000 )
+	{
+		Register = 1 + ( UINT32 ) ( ( Address - 0x80000 ) >> 17 );
+		Byte = ( UINT32 ) ( ( Address - 0x80000 ) >> 14 ) & 7;
+	}
+	else
+	{
+		Register = 3 + ( UINT32 ) ( ( Address - 0xC0000 ) >> 15 );
+		Byte = ( UINT32 ) ( ( Address - 0xC0000 ) >> 12 ) & 7;
+	}
+
+	return ( UINT8 ) ( Types->Fixed[Register] >> ( Byte * 8 ) );
+}
+
+
+//
+// A variable range only covers part of the range when its mask has bits inside it and the bits above match. Overlaps
+// follow the SDM, UC wins and WT wins over WB
+//
+UINT8 vmx::mtrr::RangeType( const Mtrrs* Types, UINT64 Base, UINT64 Size )
+{
+	UINT8 Type = MEMORY_TYPE_INVALID;
+
+	if ( !Types->Enabled )
+		return MEMORY_TYPE_UNCACHEABLE;
+
+	if ( Types->FixedEnabled && Base < MTRR_FIXED_LIMIT )
+		return Size == PAGE_SIZE ? FixedType( Types, Base ) : MEMORY_TYPE_INVALID;
+
+	for ( UINT32 i = 0; i < Types->VariableCount; i++ )
+	{
+		const MtrrRange* Range = &Types->Variable[i];
+		UINT64 Above = Range->Mask & ~( Size - 1 );
+
+		if ( ( Base & Above ) != ( Range->Base & Above ) )
+			continue;
+
+		if ( Range->Mask & ( Size - 1 ) )
+			return MEMORY_TYPE_INVALID;
+
+		if ( Type == MEMORY_TYPE_INVALID || Type == Range->Type )
+			Type = Range->Type;
+		else if ( Type == MEMORY_TYPE_UNCACHEABLE || Range->Type == MEMORY_TYPE_UNCACHEABLE )
+			Type = MEMORY_TYPE_UNCACHEABLE;
+		else if ( ( Type == MEMORY_TYPE_WRITE_THROUGH && Range->Type == MEMORY_TYPE_WRITE_BACK ) ||
+			( Type == MEMORY_TYPE_WRITE_BACK && Range->Type == MEMORY_TYPE_WRITE_THROUGH ) )
+			Type = MEMORY_TYPE_WRITE_THROUGH;
+		else
+			Type = MEMORY_TYPE_UNCACHEABLE;
+	}
+
+	return Type == MEMORY_TYPE_INVALID ? Types->DefaultType : Type;
+}
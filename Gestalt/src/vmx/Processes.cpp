@@ -0,0 +1,410 @@
+#include "vmx/vmx.h"
+
+
+static UINT32 HashCr3( UINT64 Cr3 )
+{
+	return ( UINT32 ) ( ( ( Cr3 >> 12 ) * 0x9E3779B97F4A7C15ULL ) >> 59 ) & ( PROCESS_HASH_SLOTS - 1 );
+}
+
+static_assert( PROCESS_HASH_SLOTS == 32 && 2 * MAX_WATCHED_PROCESSES < PROCESS_HASH_SLOTS, "HashCr3 takes 5 bits, a slot stays empty" );
+
+
+static INT32 Lookup( const ProcessTracking* Tracking, UINT64 Cr3 )
+{
+	const ProcessHashSlot* Hash = Tracking->Hash[Tracking->HashIndex & 1];
+
+	for ( UINT32 i = HashCr3( Cr3 ); Hash[i].Cr3; i = ( i + 1 ) & ( PROCESS_HASH_SLOTS - 1 ) )
+	{
+		if ( Hash[i].Cr3 == Cr3 )
+			return Hash[i].Watched;
+	}
+
+	return PROCESS_NOT_WATCHED;
+}
+
+
+//
+// Guest side, serialized by the caller of Watch/Unwatch
+//
+static void Insert( ProcessHashSlot* Hash, UINT64 Cr3, INT32 Watched )
+{
+	UINT32 Slot;
+
+	for ( Slot = HashCr3( Cr3 ); Hash[Slot].Cr3; Slot = ( Slot + 1 ) & ( PROCESS_HASH_SLOTS - 1 ) )
+		;
+
+	Hash[Slot].Cr3 = Cr3;
+	Hash[Slot].Watched = Watched;
+}
+
+static void RebuildHash( ProcessTracking* Tracking )
+{
+	LONG Next = ( Tracking->HashIndex + 1 ) & 1;
+	ProcessHashSlot* Hash = Tracking->Hash[Next];
+
+	RtlSecureZeroMemory( Hash, sizeof( Tracking->Hash[Next] ) );
+
+	for ( INT32 i = 0; i < MAX_WATCHED_PROCESSES; i++ )
+	{
+		if ( !Tracking->Watched[i].Active )
+			continue;
+
+		Insert( Hash, Tracking->Watched[i].Cr3, i );
+
+		if ( Tracking->Watched[i].UserCr3 )
+			Insert( Hash, Tracking->Watched[i].UserCr3, i );
+	}
+
+	KeMemoryBarrier();
+	Tracking->HashIndex = Next;
+}
+
+
+//
+// The view of the policy, if any. Leaving one goes back to the view from before, unless the guest switched meanwhile.
+// The coverage view is left alone, the process runs in it as the others do
+//
+static void SwitchPolicyView( vCPU* vcpu, UINT32 View )
+{
+	ProcessSwitches* Switches = &vcpu->Processes;
+	INT32 Current = vmx::ept::CurrentView( vcpu );
+
+	if ( Switches->PolicyView && Current == ( INT32 ) Switches->PolicyView && vmx::ept::SwitchView( vcpu, Switches->ViewBefore ) )
+	{
+		Current = ( INT32 ) Switches->ViewBefore;
+		Switches->ViewSwitches++;
+	}
+
+	Switches->PolicyView = 0;
+
+	if ( !View || Current == EPT_NO_VIEW || ( vcpu->state->Coverage.View && ( UINT32 ) Current == vcpu->state->Coverage.View ) )
+		return;
+
+	if ( vmx::ept::SwitchView( vcpu, View ) )
+	{
+		Switches->ViewBefore = ( UINT32 ) Current;
+		Switches->PolicyView = View;
+		Switches->ViewSwitches++;
+	}
+}
+
+
+//
+// Leaving a watched process, or going to one, rewrites the record, the number of targets in use and the control set of
+// the policy: while a watched process runs every load exits, the switch away from it included
+//
+static void Update( vCPU* vcpu, UINT64 Cr3, bool Load )
+{
+	ProcessSwitches* Switches = &vcpu->Processes;
+	ProcessTracking* Tracking = &vcpu->state->Processes;
+	ProcessRecord* Record = &Switches->Current;
+	INT32 Watched;
+	UINT64 Start = __rdtsc();
+	UINT64 MsrBitMap = Switches->SystemMsrBitMap;
+	UINT32 Exceptions = 0;
+	UINT32 View = 0;
+	UINT32 Targets;
+
+	Cr3 &= PROCESS_CR3_MASK;
+	Watched = Lookup( Tracking, Cr3 );
+
+	if ( Load )
+	{
+		Switches->Loads++;
+
+		if ( Watched != PROCESS_NOT_WATCHED )
+			InterlockedIncrement64( &Tracking->Watched[Watched].Switches );
+	}
+
+	if ( Watched != Record->Watched || Cr3 != Record->Cr3 )
+	{
+		if ( Record->Watched != PROCESS_NOT_WATCHED && Watched != Record->Watched )
+			InterlockedAdd64( &Tracking->Watched[Record->Watched].Cycles, ( LONG64 ) ( Start - Record->Since ) );
+
+		Record->Sequence++;
+		KeMemoryBarrier();
+
+		if ( Watched != Record->Watched )
+			Record->Since = Start;
+
+		Record->Watched = Watched;
+		Record->Cr3 = Cr3;
+
+		KeMemoryBarrier();
+		Record->Sequence++;
+	}
+
+	Targets = Watched == PROCESS_NOT_WATCHED ? Tracking->TargetCount : 0;
+
+	if ( Targets > Switches->TargetLimit )
+		Targets = Switches->TargetLimit;
+
+	if ( Targets != Switches->TargetsLoaded )
+	{
+		__vmx_vmwrite( VMCS_CTRL_CR3_TARGET_COUNT, Targets );
+		Switches->TargetsLoaded = Targets;
+	}
+
+	if ( Watched != PROCESS_NOT_WATCHED )
+	{
+		if ( Tracking->Watched[Watched].MsrBitMap )
+			MsrBitMap = Tracking->Watched[Watched].MsrBitMap;
+
+		Exceptions = Tracking->Watched[Watched].Policy.ExceptionBitmap;
+		View = Tracking->Watched[Watched].Policy.EptView;
+	}
+
+	if ( View != Switches->PolicyView )
+		SwitchPolicyView( vcpu, View );
+
+	if ( MsrBitMap != Switches->LoadedMsrBitMap || Exceptions != Switches->LoadedExceptions )
+	{
+		if ( MsrBitMap != Switches->LoadedMsrBitMap )
+			__vmx_vmwrite( VMCS_CTRL_MSR_BITMAP_ADDRESS, MsrBitMap );
+
+		if ( Exceptions != Switches->LoadedExceptions )
+			__vmx_vmwrite( VMCS_CTRL_EXCEPTION_BITMAP, Exceptions );
+
+		Switches->LoadedMsrBitMap = MsrBitMap;
+		Switches->LoadedExceptions = Exceptions;
+		Switches->ControlSwaps++;
+	}
+
+	Switches->Cycles += __rdtsc() - Start;
+}
+
+
+void vmx::process::Reset( vCPU* vcpu, bool Enabled, UINT64 Cr3 )
+{
+	ProcessSwitches* Switches = &vcpu->Processes;
+	IA32_VMX_MISC_REGISTER Misc;
+
+	RtlSecureZeroMemory( Switches, sizeof( ProcessSwitches ) );
+	Switches->Current.Watched = PROCESS_NOT_WATCHED;
+	Switches->Enabled = Enabled;
+	Switches->SystemMsrBitMap = VIRTUAL_TO_PHYSICAL( &vcpu->state->MSRBitMap );
+	Switches->LoadedMsrBitMap = Switches->SystemMsrBitMap;
+
+	//
+	// Every #PF the bitmap selects exits, whatever the error code
+	//
+	__vmx_vmwrite( VMCS_CTRL_CR3_TARGET_COUNT, 0 );
+	__vmx_vmwrite( VMCS_CTRL_EXCEPTION_BITMAP, 0 );
+	__vmx_vmwrite( VMCS_CTRL_PAGEFAULT_ERROR_CODE_MASK, 0 );
+	__vmx_vmwrite( VMCS_CTRL_PAGEFAULT_ERROR_CODE_MATCH, 0 );
+
+	if ( !Enabled )
+		return;
+
+	if ( !vcpu->state->TrackTranslations )
+	{
+		Misc.AsUInt = __readmsr( IA32_VMX_MISC );
+		Switches->TargetLimit = Misc.Cr3TargetCount < MAX_CR3_TARGETS ? ( UINT32 ) Misc.Cr3TargetCount : MAX_CR3_TARGETS;
+	}
+
+	for ( UINT32 i = 0; i < Switches->TargetLimit; i++ )
+		__vmx_vmwrite( VMCS_CTRL_CR3_TARGET_VALUE_0 + i * 2, vcpu->state->Processes.Targets[i] );
+
+	Update( vcpu, Cr3, false );
+}
+
+
+void vmx::process::Switch( vCPU* vcpu, UINT64 Cr3 )
+{
+	if ( vcpu->Processes.Enabled )
+		Update( vcpu, Cr3, true );
+}
+
+
+void vmx::process::Apply( vCPU* vcpu )
+{
+	size_t Cr3;
+
+	if ( !vcpu->Processes.Enabled )
+		return;
+
+	__vmx_vmread( VMCS_GUEST_CR3, &Cr3 );
+	Update( vcpu, Cr3, false );
+}
+
+
+bool vmx::process::Read( const ProcessRecord* Record, UINT64* Cr3, INT32* Watched )
+{
+	for ( int i = 0; i < 64; i++ )
+	{
+		UINT32 Sequence = Record->Sequence;
+
+		KeMemoryBarrier();
+
+		if ( Sequence & 1 )
+		{
+			YieldProcessor();
+			continue;
+		}
+
+		*Cr3 = Record->Cr3;
+		*Watched = Record->Watched;
+
+		KeMemoryBarrier();
+
+		if ( Record->Sequence == Sequence )
+			return true;
+	}
+
+	return false;
+}
+
+
+void vmx::process::CountIntercept( GCPUContext* context, UINT32 Reason )
+{
+	vCPU* vcpu = context->vcpu;
+	WatchedProcess* Process = &vcpu->state->Processes.Watched[vcpu->Processes.Current.Watched];
+	const ProcessPolicy* Policy = &Process->Policy;
+	VMEXIT_INTERRUPT_INFORMATION Info;
+	size_t Value;
+	bool Asked = false;
+
+	if ( Reason == vmexit_nmi )
+	{
+		__vmx_vmread( VMCS_VMEXIT_INTERRUPTION_INFORMATION, &Value );
+		Info.AsUInt = ( UINT32 ) Value;
+
+		Asked = Info.Valid && Info.InterruptionType != NonMaskableInterrupt && Info.Vector < 32 &&
+			( Policy->ExceptionBitmap & ( 1U << Info.Vector ) );
+	}
+	else if ( Reason == vmexit_rdmsr || Reason == vmexit_wrmsr )
+	{
+		for ( UINT32 i = 0; i < Policy->MsrCount && !Asked; i++ )
+			Asked = Policy->Msrs[i].Msr == ( UINT32 ) context->rcx && ( Reason == vmexit_rdmsr ? Policy->Msrs[i].Read : Policy->Msrs[i].Write );
+	}
+
+	if ( Asked )
+		InterlockedIncrement64( &Process->Intercepts );
+}
+
+
+//
+// The counters of a reused slot start over, the previous process was unwatched with every processor kicked.
+// The MSR bitmap of the policy is built before the process is in the hash, no processor uses it yet
+//
+INT32 vmx::process::Watch( GlobalState* state, UINT64 Cr3, UINT64 UserCr3, const ProcessPolicy* Policy )
+{
+	ProcessTracking* Tracking = &state->Processes;
+	WatchedProcess* Process;
+	INT32 Free = PROCESS_NOT_WATCHED;
+
+	Cr3 &= PROCESS_CR3_MASK;
+	UserCr3 &= PROCESS_CR3_MASK;
+
+	if ( UserCr3 == Cr3 )
+		UserCr3 = 0;
+
+	if ( !Cr3 )
+		return PROCESS_NOT_WATCHED;
+
+	for ( UINT32 i = 0; i < Tracking->TargetCount; i++ )
+	{
+		if ( ( Tracking->Targets[i] & PROCESS_CR3_MASK ) == Cr3 || ( Tracking->Targets[i] & PROCESS_CR3_MASK ) == UserCr3 )
+			return PROCESS_NOT_WATCHED;
+	}
+
+	for ( INT32 i = 0; i < MAX_WATCHED_PROCESSES; i++ )
+	{
+		if ( !Tracking->Watched[i].Active )
+		{
+			if ( Free == PROCESS_NOT_WATCHED )
+				Free = i;
+		}
+		else if ( Tracking->Watched[i].Cr3 == Cr3 || Tracking->Watched[i].UserCr3 == Cr3 ||
+			( UserCr3 && ( Tracking->Watched[i].Cr3 == UserCr3 || Tracking->Watched[i].UserCr3 == UserCr3 ) ) )
+		{
+			return PROCESS_NOT_WATCHED;
+		}
+	}
+
+	if ( Free == PROCESS_NOT_WATCHED )
+		return PROCESS_NOT_WATCHED;
+
+	if ( Policy && Policy->EptView && ( Policy->EptView >= state->Ept.ViewCount || Policy->EptView == state->Coverage.View ) )
+		return PROCESS_NOT_WATCHED;
+
+	Process = &Tracking->Watched[Free];
+	Process->Cr3 = Cr3;
+	Process->UserCr3 = UserCr3;
+	Process->Switches = 0;
+	Process->Cycles = 0;
+	Process->Intercepts = 0;
+	Process->MsrBitMap = 0;
+	RtlSecureZeroMemory( &Process->Policy, sizeof( ProcessPolicy ) );
+
+	if ( Policy )
+	{
+		VMX_MSR_BITMAP* BitMap = &Tracking->MsrBitMaps[Free];
+
+		Process->Policy = *Policy;
+
+		if ( Process->Policy.MsrCount > MAX_POLICY_MSRS )
+			Process->Policy.MsrCount = MAX_POLICY_MSRS;
+
+		if ( Process->Policy.MsrCount )
+		{
+			RtlCopyMemory( BitMap, &state->MSRBitMap, sizeof( VMX_MSR_BITMAP ) );
+
+			for ( UINT32 i = 0; i < Process->Policy.MsrCount; i++ )
+				RefreshMsr( state, Process->Policy.Msrs[i].Msr );
+
+			Process->MsrBitMap = VIRTUAL_TO_PHYSICAL( BitMap );
+		}
+	}
+
+	KeMemoryBarrier();
+	Process->Active = true;
+	RebuildHash( Tracking );
+
+	return Free;
+}
+
+
+bool vmx::process::Unwatch( GlobalState* state, INT32 Index )
+{
+	if ( Index < 0 || Index >= MAX_WATCHED_PROCESSES || !state->Processes.Watched[Index].Active )
+		return false;
+
+	state->Processes.Watched[Index].Active = false;
+	RebuildHash( &state->Processes );
+
+	return true;
+}
+
+
+//
+// A policy MSR exits when the system bitmap or the policy says so. Active is set after the bitmap is built, so slots
+// being built are refreshed too: any slot with a bitmap
+//
+void vmx::process::RefreshMsr( GlobalState* state, UINT32 Msr )
+{
+	ProcessTracking* Tracking = &state->Processes;
+	bool Read = vmx::IsMsrIntercepted( &state->MSRBitMap, Msr, false );
+	bool Write = vmx::IsMsrIntercepted( &state->MSRBitMap, Msr, true );
+
+	for ( UINT32 i = 0; i < MAX_WATCHED_PROCESSES; i++ )
+	{
+		const ProcessPolicy* Policy = &Tracking->Watched[i].Policy;
+		bool PolicyRead = false;
+		bool PolicyWrite = false;
+
+		if ( !Policy->MsrCount )
+			continue;
+
+		for ( UINT32 j = 0; j < Policy->MsrCount; j++ )
+		{
+			if ( Policy->Msrs[j].Msr == Msr )
+			{
+				PolicyRead |= Policy->Msrs[j].Read;
+				PolicyWrite |= Policy->Msrs[j].Write;
+			}
+		}
+
+		vmx::SetMsrBitMap( &Tracking->MsrBitMaps[i], Msr, Read || PolicyRead, Write || PolicyWrite );
+	}
+}
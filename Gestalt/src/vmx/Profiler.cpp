@@ -0,0 +1,107 @@
+#include "vmx/vmx.h"
+
+
+UINT32 vmx::profile::PeriodFromRate( UINT64 TscFrequency, UINT32 Rate, UINT32 TimerShift )
+{
+	UINT64 Ticks;
+
+	if ( !Rate )
+		return 0;
+
+	Ticks = ( TscFrequency / Rate ) >> TimerShift;
+
+	if ( Ticks > MAXUINT32 )
+		return MAXUINT32;
+
+	return Ticks ? ( UINT32 ) Ticks : 1;
+}
+
+
+void vmx::profile::Reset( ProfileRing* Ring, UINT32 PinBasedControls, UINT32 ExitControls, bool Supported )
+{
+	Ring->Head = 0;
+	Ring->Cycles = 0;
+	Ring->Period = 0;
+	Ring->PinBasedControls = PinBasedControls;
+	Ring->ExitControls = ExitControls;
+	Ring->Supported = Supported && Ring->Samples;
+}
+
+
+//
+// The timer value is saved on every exit, so the countdown goes on across the other exits instead of starting over
+//
+void vmx::profile::Apply( vCPU* vcpu )
+{
+	ProfileRing* Ring = &vcpu->Profile;
+	IA32_VMX_PINBASED_CTLS_REGISTER PinBasedControls;
+	IA32_VMX_EXIT_CTLS_REGISTER ExitControls;
+	UINT32 Period = Ring->Supported ? vcpu->state->ProfilePeriod : 0;
+
+	if ( Period == Ring->Period )
+		return;
+
+	PinBasedControls.AsUInt = Ring->PinBasedControls;
+	PinBasedControls.ActivateVmxPreemptionTimer = Period != 0;
+	ExitControls.AsUInt = Ring->ExitControls;
+	ExitControls.SaveVmxPreemptionTimerValue = Period != 0;
+
+	if ( Period )
+		__vmx_vmwrite( VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, Period );
+
+	__vmx_vmwrite( VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, PinBasedControls.AsUInt );
+	__vmx_vmwrite( VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS, ExitControls.AsUInt );
+
+	Ring->Period = Period;
+}
+
+
+int vmx::profile::HandleTimer( GCPUContext* context )
+{
+	ProfileRing* Ring = &context->vcpu->Profile;
+	ProfileSample* Sample;
+	VMX_SEGMENT_ACCESS_RIGHTS SsAccessRights;
+	size_t Value;
+	UINT64 Start = __rdtsc();
+
+	if ( !Ring->Period )
+		return 0;
+
+	Sample = &Ring->Samples[Ring->Head & ( Ring->Capacity - 1 )];
+
+	__vmx_vmread( VMCS_GUEST_CR3, &Sample->Cr3 );
+	__vmx_vmread( VMCS_GUEST_SS_ACCESS_RIGHTS, &Value );
+	SsAccessRights.AsUInt = ( UINT32 ) Value;
+
+	Sample->Tsc = Start;
+	Sample->Rip = context->ExtRegs.rip;
+	Sample->Cpl = SsAccessRights.DescriptorPrivilegeLevel;
+	Sample->Reserved = 0;
+
+	KeMemoryBarrierWithoutFence();
+	Ring->Head++;
+
+	__vmx_vmwrite( VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, Ring->Period );
+
+	Ring->Cycles += __rdtsc() - Start;
+
+	return 1;
+}
+
+
+void vmx::profile::FillHeader( const ProfileRing* Ring, int CpuNumber, ProfileHeader* Header, UINT64* First )
+{
+	UINT64 Head = Ring->Head;
+
+	RtlSecureZeroMemory( Header, sizeof( ProfileHeader ) );
+
+	Header->Magic = PROFILE_MAGIC;
+	Header->Version = PROFILE_VERSION;
+	Header->SampleSize = sizeof( ProfileSample );
+	Header->CpuNumber = ( UINT32 ) CpuNumber;
+	Header->Period = Ring->Period;
+	Header->SampleCount = Head < Ring->Capacity ? Head : Ring->Capacity;
+	Header->Lost = Head - Header->SampleCount;
+
+	*First = Head < Ring->Capacity ? 0 : Head & ( Ring->Capacity - 1 );
+}
@@ -0,0 +1,103 @@
+#include "vmx/vmx.h"
+
+
+static_assert( STATS_EXIT_REASONS == MAX_VMEXIT_REASON_FILTER, "StatsCpu::ExitsByReason mirrors vCPUCounters::ExitsByReason" );
+
+
+SIZE_T vmx::stats::RegionSize( UINT32 CpuCount )
+{
+	return sizeof( StatsHeader ) + ( SIZE_T ) CpuCount * sizeof( StatsCpu );
+}
+
+
+void vmx::stats::Initialize( void* Region, UINT32 CpuCount )
+{
+	StatsHeader* Header = ( StatsHeader* ) Region;
+	StatsCpu* Cpus = ( StatsCpu* ) ( Header + 1 );
+
+	RtlSecureZeroMemory( Region, RegionSize( CpuCount ) );
+
+	for ( UINT32 i = 0; i < CpuCount; i++ )
+		Cpus[i].CpuNumber = i;
+
+	Header->Version = STATS_VERSION;
+	Header->CpuSize = sizeof( StatsCpu );
+	Header->CpuCount = CpuCount;
+	Header->CpuOffset = sizeof( StatsHeader );
+	Header->ExitReasons = STATS_EXIT_REASONS;
+
+	//
+	// Readers check the magic first, it goes last
+	//
+	KeMemoryBarrierWithoutFence();
+	Header->Magic = STATS_MAGIC;
+}
+
+
+StatsCpu* vmx::stats::Slot( void* Region, UINT32 CpuNumber )
+{
+	StatsHeader* Header = ( StatsHeader* ) Region;
+
+	if ( !Region || CpuNumber >= Header->CpuCount )
+		return nullptr;
+
+	return ( StatsCpu* ) ( ( BYTE* ) Region + Header->CpuOffset ) + CpuNumber;
+}
+
+
+//
+// x64 doesn't reorder stores with other stores, keeping the compiler from doing it is enough on the writer side
+//
+void vmx::stats::Publish( StatsCpu* Slot, const vCPUCounters* Counters, const ExitTrace* Trace, const TranslationCache* Translations,
+	UINT32 Reason )
+{
+	Slot->Sequence++;
+	KeMemoryBarrierWithoutFence();
+
+	Slot->Exits = Counters->Exits;
+	Slot->RootCycles = Counters->RootCycles;
+	Slot->TraceRecords = Trace->Count;
+	Slot->TraceDropped = Trace->Dropped;
+	Slot->TranslationHits = Translations->Hits;
+	Slot->TranslationMisses = Translations->Misses;
+	Slot->TranslationWalkCycles = Translations->WalkCycles;
+	Slot->TranslationFlushes = Translations->Flushes;
+
+	if ( Reason < STATS_EXIT_REASONS )
+		Slot->ExitsByReason[Reason] = Counters->ExitsByReason[Reason];
+
+	KeMemoryBarrierWithoutFence();
+	Slot->Sequence++;
+}
+
+
+//
+// Loads aren't reordered with other loads either, the sequence read before and after the copy brackets it
+//
+bool vmx::stats::Read( const StatsCpu* Slot, StatsCpu* Copy, UINT32 MaxRetries )
+{
+	UINT32 Sequence;
+
+	for ( UINT32 i = 0; i < MaxRetries; i++ )
+	{
+		Sequence = Slot->Sequence;
+		KeMemoryBarrierWithoutFence();
+
+		if ( Sequence & 1 )
+		{
+			YieldProcessor();
+			continue;
+		}
+
+		RtlCopyMemory( Copy, ( const void* ) Slot, sizeof( StatsCpu ) );
+		KeMemoryBarrierWithoutFence();
+
+		if ( Slot->Sequence == Sequence )
+		{
+			Copy->Sequence = Sequence;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,76 @@
+#include "vmx/vmx.h"
+
+
+void vmx::tsc::Reset( TscCompensation* Tsc, bool Enabled )
+{
+	Tsc->Offset = 0;
+	Tsc->Adjust = 0;
+	Tsc->Hidden = 0;
+	Tsc->Capped = 0;
+	Tsc->Enabled = Enabled;
+
+	if ( Enabled )
+		__vmx_vmwrite( VMCS_CTRL_TSC_OFFSET, 0 );
+}
+
+
+//
+// The offset doesn't go below the highest one of all the vCPUs less TSC_MAX_SKEW, the rest of the exit is counted
+// in Capped. The highest offset is refreshed from the guest side, until then it is higher than it could be
+//
+void vmx::tsc::Compensate( vCPU* vcpu, UINT32 Reason, UINT64 RootCycles )
+{
+	TscCompensation* Tsc = &vcpu->Tsc;
+	INT64 Hide = ( INT64 ) RootCycles;
+	INT64 Floor;
+
+	switch ( vcpu->state->TscPolicy )
+	{
+	case TscHideRootCycles:
+		break;
+	case TscHideCalibrated:
+		if ( Reason < MAX_VMEXIT_REASON_FILTER )
+			Hide += vcpu->state->TscExitCost[Reason];
+		break;
+	default:
+		return;
+	}
+
+	if ( !Tsc->Enabled || Hide <= 0 )
+		return;
+
+	Floor = vcpu->state->TscOffset - TSC_MAX_SKEW;
+
+	if ( Tsc->Offset - Hide < Floor )
+	{
+		INT64 Room = Tsc->Offset > Floor ? Tsc->Offset - Floor : 0;
+
+		Tsc->Capped += Hide - Room;
+		Hide = Room;
+	}
+
+	if ( !Hide )
+		return;
+
+	Tsc->Offset -= Hide;
+	Tsc->Hidden += Hide;
+	__vmx_vmwrite( VMCS_CTRL_TSC_OFFSET, Tsc->Offset + Tsc->Adjust );
+}
+
+
+UINT64 vmx::tsc::ToGuest( const TscCompensation* Tsc, UINT64 HostTsc )
+{
+	return HostTsc + Tsc->Offset + Tsc->Adjust;
+}
+
+UINT64 vmx::tsc::ToHost( const TscCompensation* Tsc, UINT64 GuestTsc )
+{
+	return GuestTsc - Tsc->Offset - Tsc->Adjust;
+}
+
+
+void vmx::tsc::Adjust( TscCompensation* Tsc, INT64 Cycles )
+{
+	Tsc->Adjust += Cycles;
+	__vmx_vmwrite( VMCS_CTRL_TSC_OFFSET, Tsc->Offset + Tsc->Adjust );
+}
@@ -79,6 +79,139 @@ UINT64 VMXUtils::AdjustControlValue( VMX_CONTROL_FIELD Field, UINT64 Value )
 }
 
 
+//
+// Same as above, but using the capability MSRs saved in a CpuSnapshot instead of reading them again
+//
+UINT64 VMXUtils::AdjustCR0( const VmxCapabilities* Capabilities, UINT64 cr0Value )
+{
+	cr0Value &= Capabilities->Cr0Fixed1;
+	cr0Value |= Capabilities->Cr0Fixed0;
+
+	return cr0Value;
+}
+
+UINT64 VMXUtils::AdjustCR4( const VmxCapabilities* Capabilities, UINT64 cr4Value )
+{
+	cr4Value &= Capabilities->Cr4Fixed1;
+	cr4Value |= Capabilities->Cr4Fixed0;
+
+	return cr4Value;
+}
+
+UINT64 VMXUtils::AdjustControlValue( const VmxCapabilities* Capabilities, VMX_CONTROL_FIELD Field, UINT64 Value )
+{
+	IA32_VMX_TRUE_CTLS_REGISTER Allowed;
+	UINT64 EffectiveValue = Value;
+
+	switch ( Field )
+	{
+	case VmxPinBasedControls:
+		Allowed.AsUInt = Capabilities->PinBasedControls;
+		break;
+	case VmxProcessorBasedControls:
+		Allowed.AsUInt = Capabilities->ProcessorBasedControls;
+		break;
+	case VmxVmExitControls:
+		Allowed.AsUInt = Capabilities->ExitControls;
+		break;
+	case VmxVmEntryControls:
+		Allowed.AsUInt = Capabilities->EntryControls;
+		break;
+	case VmxProcessorBasedControls2:
+		Allowed.AsUInt = Capabilities->ProcessorBasedControls2;
+		break;
+	default:
+		KD_DEBUG_BREAK();
+		return EffectiveValue;
+	}
+
+	EffectiveValue |= Allowed.Allowed0Settings;
+	EffectiveValue &= Allowed.Allowed1Settings;
+
+	return EffectiveValue;
+}
+
+
+//
+// Read the VMX capability MSRs once, choosing the TRUE_* variants when the processor reports them
+//
+void VMXUtils::CaptureVmxCapabilities( VmxCapabilities* Capabilities )
+{
+	IA32_VMX_BASIC_REGISTER VMXBasicMSR;
+
+	VMXBasicMSR.AsUInt = __readmsr( IA32_VMX_BASIC );
+
+	Capabilities->Basic = VMXBasicMSR.AsUInt;
+	Capabilities->PinBasedControls = __readmsr( VMXBasicMSR.VmxControls ? IA32_VMX_TRUE_PINBASED_CTLS : IA32_VMX_PINBASED_CTLS );
+	Capabilities->ProcessorBasedControls = __readmsr( VMXBasicMSR.VmxControls ? IA32_VMX_TRUE_PROCBASED_CTLS : IA32_VMX_PROCBASED_CTLS );
+	Capabilities->ExitControls = __readmsr( VMXBasicMSR.VmxControls ? IA32_VMX_TRUE_EXIT_CTLS : IA32_VMX_EXIT_CTLS );
+	Capabilities->EntryControls = __readmsr( VMXBasicMSR.VmxControls ? IA32_VMX_TRUE_ENTRY_CTLS : IA32_VMX_ENTRY_CTLS );
+	Capabilities->ProcessorBasedControls2 = __readmsr( IA32_VMX_PROCBASED_CTLS2 );
+	Capabilities->Cr0Fixed0 = __readmsr( IA32_VMX_CR0_FIXED0 );
+	Capabilities->Cr0Fixed1 = __readmsr( IA32_VMX_CR0_FIXED1 );
+	Capabilities->Cr4Fixed0 = __readmsr( IA32_VMX_CR4_FIXED0 );
+	Capabilities->Cr4Fixed1 = __readmsr( IA32_VMX_CR4_FIXED1 );
+}
+
+
+//
+// Capture the processor state in one pass and resolve the segment bases with a single GDT walk per selector
+//
+void VMXUtils::CaptureCpuSnapshot( CpuSnapshot* Snapshot )
+{
+	RtlSecureZeroMemory( Snapshot, sizeof( CpuSnapshot ) );
+
+	Snapshot->Magic = CPU_SNAPSHOT_MAGIC;
+	Snapshot->Version = CPU_SNAPSHOT_VERSION;
+	Snapshot->Size = sizeof( CpuSnapshot );
+
+	__capture_cpu_snapshot( Snapshot );
+
+	for ( int i = 0; i < SnapshotSegmentCount; i++ )
+	{
+		Snapshot->Segments[i].Base = VMXUtils::GetSegmentBase( Snapshot->GDTR.Base, Snapshot->Segments[i].Selector );
+	}
+	//
+	// In long mode the FS/GS bases live in the MSRs, not in the descriptors
+	//
+	Snapshot->Segments[SnapshotFs].Base = Snapshot->FsBase;
+	Snapshot->Segments[SnapshotGs].Base = Snapshot->GsBase;
+
+	CaptureVmxCapabilities( &Snapshot->Vmx );
+}
+
+
+//
+// The snapshot has a fixed little-endian layout without pointers, serializing it is a validated copy
+//
+SIZE_T VMXUtils::SerializeCpuSnapshot( const CpuSnapshot* Snapshot, void* Buffer, SIZE_T BufferSize )
+{
+	if ( BufferSize < sizeof( CpuSnapshot ) || Snapshot->Magic != CPU_SNAPSHOT_MAGIC )
+		return 0;
+
+	RtlCopyMemory( Buffer, Snapshot, sizeof( CpuSnapshot ) );
+
+	return sizeof( CpuSnapshot );
+}
+
+bool VMXUtils::DeserializeCpuSnapshot( const void* Buffer, SIZE_T BufferSize, CpuSnapshot* Snapshot )
+{
+	const CpuSnapshot* Saved = ( const CpuSnapshot* ) Buffer;
+
+	if ( BufferSize < sizeof( CpuSnapshot ) ||
+		Saved->Magic != CPU_SNAPSHOT_MAGIC ||
+		Saved->Version != CPU_SNAPSHOT_VERSION ||
+		Saved->Size != sizeof( CpuSnapshot ) )
+	{
+		return false;
+	}
+
+	RtlCopyMemory( Snapshot, Saved, sizeof( CpuSnapshot ) );
+
+	return true;
+}
+
+
 //
 // Get the segment base address 
 //
@@ -197,13 +330,12 @@ exit:
 }
 
 
-UINT64 VMXUtils::GetSegmentAccessRights( UINT16 SegmentSelector )
+UINT64 VMXUtils::GetSegmentAccessRights( const SegmentSnapshot& Segment )
 {
     SEGMENT_SELECTOR segmentSelector;
-    UINT32 nativeAccessRight;
     VMX_SEGMENT_ACCESS_RIGHTS accessRight;
 
-    segmentSelector.AsUInt = SegmentSelector;
+    segmentSelector.AsUInt = Segment.Selector;
 
     //
     // "In general, a segment register is unusable if it has been loaded with a
@@ -224,8 +356,7 @@ UINT64 VMXUtils::GetSegmentAccessRights( UINT16 SegmentSelector )
     // not exist in the VMX format, and that few fields are undefined in the
     // native format but reserved to be zero in the VMX format.
     //
-    nativeAccessRight = __segment_access_rights( SegmentSelector );
-    accessRight.AsUInt = ( nativeAccessRight >> 8 );
+    accessRight.AsUInt = ( Segment.AccessRights >> 8 );
     accessRight.Reserved1 = 0;
     accessRight.Reserved2 = 0;
     accessRight.Unusable = FALSE;
@@ -1,5 +1,12 @@
 #include "vmx/vmx.h"
 
+//
+// Instruction information encodings
+//
+#define INSTRUCTION_SEGMENT_FS 4
+#define INSTRUCTION_SEGMENT_GS 5
+#define INSTRUCTION_ADDRESS_SIZE_64 2
+
 
 //
 // Handle the CPUID instruction by executing it on the processor normally, returns the leaf for further modifications
@@ -54,24 +61,118 @@ int vmx::vm::HandleCPUID( GCPUContext* context, bool hide )
 }
 
 //
-// Passtrought every MSR access
+// Hypercalls are only accepted from ring 0, returns 0 when the processor must leave VMX operation
+//
+int vmx::vm::HandleVMCall( GCPUContext* context )
+{
+	size_t CsSelector;
+
+	__vmx_vmread( VMCS_GUEST_CS_SELECTOR, &CsSelector );
+
+	if ( ( CsSelector & 3 ) == 0 )
+	{
+		switch ( context->rcx )
+		{
+		case VMCALL_DEVIRTUALIZE:
+			context->rax = 0;
+			return 0;
+		case VMCALL_SWITCH_VIEW:
+			context->rax = vmx::ept::SwitchView( context->vcpu, ( UINT32 ) context->rdx ) ? 0 : MAXUINT64;
+			context->vcpu->Ept.HypercallSwitches++;
+			vmx::vm::NextInstruction( context );
+			return 1;
+		case VMCALL_VE_UNRESOLVED:
+			context->rax = vmx::ept::HandleUnresolvedVe( context->vcpu ) ? 0 : MAXUINT64;
+			vmx::vm::NextInstruction( context );
+			return 1;
+		}
+	}
+
+	context->rax = MAXUINT64;
+	vmx::vm::NextInstruction( context );
+
+	return 1;
+}
+
+//
+// #GP(0) for the RDMSR/WRMSR, RIP stays on it
+//
+static int MsrFault( GCPUContext* context )
+{
+	vmx::events::QueueException( &context->vcpu->Injection, GeneralProtection, true, 0 );
+
+	return 1;
+}
+
+
+//
+// With TSC offsetting, a write of the TSC or of IA32_TSC_ADJUST moves the guest TSC through the offset instead of
+// the real one: the other vCPUs, the host and the compensation keep their time base
+//
+static int WriteTsc( GCPUContext* context, UINT32 MSRId, UINT64 Value )
+{
+	TscCompensation* Tsc = &context->vcpu->Tsc;
+	UINT64 HostAdjust;
+
+	if ( MSRId == IA32_TIME_STAMP_COUNTER )
+	{
+		vmx::tsc::Adjust( Tsc, ( INT64 ) ( Value - vmx::tsc::ToGuest( Tsc, __rdtsc() ) ) );
+	}
+	else
+	{
+		if ( vmx::__vmx_rdmsr_safe( IA32_TSC_ADJUST, &HostAdjust ) )
+			return MsrFault( context );
+
+		vmx::tsc::Adjust( Tsc, ( INT64 ) ( Value - HostAdjust ) - Tsc->Adjust );
+	}
+
+	vmx::vm::NextInstruction( context );
+
+	return 1;
+}
+
+
+//
+// Passtrought every MSR access. The TSC and the TSC deadline are in guest time, they move with the TSC offset
+// (a deadline of 0 disarms the timer), and so does IA32_TSC_ADJUST. An MSR that doesn't exist or refuses the value
+// is a #GP of the guest, the instruction isn't skipped
 //
 int vmx::vm::HandleMSRAccess( GCPUContext* context, MSR_ACCESS AccessType )
 {
 	UINT64 Value;
 	UINT32 MSRId = ( UINT32 ) context->rcx;
+	bool Timestamp;
 
 	switch ( AccessType )
 	{
 	case MSR_READ:
-		Value = ( UINT64 ) __readmsr( MSRId );
+		if ( vmx::__vmx_rdmsr_safe( MSRId, &Value ) )
+			return MsrFault( context );
+
+		Timestamp = MSRId == IA32_TIME_STAMP_COUNTER || ( MSRId == IA32_TSC_DEADLINE && Value );
+
+		if ( Timestamp )
+			Value = vmx::tsc::ToGuest( &context->vcpu->Tsc, Value );
+		else if ( MSRId == IA32_TSC_ADJUST && context->vcpu->Tsc.Enabled )
+			Value += context->vcpu->Tsc.Adjust;
+
 		context->rdx = Value >> 32;
 		context->rax = Value & MSR_MASK_LOW;
 		break;
 	case MSR_WRITE:
 		Value = context->rdx << 32;
 		Value |= context->rax & MSR_MASK_LOW;
-		__writemsr( MSRId, Value );
+
+		if ( ( MSRId == IA32_TIME_STAMP_COUNTER || MSRId == IA32_TSC_ADJUST ) && context->vcpu->Tsc.Enabled )
+			return WriteTsc( context, MSRId, Value );
+
+		Timestamp = MSRId == IA32_TIME_STAMP_COUNTER || ( MSRId == IA32_TSC_DEADLINE && Value );
+
+		if ( Timestamp )
+			Value = vmx::tsc::ToHost( &context->vcpu->Tsc, Value );
+
+		if ( vmx::__vmx_wrmsr_safe( MSRId, Value ) )
+			return MsrFault( context );
 		break;
 	}
 	
@@ -92,4 +193,179 @@ void vmx::vm::NextInstruction( GCPUContext* context )
 	context->ExtRegs.rip += InstructionLength;
 	
 	__vmx_vmwrite( VMCS_GUEST_RIP, context->ExtRegs.rip );
-}
\ No newline at end of file
+}
+
+
+//
+// GPR of an exit qualification or instruction information field, in the processor encoding (rax, rcx, rdx, rbx, rsp, rbp, ...).
+// RSP is the extended register, it has to be written back to the VMCS when changed
+//
+UINT64* vmx::vm::GetRegister( GCPUContext* context, UINT32 Index )
+{
+	switch ( Index & 0xF )
+	{
+	case 0: return &context->rax;
+	case 1: return &context->rcx;
+	case 2: return &context->rdx;
+	case 3: return &context->rbx;
+	case 4: return &context->ExtRegs.rsp;
+	case 5: return &context->rbp;
+	case 6: return &context->rsi;
+	case 7: return &context->rdi;
+	case 8: return &context->r8;
+	case 9: return &context->r9;
+	case 10: return &context->r10;
+	case 11: return &context->r11;
+	case 12: return &context->r12;
+	case 13: return &context->r13;
+	case 14: return &context->r14;
+	default: return &context->r15;
+	}
+}
+
+
+//
+// Linear address of the memory operand of an instruction-information field. Scaling, address size, segment, index and
+// base sit at the same place for every instruction with a memory operand, the displacement is the exit qualification
+//
+UINT64 vmx::vm::OperandAddress( GCPUContext* context, UINT64 InstructionInfo )
+{
+	VMX_VMEXIT_INSTRUCTION_INFO_INVALIDATE Info;
+	UINT64 Address;
+	size_t Value;
+
+	Info.AsUInt = InstructionInfo;
+
+	__vmx_vmread( VMCS_EXIT_QUALIFICATION, &Value );
+	Address = Value;
+
+	if ( !Info.BaseRegisterInvalid )
+		Address += *GetRegister( context, ( UINT32 ) Info.BaseRegister );
+
+	if ( !Info.GeneralPurposeRegisterInvalid )
+		Address += *GetRegister( context, ( UINT32 ) Info.GeneralPurposeRegister ) << Info.Scaling;
+
+	//
+	// Only FS and GS have a base in 64-bit mode
+	//
+	if ( Info.SegmentRegister == INSTRUCTION_SEGMENT_FS || Info.SegmentRegister == INSTRUCTION_SEGMENT_GS )
+	{
+		__vmx_vmread( Info.SegmentRegister == INSTRUCTION_SEGMENT_FS ? VMCS_GUEST_FS_BASE : VMCS_GUEST_GS_BASE, &Value );
+		Address += Value;
+	}
+
+	if ( Info.AddressSize != INSTRUCTION_ADDRESS_SIZE_64 )
+		Address = ( UINT32 ) Address;
+
+	return Address;
+}
+
+
+//
+// MOV to and from CR3, they only exit while the translations or the processes are tracked. Without VPIDs every VM entry
+// flushes the processor TLB, only the software translation cache is left to invalidate. CR0/CR4 writes and CLTS/LMSW
+// aren't handled
+//
+int vmx::vm::HandleCRAccess( GCPUContext* context )
+{
+	VMX_EXIT_QUALIFICATION_MOV_CR Qualification;
+	UINT64* Register;
+	size_t Value;
+	size_t Cr4;
+
+	__vmx_vmread( VMCS_EXIT_QUALIFICATION, &Value );
+	Qualification.AsUInt = Value;
+
+	if ( Qualification.ControlRegister != VMX_EXIT_QUALIFICATION_REGISTER_CR3 )
+		return 0;
+
+	Register = GetRegister( context, ( UINT32 ) Qualification.GeneralPurposeRegister );
+
+	switch ( Qualification.AccessType )
+	{
+	case VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR:
+		//
+		// Bit 63 (don't flush the PCID) belongs to the instruction, not to CR3
+		//
+		__vmx_vmread( VMCS_GUEST_CR4, &Cr4 );
+		__vmx_vmwrite( VMCS_GUEST_CR3, *Register & ~GUEST_CR3_NO_FLUSH );
+		vmx::guest::LoadCr3( &context->vcpu->Translations, *Register, Cr4 );
+		vmx::process::Switch( context->vcpu, *Register );
+		break;
+	case VMX_EXIT_QUALIFICATION_ACCESS_MOV_FROM_CR:
+		__vmx_vmread( VMCS_GUEST_CR3, &Value );
+		*Register = Value;
+
+		if ( Register == &context->ExtRegs.rsp )
+			__vmx_vmwrite( VMCS_GUEST_RSP, Value );
+		break;
+	default:
+		return 0;
+	}
+
+	vmx::vm::NextInstruction( context );
+
+	return 1;
+}
+
+
+int vmx::vm::HandleInvlpg( GCPUContext* context )
+{
+	size_t Address;
+
+	__vmx_vmread( VMCS_EXIT_QUALIFICATION, &Address );
+	vmx::guest::FlushAddress( &context->vcpu->Translations, Address );
+
+	vmx::vm::NextInstruction( context );
+
+	return 1;
+}
+
+
+//
+// The descriptor is read from guest memory through the translation cache. When it can't be read, or the type is invalid,
+// everything is flushed instead of raising the #GP/#PF the guest would get
+//
+int vmx::vm::HandleInvpcid( GCPUContext* context )
+{
+	VMX_VMEXIT_INSTRUCTION_INFO_INVALIDATE Info;
+	INVPCID_DESCRIPTOR Descriptor;
+	TranslationCache* Cache = &context->vcpu->Translations;
+	size_t Value;
+	size_t Cr3;
+	size_t Cr4;
+	UINT64 Address;
+	UINT64 Type;
+
+	__vmx_vmread( VMCS_VMEXIT_INSTRUCTION_INFO, &Value );
+	Info.AsUInt = Value;
+	Address = OperandAddress( context, Info.AsUInt );
+
+	Type = *GetRegister( context, ( UINT32 ) Info.Register2 );
+
+	__vmx_vmread( VMCS_GUEST_CR3, &Cr3 );
+	__vmx_vmread( VMCS_GUEST_CR4, &Cr4 );
+
+	if ( !vmx::guest::ReadVirtual( Cache, &context->vcpu->state->Host, Cr3, Cr4, Address, &Descriptor, sizeof( Descriptor ) ) )
+		Type = InvpcidAllContextWithGlobals;
+
+	switch ( Type )
+	{
+	case InvpcidIndividualAddress:
+		vmx::guest::FlushPcid( Cache, Descriptor.Pcid, true, Descriptor.LinearAddress );
+		break;
+	case InvpcidSingleContext:
+		vmx::guest::FlushPcid( Cache, Descriptor.Pcid, false, 0 );
+		break;
+	case InvpcidAllContext:
+		vmx::guest::FlushAll( Cache, false );
+		break;
+	default:
+		vmx::guest::FlushAll( Cache, true );
+		break;
+	}
+
+	vmx::vm::NextInstruction( context );
+
+	return 1;
+}
@@ -89,6 +89,12 @@ bool vmx::StartVMX( vCPU* vcpu )
 
 	__try
 	{
+		//
+		// CR4.VMXE and the fixed bits are per processor, and they are lost on resume from sleep
+		//
+		__writecr4( VMXUtils::AdjustCR4( __readcr4() ) );
+		__writecr0( VMXUtils::AdjustCR0( __readcr0() ) );
+
 		VMXBasicRegister.AsUInt = __readmsr( IA32_VMX_BASIC );
 		vcpu->vmxonRegion.RevisionId = VMXBasicRegister.VmcsRevisionId;
 		int status = __vmx_on( &vcpu->Phys.VMXOnRegion );
@@ -110,6 +116,51 @@ bool vmx::StartVMX( vCPU* vcpu )
 }
 
 
+//
+// Ask the hypervisor to leave VMX operation on the current processor, the vCPU memory is kept so it can be launched again
+//
+bool vmx::StopVMX( vCPU* vcpu )
+{
+	__try
+	{
+		__vmcall( VMCALL_DEVIRTUALIZE, 0, 0 );
+	}
+	__except ( EXCEPTION_EXECUTE_HANDLER )
+	{
+		DbgInfo( "Exception when issueing the devirtualize hypercall!" );
+		return false;
+	}
+
+	return !vcpu->Launched;
+}
+
+
+//
+// Leave VMX operation on the current processor when its guest never ran, so there's no hypervisor to take the
+// devirtualize hypercall. Nothing may point to the VMXON region or the VMCS once they are freed
+//
+void vmx::AbortVMX( vCPU* vcpu )
+{
+	CR4 Cr4;
+
+	__try
+	{
+		if ( vcpu->Phys.VMCS )
+			__vmx_vmclear( &vcpu->Phys.VMCS );
+
+		__vmx_off();
+
+		Cr4.AsUInt = __readcr4();
+		Cr4.VmxEnable = 0;
+		__writecr4( Cr4.AsUInt );
+	}
+	__except ( EXCEPTION_EXECUTE_HANDLER )
+	{
+		DbgInfo( "Exception when leaving VMX operation on processor %d!", vcpu->CpuNumber );
+	}
+}
+
+
 //
 // Set the VMCS region, set it and configure
 //
@@ -143,70 +194,102 @@ bool vmx::ConfigureVMCS( vCPU* vcpu )
 		return false;
 	}
 
-	return ConfigureVMCSFields( vcpu->state );
+	//
+	// Kicks are sent to this processor, ConfigureVMCSFields may run with a saved snapshot
+	//
+	RtlSecureZeroMemory( &vcpu->Kick, sizeof( KickState ) );
+	vcpu->Kick.ApicId = vmx::kick::CurrentApicId();
+
+	CpuSnapshot snapshot;
+	VMXUtils::CaptureCpuSnapshot( &snapshot );
+
+	return ConfigureVMCSFields( vcpu, &snapshot );
 }
 
 
 //
-// Configure all the VMCS fields necessary to switch to guest/virtualized mode
+// Configure all the VMCS fields necessary to switch to guest/virtualized mode, everything comes from the snapshot
+// so the same VMCS can be rebuilt later from a saved one
 //
-bool vmx::ConfigureVMCSFields( GlobalState* state )
+bool vmx::ConfigureVMCSFields( vCPU* vcpu, const CpuSnapshot* snapshot )
 {
 	IA32_VMX_ENTRY_CTLS_REGISTER VMEntryControls;
 	IA32_VMX_EXIT_CTLS_REGISTER VMExitControls;
 	IA32_VMX_PINBASED_CTLS_REGISTER PinBasedControls;
 	IA32_VMX_PROCBASED_CTLS_REGISTER PrimaryProcBasedControls;
 	IA32_VMX_PROCBASED_CTLS2_REGISTER SecondaryProcBasedControls;
-	UINT64 cr4 = __readcr4();
-	UINT64 cr0 = __readcr0();
-	UINT64 cr3 = __readcr3();
+	IA32_VMX_PROCBASED_CTLS_REGISTER NmiWindowControls;
+	IA32_VMX_PINBASED_CTLS_REGISTER TimerPinControls;
+	IA32_VMX_EXIT_CTLS_REGISTER TimerExitControls;
+	const VmxCapabilities* caps = &snapshot->Vmx;
+	const SegmentSnapshot* segments = snapshot->Segments;
 
-	UINT64 cr4Mask = VMXUtils::AdjustCR4( cr4 );
-	UINT64 cr0Mask = VMXUtils::AdjustCR0( cr0 );
+	UINT64 cr4Mask = VMXUtils::AdjustCR4( caps, snapshot->Cr4 );
+	UINT64 cr0Mask = VMXUtils::AdjustCR0( caps, snapshot->Cr0 );
 
-	_sgdt( &state->GuestState.GDTR);
-	__sidt( &state->GuestState.IDTR );
+	vcpu->GuestState.GDTR.BaseAddress = snapshot->GDTR.Base;
+	vcpu->GuestState.GDTR.Limit = snapshot->GDTR.Limit;
+	vcpu->GuestState.IDTR.BaseAddress = snapshot->IDTR.Base;
+	vcpu->GuestState.IDTR.Limit = snapshot->IDTR.Limit;
 
-	_sgdt( &state->HostState.GDTR );
-	__sidt( &state->HostState.IDTR );
+	//
+	// Root mode gets its own tables, so an exception during an exit never goes through the guest IDT. Without them the
+	// processor isn't virtualized, the guest IDT can't take root mode exceptions
+	//
+	if ( !vmx::host::BuildDescriptors( &vcpu->Descriptors, &vcpu->GuestState.GDTR, MASK_SELECTOR( segments[SnapshotCs].Selector ),
+		MASK_SELECTOR( segments[SnapshotTr].Selector ) ) )
+	{
+		DbgInfo( "Unable to build the host descriptor tables of processor %d", vcpu->CpuNumber );
+		return false;
+	}
+
+	vcpu->HostState.GDTR.BaseAddress = ( UINT64 ) vcpu->Descriptors.Gdt;
+	vcpu->HostState.GDTR.Limit = sizeof( vcpu->Descriptors.Gdt ) - 1;
+	vcpu->HostState.IDTR.BaseAddress = ( UINT64 ) vcpu->Descriptors.Idt;
+	vcpu->HostState.IDTR.Limit = sizeof( vcpu->Descriptors.Idt ) - 1;
+
+	RtlSecureZeroMemory( &vcpu->Events, sizeof( HostEvents ) );
 	
 	__vmx_vmwrite( VMCS_GUEST_ACTIVITY_STATE, 0 );
 	//
 	// Guest CR values
 	//
-	__vmx_vmwrite( VMCS_GUEST_CR0, cr0 );
-	__vmx_vmwrite( VMCS_GUEST_CR3, cr3 );
-	__vmx_vmwrite( VMCS_GUEST_CR4, cr4 );
+	__vmx_vmwrite( VMCS_GUEST_CR0, snapshot->Cr0 );
+	__vmx_vmwrite( VMCS_GUEST_CR3, snapshot->Cr3 );
+	__vmx_vmwrite( VMCS_GUEST_CR4, snapshot->Cr4 );
+	__vmx_vmwrite( VMCS_GUEST_DR7, snapshot->Dr7 );
 	//
 	// RFLAGS & MSR
 	//
-	__vmx_vmwrite( VMCS_GUEST_DEBUGCTL,		__readmsr( IA32_DEBUGCTL ) );
-	__vmx_vmwrite( VMCS_GUEST_SYSENTER_ESP, __readmsr( IA32_SYSENTER_ESP ) );
-	__vmx_vmwrite( VMCS_GUEST_SYSENTER_EIP, __readmsr( IA32_SYSENTER_EIP ) );
-	__vmx_vmwrite( VMCS_GUEST_SYSENTER_CS,	__readmsr( IA32_SYSENTER_CS ) );
-	__vmx_vmwrite( VMCS_GUEST_RFLAGS, __readeflags() );
+	__vmx_vmwrite( VMCS_GUEST_DEBUGCTL,		snapshot->DebugCtl );
+	__vmx_vmwrite( VMCS_GUEST_SYSENTER_ESP, snapshot->SysenterEsp );
+	__vmx_vmwrite( VMCS_GUEST_SYSENTER_EIP, snapshot->SysenterEip );
+	__vmx_vmwrite( VMCS_GUEST_SYSENTER_CS,	snapshot->SysenterCs );
+	__vmx_vmwrite( VMCS_GUEST_RFLAGS, snapshot->Rflags );
 	//
 	// Fill Segment selector information
 	//
-	FILL_SEGMENT_SELECTOR( VMCS_GUEST_CS, state->GuestState.GDTR.BaseAddress, __readcs() );
-	FILL_SEGMENT_SELECTOR( VMCS_GUEST_DS, state->GuestState.GDTR.BaseAddress, __readds() );
-	FILL_SEGMENT_SELECTOR( VMCS_GUEST_SS, state->GuestState.GDTR.BaseAddress, __readss() );
-	FILL_SEGMENT_SELECTOR( VMCS_GUEST_ES, state->GuestState.GDTR.BaseAddress, __reades() );
-	FILL_SEGMENT_SELECTOR( VMCS_GUEST_FS, state->GuestState.GDTR.BaseAddress, __readfs() );
-	FILL_SEGMENT_SELECTOR( VMCS_GUEST_GS, state->GuestState.GDTR.BaseAddress, __readgs() );
-	FILL_SEGMENT_SELECTOR( VMCS_GUEST_LDTR, state->GuestState.GDTR.BaseAddress, __readldtr() );
-	FILL_SEGMENT_SELECTOR( VMCS_GUEST_TR, state->GuestState.GDTR.BaseAddress, __readtr() );
-	__vmx_vmwrite( VMCS_GUEST_FS_BASE, __readmsr( IA32_FS_BASE ) );
-	__vmx_vmwrite( VMCS_GUEST_GS_BASE, __readmsr( IA32_GS_BASE ) );
-	__vmx_vmwrite( VMCS_GUEST_IDTR_BASE, state->GuestState.IDTR.BaseAddress );
-	__vmx_vmwrite( VMCS_GUEST_GDTR_BASE, state->GuestState.GDTR.BaseAddress );
-	__vmx_vmwrite( VMCS_GUEST_GDTR_LIMIT, state->GuestState.GDTR.Limit );
-	__vmx_vmwrite( VMCS_GUEST_IDTR_LIMIT, state->GuestState.IDTR.Limit );
+	FILL_SEGMENT_SELECTOR( VMCS_GUEST_CS, segments[SnapshotCs] );
+	FILL_SEGMENT_SELECTOR( VMCS_GUEST_DS, segments[SnapshotDs] );
+	FILL_SEGMENT_SELECTOR( VMCS_GUEST_SS, segments[SnapshotSs] );
+	FILL_SEGMENT_SELECTOR( VMCS_GUEST_ES, segments[SnapshotEs] );
+	FILL_SEGMENT_SELECTOR( VMCS_GUEST_FS, segments[SnapshotFs] );
+	FILL_SEGMENT_SELECTOR( VMCS_GUEST_GS, segments[SnapshotGs] );
+	FILL_SEGMENT_SELECTOR( VMCS_GUEST_LDTR, segments[SnapshotLdtr] );
+	FILL_SEGMENT_SELECTOR( VMCS_GUEST_TR, segments[SnapshotTr] );
+	__vmx_vmwrite( VMCS_GUEST_IDTR_BASE, snapshot->IDTR.Base );
+	__vmx_vmwrite( VMCS_GUEST_GDTR_BASE, snapshot->GDTR.Base );
+	__vmx_vmwrite( VMCS_GUEST_GDTR_LIMIT, snapshot->GDTR.Limit );
+	__vmx_vmwrite( VMCS_GUEST_IDTR_LIMIT, snapshot->IDTR.Limit );
 	//
 	// Link pointer
 	//
 	__vmx_vmwrite( VMCS_GUEST_VMCS_LINK_POINTER, MAXUINT64 );
 	//
+	// Nothing cached is valid after the guest ran without the hypervisor
+	//
+	vmx::guest::ResetCache( &vcpu->Translations, vcpu->state->TrackTranslations );
+	//
 	// VM Entry/Exit controls fields
 	//
 	VMEntryControls.AsUInt = 0;
@@ -214,12 +297,23 @@ bool vmx::ConfigureVMCSFields( GlobalState* state )
 	VMExitControls.HostAddressSpaceSize = 1;
 	VMEntryControls.Ia32EModeGuest = 1;
 
-	VMExitControls.AsUInt = VMXUtils::AdjustControlValue( VmxVmExitControls, VMExitControls.AsUInt );
-	VMEntryControls.AsUInt = VMXUtils::AdjustControlValue( VmxVmEntryControls, VMEntryControls.AsUInt );
+	VMExitControls.AsUInt = VMXUtils::AdjustControlValue( caps, VmxVmExitControls, VMExitControls.AsUInt );
+	VMEntryControls.AsUInt = VMXUtils::AdjustControlValue( caps, VmxVmEntryControls, VMEntryControls.AsUInt );
+	//
+	// PinBasedControls: NMIs exit so the hypervisor can tell its kicks from real NMIs, the real ones are given back to the guest.
+	// Virtual NMIs track the guest NMI blocking, which NMI-window exiting needs
+	//
+	PinBasedControls.AsUInt = 0;
+	PinBasedControls.NmiExiting = 1;
+	PinBasedControls.VirtualNmi = 1;
+	PinBasedControls.AsUInt = VMXUtils::AdjustControlValue( caps, VmxPinBasedControls, PinBasedControls.AsUInt );
 	//
-	// PinBasedControls
+	// Virtual NMIs are only valid with NMI exiting
 	//
-	PinBasedControls.AsUInt = VMXUtils::AdjustControlValue( VmxPinBasedControls, 0 );
+	if ( !PinBasedControls.NmiExiting )
+		PinBasedControls.VirtualNmi = 0;
+
+	vcpu->Kick.Enabled = PinBasedControls.NmiExiting && PinBasedControls.VirtualNmi;
 
 	//
 	// ProcBased controls fields
@@ -227,14 +321,28 @@ bool vmx::ConfigureVMCSFields( GlobalState* state )
 	PrimaryProcBasedControls.AsUInt = 0;
 	PrimaryProcBasedControls.ActivateSecondaryControls = 1;
 	PrimaryProcBasedControls.UseMsrBitmaps = 1;
+	PrimaryProcBasedControls.UseIoBitmaps = 1;
+	//
+	// INVLPG exiting also makes INVPCID exit
+	//
+	PrimaryProcBasedControls.Cr3LoadExiting = vcpu->state->TrackTranslations || vcpu->state->TrackProcesses;
+	PrimaryProcBasedControls.InvlpgExiting = vcpu->state->TrackTranslations;
+	PrimaryProcBasedControls.UseTscOffsetting = vcpu->state->TscOffsetting;
 	
-	PrimaryProcBasedControls.AsUInt = VMXUtils::AdjustControlValue( VmxProcessorBasedControls, PrimaryProcBasedControls.AsUInt );
+	PrimaryProcBasedControls.AsUInt = VMXUtils::AdjustControlValue( caps, VmxProcessorBasedControls, PrimaryProcBasedControls.AsUInt );
 
 	SecondaryProcBasedControls.AsUInt = 0;
 	SecondaryProcBasedControls.EnableRdtscp = 1;
 	SecondaryProcBasedControls.EnableXsaves = 1;
 	SecondaryProcBasedControls.EnableInvpcid = 1;
-	SecondaryProcBasedControls.AsUInt = VMXUtils::AdjustControlValue( VmxProcessorBasedControls2, SecondaryProcBasedControls.AsUInt );
+	SecondaryProcBasedControls.DescriptorTableExiting = vcpu->state->DescriptorTableExiting;
+	SecondaryProcBasedControls.EnableEpt = vcpu->state->Ept.Enabled;
+	SecondaryProcBasedControls.EnableVmFunctions = vcpu->state->Ept.VmfuncSwitching;
+	//
+	// The guest runs on an IDT copy with #VE, SIDT and LIDT have to exit to keep it hidden and current
+	//
+	SecondaryProcBasedControls.EptViolation = vcpu->state->Ept.VeDelivery && vcpu->state->DescriptorTableExiting;
+	SecondaryProcBasedControls.AsUInt = VMXUtils::AdjustControlValue( caps, VmxProcessorBasedControls2, SecondaryProcBasedControls.AsUInt );
 	//
 	// Write control fields values
 	//
@@ -244,14 +352,48 @@ bool vmx::ConfigureVMCSFields( GlobalState* state )
 	__vmx_vmwrite( VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, PrimaryProcBasedControls.AsUInt );
 	__vmx_vmwrite( VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, SecondaryProcBasedControls.AsUInt );
 	//
+	// The event queue arms the window exits on top of the primary controls. NMI-window exiting needs virtual NMIs
+	//
+	NmiWindowControls.AsUInt = 0;
+	NmiWindowControls.NmiWindowExiting = 1;
+	vmx::events::Reset( &vcpu->Injection, ( UINT32 ) PrimaryProcBasedControls.AsUInt, PinBasedControls.VirtualNmi &&
+		( VMXUtils::AdjustControlValue( caps, VmxProcessorBasedControls, NmiWindowControls.AsUInt ) & NmiWindowControls.AsUInt ) );
+	//
+	// The profiler turns the preemption timer on and off on top of these controls
+	//
+	TimerPinControls.AsUInt = 0;
+	TimerPinControls.ActivateVmxPreemptionTimer = 1;
+	TimerExitControls.AsUInt = 0;
+	TimerExitControls.SaveVmxPreemptionTimerValue = 1;
+	vmx::profile::Reset( &vcpu->Profile, ( UINT32 ) PinBasedControls.AsUInt, ( UINT32 ) VMExitControls.AsUInt,
+		( VMXUtils::AdjustControlValue( caps, VmxPinBasedControls, TimerPinControls.AsUInt ) & TimerPinControls.AsUInt ) &&
+		( VMXUtils::AdjustControlValue( caps, VmxVmExitControls, TimerExitControls.AsUInt ) & TimerExitControls.AsUInt ) );
+	vmx::profile::Apply( vcpu );
+	vmx::tsc::Reset( &vcpu->Tsc, PrimaryProcBasedControls.UseTscOffsetting );
+	RtlSecureZeroMemory( &vcpu->DescriptorTables, sizeof( DescriptorTableExits ) );
+	//
 	// Load MSR bitmap
 	//
-	__vmx_vmwrite( VMCS_CTRL_MSR_BITMAP_ADDRESS, VIRTUAL_TO_PHYSICAL( &state->MSRBitMap ) );
+	__vmx_vmwrite( VMCS_CTRL_MSR_BITMAP_ADDRESS, VIRTUAL_TO_PHYSICAL( &vcpu->state->MSRBitMap ) );
+	//
+	// I/O bitmaps, only the ports of the registered ranges exit
+	//
+	__vmx_vmwrite( VMCS_CTRL_IO_BITMAP_A_ADDRESS, VIRTUAL_TO_PHYSICAL( vcpu->state->Io.BitMapA ) );
+	__vmx_vmwrite( VMCS_CTRL_IO_BITMAP_B_ADDRESS, VIRTUAL_TO_PHYSICAL( vcpu->state->Io.BitMapB ) );
+	//
+	// EPT views, the vCPU starts in the identity map. With #VE the guest runs on a copy of its IDT
+	//
+	vmx::ept::Reset( vcpu, SecondaryProcBasedControls.EnableEpt, SecondaryProcBasedControls.EnableVmFunctions );
+	vmx::ept::ResetVe( vcpu, snapshot, SecondaryProcBasedControls.EptViolation );
+	//
+	// The policy of a watched process swaps the MSR and exception bitmaps while it runs, and the EPT view
+	//
+	vmx::process::Reset( vcpu, PrimaryProcBasedControls.Cr3LoadExiting && vcpu->state->TrackProcesses, snapshot->Cr3 );
 	//
 	// Shadow CR0/4
 	//
-	__vmx_vmwrite( VMCS_CTRL_CR0_READ_SHADOW,cr0 );
-	__vmx_vmwrite( VMCS_CTRL_CR4_READ_SHADOW, cr4 );
+	__vmx_vmwrite( VMCS_CTRL_CR0_READ_SHADOW, snapshot->Cr0 );
+	__vmx_vmwrite( VMCS_CTRL_CR4_READ_SHADOW, snapshot->Cr4 );
 	//
 	// Host CR mask
 	//
@@ -264,30 +406,34 @@ bool vmx::ConfigureVMCSFields( GlobalState* state )
 	//
 	// Host CR
 	//
-	__vmx_vmwrite( VMCS_HOST_CR0, cr0 );
-	__vmx_vmwrite( VMCS_HOST_CR3, cr3 );
-	__vmx_vmwrite( VMCS_HOST_CR4, cr4 );
+	__vmx_vmwrite( VMCS_HOST_CR0, snapshot->Cr0 );
+	__vmx_vmwrite( VMCS_HOST_CR3, vcpu->state->Host.Cr3 ? vcpu->state->Host.Cr3 : snapshot->Cr3 );
+	__vmx_vmwrite( VMCS_HOST_CR4, snapshot->Cr4 );
 	//
 	// Host segment selectors
 	//
-	__vmx_vmwrite( VMCS_HOST_GDTR_BASE, state->HostState.GDTR.BaseAddress );
-	__vmx_vmwrite( VMCS_HOST_IDTR_BASE, state->HostState.IDTR.BaseAddress );
-	__vmx_vmwrite( VMCS_HOST_CS_SELECTOR, MASK_SELECTOR( __readcs() ) );
-	__vmx_vmwrite( VMCS_HOST_SS_SELECTOR, MASK_SELECTOR( __readss() ) );
-	__vmx_vmwrite( VMCS_HOST_DS_SELECTOR, MASK_SELECTOR( __readds() ) );
-	__vmx_vmwrite( VMCS_HOST_ES_SELECTOR, MASK_SELECTOR( __reades() ) );
-	__vmx_vmwrite( VMCS_HOST_FS_SELECTOR, MASK_SELECTOR( __readfs() ) );
-	__vmx_vmwrite( VMCS_HOST_GS_SELECTOR, MASK_SELECTOR( __readgs() ) );
-	__vmx_vmwrite( VMCS_HOST_TR_SELECTOR, MASK_SELECTOR( __readtr() ) );
-	__vmx_vmwrite( VMCS_HOST_FS_BASE, __readmsr( IA32_FS_BASE ) );
-	__vmx_vmwrite( VMCS_HOST_GS_BASE, __readmsr( IA32_GS_BASE ) );
-	__vmx_vmwrite( VMCS_HOST_SYSENTER_CS, __readmsr( IA32_SYSENTER_CS ) );
-	__vmx_vmwrite( VMCS_HOST_TR_BASE, VMXUtils::GetSegmentBase( state->HostState.GDTR.BaseAddress, __readtr() ) );
+	__vmx_vmwrite( VMCS_HOST_GDTR_BASE, vcpu->HostState.GDTR.BaseAddress );
+	__vmx_vmwrite( VMCS_HOST_IDTR_BASE, vcpu->HostState.IDTR.BaseAddress );
+	__vmx_vmwrite( VMCS_HOST_CS_SELECTOR, MASK_SELECTOR( segments[SnapshotCs].Selector ) );
+	__vmx_vmwrite( VMCS_HOST_SS_SELECTOR, MASK_SELECTOR( segments[SnapshotSs].Selector ) );
+	__vmx_vmwrite( VMCS_HOST_DS_SELECTOR, MASK_SELECTOR( segments[SnapshotDs].Selector ) );
+	__vmx_vmwrite( VMCS_HOST_ES_SELECTOR, MASK_SELECTOR( segments[SnapshotEs].Selector ) );
+	__vmx_vmwrite( VMCS_HOST_FS_SELECTOR, MASK_SELECTOR( segments[SnapshotFs].Selector ) );
+	__vmx_vmwrite( VMCS_HOST_GS_SELECTOR, MASK_SELECTOR( segments[SnapshotGs].Selector ) );
+	__vmx_vmwrite( VMCS_HOST_TR_SELECTOR, MASK_SELECTOR( segments[SnapshotTr].Selector ) );
+	__vmx_vmwrite( VMCS_HOST_FS_BASE, snapshot->FsBase );
+	__vmx_vmwrite( VMCS_HOST_GS_BASE, snapshot->GsBase );
+	__vmx_vmwrite( VMCS_HOST_SYSENTER_CS, snapshot->SysenterCs );
+	//
+	// The host GDT, IDT and TSS are part of the vCPU, mapped in the host address space with it: root mode never goes
+	// through a system table
+	//
+	__vmx_vmwrite( VMCS_HOST_TR_BASE, ( UINT64 ) &vcpu->Descriptors.Tss );
 
 	//
-	// Host RSP should point to the middle of the stack, that way we avoid PAGE faults when pushing into it
+	// Host RSP points to the top of the vCPU own stack, the exit context is built right there
 	//
-	__vmx_vmwrite( VMCS_HOST_RSP, state->HostState.RSP + ( state->HostState.StackSize/2 ) );
+	__vmx_vmwrite( VMCS_HOST_RSP, vmx::GetHostStackPointer( vcpu ) );
 	__vmx_vmwrite( VMCS_HOST_RIP, ( size_t ) vmx::__vmx_default_exit_handler );
 
 	//
@@ -297,6 +443,150 @@ bool vmx::ConfigureVMCSFields( GlobalState* state )
 	return true;
 }
 
+//
+// Host RSP points right bellow the HostStackTop, which is pre-filled with the vCPU so the exit handler gets it from the GCPUContext
+//
+UINT64 vmx::GetHostStackPointer( vCPU* vcpu )
+{
+	HostStackTop* Top = ( HostStackTop* ) ( vcpu->HostState.RSP + vcpu->HostState.StackSize - sizeof( HostStackTop ) );
+
+	RtlSecureZeroMemory( Top, sizeof( HostStackTop ) );
+	Top->vcpu = vcpu;
+
+	return ( UINT64 ) Top;
+}
+
+//
+// Bytes of the read and write bitmaps holding Msr, false for MSRs outside the two ranges
+//
+static bool LocateMsr( const VMX_MSR_BITMAP* BitMap, UINT32 Msr, const UINT8** ReadBitMap, const UINT8** WriteBitMap, UINT32* Bit )
+{
+	if ( Msr <= MSR_ID_LOW_MAX )
+	{
+		*ReadBitMap = BitMap->RdmsrLow;
+		*WriteBitMap = BitMap->WrmsrLow;
+		*Bit = Msr - MSR_ID_LOW_MIN;
+	}
+	else if ( Msr >= MSR_ID_HIGH_MIN && Msr <= MSR_ID_HIGH_MAX )
+	{
+		*ReadBitMap = BitMap->RdmsrHigh;
+		*WriteBitMap = BitMap->WrmsrHigh;
+		*Bit = Msr - MSR_ID_HIGH_MIN;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+//
+// Choose whether RDMSR/WRMSR of one MSR exit, MSRs outside the two bitmap ranges always exit.
+// The intercepted MSRs are emulated with the real MSR by vm::HandleMSRAccess, it must exist.
+// The MSR bitmaps of the process policies follow, see vmx::process::RefreshMsr: the caller serializes it with
+// vmx::process::Watch, which copies the system bitmap
+//
+bool vmx::SetMsrIntercept( GlobalState* state, UINT32 Msr, bool Read, bool Write )
+{
+	if ( !SetMsrBitMap( &state->MSRBitMap, Msr, Read, Write ) )
+		return false;
+
+	vmx::process::RefreshMsr( state, Msr );
+
+	return true;
+}
+
+
+bool vmx::IsMsrIntercepted( const VMX_MSR_BITMAP* BitMap, UINT32 Msr, bool Write )
+{
+	const UINT8* ReadBitMap;
+	const UINT8* WriteBitMap;
+	UINT32 Bit;
+
+	if ( !LocateMsr( BitMap, Msr, &ReadBitMap, &WriteBitMap, &Bit ) )
+		return true;
+
+	return ( ( Write ? WriteBitMap : ReadBitMap )[Bit / 8] & ( 1 << ( Bit % 8 ) ) ) != 0;
+}
+
+
+bool vmx::SetMsrBitMap( VMX_MSR_BITMAP* BitMap, UINT32 Msr, bool Read, bool Write )
+{
+	UINT8* ReadBitMap;
+	UINT8* WriteBitMap;
+	UINT32 Bit;
+
+	if ( !LocateMsr( BitMap, Msr, ( const UINT8** ) &ReadBitMap, ( const UINT8** ) &WriteBitMap, &Bit ) )
+		return false;
+
+	//
+	// The bitmap can be changed while the processors run, every bit flips atomically
+	//
+	if ( Read )
+		InterlockedOr8( ( char* ) &ReadBitMap[Bit / 8], ( char ) ( 1 << ( Bit % 8 ) ) );
+	else
+		InterlockedAnd8( ( char* ) &ReadBitMap[Bit / 8], ( char ) ~( 1 << ( Bit % 8 ) ) );
+
+	if ( Write )
+		InterlockedOr8( ( char* ) &WriteBitMap[Bit / 8], ( char ) ( 1 << ( Bit % 8 ) ) );
+	else
+		InterlockedAnd8( ( char* ) &WriteBitMap[Bit / 8], ( char ) ~( 1 << ( Bit % 8 ) ) );
+
+	return true;
+}
+
+//
+// Build what the exit stub needs to return to the guest without VMX: it loads RFLAGS from R8,
+// RSP from RDX and jumps to RCX after the vmxoff. The guest CR3 and descriptor tables are restored here
+// because a VM exit leaves the host ones (and 0xFFFF limits) loaded
+//
+void vmx::PrepareDevirtualize( GCPUContext* context )
+{
+	SEGMENT_DESCRIPTOR_REGISTER_64 gdtr;
+	SEGMENT_DESCRIPTOR_REGISTER_64 idtr;
+	SEGMENT_DESCRIPTOR_64* Tss;
+	size_t Value;
+	size_t InstructionLength;
+
+	__vmx_vmread( VMCS_GUEST_GDTR_BASE, &Value );
+	gdtr.BaseAddress = Value;
+	__vmx_vmread( VMCS_GUEST_GDTR_LIMIT, &Value );
+	gdtr.Limit = ( UINT16 ) Value;
+	__vmx_vmread( VMCS_GUEST_IDTR_BASE, &Value );
+	idtr.BaseAddress = Value;
+	__vmx_vmread( VMCS_GUEST_IDTR_LIMIT, &Value );
+	idtr.Limit = ( UINT16 ) Value;
+
+	//
+	// The guest tables are only mapped in the guest address space: CR3 first, so an NMI taken in between finds the
+	// tables it goes through. The vCPU and the driver image are in both
+	//
+	__vmx_vmread( VMCS_GUEST_CR3, &Value );
+	__writecr3( Value );
+
+	_lgdt( &gdtr );
+	__lidt( &idtr );
+
+	//
+	// The exit loaded TR with the host TSS, the guest one comes back with LTR. LTR faults on a busy TSS descriptor,
+	// and the guest one is busy since the guest loaded it
+	//
+	__vmx_vmread( VMCS_GUEST_TR_SELECTOR, &Value );
+	Tss = ( SEGMENT_DESCRIPTOR_64* ) ( gdtr.BaseAddress + MASK_SELECTOR( Value ) );
+	Tss->Type = SEGMENT_DESCRIPTOR_TYPE_TSS_AVAILABLE;
+	vmx::__load_tr( ( UINT16 ) Value );
+
+	__vmx_vmread( VMCS_VMEXIT_INSTRUCTION_LENGTH, &InstructionLength );
+
+	context->rcx = context->ExtRegs.rip + InstructionLength;
+	context->rdx = context->ExtRegs.rsp;
+	context->r8 = context->ExtRegs.rflags.AsUInt;
+
+	context->vcpu->Launched = false;
+}
+
 size_t vmx::GetVMXErrorCode()
 {
 	size_t error;
@@ -306,20 +596,16 @@ size_t vmx::GetVMXErrorCode()
 }
 
 //
-// Set guest RIP/RSP and a custom handler to be invoked after the default __vmx_exit_handler
+// Set a custom handler to be invoked after the default __vmx_exit_handler and launch the current processor.
+// On success it returns 0 as the guest, right after this call, with the non-volatile context restored
 //
-int vmx::VMLaunch(UINT64 Rip, UINT64 Rsp, int ( *Handler )( GCPUContext* context, void* Args, VMX_VMEXIT_REASON ExitReasonBitMap ), void* Args, BYTE* ExitReasonBitMap)
+int vmx::VMLaunch( vCPU* vcpu, int ( *Handler )( GCPUContext* context, void* Args, VMX_VMEXIT_REASON ExitReasonBitMap ), void* Args, BYTE* ExitReasonBitMap )
 {
 	VMExit.Handler = Handler;
 	VMExit.ExitReasonBitMap = ExitReasonBitMap;
 	VMExit.Args = Args;
-	//
-	// RIP & RSP from both Guest/Host
-	//
-	__vmx_vmwrite( VMCS_GUEST_RIP, Rip );
-	__vmx_vmwrite( VMCS_GUEST_RSP, Rsp );
 
-	return __vmx_vmlaunch();
+	return __vmx_launch( &vcpu->Launch );
 }
 
 //
@@ -330,46 +616,144 @@ int vmx::VMExitHandler( GCPUContext* gcpuContext )
 {
 	int status = 0;
 	VMX_VMEXIT_REASON ExitReason;
+	size_t Reason;
 	UINT64 Rip;
+	UINT64 Start = __rdtsc();
+	UINT64 Cycles;
+	vCPU* vcpu = gcpuContext->vcpu;
+	vCPUCounters* Counters = &vcpu->Counters;
 
 	__vmx_vmread( VMCS_GUEST_RIP, &gcpuContext->ExtRegs.rip );
 	__vmx_vmread( VMCS_GUEST_RSP, &gcpuContext->ExtRegs.rsp );
 	__vmx_vmread( VMCS_GUEST_RFLAGS, &gcpuContext->ExtRegs.rflags.AsUInt );
 
-	__vmx_vmread( VMCS_EXIT_REASON, ( size_t* ) &ExitReason.AsUInt );
+	//
+	// The exit reason is 32 bits wide, vmread stores a full 64-bit value
+	//
+	__vmx_vmread( VMCS_EXIT_REASON, &Reason );
+	ExitReason.AsUInt = ( UINT32 ) Reason;
 
-	if ( VMExit.ExitReasonBitMap[ExitReason.BasicExitReason] )
-	{
-		return vmx::VMExit.Handler( gcpuContext, VMExit.Args, ExitReason );
-	}
+	if ( ExitReason.BasicExitReason < MAX_VMEXIT_REASON_FILTER )
+		Counters->ExitsByReason[ExitReason.BasicExitReason]++;
+
+	Counters->Exits++;
+
+	if ( vcpu->Processes.Current.Watched != PROCESS_NOT_WATCHED )
+		vmx::process::CountIntercept( gcpuContext, ExitReason.BasicExitReason );
+
+	if ( vcpu->Trace.Records )
+		vmx::trace::Record( &vcpu->Trace, gcpuContext, ExitReason.AsUInt, Start );
 
 	Rip = gcpuContext->ExtRegs.rip;
-	//
-	// Default handler
-	//
-	switch ( ExitReason.BasicExitReason )
+
+	if ( ExitReason.BasicExitReason < MAX_VMEXIT_REASON_FILTER && VMExit.ExitReasonBitMap[ExitReason.BasicExitReason] )
 	{
-	case vmexit_cpuid:
-		vmx::vm::HandleCPUID( gcpuContext, false );
-		status = 1; // HandleCPUID returns the leaf, we don't really care about it here
-		break;
-	case vmexit_rdmsr:
-		status = vmx::vm::HandleMSRAccess( gcpuContext, vmx::vm::MSR_ACCESS::MSR_READ );
-		break;
-	case vmexit_wrmsr:
-		status = vmx::vm::HandleMSRAccess( gcpuContext, vmx::vm::MSR_ACCESS::MSR_WRITE );
-		break;
-	default:
-		status = 0;
-		break;
+		//
+		// An exit the custom handler can't handle leaves VMX operation like the default ones do
+		//
+		status = vmx::VMExit.Handler( gcpuContext, VMExit.Args, ExitReason );
+	}
+	else
+	{
+		//
+		// Default handler
+		//
+		switch ( ExitReason.BasicExitReason )
+		{
+		case vmexit_cpuid:
+			vmx::vm::HandleCPUID( gcpuContext, false );
+			status = 1; // HandleCPUID returns the leaf, we don't really care about it here
+			break;
+		case vmexit_rdmsr:
+			status = vmx::vm::HandleMSRAccess( gcpuContext, vmx::vm::MSR_ACCESS::MSR_READ );
+			break;
+		case vmexit_wrmsr:
+			status = vmx::vm::HandleMSRAccess( gcpuContext, vmx::vm::MSR_ACCESS::MSR_WRITE );
+			break;
+		case vmexit_vmcall:
+			status = vmx::vm::HandleVMCall( gcpuContext );
+			break;
+		case vmexit_control_register_access:
+			status = vmx::vm::HandleCRAccess( gcpuContext );
+			break;
+		case vmexit_invlpg:
+			status = vmx::vm::HandleInvlpg( gcpuContext );
+			break;
+		case vmexit_invpcid:
+			status = vmx::vm::HandleInvpcid( gcpuContext );
+			break;
+		case vmexit_io_instruction:
+			status = vmx::io::HandleIo( gcpuContext );
+			break;
+		case vmexit_access_to_gdtr_or_idtr:
+			status = vmx::dt::HandleGdtrIdtrAccess( gcpuContext );
+			break;
+		case vmexit_access_to_ldtr_or_tr:
+			status = vmx::dt::HandleLdtrTrAccess( gcpuContext );
+			break;
+		case vmexit_nmi:
+			status = vmx::events::HandleExceptionOrNmi( gcpuContext );
+			break;
+		case vmexit_ept_violation:
+			status = vmx::ept::HandleViolation( gcpuContext );
+			break;
+		case vmexit_vmfunc:
+			status = vmx::ept::HandleVmfunc( gcpuContext );
+			break;
+		case vmexit_vmx_preemption_timer_expired:
+			status = vmx::profile::HandleTimer( gcpuContext );
+			break;
+		case vmexit_interrupt_window:
+		case vmexit_nmi_window:
+			//
+			// Nothing to emulate, the queued event goes in right bellow
+			//
+			status = 1;
+			break;
+		default:
+			status = 0;
+			break;
+		}
 	}
 
 	if ( !status )
 	{
-		DbgInfo( "VMExit unhandled: %d\nRIP: 0x%x\n", ExitReason.BasicExitReason, Rip );
-		KD_DEBUG_BREAK();
+		//
+		// Returning 0 makes the exit stub leave VMX operation on this processor. The report comes after the guest CR3 is
+		// back, the host address space doesn't map the kernel
+		//
+		vmx::PrepareDevirtualize( gcpuContext );
+
+		if ( ExitReason.BasicExitReason != vmexit_vmcall )
+		{
+			DbgInfo( "VMExit unhandled: %d\nRIP: 0x%x\n", ExitReason.BasicExitReason, Rip );
+			KD_DEBUG_BREAK();
+		}
 	}
 
+	//
+	// Kicks, whatever the exit was. A kick that lands after this check waits for the next exit, senders resend
+	//
+	if ( status && vcpu->Kick.Claimed )
+		vmx::kick::Process( vcpu );
+
+	//
+	// Queued events, and the ones that hit root mode during this exit
+	//
+	if ( status )
+		vmx::events::Inject( vcpu, gcpuContext );
+
+	Cycles = __rdtsc() - Start;
+	Counters->RootCycles += Cycles;
+
+	//
+	// The time of this exit comes off the guest TSC, depending on the policy
+	//
+	if ( status )
+		vmx::tsc::Compensate( vcpu, ExitReason.BasicExitReason, Cycles );
+
+	if ( vcpu->Stats )
+		vmx::stats::Publish( vcpu->Stats, Counters, &vcpu->Trace, &vcpu->Translations, ExitReason.BasicExitReason );
+
 	return status;
 }
-
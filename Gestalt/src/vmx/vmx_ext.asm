@@ -2,6 +2,27 @@
 
 
 extern VMExitHandler : proc
+extern HostExceptionHandler : proc
+extern HostFaultResume : proc
+extern GuestVeHandler : proc
+
+;
+; LaunchContext offsets, keep in sync with vmx.h
+;
+LAUNCH_RBX              equ 0A0h
+LAUNCH_RBP              equ 0A8h
+LAUNCH_RDI              equ 0B0h
+LAUNCH_RSI              equ 0B8h
+LAUNCH_R12              equ 0C0h
+LAUNCH_R13              equ 0C8h
+LAUNCH_R14              equ 0D0h
+LAUNCH_R15              equ 0D8h
+LAUNCH_RSP              equ 0E0h
+LAUNCH_RFLAGS           equ 0E8h
+
+VMCS_GUEST_RSP          equ 681Ch
+VMCS_GUEST_RIP          equ 681Eh
+VMCS_GUEST_RFLAGS       equ 6820h
 
 SAVE_GP macro
         push    rax
@@ -84,4 +105,342 @@ vmerror:
 
 __vmx_default_exit_handler endp
 
+;
+; Host IDT stubs, one per exception vector and one for everything above. Each builds a HostTrapFrame (vmx.h):
+; the error code (0 when the processor doesn't push one), the vector, the GPRs and xmm0-xmm5.
+; The processor aligns RSP to 16 bytes before pushing its frame, so the frame is aligned too
+;
+HOST_ISR macro Vector, ErrorCode
+host_isr_&Vector&::
+if ErrorCode eq 0
+        push    0
+endif
+        push    Vector
+        jmp     host_isr_common
+endm
+
+__vmx_host_isr proc
+        HOST_ISR 0, 0
+        HOST_ISR 1, 0
+        HOST_ISR 2, 0
+        HOST_ISR 3, 0
+        HOST_ISR 4, 0
+        HOST_ISR 5, 0
+        HOST_ISR 6, 0
+        HOST_ISR 7, 0
+        HOST_ISR 8, 1
+        HOST_ISR 9, 0
+        HOST_ISR 10, 1
+        HOST_ISR 11, 1
+        HOST_ISR 12, 1
+        HOST_ISR 13, 1
+        HOST_ISR 14, 1
+        HOST_ISR 15, 0
+        HOST_ISR 16, 0
+        HOST_ISR 17, 1
+        HOST_ISR 18, 0
+        HOST_ISR 19, 0
+        HOST_ISR 20, 0
+        HOST_ISR 21, 1
+        HOST_ISR 22, 0
+        HOST_ISR 23, 0
+        HOST_ISR 24, 0
+        HOST_ISR 25, 0
+        HOST_ISR 26, 0
+        HOST_ISR 27, 0
+        HOST_ISR 28, 0
+        HOST_ISR 29, 1
+        HOST_ISR 30, 1
+        HOST_ISR 31, 0
+        HOST_ISR 32, 0
+
+host_isr_common:
+        SAVE_GP
+        sub     rsp, 60h
+        movaps  xmmword ptr [rsp +  0h], xmm0
+        movaps  xmmword ptr [rsp + 10h], xmm1
+        movaps  xmmword ptr [rsp + 20h], xmm2
+        movaps  xmmword ptr [rsp + 30h], xmm3
+        movaps  xmmword ptr [rsp + 40h], xmm4
+        movaps  xmmword ptr [rsp + 50h], xmm5
+
+        mov     rcx, rsp
+        sub     rsp, 20h
+        call    HostExceptionHandler
+        add     rsp, 20h
+
+        movaps  xmm0, xmmword ptr [rsp +  0h]
+        movaps  xmm1, xmmword ptr [rsp + 10h]
+        movaps  xmm2, xmmword ptr [rsp + 20h]
+        movaps  xmm3, xmmword ptr [rsp + 30h]
+        movaps  xmm4, xmmword ptr [rsp + 40h]
+        movaps  xmm5, xmmword ptr [rsp + 50h]
+        add     rsp, 60h
+        RESTORE_GP
+        add     rsp, 10h
+        iretq
+__vmx_host_isr endp
+
+;
+; Reached with IRETQ from HostExceptionHandler after a fatal exception, RSP is the GCPUContext of the exit.
+; Leaves VMX operation like an unhandled exit does
+;
+__vmx_host_fault_resume proc
+        mov     rcx, rsp
+        sub     rsp, 20h
+        call    HostFaultResume
+        add     rsp, 20h
+
+        movaps  xmm0, xmmword ptr [rsp +  0h]
+        movaps  xmm1, xmmword ptr [rsp + 10h]
+        movaps  xmm2, xmmword ptr [rsp + 20h]
+        movaps  xmm3, xmmword ptr [rsp + 30h]
+        movaps  xmm4, xmmword ptr [rsp + 40h]
+        movaps  xmm5, xmmword ptr [rsp + 50h]
+        add     rsp, 68h
+
+        RESTORE_GP
+        vmxoff
+        jz      fault_vmerror
+        jc      fault_vmerror
+        push    r8
+        popf
+        mov     rsp, rdx
+        push    rcx
+        ret
+
+fault_vmerror:
+        int 3
+__vmx_host_fault_resume endp
+
+;
+; int __vmx_launch( LaunchContext* Context )
+;
+; Capture the non-volatile context and launch with the guest starting at launch_resume on this same stack,
+; so a successful launch returns 0 to the caller as a normal function return, now running as the guest.
+; On failure it returns 1 (VMfailInvalid) or 2 (VMfailValid)
+;
+__vmx_launch proc
+        movaps  xmmword ptr [rcx +  0h], xmm6
+        movaps  xmmword ptr [rcx + 10h], xmm7
+        movaps  xmmword ptr [rcx + 20h], xmm8
+        movaps  xmmword ptr [rcx + 30h], xmm9
+        movaps  xmmword ptr [rcx + 40h], xmm10
+        movaps  xmmword ptr [rcx + 50h], xmm11
+        movaps  xmmword ptr [rcx + 60h], xmm12
+        movaps  xmmword ptr [rcx + 70h], xmm13
+        movaps  xmmword ptr [rcx + 80h], xmm14
+        movaps  xmmword ptr [rcx + 90h], xmm15
+        mov     qword ptr [rcx + LAUNCH_RBX], rbx
+        mov     qword ptr [rcx + LAUNCH_RBP], rbp
+        mov     qword ptr [rcx + LAUNCH_RDI], rdi
+        mov     qword ptr [rcx + LAUNCH_RSI], rsi
+        mov     qword ptr [rcx + LAUNCH_R12], r12
+        mov     qword ptr [rcx + LAUNCH_R13], r13
+        mov     qword ptr [rcx + LAUNCH_R14], r14
+        mov     qword ptr [rcx + LAUNCH_R15], r15
+        mov     qword ptr [rcx + LAUNCH_RSP], rsp
+        pushfq
+        pop     qword ptr [rcx + LAUNCH_RFLAGS]
+
+        mov     rdx, VMCS_GUEST_RSP
+        vmwrite rdx, rsp
+        mov     rdx, VMCS_GUEST_RIP
+        lea     rax, launch_resume
+        vmwrite rdx, rax
+        mov     rdx, VMCS_GUEST_RFLAGS
+        vmwrite rdx, qword ptr [rcx + LAUNCH_RFLAGS]
+
+        vmlaunch
+
+        mov     eax, 1
+        jc      launch_failed
+        mov     eax, 2
+launch_failed:
+        ret
+
+launch_resume:
+        ;
+        ; Guest from here, VM entry doesn't load general purpose registers so RCX still holds the context
+        ;
+        movaps  xmm6,  xmmword ptr [rcx +  0h]
+        movaps  xmm7,  xmmword ptr [rcx + 10h]
+        movaps  xmm8,  xmmword ptr [rcx + 20h]
+        movaps  xmm9,  xmmword ptr [rcx + 30h]
+        movaps  xmm10, xmmword ptr [rcx + 40h]
+        movaps  xmm11, xmmword ptr [rcx + 50h]
+        movaps  xmm12, xmmword ptr [rcx + 60h]
+        movaps  xmm13, xmmword ptr [rcx + 70h]
+        movaps  xmm14, xmmword ptr [rcx + 80h]
+        movaps  xmm15, xmmword ptr [rcx + 90h]
+        mov     rbx, qword ptr [rcx + LAUNCH_RBX]
+        mov     rbp, qword ptr [rcx + LAUNCH_RBP]
+        mov     rdi, qword ptr [rcx + LAUNCH_RDI]
+        mov     rsi, qword ptr [rcx + LAUNCH_RSI]
+        mov     r12, qword ptr [rcx + LAUNCH_R12]
+        mov     r13, qword ptr [rcx + LAUNCH_R13]
+        mov     r14, qword ptr [rcx + LAUNCH_R14]
+        mov     r15, qword ptr [rcx + LAUNCH_R15]
+        mov     rsp, qword ptr [rcx + LAUNCH_RSP]
+        push    qword ptr [rcx + LAUNCH_RFLAGS]
+        popfq
+        xor     eax, eax
+        ret
+__vmx_launch endp
+
+;
+; UINT64 __vmcall( UINT64 Hypercall, UINT64 Arg1, UINT64 Arg2 ), the hypercall number goes in RCX
+;
+__vmcall proc
+        vmcall
+        ret
+__vmcall endp
+
+;
+; void __load_tr( UINT16 Selector )
+;
+__load_tr proc
+        ltr     cx
+        ret
+__load_tr endp
+
+;
+; void __unblock_nmi(), IRET to the next instruction. NMIs stay blocked after an NMI exit until the host executes one
+;
+__unblock_nmi proc
+        mov     rax, rsp
+        mov     ecx, ss
+        push    rcx
+        push    rax
+        pushfq
+        mov     ecx, cs
+        push    rcx
+        lea     rcx, unblocked
+        push    rcx
+        iretq
+unblocked:
+        ret
+__unblock_nmi endp
+
+;
+; unsigned char __invept( UINT64 Type, const INVEPT_DESCRIPTOR* Descriptor ), 0 on success, 1 with an error number in
+; the VMCS, 2 without
+;
+__invept proc
+        invept  rcx, oword ptr [rdx]
+        jz      invept_failed_valid
+        jc      invept_failed_invalid
+        xor     eax, eax
+        ret
+invept_failed_valid:
+        mov     eax, 1
+        ret
+invept_failed_invalid:
+        mov     eax, 2
+        ret
+__invept endp
+
+;
+; void __vmfunc( UINT32 Function, UINT32 Index ), guest side. VMFUNC 0 switches to the EPTP at Index of the list
+;
+__vmfunc proc
+        mov     eax, ecx
+        mov     ecx, edx
+        db      0Fh, 01h, 0D4h
+        ret
+__vmfunc endp
+
+;
+; unsigned char __vmx_rdmsr_safe( UINT32 Msr, UINT64* Value ) and __vmx_wrmsr_safe( UINT32 Msr, UINT64 Value ), root
+; mode. 0 when done, 1 when the MSR raised #GP: HostExceptionHandler resumes a #GP at __vmx_msr_read or
+; __vmx_msr_write in __vmx_msr_fault
+;
+public __vmx_msr_read
+public __vmx_msr_write
+public __vmx_msr_fault
+
+__vmx_rdmsr_safe proc
+        mov     r8, rdx
+__vmx_msr_read label byte
+        rdmsr
+        shl     rdx, 32
+        or      rax, rdx
+        mov     [r8], rax
+        xor     eax, eax
+        ret
+__vmx_rdmsr_safe endp
+
+__vmx_wrmsr_safe proc
+        mov     eax, edx
+        shr     rdx, 32
+__vmx_msr_write label byte
+        wrmsr
+        xor     eax, eax
+        ret
+__vmx_wrmsr_safe endp
+
+__vmx_msr_fault proc
+        mov     eax, 1
+        ret
+__vmx_msr_fault endp
+
+;
+; #VE gate of the guest IDT copy, no error code. Volatile registers are saved around GuestVeHandler, which clears the
+; semaphore of the information page before the IRET
+;
+__vmx_ve_isr proc
+        test    byte ptr [rsp + 8], 3
+        jz      ve_kernel_entry
+        swapgs
+ve_kernel_entry:
+        push    rax
+        push    rcx
+        push    rdx
+        push    r8
+        push    r9
+        push    r10
+        push    r11
+        sub     rsp, 80h
+        movaps  [rsp + 20h], xmm0
+        movaps  [rsp + 30h], xmm1
+        movaps  [rsp + 40h], xmm2
+        movaps  [rsp + 50h], xmm3
+        movaps  [rsp + 60h], xmm4
+        movaps  [rsp + 70h], xmm5
+        cld
+        call    GuestVeHandler
+        movaps  xmm0, [rsp + 20h]
+        movaps  xmm1, [rsp + 30h]
+        movaps  xmm2, [rsp + 40h]
+        movaps  xmm3, [rsp + 50h]
+        movaps  xmm4, [rsp + 60h]
+        movaps  xmm5, [rsp + 70h]
+        add     rsp, 80h
+        pop     r11
+        pop     r10
+        pop     r9
+        pop     r8
+        pop     rdx
+        pop     rcx
+        pop     rax
+        test    byte ptr [rsp + 8], 3
+        jz      ve_kernel_exit
+        swapgs
+ve_kernel_exit:
+        iretq
+__vmx_ve_isr endp
+
+.const
+
+;
+; Stub of each exception vector, indexed by vmx::host::BuildDescriptors
+;
+public __vmx_host_isr_table
+__vmx_host_isr_table label qword
+        dq      host_isr_0, host_isr_1, host_isr_2, host_isr_3, host_isr_4, host_isr_5, host_isr_6, host_isr_7
+        dq      host_isr_8, host_isr_9, host_isr_10, host_isr_11, host_isr_12, host_isr_13, host_isr_14, host_isr_15
+        dq      host_isr_16, host_isr_17, host_isr_18, host_isr_19, host_isr_20, host_isr_21, host_isr_22, host_isr_23
+        dq      host_isr_24, host_isr_25, host_isr_26, host_isr_27, host_isr_28, host_isr_29, host_isr_30, host_isr_31
+        dq      host_isr_32
+
 end
\ No newline at end of file
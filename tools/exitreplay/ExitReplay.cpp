@@ -0,0 +1,279 @@
+//
+// Replay a recorded exit trace through vmx::VMExitHandler and the host exit policy at full speed, on the software VMX model.
+// Every thread is a vCPU replaying one processor block of the trace (blocks are reused round-robin when there are
+// more threads than blocks), the result is the handler throughput in exits per second per core
+//
+#include "sim/SimVMX.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+enum TRACE_GPR
+{
+	TraceR15 = 0,
+	TraceR14,
+	TraceR13,
+	TraceR12,
+	TraceR11,
+	TraceR10,
+	TraceR9,
+	TraceR8,
+	TraceRdi,
+	TraceRsi,
+	TraceRbp,
+	TraceRbx,
+	TraceRdx,
+	TraceRcx,
+	TraceRax,
+};
+
+struct TraceBlock
+{
+	ExitTraceHeader Header;
+	const ExitTraceRecord* Records;
+};
+
+struct ReplayResult
+{
+	bool Launched;
+	UINT64 Exits;
+	UINT64 Relaunches;
+	UINT64 RootCycles;
+	double Seconds;
+	UINT64 ExitsByReason[MAX_VMEXIT_REASON_FILTER];
+};
+
+static GlobalState* Global;
+
+
+static void LoadExit( const ExitTraceRecord* Record, sim::ExitEvent* Exit )
+{
+	Exit->Reason = Record->Reason;
+	Exit->InstructionLength = Record->InstructionLength;
+	Exit->Qualification = Record->Qualification;
+	Exit->Regs.rax = Record->Gpr[TraceRax];
+	Exit->Regs.rcx = Record->Gpr[TraceRcx];
+	Exit->Regs.rdx = Record->Gpr[TraceRdx];
+	Exit->Regs.rbx = Record->Gpr[TraceRbx];
+	Exit->Regs.rbp = Record->Gpr[TraceRbp];
+	Exit->Regs.rsi = Record->Gpr[TraceRsi];
+	Exit->Regs.rdi = Record->Gpr[TraceRdi];
+	Exit->Regs.r8 = Record->Gpr[TraceR8];
+	Exit->Regs.r9 = Record->Gpr[TraceR9];
+	Exit->Regs.r10 = Record->Gpr[TraceR10];
+	Exit->Regs.r11 = Record->Gpr[TraceR11];
+	Exit->Regs.r12 = Record->Gpr[TraceR12];
+	Exit->Regs.r13 = Record->Gpr[TraceR13];
+	Exit->Regs.r14 = Record->Gpr[TraceR14];
+	Exit->Regs.r15 = Record->Gpr[TraceR15];
+	Exit->Regs.rip = Record->Rip;
+	Exit->Regs.rsp = Record->Rsp;
+	Exit->Regs.rflags = Record->Rflags;
+}
+
+
+static void ReplayThread( int Index, const TraceBlock* Block, UINT64 Iterations, ReplayResult* Result )
+{
+	sim::ExitEvent Exit = {};
+	vCPU* vcpu;
+
+	sim::AttachProcessor( Index );
+	vcpu = sim::AllocateVCPU( Index, Global );
+
+	Result->Launched = sim::Virtualize( vcpu );
+
+	if ( Result->Launched )
+	{
+		auto Start = std::chrono::steady_clock::now();
+
+		for ( UINT64 i = 0; i < Iterations && Result->Launched; i++ )
+		{
+			for ( UINT64 j = 0; j < Block->Header.RecordCount; j++ )
+			{
+				LoadExit( &Block->Records[j], &Exit );
+
+				//
+				// Exits that make the processor leave VMX operation (devirtualize hypercall, unhandled exits) are replayed too,
+				// the vCPU is launched again to go on with the stream
+				//
+				if ( !sim::InjectExit( &Exit ) )
+				{
+					Result->Relaunches++;
+
+					if ( !sim::Virtualize( vcpu ) )
+					{
+						Result->Launched = false;
+						break;
+					}
+				}
+			}
+		}
+
+		Result->Seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - Start ).count();
+		Result->Exits = vcpu->Counters.Exits;
+		Result->RootCycles = vcpu->Counters.RootCycles;
+		memcpy( Result->ExitsByReason, vcpu->Counters.ExitsByReason, sizeof( Result->ExitsByReason ) );
+
+		if ( sim::InVmxOperation() )
+			__vmx_off();
+	}
+
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+}
+
+
+static bool LoadTrace( const char* Path, std::vector< BYTE >& Buffer, std::vector< TraceBlock >& Blocks )
+{
+	FILE* File = fopen( Path, "rb" );
+	SIZE_T Offset = 0;
+	long Size;
+
+	if ( !File )
+		return false;
+
+	fseek( File, 0, SEEK_END );
+	Size = ftell( File );
+	fseek( File, 0, SEEK_SET );
+
+	Buffer.resize( Size > 0 ? ( size_t ) Size : 0 );
+
+	if ( Size <= 0 || fread( Buffer.data(), 1, Buffer.size(), File ) != Buffer.size() )
+	{
+		fclose( File );
+		return false;
+	}
+
+	fclose( File );
+
+	while ( Offset < Buffer.size() )
+	{
+		TraceBlock Block;
+		SIZE_T BlockSize;
+
+		Block.Records = vmx::trace::ParseBlock( Buffer.data() + Offset, Buffer.size() - Offset, &Block.Header, &BlockSize );
+
+		if ( !Block.Records )
+			return false;
+
+		if ( Block.Header.RecordCount )
+			Blocks.push_back( Block );
+
+		Offset += BlockSize;
+	}
+
+	return !Blocks.empty();
+}
+
+
+static void Usage( const char* Name )
+{
+	fprintf( stderr, "usage: %s TRACE [--threads N] [--iterations N] [--verbose]\n", Name );
+}
+
+int main( int argc, char** argv )
+{
+	std::vector< BYTE > Buffer;
+	std::vector< TraceBlock > Blocks;
+	const char* Path = nullptr;
+	unsigned ThreadCount = 0;
+	UINT64 Iterations = 1;
+	bool Verbose = false;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		bool HasValue = i + 1 < argc;
+
+		if ( !strcmp( argv[i], "--threads" ) && HasValue )
+			ThreadCount = ( unsigned ) strtoul( argv[++i], nullptr, 0 );
+		else if ( !strcmp( argv[i], "--iterations" ) && HasValue )
+			Iterations = strtoull( argv[++i], nullptr, 0 );
+		else if ( !strcmp( argv[i], "--verbose" ) )
+			Verbose = true;
+		else if ( argv[i][0] != '-' && !Path )
+			Path = argv[i];
+		else
+		{
+			Usage( argv[0] );
+			return 2;
+		}
+	}
+
+	if ( !Path )
+	{
+		Usage( argv[0] );
+		return 2;
+	}
+
+	if ( !LoadTrace( Path, Buffer, Blocks ) )
+	{
+		fprintf( stderr, "%s is not a valid exit trace\n", Path );
+		return 1;
+	}
+
+	if ( !ThreadCount )
+		ThreadCount = ( unsigned ) Blocks.size();
+
+	sim::SetLogging( Verbose );
+
+	Global = new ( std::align_val_t( PAGE_SIZE ) ) GlobalState;
+	memset( Global, 0, sizeof( GlobalState ) );
+
+	std::vector< ReplayResult > Results( ThreadCount );
+	std::vector< std::thread > Threads;
+
+	for ( unsigned i = 0; i < ThreadCount; i++ )
+	{
+		memset( &Results[i], 0, sizeof( ReplayResult ) );
+		Threads.emplace_back( ReplayThread, ( int ) i, &Blocks[i % Blocks.size()], Iterations, &Results[i] );
+	}
+
+	for ( auto& Thread : Threads )
+		Thread.join();
+
+	UINT64 TotalExits = 0;
+	UINT64 ExitsByReason[MAX_VMEXIT_REASON_FILTER] = { 0 };
+	double Rate = 0;
+	int status = 0;
+
+	for ( unsigned i = 0; i < ThreadCount; i++ )
+	{
+		ReplayResult* Result = &Results[i];
+		const TraceBlock* Block = &Blocks[i % Blocks.size()];
+
+		if ( !Result->Launched )
+		{
+			printf( "vcpu %u: launch failed\n", i );
+			status = 1;
+			continue;
+		}
+
+		double PerSecond = Result->Seconds > 0 ? Result->Exits / Result->Seconds : 0;
+
+		printf( "vcpu %u (trace cpu %u): %llu exits, %.0f exits/s, %.0f root cycles/exit, %llu relaunches\n",
+			i, Block->Header.CpuNumber, ( unsigned long long ) Result->Exits, PerSecond,
+			Result->Exits ? ( double ) Result->RootCycles / Result->Exits : 0.0, ( unsigned long long ) Result->Relaunches );
+
+		for ( int j = 0; j < MAX_VMEXIT_REASON_FILTER; j++ )
+			ExitsByReason[j] += Result->ExitsByReason[j];
+
+		TotalExits += Result->Exits;
+		Rate += PerSecond;
+	}
+
+	printf( "total: %u vcpus, %llu exits, %.0f exits/s\n", ThreadCount, ( unsigned long long ) TotalExits, Rate );
+
+	for ( int j = 0; j < MAX_VMEXIT_REASON_FILTER; j++ )
+	{
+		if ( ExitsByReason[j] )
+			printf( "reason %d: %llu exits\n", j, ( unsigned long long ) ExitsByReason[j] );
+	}
+
+	operator delete( Global, std::align_val_t( PAGE_SIZE ) );
+
+	return status;
+}
@@ -0,0 +1,1339 @@
+//
+// Guest page walker and translation cache checks, on synthetic page tables. The tables live in an arena that stands for
+// guest-physical memory: the direct map of the test host address space starts at the arena, its first page isn't RAM.
+// The MOV to CR3, INVLPG, INVPCID, string I/O and descriptor-table handlers, the process tracking and the EPT views are
+// driven through the software VMX model, the direct map is built over the sim MTRRs, then the cache is measured against
+// plain walks on a random working set
+//
+#include "sim/SimVMX.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#define ARENA_SIZE ( 64ULL << 20 )
+
+#define PTE_PRESENT ( 1ULL << 0 )
+#define PTE_WRITE ( 1ULL << 1 )
+#define PTE_USER ( 1ULL << 2 )
+#define PTE_LARGE ( 1ULL << 7 )
+#define PTE_GLOBAL ( 1ULL << 8 )
+#define PTE_NX ( 1ULL << 63 )
+
+#define CR4_PGE ( 1ULL << 7 )
+#define CR4_LA57 ( 1ULL << 12 )
+#define CR4_PCIDE ( 1ULL << 17 )
+
+struct Arena
+{
+	BYTE* Memory;
+	UINT64 Next;
+	HostAddressSpace Host;
+};
+
+static Arena Guest;
+static int Failures;
+
+
+static void Check( bool Condition, const char* What )
+{
+	if ( !Condition )
+	{
+		printf( "FAILED: %s\n", What );
+		Failures++;
+	}
+}
+
+static UINT64 AllocatePage()
+{
+	UINT64 Page = Guest.Next;
+
+	Guest.Next += PAGE_SIZE;
+
+	if ( Guest.Next > ARENA_SIZE )
+	{
+		fprintf( stderr, "arena exhausted\n" );
+		exit( 1 );
+	}
+
+	memset( Guest.Memory + Page, 0, PAGE_SIZE );
+
+	return Page;
+}
+
+static UINT64* Entry( UINT64 Table, UINT64 Address, int Shift )
+{
+	return ( UINT64* ) ( Guest.Memory + Table ) + ( ( Address >> Shift ) & 0x1FF );
+}
+
+//
+// Map one page of 1 << PageShift bytes, the intermediate tables are created writable and user so the leaf flags decide
+//
+static void Map( UINT64 Root, bool FiveLevel, UINT64 Address, UINT64 Physical, int PageShift, UINT64 Flags )
+{
+	UINT64 Table = Root;
+
+	for ( int Shift = FiveLevel ? 48 : 39; Shift > PageShift; Shift -= 9 )
+	{
+		UINT64* Pointer = Entry( Table, Address, Shift );
+
+		if ( !( *Pointer & PTE_PRESENT ) )
+			*Pointer = AllocatePage() | PTE_PRESENT | PTE_WRITE | PTE_USER;
+
+		Table = *Pointer & 0x000FFFFFFFFFF000ULL;
+	}
+
+	*Entry( Table, Address, PageShift ) = Physical | Flags | PTE_PRESENT | ( PageShift != GUEST_PAGE_SHIFT_4KB ? PTE_LARGE : 0 );
+}
+
+static UINT64* Leaf( UINT64 Root, UINT64 Address )
+{
+	UINT64 Table = Root;
+
+	for ( int Shift = 39; Shift > GUEST_PAGE_SHIFT_4KB; Shift -= 9 )
+		Table = *Entry( Table, Address, Shift ) & 0x000FFFFFFFFFF000ULL;
+
+	return Entry( Table, Address, GUEST_PAGE_SHIFT_4KB );
+}
+
+static UINT64 Translated( TranslationCache* Cache, UINT64 Cr3, UINT64 Cr4, UINT64 Address )
+{
+	GuestTranslation Translation;
+
+	if ( vmx::guest::Translate( Cache, &Guest.Host, Cr3, Cr4, Address, &Translation ) != GuestWalkOk )
+		return MAXUINT64;
+
+	return Translation.PhysicalAddress;
+}
+
+
+static void CheckWalker()
+{
+	GuestTranslation Translation;
+	UINT64 Root = AllocatePage();
+	UINT64 Root5 = AllocatePage();
+	UINT64 Cr4 = CR4_PGE;
+
+	Map( Root, false, 0x00007FF612340000ULL, 0x1234000, GUEST_PAGE_SHIFT_4KB, PTE_WRITE | PTE_USER );
+	Map( Root, false, 0xFFFFF80000200000ULL, 0x40000000, GUEST_PAGE_SHIFT_2MB, PTE_WRITE | PTE_GLOBAL | PTE_NX );
+	Map( Root, false, 0xFFFF900000000000ULL, 0x80000000, GUEST_PAGE_SHIFT_1GB, 0 );
+
+	Check( vmx::guest::Walk( &Guest.Host, Root, Cr4, 0x00007FF612340ABCULL, &Translation ) == GuestWalkOk &&
+		Translation.PhysicalAddress == 0x1234ABC && Translation.PageShift == GUEST_PAGE_SHIFT_4KB &&
+		Translation.Writable && Translation.User && Translation.Executable && !Translation.Global, "4 KB page" );
+
+	Check( vmx::guest::Walk( &Guest.Host, Root, Cr4, 0xFFFFF800003FFFF8ULL, &Translation ) == GuestWalkOk &&
+		Translation.PhysicalAddress == 0x401FFFF8 && Translation.PageShift == GUEST_PAGE_SHIFT_2MB &&
+		Translation.Writable && !Translation.User && !Translation.Executable && Translation.Global, "2 MB page" );
+
+	Check( vmx::guest::Walk( &Guest.Host, Root, 0, 0xFFFFF80000200000ULL, &Translation ) == GuestWalkOk && !Translation.Global,
+		"global bit without CR4.PGE" );
+
+	Check( vmx::guest::Walk( &Guest.Host, Root, Cr4, 0xFFFF90003FFFF000ULL, &Translation ) == GuestWalkOk &&
+		Translation.PhysicalAddress == 0xBFFFF000 && Translation.PageShift == GUEST_PAGE_SHIFT_1GB && !Translation.Writable,
+		"1 GB page" );
+
+	Check( vmx::guest::Walk( &Guest.Host, Root, Cr4, 0x00007FF612341000ULL, &Translation ) == GuestWalkNotPresent, "not present" );
+	Check( vmx::guest::Walk( &Guest.Host, Root, Cr4, 0x0000800000000000ULL, &Translation ) == GuestWalkNonCanonical, "non-canonical" );
+	Check( vmx::guest::Walk( &Guest.Host, 0, Cr4, 0x00007FF612340000ULL, &Translation ) == GuestWalkUnreadable, "tables outside RAM" );
+
+	//
+	// 57-bit addresses, canonical only with CR4.LA57
+	//
+	Map( Root5, true, 0x00FF000000001000ULL, 0x5000, GUEST_PAGE_SHIFT_4KB, PTE_WRITE );
+	Map( Root5, true, 0xFF00000000200000ULL, 0x600000, GUEST_PAGE_SHIFT_2MB, 0 );
+
+	Check( vmx::guest::Walk( &Guest.Host, Root5, Cr4 | CR4_LA57, 0x00FF000000001234ULL, &Translation ) == GuestWalkOk &&
+		Translation.PhysicalAddress == 0x5234 && !Translation.User, "5-level 4 KB page" );
+	Check( vmx::guest::Walk( &Guest.Host, Root5, Cr4 | CR4_LA57, 0xFF00000000212345ULL, &Translation ) == GuestWalkOk &&
+		Translation.PhysicalAddress == 0x612345, "5-level 2 MB page" );
+	Check( vmx::guest::Walk( &Guest.Host, Root5, Cr4, 0x00FF000000001234ULL, &Translation ) == GuestWalkNonCanonical,
+		"57-bit address with 4-level paging" );
+}
+
+
+static void CheckCache()
+{
+	TranslationCache Cache;
+	UINT64 RootA = AllocatePage();
+	UINT64 RootB = AllocatePage();
+	UINT64 Cr4 = CR4_PGE | CR4_PCIDE;
+	UINT64 Cr3A = RootA | 1;
+	UINT64 Cr3B = RootB | 2;
+	UINT64 UserA = 0x0000000140000000ULL;
+	UINT64 UserB = 0x0000000140005000ULL;
+	UINT64 Kernel = 0xFFFFF80000400000ULL;	// Kernel + 0x1000, UserA and UserB take different slots
+
+	vmx::guest::ResetCache( &Cache, true );
+
+	//
+	// The same user addresses in two address spaces, the kernel large page is global and in both
+	//
+	Map( RootA, false, UserA, 0x10000, GUEST_PAGE_SHIFT_4KB, PTE_USER );
+	Map( RootB, false, UserA, 0x20000, GUEST_PAGE_SHIFT_4KB, PTE_USER );
+	Map( RootB, false, UserB, 0x21000, GUEST_PAGE_SHIFT_4KB, PTE_USER );
+	Map( RootA, false, Kernel, 0x800000, GUEST_PAGE_SHIFT_2MB, PTE_GLOBAL );
+	Map( RootB, false, Kernel, 0x800000, GUEST_PAGE_SHIFT_2MB, PTE_GLOBAL );
+
+	Check( Translated( &Cache, Cr3A, Cr4, UserA ) == 0x10000 && Translated( &Cache, Cr3A, Cr4, UserA + 8 ) == 0x10008 &&
+		Cache.Hits == 1 && Cache.Misses == 1, "hit on the second access" );
+	Check( Translated( &Cache, Cr3B, Cr4, UserA ) == 0x20000 && Cache.Misses == 2, "address spaces are apart" );
+	Check( Translated( &Cache, Cr3A, Cr4, Kernel + 0x1000 ) == 0x801000 && Translated( &Cache, Cr3B, Cr4, Kernel + 0x1000 ) == 0x801000 &&
+		Cache.Hits == 2, "global translations are shared" );
+
+	//
+	// The cache keeps a translation until it's invalidated, like the TLB
+	//
+	Translated( &Cache, Cr3A, Cr4, UserA );
+	Translated( &Cache, Cr3B, Cr4, UserB );
+	*Leaf( RootA, UserA ) = 0x30000 | PTE_PRESENT | PTE_USER;
+	Check( Translated( &Cache, Cr3A, Cr4, UserA ) == 0x10000 && Cache.Hits == 3, "stale until invalidated" );
+
+	vmx::guest::LoadCr3( &Cache, Cr3A | GUEST_CR3_NO_FLUSH, Cr4 );
+	Check( Translated( &Cache, Cr3A, Cr4, UserA ) == 0x10000, "MOV to CR3 with bit 63 keeps the PCID" );
+
+	vmx::guest::LoadCr3( &Cache, Cr3A, Cr4 );
+	Check( Translated( &Cache, Cr3A, Cr4, UserA ) == 0x30000, "MOV to CR3 flushes the PCID" );
+	Check( Translated( &Cache, Cr3B, Cr4, UserB ) == 0x21000 && Cache.Hits == 5, "other PCIDs are kept" );
+
+	*Leaf( RootA, UserA ) = 0x40000 | PTE_PRESENT | PTE_USER;
+	vmx::guest::FlushAddress( &Cache, UserA + 0x800 );
+	Check( Translated( &Cache, Cr3A, Cr4, UserA ) == 0x40000, "INVLPG" );
+
+	vmx::guest::FlushAddress( &Cache, Kernel + 0x1FF000 );
+	Translated( &Cache, Cr3A, Cr4, Kernel + 0x1000 );
+	Check( Cache.Misses == 8, "INVLPG of a large page drops every 4 KB piece" );
+
+	*Leaf( RootB, UserB ) = 0x50000 | PTE_PRESENT | PTE_USER;
+	vmx::guest::FlushPcid( &Cache, 1, false, 0 );
+	Check( Translated( &Cache, Cr3B, Cr4, UserB ) == 0x21000, "INVPCID single-context of another PCID" );
+	vmx::guest::FlushPcid( &Cache, 2, true, UserB );
+	Check( Translated( &Cache, Cr3B, Cr4, UserB ) == 0x50000, "INVPCID individual-address" );
+
+	vmx::guest::FlushAll( &Cache, false );
+	Translated( &Cache, Cr3A, Cr4, Kernel + 0x1000 );
+	Check( Cache.Hits == 7, "global translations survive a non-global flush" );
+	vmx::guest::FlushAll( &Cache, true );
+	Translated( &Cache, Cr3A, Cr4, Kernel + 0x1000 );
+	Check( Cache.Hits == 7, "INVPCID all-context with globals" );
+
+	//
+	// Without PCIDs a MOV to CR3 drops every non-global translation
+	//
+	Translated( &Cache, RootA, CR4_PGE, UserA );
+	vmx::guest::LoadCr3( &Cache, RootB, CR4_PGE );
+	Check( Translated( &Cache, RootA, CR4_PGE, UserA ) == 0x40000 && Cache.Hits == 7, "MOV to CR3 without PCIDs" );
+}
+
+
+//
+// I/O range handler of CheckExits, the accesses go on to the sim ports
+//
+static IoAccess LastAccess;
+
+static int CountIo( GCPUContext* context, const IoAccess* Access, void* Context )
+{
+	UNREFERENCED_PARAMETER( context );
+
+	LastAccess = *Access;
+	( *( int* ) Context )++;
+
+	return -1;
+}
+
+//
+// The handlers, through exits injected in a virtualized processor
+//
+static void CheckExits( GlobalState* Global )
+{
+	sim::ExitEvent Exit;
+	vCPU* vcpu;
+	UINT64 Root = AllocatePage();
+	UINT64 Data = AllocatePage();
+	UINT64 User = 0x0000000150000000ULL;
+	UINT64 Descriptors = 0x0000000160000000ULL;
+	UINT64 Buffer = 0x0000000170000000ULL;
+	UINT64 Cr4 = CR4_PGE | CR4_PCIDE;
+	UINT64* Invpcid = ( UINT64* ) ( Guest.Memory + Data );
+	BYTE* Bytes = Guest.Memory + Data;
+	int IoExits = 0;
+
+	Map( Root, false, User, 0x70000, GUEST_PAGE_SHIFT_4KB, PTE_USER );
+	Map( Root, false, Descriptors, Data, GUEST_PAGE_SHIFT_4KB, 0 );
+	Map( Root, false, Buffer, Data, GUEST_PAGE_SHIFT_4KB, PTE_WRITE );
+
+	sim::AttachProcessor( 0 );
+	vcpu = sim::AllocateVCPU( 0, Global );
+
+	Check( vmx::Enable() && vmx::StartVMX( vcpu ) && vmx::ConfigureVMCS( vcpu ), "VMCS configured" );
+	vmx::AbortVMX( vcpu );
+	Check( !sim::InVmxOperation() && !( __readcr4() & CR4_VMX_ENABLE_FLAG ), "VMX operation left without a launch" );
+
+	if ( !sim::Virtualize( vcpu ) )
+	{
+		Check( false, "launch" );
+		sim::FreeVCPU( vcpu );
+		sim::DetachProcessor();
+		return;
+	}
+
+	Check( sim::ReadField( VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & ( 1ULL << 15 ), "CR3-load exiting" );
+	Check( vcpu->Translations.Enabled, "cache enabled" );
+
+	__vmx_vmwrite( VMCS_GUEST_CR4, Cr4 );
+
+	memset( &Exit, 0, sizeof( Exit ) );
+	Exit.Reason = vmexit_control_register_access;
+	Exit.InstructionLength = 3;
+	Exit.Qualification = VMX_EXIT_QUALIFICATION_REGISTER_CR3 | ( 1 << 8 );		// mov cr3, rcx
+	Exit.Regs.rcx = Root | 5 | GUEST_CR3_NO_FLUSH;
+	Exit.Regs.rip = 0x1000;
+
+	Check( sim::InjectExit( &Exit ) && sim::ReadField( VMCS_GUEST_CR3 ) == ( Root | 5 ) && Exit.Regs.rip == 0x1003, "MOV to CR3" );
+
+	Exit.Qualification = VMX_EXIT_QUALIFICATION_REGISTER_CR3 | ( VMX_EXIT_QUALIFICATION_ACCESS_MOV_FROM_CR << 4 ) | ( 2 << 8 );
+	Check( sim::InjectExit( &Exit ) && Exit.Regs.rdx == ( Root | 5 ), "MOV from CR3" );
+
+	Check( Translated( &vcpu->Translations, Root | 5, Cr4, User ) == 0x70000, "translation through the vCPU cache" );
+	*Leaf( Root, User ) = 0x71000 | PTE_PRESENT | PTE_USER;
+
+	Exit.Reason = vmexit_invlpg;
+	Exit.Qualification = User;
+	Check( sim::InjectExit( &Exit ) && Translated( &vcpu->Translations, Root | 5, Cr4, User ) == 0x71000, "INVLPG exit" );
+
+	//
+	// invpcid rcx, [rax + 0x10]: individual-address descriptor for PCID 5
+	//
+	*Leaf( Root, User ) = 0x72000 | PTE_PRESENT | PTE_USER;
+	Invpcid[2] = 5;
+	Invpcid[3] = User;
+
+	Exit.InstructionInfo = ( 2 << 7 ) | ( 3 << 15 ) | ( 1 << 22 ) | ( 0 << 23 ) | ( 1ULL << 28 );
+	Exit.Reason = vmexit_invpcid;
+	Exit.Qualification = 0x10;
+	Exit.Regs.rax = Descriptors;
+	Exit.Regs.rcx = InvpcidIndividualAddress;
+	Check( sim::InjectExit( &Exit ) && Translated( &vcpu->Translations, Root | 5, Cr4, User ) == 0x72000, "INVPCID exit" );
+
+	//
+	// RDMSR of an MSR the processor doesn't have: the #GP goes to the guest, which stays on the instruction
+	//
+	Exit.Reason = vmexit_rdmsr;
+	Exit.InstructionLength = 2;
+	Exit.Regs.rcx = 0x4000FFFF;
+	Exit.Regs.rip = 0x1100;
+	Check( sim::InjectExit( &Exit ) && Exit.Regs.rip == 0x1100 && sim::InVmxOperation() &&
+		sim::ReadField( VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD ) == 0x80000B0D &&
+		!sim::ReadField( VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE ), "RDMSR of a missing MSR" );
+
+	//
+	// Ports 0x60 - 0x64 exit, and nothing else
+	//
+	Check( vmx::io::AddRange( Global, 0x60, 0x64, CountIo, &IoExits ) && !vmx::io::AddRange( Global, 0x64, 0x70, CountIo, &IoExits ) &&
+		Global->Io.BitMapA[0x60 / 8] == 0x1F && Global->Io.BitMapA[0x68 / 8] == 0 &&
+		( sim::ReadField( VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & ( 1ULL << 25 ) ), "I/O range registration" );
+
+	memset( &Exit, 0, sizeof( Exit ) );
+	Exit.Reason = vmexit_io_instruction;
+	Exit.InstructionLength = 2;
+	Exit.Regs.rip = 0x2000;
+
+	//
+	// out 0x60, al, then in ax, dx on 0x5F: the word touches 0x60
+	//
+	Exit.Qualification = ( 0x60 << 16 ) | ( 1 << 6 );
+	Exit.Regs.rax = 0x12345678AB;
+	Check( sim::InjectExit( &Exit ) && sim::GetPort( 0x60 ) == 0xAB && Exit.Regs.rip == 0x2002 && IoExits == 1 &&
+		LastAccess.Size == 1 && !LastAccess.In && LastAccess.Immediate, "OUT to an intercepted port" );
+
+	sim::SetPort( 0x5F, 0xBEEF );
+	Exit.Qualification = ( 0x5F << 16 ) | ( 1 << 3 ) | 1;
+	Check( sim::InjectExit( &Exit ) && Exit.Regs.rax == 0x123456BEEF && IoExits == 2 && LastAccess.Size == 2 && LastAccess.In,
+		"IN across the range start" );
+
+	//
+	// rep outsb on 0x61 from the read-only page, rep insw on 0x62 to the writable one
+	//
+	memcpy( Bytes + 0x100, "abc", 3 );
+	Exit.Qualification = ( 0x61 << 16 ) | ( 1 << 5 ) | ( 1 << 4 );
+	Exit.GuestLinearAddress = Descriptors + 0x100;
+	Exit.Regs.rsi = Descriptors + 0x100;
+	Exit.Regs.rcx = 3;
+	Check( sim::InjectExit( &Exit ) && sim::GetPort( 0x61 ) == 'c' && Exit.Regs.rsi == Descriptors + 0x103 && !Exit.Regs.rcx &&
+		LastAccess.Count == 3 && LastAccess.String && LastAccess.Rep, "REP OUTSB" );
+
+	sim::SetPort( 0x62, 0xCAFE );
+	Exit.Qualification = ( 0x62 << 16 ) | ( 1 << 5 ) | ( 1 << 4 ) | ( 1 << 3 ) | 1;
+	Exit.GuestLinearAddress = Buffer + 0x200;
+	Exit.Regs.rdi = Buffer + 0x200;
+	Exit.Regs.rcx = 2;
+	Check( sim::InjectExit( &Exit ) && *( UINT16* ) ( Bytes + 0x200 ) == 0xCAFE && *( UINT16* ) ( Bytes + 0x202 ) == 0xCAFE &&
+		Exit.Regs.rdi == Buffer + 0x204 && !Exit.Regs.rcx, "REP INSW" );
+
+	//
+	// An exit already on its way when the range goes still passes through
+	//
+	Exit.Qualification = ( 0x60 << 16 ) | ( 1 << 6 );
+	Check( vmx::io::RemoveRange( Global, 0x60 ) && !Global->Io.BitMapA[0x60 / 8] && sim::InjectExit( &Exit ) && IoExits == 4,
+		"I/O range removal" );
+
+	//
+	// A long REP OUTSB goes in steps, RIP stays on it until RCX is done
+	//
+	Exit.Qualification = ( 0x61 << 16 ) | ( 1 << 5 ) | ( 1 << 4 );
+	Exit.GuestLinearAddress = Descriptors;
+	Exit.Regs.rsi = Descriptors;
+	Exit.Regs.rcx = MAX_IO_STRING_ITERATIONS + 10;
+	Exit.Regs.rip = 0x2000;
+	Check( sim::InjectExit( &Exit ) && Exit.Regs.rip == 0x2000 && Exit.Regs.rcx == 10 &&
+		Exit.Regs.rsi == Descriptors + MAX_IO_STRING_ITERATIONS, "REP OUTSB split" );
+
+	Exit.GuestLinearAddress = Exit.Regs.rsi;
+	Check( sim::InjectExit( &Exit ) && Exit.Regs.rip == 0x2002 && !Exit.Regs.rcx, "REP OUTSB resumed" );
+
+	//
+	// REP INSB across into a read-only page: the writable part is done, then a #PF on the first byte that isn't
+	//
+	Map( Root, false, Buffer + PAGE_SIZE, Data, GUEST_PAGE_SHIFT_4KB, 0 );
+	Exit.Qualification = ( 0x62 << 16 ) | ( 1 << 5 ) | ( 1 << 4 ) | ( 1 << 3 );
+	Exit.GuestLinearAddress = Buffer + PAGE_SIZE - 2;
+	Exit.Regs.rdi = Buffer + PAGE_SIZE - 2;
+	Exit.Regs.rcx = 4;
+	Exit.Regs.rip = 0x2000;
+	Check( sim::InjectExit( &Exit ) && sim::InVmxOperation() && Exit.Regs.rip == 0x2000 && Exit.Regs.rcx == 2 &&
+		Exit.Regs.rdi == Buffer + PAGE_SIZE && __readcr2() == Buffer + PAGE_SIZE &&
+		sim::ReadField( VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD ) == 0x80000B0E &&
+		sim::ReadField( VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE ) == 3, "REP INSB to a read-only page" );
+
+	if ( sim::InVmxOperation() )
+		__vmx_off();
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+}
+
+
+//
+// Descriptor-table instruction exits, with memory operands in a writable guest page, and their handler cost on the model
+//
+static void CheckDescriptorExits( GlobalState* Global )
+{
+	sim::ExitEvent Exit;
+	vCPU* vcpu;
+	DescriptorTableExits* Exits;
+	UINT64 Root = AllocatePage();
+	UINT64 GdtPage = AllocatePage();
+	UINT64 DataPage = AllocatePage();
+	UINT64 Gdt = 0xFFFFF80000010000ULL;
+	UINT64 Data = 0xFFFFF80000020000ULL;
+	UINT64 Unmapped = 0xFFFFF80000030000ULL;
+	UINT64* Descriptors = ( UINT64* ) ( Guest.Memory + GdtPage );
+	BYTE* Operand = Guest.Memory + DataPage;
+	UINT64 Value;
+
+	Map( Root, false, Gdt, GdtPage, GUEST_PAGE_SHIFT_4KB, PTE_WRITE );
+	Map( Root, false, Data, DataPage, GUEST_PAGE_SHIFT_4KB, PTE_WRITE );
+
+	//
+	// 0x40: available 64-bit TSS at 0xFFFFF80012345000, 0x50: LDT, 0x60: a code segment
+	//
+	Descriptors[8] = 0x67 | ( 0x5000ULL << 16 ) | ( 0x34ULL << 32 ) | ( 0x89ULL << 40 ) | ( 0x12ULL << 56 );
+	Descriptors[9] = 0xFFFFF800;
+	Descriptors[10] = 0xFFFF | ( 0x82ULL << 40 ) | ( 0x8ULL << 52 );
+	Descriptors[11] = 0;
+	Descriptors[12] = 0x00209B0000000000ULL;
+
+	Global->DescriptorTableExiting = true;
+
+	sim::AttachProcessor( 0 );
+	vcpu = sim::AllocateVCPU( 0, Global );
+	Exits = &vcpu->DescriptorTables;
+
+	if ( !sim::Virtualize( vcpu ) )
+	{
+		Check( false, "launch" );
+		sim::FreeVCPU( vcpu );
+		sim::DetachProcessor();
+		Global->DescriptorTableExiting = false;
+		return;
+	}
+
+	Check( sim::ReadField( VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & ( 1 << 2 ), "descriptor-table exiting" );
+
+	__vmx_vmwrite( VMCS_GUEST_CR3, Root );
+	__vmx_vmwrite( VMCS_GUEST_CR4, 0 );
+	__vmx_vmwrite( VMCS_GUEST_CS_ACCESS_RIGHTS, 0xA09B );
+	__vmx_vmwrite( VMCS_GUEST_SS_ACCESS_RIGHTS, 0xC093 );
+	__vmx_vmwrite( VMCS_GUEST_GDTR_BASE, Gdt );
+	__vmx_vmwrite( VMCS_GUEST_GDTR_LIMIT, 0x7F );
+	__vmx_vmwrite( VMCS_GUEST_IDTR_BASE, 0xFFFFF80000040000ULL );
+	__vmx_vmwrite( VMCS_GUEST_IDTR_LIMIT, 0xFFF );
+
+	memset( &Exit, 0, sizeof( Exit ) );
+	Exit.Reason = vmexit_access_to_gdtr_or_idtr;
+	Exit.InstructionLength = 3;
+	Exit.Regs.rip = 0x3000;
+	Exit.Regs.rax = Data;
+
+	//
+	// sgdt [rax]: 64-bit address, DS, no index, base RAX
+	//
+	Exit.InstructionInfo = ( 2 << 7 ) | ( 3 << 15 ) | ( 1 << 22 ) | ( DescriptorSgdt << 28 );
+	Check( sim::InjectExit( &Exit ) && *( UINT16* ) Operand == 0x7F && *( UINT64* ) ( Operand + 2 ) == Gdt && Exit.Regs.rip == 0x3003,
+		"SGDT" );
+
+	//
+	// sidt [rax + 0x10] with a shadow, then lidt [rax + 0x10] loads it for real and drops the shadow
+	//
+	vmx::dt::SetShadow( &Exits->Idt, 0xFFFFF80000050000ULL, 0x7FF, true );
+	Exit.Qualification = 0x10;
+	Exit.InstructionInfo = ( 2 << 7 ) | ( 3 << 15 ) | ( 1 << 22 ) | ( DescriptorSidt << 28 );
+	Check( sim::InjectExit( &Exit ) && *( UINT16* ) ( Operand + 0x10 ) == 0x7FF &&
+		*( UINT64* ) ( Operand + 0x12 ) == 0xFFFFF80000050000ULL && sim::ReadField( VMCS_GUEST_IDTR_BASE ) == 0xFFFFF80000040000ULL,
+		"SIDT with a shadow" );
+
+	*( UINT64* ) ( Operand + 0x12 ) = 0xFFFFF80000060000ULL;
+	Exit.InstructionInfo = ( 2 << 7 ) | ( 3 << 15 ) | ( 1 << 22 ) | ( DescriptorLidt << 28 );
+	Check( sim::InjectExit( &Exit ) && sim::ReadField( VMCS_GUEST_IDTR_BASE ) == 0xFFFFF80000060000ULL &&
+		sim::ReadField( VMCS_GUEST_IDTR_LIMIT ) == 0x7FF && !Exits->Idt.Active, "LIDT" );
+
+	//
+	// sidt to a page that isn't mapped: a #PF (write, supervisor, not present) and the instruction isn't skipped
+	//
+	Exit.Regs.rax = Unmapped;
+	Exit.Regs.rip = 0x3000;
+	Exit.Qualification = 0;
+	Exit.InstructionInfo = ( 2 << 7 ) | ( 3 << 15 ) | ( 1 << 22 ) | ( DescriptorSidt << 28 );
+	Check( sim::InjectExit( &Exit ) && Exit.Regs.rip == 0x3000 && Exits->Faults == 1 && __readcr2() == Unmapped &&
+		sim::ReadField( VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD ) == 0x80000B0E &&
+		sim::ReadField( VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE ) == 2, "SIDT page fault" );
+
+	//
+	// ltr cx, then str rdx
+	//
+	Exit.Reason = vmexit_access_to_ldtr_or_tr;
+	Exit.Regs.rcx = 0x40;
+	Exit.InstructionInfo = ( 1 << 3 ) | ( 1 << 10 ) | ( ( DescriptorLtr - DescriptorSldt ) << 28 );
+	Check( sim::InjectExit( &Exit ) && sim::ReadField( VMCS_GUEST_TR_BASE ) == 0xFFFFF80012345000ULL &&
+		sim::ReadField( VMCS_GUEST_TR_LIMIT ) == 0x67 && sim::ReadField( VMCS_GUEST_TR_ACCESS_RIGHTS ) == 0x8B &&
+		( ( Descriptors[8] >> 40 ) & 0xF ) == SEGMENT_DESCRIPTOR_TYPE_TSS_BUSY, "LTR" );
+
+	Exit.Regs.rdx = MAXUINT64;
+	Exit.InstructionInfo = ( 2 << 3 ) | ( 1 << 10 ) | ( ( DescriptorStr - DescriptorSldt ) << 28 );
+	Check( sim::InjectExit( &Exit ) && Exit.Regs.rdx == 0x40, "STR" );
+
+	//
+	// lldt [rax]: the LDT at 0x50 (4 KB granular limit), a code segment is a #GP with the selector, null is unusable
+	//
+	Exit.Regs.rax = Data;
+	Exit.Regs.rip = 0x3000;
+	*( UINT16* ) Operand = 0x50;
+	Exit.InstructionInfo = ( 2 << 7 ) | ( 3 << 15 ) | ( 1 << 22 ) | ( ( DescriptorLldt - DescriptorSldt ) << 28 );
+	Check( sim::InjectExit( &Exit ) && sim::ReadField( VMCS_GUEST_LDTR_LIMIT ) == 0xFFFFFFF &&
+		sim::ReadField( VMCS_GUEST_LDTR_ACCESS_RIGHTS ) == 0x8082 && Exit.Regs.rip == 0x3003, "LLDT" );
+
+	*( UINT16* ) Operand = 0x60;
+	Check( sim::InjectExit( &Exit ) && Exit.Regs.rip == 0x3003 && Exits->Faults == 2 &&
+		sim::ReadField( VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD ) == 0x80000B0D &&
+		sim::ReadField( VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE ) == 0x60, "LLDT of a code segment" );
+
+	*( UINT16* ) Operand = 0;
+	Check( sim::InjectExit( &Exit ) && ( sim::ReadField( VMCS_GUEST_LDTR_ACCESS_RIGHTS ) & ( 1 << 16 ) ), "LLDT of a null selector" );
+
+	//
+	// Handler cost, the memory forms through the translation cache
+	//
+	Exit.Reason = vmexit_access_to_gdtr_or_idtr;
+	Exit.InstructionInfo = ( 2 << 7 ) | ( 3 << 15 ) | ( 1 << 22 ) | ( DescriptorSidt << 28 );
+
+	for ( int i = 0; i < 100000; i++ )
+		sim::InjectExit( &Exit );
+
+	Exit.Reason = vmexit_access_to_ldtr_or_tr;
+	Exit.InstructionInfo = ( 2 << 3 ) | ( 1 << 10 ) | ( ( DescriptorStr - DescriptorSldt ) << 28 );
+
+	for ( int i = 0; i < 100000; i++ )
+		sim::InjectExit( &Exit );
+
+	for ( int i = 0; i < DescriptorInstructionCount; i++ )
+	{
+		if ( Exits->Exits[i] )
+			printf( "%s: %llu exits, %llu root mode cycles/exit\n", vmx::dt::InstructionName( ( DESCRIPTOR_INSTRUCTION ) i ),
+				( unsigned long long ) Exits->Exits[i], ( unsigned long long ) ( Exits->Cycles[i] / Exits->Exits[i] ) );
+	}
+
+	Value = sim::ReadField( VMCS_GUEST_TR_SELECTOR );
+	Check( Value == 0x40, "TR selector" );
+
+	__vmx_off();
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	Global->DescriptorTableExiting = false;
+}
+
+
+//
+// TSC offsetting: root mode time comes off the guest TSC down to TSC_MAX_SKEW under the highest offset, and the guest
+// writes of the TSC and IA32_TSC_ADJUST move the offset, not the TSC
+//
+//
+// Size of the direct map page at Address, 0 when it isn't mapped. The sim tables are at their physical address
+//
+static UINT64 DirectMapPage( const HostAddressSpace* Host, UINT64 Address )
+{
+	const UINT64* Table = ( const UINT64* ) Host->Pml4;
+	UINT64 Entry = Table[Host->FirstSlot + ( Address >> 39 )];
+
+	for ( int Level = 3; Level >= 1; Level-- )
+	{
+		if ( !( Entry & PTE_PRESENT ) )
+			return 0;
+
+		Table = ( const UINT64* ) ( Entry & 0xFFFFFFFFFF000ULL );
+		Entry = Table[( Address >> ( PAGE_SHIFT + 9 * ( Level - 1 ) ) ) & 511];
+
+		if ( ( Entry & PTE_PRESENT ) && ( Level == 1 || ( Entry & PTE_LARGE ) ) )
+			return ( Entry & 0xFFFFFFFFFF000ULL ) == ( Address & ~( ( 1ULL << ( PAGE_SHIFT + 9 * ( Level - 1 ) ) ) - 1 ) ) &&
+				( Entry & PTE_NX ) ? 1ULL << ( PAGE_SHIFT + 9 * ( Level - 1 ) ) : 0;
+	}
+
+	return 0;
+}
+
+//
+// Direct map of RAM around the sim MTRRs: fixed ranges below 1 MB, uncacheable from 0xE0000000 for 512 MB
+//
+static void CheckDirectMap()
+{
+	static HostAddressSpace Host;
+	static PML4E_64 SystemPml4[512];
+	PhysicalRange Ranges[] = { { 0x1000, 0x9E000 }, { 0x100000, 0xFFF00000ULL }, { 0x100000000ULL, 0x40000000 } };
+	SIZE_T Size;
+	BYTE* Tables;
+
+	sim::AttachProcessor( 0 );
+
+	Check( vmx::host::TablesSize( Ranges, 3, false ) == 8 * PAGE_SIZE, "direct map tables with 2 MB pages" );
+	Size = vmx::host::TablesSize( Ranges, 3, true );
+	Check( Size == 5 * PAGE_SIZE, "direct map tables with 1 GB pages" );
+
+	Tables = ( BYTE* ) operator new( Size, std::align_val_t( PAGE_SIZE ) );
+
+	Check( !vmx::host::BuildAddressSpace( &Host, SystemPml4, Ranges, 3, Tables, Size - PAGE_SIZE, true ), "direct map too small" );
+	Check( vmx::host::BuildAddressSpace( &Host, SystemPml4, Ranges, 3, Tables, Size, true ) && Host.DirectMapTables == 4 &&
+		Host.FirstSlot == 512 - 1, "direct map" );
+	Check( !DirectMapPage( &Host, 0 ) && DirectMapPage( &Host, 0x1000 ) == PAGE_SIZE && DirectMapPage( &Host, 0x9E000 ) == PAGE_SIZE &&
+		!DirectMapPage( &Host, 0x9F000 ) && !DirectMapPage( &Host, 0xA0000 ) && DirectMapPage( &Host, 0x100000 ) == PAGE_SIZE,
+		"4 KB pages over the fixed ranges, none for the holes" );
+	Check( DirectMapPage( &Host, 0x200000 ) == 0x200000 && DirectMapPage( &Host, 0x40000000 ) == 1ULL << 30 &&
+		DirectMapPage( &Host, 0x100000000ULL ) == 1ULL << 30, "large pages where RAM is of one type" );
+	Check( DirectMapPage( &Host, 0xDFE00000 ) == 0x200000 && DirectMapPage( &Host, 0xE0000000 ) == 0x200000,
+		"1 GB page split at the variable range" );
+	Check( !DirectMapPage( &Host, 0x140000000ULL ) && !DirectMapPage( &Host, 0x7FC0000000ULL ), "nothing past the last range" );
+
+	operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+	sim::DetachProcessor();
+}
+
+static void CheckTsc( GlobalState* Global )
+{
+	sim::ExitEvent Exit;
+	vCPU* vcpu;
+	INT64 Adjust;
+
+	Global->TscOffsetting = true;
+	Global->TscPolicy = TscHideRootCycles;
+	Global->TscOffset = 0;
+	vmx::SetMsrIntercept( Global, IA32_TIME_STAMP_COUNTER, false, true );
+	vmx::SetMsrIntercept( Global, IA32_TSC_ADJUST, true, true );
+
+	sim::AttachProcessor( 0 );
+	vcpu = sim::AllocateVCPU( 0, Global );
+
+	if ( !sim::Virtualize( vcpu ) )
+	{
+		Check( false, "launch" );
+		sim::FreeVCPU( vcpu );
+		sim::DetachProcessor();
+		Global->TscOffsetting = false;
+		return;
+	}
+
+	memset( &Exit, 0, sizeof( Exit ) );
+	Exit.Reason = vmexit_cpuid;
+	Exit.InstructionLength = 2;
+	Check( sim::InjectExit( &Exit ) && vcpu->Tsc.Offset < 0 && vcpu->Tsc.Hidden == ( UINT64 ) -vcpu->Tsc.Offset &&
+		( INT64 ) sim::ReadField( VMCS_CTRL_TSC_OFFSET ) == vcpu->Tsc.Offset, "root mode cycles hidden" );
+
+	vcpu->Tsc.Offset = 1 - TSC_MAX_SKEW;
+	Check( sim::InjectExit( &Exit ) && vcpu->Tsc.Offset == -TSC_MAX_SKEW && vcpu->Tsc.Capped > 0 &&
+		sim::InjectExit( &Exit ) && vcpu->Tsc.Offset == -TSC_MAX_SKEW, "hidden down to the skew cap" );
+
+	Global->TscOffset = -TSC_MAX_SKEW;
+	Check( sim::InjectExit( &Exit ) && vcpu->Tsc.Offset < -TSC_MAX_SKEW, "cap follows the highest offset" );
+
+	//
+	// WRMSR of the TSC: the guest TSC restarts from there, less the root mode time of the exit, the real one doesn't move
+	//
+	Exit.Reason = vmexit_wrmsr;
+	Exit.Regs.rcx = IA32_TIME_STAMP_COUNTER;
+	Exit.Regs.rdx = 0x10;
+	Exit.Regs.rax = 0;
+	Check( sim::InjectExit( &Exit ) && llabs( ( INT64 ) ( vmx::tsc::ToGuest( &vcpu->Tsc, __rdtsc() ) - 0x1000000000ULL ) ) < 1LL << 32 &&
+		( INT64 ) sim::ReadField( VMCS_CTRL_TSC_OFFSET ) == vcpu->Tsc.Offset + vcpu->Tsc.Adjust &&
+		__readmsr( IA32_TIME_STAMP_COUNTER ) == 0, "TSC write goes to the offset" );
+
+	Adjust = vcpu->Tsc.Adjust;
+	Exit.Reason = vmexit_rdmsr;
+	Exit.Regs.rcx = IA32_TSC_ADJUST;
+	Check( sim::InjectExit( &Exit ) && ( INT64 ) ( ( Exit.Regs.rdx << 32 ) | Exit.Regs.rax ) == Adjust, "IA32_TSC_ADJUST follows" );
+
+	Exit.Reason = vmexit_wrmsr;
+	Exit.Regs.rax = ( Adjust + 5000 ) & MAXUINT32;
+	Exit.Regs.rdx = ( UINT64 ) ( Adjust + 5000 ) >> 32;
+	Check( sim::InjectExit( &Exit ) && vcpu->Tsc.Adjust == Adjust + 5000 && __readmsr( IA32_TSC_ADJUST ) == 0 &&
+		( INT64 ) sim::ReadField( VMCS_CTRL_TSC_OFFSET ) == vcpu->Tsc.Offset + vcpu->Tsc.Adjust, "IA32_TSC_ADJUST write" );
+
+	__vmx_off();
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	vmx::SetMsrIntercept( Global, IA32_TIME_STAMP_COUNTER, false, false );
+	vmx::SetMsrIntercept( Global, IA32_TSC_ADJUST, false, false );
+	Global->TscOffsetting = false;
+	Global->TscPolicy = TscAccountOnly;
+	Global->TscOffset = 0;
+}
+
+
+//
+// Context switches with the CR3-target list and a watched process, the translation cache off so the targets are used.
+// The identity map has a second view for the policy of 0x7000
+//
+static void CheckProcesses( GlobalState* Global )
+{
+	EptState* Ept = &Global->Ept;
+	sim::ExitEvent Exit;
+	vCPU* vcpu;
+	ProcessTracking* Tracking = &Global->Processes;
+	ProcessSwitches* Switches;
+	UINT64 System = 0x1000;
+	UINT64 Limit;
+	UINT64 Cr3;
+	SIZE_T TablesSize;
+	BYTE* Tables;
+	INT32 Watched;
+	INT32 Index;
+	bool Pages1Gb = false;
+	bool Exited;
+
+	vmx::ept::Supported( &Pages1Gb );
+	Limit = vmx::ept::MapLimit( Pages1Gb );
+	TablesSize = vmx::ept::TablesSize( Limit, Pages1Gb, 1, 0 );
+	Tables = ( BYTE* ) operator new( TablesSize, std::align_val_t( PAGE_SIZE ) );
+	Check( vmx::ept::Build( Ept, Tables, TablesSize, Limit, Pages1Gb ) && vmx::ept::CreateView( Ept ) == 1, "policy view" );
+
+	Global->TrackTranslations = false;
+	Global->TrackProcesses = true;
+	Tracking->Targets[0] = System;
+	Tracking->Targets[1] = System | GUEST_CR3_NO_FLUSH;
+	Tracking->TargetCount = 2;
+
+	sim::AttachProcessor( 0 );
+	vcpu = sim::AllocateVCPU( 0, Global );
+	Switches = &vcpu->Processes;
+
+	if ( !sim::Virtualize( vcpu ) )
+	{
+		Check( false, "launch" );
+		sim::FreeVCPU( vcpu );
+		sim::DetachProcessor();
+		operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+		memset( Ept, 0, sizeof( EptState ) );
+		Global->TrackTranslations = true;
+		Global->TrackProcesses = false;
+		return;
+	}
+
+	Check( ( sim::ReadField( VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & ( 1ULL << 15 ) ) &&
+		sim::ReadField( VMCS_CTRL_CR3_TARGET_COUNT ) == 2 && sim::ReadField( VMCS_CTRL_CR3_TARGET_VALUE_1 ) == ( System | GUEST_CR3_NO_FLUSH ),
+		"CR3 targets" );
+
+	Check( vmx::process::Watch( Global, System, 0, nullptr ) == PROCESS_NOT_WATCHED &&
+		vmx::process::Watch( Global, 0x5000, System | 1, nullptr ) == PROCESS_NOT_WATCHED, "a target can't be watched" );
+	Index = vmx::process::Watch( Global, 0x5000, 0x6000 | 1, nullptr );
+	Check( Index == 0 && vmx::process::Watch( Global, 0x5000 | 3, 0, nullptr ) == PROCESS_NOT_WATCHED &&
+		vmx::process::Watch( Global, 0x6000, 0, nullptr ) == PROCESS_NOT_WATCHED, "watch" );
+	vmx::process::Apply( vcpu );
+
+	memset( &Exit, 0, sizeof( Exit ) );
+	Exit.Regs.rip = 0x4000;
+
+	Exit.Regs.rcx = System | GUEST_CR3_NO_FLUSH;
+	Check( sim::MovToCr3( &Exit, &Exited ) == 1 && !Exited && sim::ReadField( VMCS_GUEST_CR3 ) == System && Switches->Loads == 0,
+		"switch to a target" );
+
+	Exit.Regs.rcx = 0x3000 | 2;
+	Check( sim::MovToCr3( &Exit, &Exited ) == 1 && Exited && vmx::process::Read( &Switches->Current, &Cr3, &Watched ) &&
+		Cr3 == 0x3000 && Watched == PROCESS_NOT_WATCHED && Switches->Loads == 1, "switch to another process" );
+
+	Exit.Regs.rcx = 0x5000 | 1 | GUEST_CR3_NO_FLUSH;
+	Check( sim::MovToCr3( &Exit, &Exited ) == 1 && Exited && vmx::process::Read( &Switches->Current, &Cr3, &Watched ) &&
+		Cr3 == 0x5000 && Watched == Index && Tracking->Watched[Index].Switches == 1 &&
+		sim::ReadField( VMCS_CTRL_CR3_TARGET_COUNT ) == 0, "switch to the watched process" );
+
+	//
+	// Its user-mode directory base, PCID masked, is the same process
+	//
+	Exit.Regs.rcx = 0x6000 | 1 | GUEST_CR3_NO_FLUSH;
+	Check( sim::MovToCr3( &Exit, &Exited ) == 1 && Exited && vmx::process::Read( &Switches->Current, &Cr3, &Watched ) &&
+		Cr3 == 0x6000 && Watched == Index && Tracking->Watched[Index].Switches == 2 && Tracking->Watched[Index].Cycles == 0,
+		"switch to the user directory base" );
+
+	//
+	// No target while it runs, the switch away exits and ends its time
+	//
+	Exit.Regs.rcx = System;
+	Check( sim::MovToCr3( &Exit, &Exited ) == 1 && Exited && vmx::process::Read( &Switches->Current, &Cr3, &Watched ) &&
+		Watched == PROCESS_NOT_WATCHED && Tracking->Watched[Index].Cycles > 0 && sim::ReadField( VMCS_CTRL_CR3_TARGET_COUNT ) == 2,
+		"switch away from the watched process" );
+
+	Exit.Regs.rcx = 0x5000;
+	sim::MovToCr3( &Exit, &Exited );
+	Check( vmx::process::Unwatch( Global, Index ) && !vmx::process::Unwatch( Global, Index ), "unwatch" );
+	vmx::process::Apply( vcpu );
+	Check( vmx::process::Read( &Switches->Current, &Cr3, &Watched ) && Watched == PROCESS_NOT_WATCHED &&
+		sim::ReadField( VMCS_CTRL_CR3_TARGET_COUNT ) == 2 && Exit.Regs.rip == 0x4000 + 6 * 3, "catch up after unwatch" );
+
+	//
+	// A policy: #BP and RDMSR of IA32_PAT exit while 0x7000 runs, in view 1
+	//
+	ProcessPolicy Policy = {};
+	UINT64 Swaps;
+
+	Policy.ExceptionBitmap = 1 << Breakpoint;
+	Policy.MsrCount = 1;
+	Policy.Msrs[0] = { IA32_PAT, true, false };
+	Policy.EptView = 2;
+
+	Check( vmx::process::Watch( Global, 0x7000, 0, &Policy ) == PROCESS_NOT_WATCHED, "policy view missing" );
+	Policy.EptView = 1;
+
+	Index = vmx::process::Watch( Global, 0x7000, 0, &Policy );
+	Check( Index != PROCESS_NOT_WATCHED && vmx::IsMsrIntercepted( &Tracking->MsrBitMaps[Index], IA32_PAT, false ) &&
+		!vmx::IsMsrIntercepted( &Tracking->MsrBitMaps[Index], IA32_PAT, true ) &&
+		!vmx::IsMsrIntercepted( &Global->MSRBitMap, IA32_PAT, false ), "policy MSR bitmap" );
+
+	vmx::SetMsrIntercept( Global, IA32_SYSENTER_ESP, false, true );
+	Check( vmx::IsMsrIntercepted( &Tracking->MsrBitMaps[Index], IA32_SYSENTER_ESP, true ), "system MSR intercept in the policy" );
+
+	Exit.Regs.rcx = 0x7000;
+	Swaps = Switches->ControlSwaps;
+	sim::MovToCr3( &Exit, &Exited );
+	Check( sim::ReadField( VMCS_CTRL_MSR_BITMAP_ADDRESS ) == ( UINT64 ) &Tracking->MsrBitMaps[Index] &&
+		sim::ReadField( VMCS_CTRL_EXCEPTION_BITMAP ) == ( 1 << Breakpoint ) && Switches->ControlSwaps == Swaps + 1,
+		"policy control set" );
+	Check( vmx::ept::CurrentView( vcpu ) == 1 && Switches->ViewSwitches == 1, "policy view switched to" );
+
+	Exit.Reason = vmexit_rdmsr;
+	Exit.InstructionLength = 2;
+	Exit.Regs.rcx = IA32_PAT;
+	Check( sim::InjectExit( &Exit ) == 1 && Tracking->Watched[Index].Intercepts == 1, "policy intercept counted" );
+
+	Exit.Reason = vmexit_wrmsr;
+	Exit.Regs.rcx = IA32_SYSENTER_ESP;
+	Check( sim::InjectExit( &Exit ) == 1 && Tracking->Watched[Index].Intercepts == 1, "system intercept not counted" );
+
+	Exit.Regs.rcx = 0x3000;
+	sim::MovToCr3( &Exit, &Exited );
+	Exit.Regs.rcx = 0x4000;
+	sim::MovToCr3( &Exit, &Exited );
+	Check( sim::ReadField( VMCS_CTRL_MSR_BITMAP_ADDRESS ) == ( UINT64 ) &Global->MSRBitMap &&
+		sim::ReadField( VMCS_CTRL_EXCEPTION_BITMAP ) == 0 && Switches->ControlSwaps == Swaps + 2, "system control set" );
+	Check( vmx::ept::CurrentView( vcpu ) == 0 && Switches->ViewSwitches == 2, "view from before restored" );
+
+	vmx::SetMsrIntercept( Global, IA32_SYSENTER_ESP, false, false );
+
+	//
+	// A full table, every directory base goes to its own process through the hash
+	//
+	for ( UINT64 Cr3 = 0x8000; Cr3 < 0x8000 + ( MAX_WATCHED_PROCESSES - 1 ) * 0x1000; Cr3 += 0x1000 )
+		vmx::process::Watch( Global, Cr3, Cr3 + 0x80000, nullptr );
+
+	Check( vmx::process::Watch( Global, 0x100000, 0, nullptr ) == PROCESS_NOT_WATCHED, "watched process table full" );
+
+	for ( INT32 i = 0; i < MAX_WATCHED_PROCESSES; i++ )
+	{
+		Exit.Regs.rcx = Tracking->Watched[i].Cr3;
+		sim::MovToCr3( &Exit, &Exited );
+		Check( vmx::process::Read( &Switches->Current, &Cr3, &Watched ) && Watched == i, "hash lookup" );
+
+		if ( !Tracking->Watched[i].UserCr3 )
+			continue;
+
+		Exit.Regs.rcx = Tracking->Watched[i].UserCr3;
+		sim::MovToCr3( &Exit, &Exited );
+		Check( vmx::process::Read( &Switches->Current, &Cr3, &Watched ) && Watched == i, "hash lookup, user directory base" );
+	}
+
+	__vmx_off();
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+	memset( Ept, 0, sizeof( EptState ) );
+	memset( Tracking, 0, sizeof( ProcessTracking ) );
+	Global->TrackTranslations = true;
+	Global->TrackProcesses = false;
+}
+
+
+//
+// The view the #VE handler of CheckEptViews answers with, and the address of the last fault it saw
+//
+static INT32 VeView;
+static UINT64 VeAddress;
+
+static INT32 ResolveVe( const VMX_VIRTUALIZATION_EXCEPTION_INFORMATION* Info, void* Context )
+{
+	UNREFERENCED_PARAMETER( Context );
+
+	VeAddress = Info->GuestPhysicalAddress;
+
+	return VeView;
+}
+
+
+//
+// EPT views over the sim MTRRs: 1 GB pages but around the fixed ranges and the uncacheable hole under 4 GB. View 1
+// remaps a page read-only, a write to it falls back to view 0. A convertible page of view 2 faults as #VE instead
+//
+static void CheckEptViews( GlobalState* Global )
+{
+	EptState* Ept = &Global->Ept;
+	sim::ExitEvent Exit;
+	vCPU* vcpu;
+	UINT64 Remapped = 0x100005000ULL;
+	UINT64 Convertible = 0x100007000ULL;
+	UINT64 Limit;
+	UINT64 Physical;
+	UINT64 Size;
+	UINT64 Inveptions;
+	UINT32 Access;
+	UINT32 Type;
+	SIZE_T TablesSize;
+	BYTE* Tables;
+	bool Pages1Gb = false;
+	bool Exited;
+
+	sim::AttachProcessor( 0 );
+
+	Check( vmx::ept::Supported( &Pages1Gb ) && Pages1Gb, "EPT supported" );
+	Limit = vmx::ept::MapLimit( Pages1Gb );
+	Check( Limit == 1ULL << 39, "identity map up to MAXPHYADDR" );
+
+	TablesSize = vmx::ept::TablesSize( Limit, Pages1Gb, 2, 0 );
+	Tables = ( BYTE* ) operator new( TablesSize, std::align_val_t( PAGE_SIZE ) );
+
+	Check( vmx::ept::Build( Ept, Tables, TablesSize, Limit, Pages1Gb ) && Ept->Views[0].Tables == 5, "identity map" );
+	Check( vmx::ept::CreateView( Ept ) == 1 && vmx::ept::CreateView( Ept ) == 2 && Ept->ViewCount == 3, "views" );
+	Check( Ept->VmfuncSwitching && Ept->ExecuteOnly && Ept->InveptAllContexts, "EPT capabilities" );
+
+	Check( vmx::ept::GetPage( Ept, 0, 0x9F000, &Physical, &Access, &Type, &Size ) && Physical == 0x9F000 &&
+		Type == MEMORY_TYPE_WRITE_BACK && Size == PAGE_SIZE && Access == EPT_ACCESS_ALL, "fixed range, write-back" );
+	Check( vmx::ept::GetPage( Ept, 0, 0xA0000, &Physical, &Access, &Type, &Size ) && Type == MEMORY_TYPE_UNCACHEABLE &&
+		Size == PAGE_SIZE, "fixed range, uncacheable" );
+	Check( vmx::ept::GetPage( Ept, 0, 0x200000, &Physical, &Access, &Type, &Size ) && Type == MEMORY_TYPE_WRITE_BACK &&
+		Size == 0x200000, "2 MB page next to the fixed ranges" );
+	Check( vmx::ept::GetPage( Ept, 0, 0xE0001000, &Physical, &Access, &Type, &Size ) && Physical == 0xE0001000 &&
+		Type == MEMORY_TYPE_UNCACHEABLE && Size == 0x200000, "variable range, uncacheable" );
+	Check( vmx::ept::GetPage( Ept, 0, 0xC0000000, &Physical, &Access, &Type, &Size ) && Type == MEMORY_TYPE_WRITE_BACK &&
+		Size == 0x200000, "default type next to the variable range" );
+	Check( vmx::ept::GetPage( Ept, 0, 0x7FC0000000ULL, &Physical, &Access, &Type, &Size ) && Type == MEMORY_TYPE_WRITE_BACK &&
+		Size == 1ULL << 30 && !vmx::ept::GetPage( Ept, 0, Limit, &Physical, &Access, &Type, &Size ), "1 GB pages up to the limit" );
+
+	Check( !vmx::ept::SetPage( Ept, 0, Remapped, 0x7000, EPT_READ ) && !vmx::ept::SetPage( Ept, 1, Remapped, 0x7000, EPT_WRITE ) &&
+		!vmx::ept::SetPage( Ept, 1, Limit, 0x7000, EPT_READ ) && !vmx::ept::SetPage( Ept, 3, Remapped, 0x7000, EPT_READ ),
+		"view 0, write without read, past the limit and missing views are refused" );
+	Check( vmx::ept::SetPage( Ept, 1, Remapped, 0x7000, EPT_READ ) && Ept->Views[1].Tables == 4, "1 GB page split in view 1" );
+	Check( vmx::ept::GetPage( Ept, 1, Remapped + 0x10, &Physical, &Access, &Type, &Size ) && Physical == 0x7010 &&
+		Access == EPT_READ && Type == MEMORY_TYPE_WRITE_BACK && Size == PAGE_SIZE, "remapped page" );
+	Check( vmx::ept::GetPage( Ept, 1, Remapped + PAGE_SIZE, &Physical, &Access, &Type, &Size ) && Physical == Remapped + PAGE_SIZE &&
+		Access == EPT_ACCESS_ALL && Size == PAGE_SIZE, "rest of the split page" );
+	Check( vmx::ept::GetPage( Ept, 0, Remapped, &Physical, &Access, &Type, &Size ) && Physical == Remapped && Size == 1ULL << 30 &&
+		vmx::ept::GetPage( Ept, 2, Remapped, &Physical, &Access, &Type, &Size ) && Size == 1ULL << 30, "other views unchanged" );
+
+	Check( vmx::ept::SetPage( Ept, 2, Convertible, Convertible, EPT_READ | EPT_CONVERTIBLE ) &&
+		vmx::ept::SetPage( Ept, 1, Convertible, Convertible, EPT_READ | EPT_CONVERTIBLE ) &&
+		vmx::ept::GetPage( Ept, 2, Convertible, &Physical, &Access, &Type, &Size ) && Access == ( EPT_READ | EPT_CONVERTIBLE ) &&
+		vmx::ept::GetPage( Ept, 1, Remapped, &Physical, &Access, &Type, &Size ) && Access == EPT_READ, "convertible pages" );
+	Check( vmx::ept::EnableVe( Ept, ResolveVe, nullptr ) && Ept->VeDelivery, "#VE delivery" );
+
+	vcpu = sim::AllocateVCPU( 0, Global );
+
+	if ( !sim::Virtualize( vcpu ) )
+	{
+		Check( false, "launch" );
+		sim::FreeVCPU( vcpu );
+		sim::DetachProcessor();
+		operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+		memset( Ept, 0, sizeof( EptState ) );
+		return;
+	}
+
+	Check( !( sim::ReadField( VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & ( 1 << 18 ) ) &&
+		!vcpu->DescriptorTables.Idt.Active, "no #VE without descriptor-table exiting" );
+
+	__vmx_off();
+	Global->DescriptorTableExiting = true;
+	Inveptions = sim::InveptCount();
+
+	if ( !sim::Virtualize( vcpu ) )
+	{
+		Check( false, "launch" );
+		sim::FreeVCPU( vcpu );
+		sim::DetachProcessor();
+		operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+		memset( Ept, 0, sizeof( EptState ) );
+		Global->DescriptorTableExiting = false;
+		return;
+	}
+
+	Check( ( sim::ReadField( VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS ) & ( 1 << 1 | 1 << 2 | 1 << 13 | 1 << 18 ) ) ==
+		( 1 << 1 | 1 << 2 | 1 << 13 | 1 << 18 ) && sim::ReadField( VMCS_CTRL_EPT_POINTER ) == Ept->Views[0].Eptp &&
+		sim::InveptCount() == Inveptions + 1, "EPT on at launch" );
+
+	{
+		const SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64* Gate = &vcpu->Ve.Idt[VirtualizationException];
+		UINT64 Isr = ( UINT64 ) Gate->OffsetHigh << 32 | ( UINT64 ) Gate->OffsetMiddle << 16 | Gate->OffsetLow;
+
+		Check( sim::ReadField( VMCS_CTRL_VIRTUALIZATION_EXCEPTION_INFORMATION_ADDRESS ) == ( UINT64 ) &vcpu->Ve.Info &&
+			sim::ReadField( VMCS_GUEST_IDTR_BASE ) == ( UINT64 ) vcpu->Ve.Idt && Gate->Present && Isr == ( UINT64 ) vmx::__vmx_ve_isr &&
+			vcpu->DescriptorTables.Idt.Active, "guest IDT copy with the #VE gate" );
+	}
+
+	memset( &Exit, 0, sizeof( Exit ) );
+	vmx::__vmfunc( 0, 1 );
+	Check( vmx::ept::CurrentView( vcpu ) == 1 && vcpu->Counters.Exits == 0, "VMFUNC switch without an exit" );
+	Check( sim::GuestAccess( &Exit, Remapped, EPT_READ, &Exited ) == 1 && !Exited, "read of the remapped page" );
+	Check( sim::GuestAccess( &Exit, Remapped, EPT_WRITE, &Exited ) == 1 && Exited && vcpu->Ept.Violations == 1 &&
+		vcpu->Ept.LastViolation == Remapped && vmx::ept::CurrentView( vcpu ) == 0, "write falls back to view 0" );
+	Check( sim::GuestAccess( &Exit, Remapped, EPT_WRITE, &Exited ) == 1 && !Exited, "write in view 0" );
+
+	//
+	// The handler sends the write of view 2 to view 0 without an exit, the semaphore is clear for the next one
+	//
+	VeView = 0;
+	vmx::__vmfunc( 0, 2 );
+	Check( sim::GuestAccess( &Exit, Convertible, EPT_WRITE, &Exited ) == 1 && !Exited && vcpu->Ept.VeDelivered == 1 &&
+		vcpu->Ept.Violations == 1 && VeAddress == Convertible && vmx::ept::CurrentView( vcpu ) == 0 &&
+		vcpu->Ve.Info.ExceptionMask == 0 && vcpu->Ve.Info.CurrentEptpIndex == 2 && vcpu->Counters.Exits == 1, "write as #VE" );
+
+	VeView = EPT_NO_VIEW;
+	vmx::__vmfunc( 0, 2 );
+	Check( sim::GuestAccess( &Exit, Convertible, EPT_WRITE, &Exited ) == 1 && !Exited && vcpu->Ept.VeDelivered == 2 &&
+		vcpu->Ept.VeUnresolved == 1 && vcpu->Ept.Violations == 2 && vmx::ept::CurrentView( vcpu ) == 0, "#VE left to the hypervisor" );
+
+	vmx::__vmfunc( 0, 1 );
+	Check( sim::GuestAccess( &Exit, Remapped, EPT_WRITE, &Exited ) == 1 && Exited && vcpu->Ept.VeDelivered == 2 &&
+		vcpu->Ept.Violations == 3, "page without EPT_CONVERTIBLE still exits" );
+
+	vmx::__vmfunc( 0, 5 );
+	Check( vcpu->Ept.FailedVmfuncs == 1 && vmx::ept::CurrentView( vcpu ) == 0 &&
+		( sim::ReadField( VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD ) & 0x800000FF ) == ( 0x80000000 | InvalidOpcode ),
+		"VMFUNC to a missing view raises #UD" );
+
+	Check( vmx::__vmcall( VMCALL_SWITCH_VIEW, 2, 0 ) == 0 && vmx::ept::CurrentView( vcpu ) == 2 &&
+		vmx::__vmcall( VMCALL_SWITCH_VIEW, 3, 0 ) == MAXUINT64 && vcpu->Ept.HypercallSwitches == 2, "hypercall switch" );
+
+	Inveptions = sim::InveptCount();
+	vmx::ept::Invalidate( vcpu );
+	Check( vcpu->Ept.Invalidations == 1 && sim::InveptCount() == Inveptions + 1, "one INVEPT for every view" );
+
+	//
+	// lidt [rax]: the copy is rebuilt from the new table, with the #VE gate, and SIDT shows the new table
+	//
+	{
+		UINT64 Root = AllocatePage();
+		UINT64 IdtPage = AllocatePage();
+		UINT64 DataPage = AllocatePage();
+		UINT64 Idt = 0xFFFFF80000070000ULL;
+		UINT64 Data = 0xFFFFF80000080000ULL;
+		BYTE* Operand = Guest.Memory + DataPage;
+		const SEGMENT_DESCRIPTOR_INTERRUPT_GATE_64* Gate = &vcpu->Ve.Idt[VirtualizationException];
+		UINT64 BreakpointGate;
+		bool Reloaded;
+
+		Map( Root, false, Idt, IdtPage, GUEST_PAGE_SHIFT_4KB, 0 );
+		Map( Root, false, Data, DataPage, GUEST_PAGE_SHIFT_4KB, PTE_WRITE );
+		( ( UINT64* ) ( Guest.Memory + IdtPage ) )[Breakpoint * 2] = 0x123456789ULL;
+		*( UINT16* ) Operand = 0xFFF;
+		*( UINT64* ) ( Operand + 2 ) = Idt;
+
+		__vmx_vmwrite( VMCS_GUEST_CR3, Root );
+		__vmx_vmwrite( VMCS_GUEST_CR4, 0 );
+		__vmx_vmwrite( VMCS_GUEST_CS_ACCESS_RIGHTS, 0xA09B );
+
+		memset( &Exit, 0, sizeof( Exit ) );
+		Exit.Reason = vmexit_access_to_gdtr_or_idtr;
+		Exit.InstructionLength = 3;
+		Exit.Regs.rax = Data;
+		Exit.InstructionInfo = ( 2 << 7 ) | ( 3 << 15 ) | ( 1 << 22 ) | ( DescriptorLidt << 28 );
+
+		Reloaded = sim::InjectExit( &Exit );
+		memcpy( &BreakpointGate, &vcpu->Ve.Idt[Breakpoint], sizeof( BreakpointGate ) );
+
+		Check( Reloaded && sim::ReadField( VMCS_GUEST_IDTR_BASE ) == ( UINT64 ) vcpu->Ve.Idt &&
+			BreakpointGate == 0x123456789ULL && Gate->Present && vcpu->Ept.VeIdtReloads == 1 &&
+			vcpu->DescriptorTables.Idt.Active && vcpu->DescriptorTables.Idt.Base == Idt && vcpu->DescriptorTables.Idt.Limit == 0xFFF,
+			"LIDT rebuilds the IDT copy" );
+
+		*( UINT64* ) ( Operand + 2 ) = 0xFFFFF80000090000ULL;
+		Check( sim::InjectExit( &Exit ) && sim::ReadField( VMCS_GUEST_IDTR_BASE ) == 0xFFFFF80000090000ULL &&
+			!vcpu->DescriptorTables.Idt.Active && vcpu->Ept.VeIdtLost == 1, "LIDT of a table that can't be copied" );
+	}
+
+	__vmx_off();
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+	memset( Ept, 0, sizeof( EptState ) );
+	Global->DescriptorTableExiting = false;
+}
+
+
+//
+// Execution coverage in view 1: the first fetch from a covered page exits and is recorded, the next ones don't exit.
+// A reset takes execute back from the executed pages only
+//
+static void CheckCoverage( GlobalState* Global )
+{
+	EptState* Ept = &Global->Ept;
+	ExecutionCoverage* Coverage = &Global->Coverage;
+	sim::ExitEvent Exit;
+	vCPU* vcpu;
+	UINT64 First = 0x100010000ULL;
+	UINT64 Second = 0x100011000ULL;
+	UINT64 Far = 0x7000000000ULL;
+	UINT64 Pages[4];
+	UINT64 Limit;
+	UINT64 Physical;
+	UINT64 Size;
+	UINT32 Access;
+	UINT32 Type;
+	SIZE_T TablesSize;
+	BYTE* Tables;
+	bool Pages1Gb = false;
+	bool Exited;
+	bool Full = true;
+
+	sim::AttachProcessor( 0 );
+
+	vmx::ept::Supported( &Pages1Gb );
+	Limit = vmx::ept::MapLimit( Pages1Gb );
+	TablesSize = vmx::ept::TablesSize( Limit, Pages1Gb, 0, vmx::coverage::Tables( Limit ) );
+	Tables = ( BYTE* ) operator new( TablesSize, std::align_val_t( PAGE_SIZE ) );
+
+	Check( vmx::ept::Build( Ept, Tables, TablesSize, Limit, Pages1Gb ) && vmx::ept::CreateView( Ept ) == 1, "coverage view" );
+	Check( !vmx::coverage::Cover( Global, First ) && !vmx::coverage::Setup( Global, 0 ) && !vmx::coverage::Setup( Global, 2 ) &&
+		vmx::coverage::Setup( Global, 1 ) && !vmx::coverage::Setup( Global, 1 ), "coverage setup" );
+
+	Check( vmx::coverage::Cover( Global, First ) && vmx::coverage::Cover( Global, Second + 0x123 ) && vmx::coverage::Cover( Global, Far ) &&
+		!vmx::coverage::Cover( Global, First ) && !vmx::coverage::Cover( Global, Limit ) && Coverage->Count == 3, "pages covered" );
+	Check( vmx::ept::GetPage( Ept, 1, Second, &Physical, &Access, &Type, &Size ) && Physical == Second &&
+		Access == ( EPT_READ | EPT_WRITE ) && vmx::ept::GetPage( Ept, 0, Second, &Physical, &Access, &Type, &Size ) &&
+		Access == EPT_ACCESS_ALL, "covered pages lose execute in the coverage view only" );
+
+	vcpu = sim::AllocateVCPU( 0, Global );
+
+	if ( !sim::Virtualize( vcpu ) )
+	{
+		Check( false, "launch" );
+		sim::FreeVCPU( vcpu );
+		sim::DetachProcessor();
+		operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+		memset( Ept, 0, sizeof( EptState ) );
+		memset( Coverage, 0, sizeof( ExecutionCoverage ) );
+		return;
+	}
+
+	vmx::coverage::Apply( vcpu );
+	Check( vmx::ept::CurrentView( vcpu ) == 1, "KICK_COVERAGE switches to the coverage view" );
+
+	memset( &Exit, 0, sizeof( Exit ) );
+	Check( sim::GuestAccess( &Exit, First + 0x40, EPT_EXECUTE, &Exited ) == 1 && Exited && vcpu->Ept.CoverageHits == 1 &&
+		vcpu->Ept.Violations == 0 && vmx::ept::CurrentView( vcpu ) == 1, "first execution recorded in the view" );
+	Check( sim::GuestAccess( &Exit, First + 0x80, EPT_EXECUTE, &Exited ) == 1 && !Exited &&
+		sim::GuestAccess( &Exit, First, EPT_WRITE, &Exited ) == 1 && !Exited, "executed page runs without exits" );
+	Check( sim::GuestAccess( &Exit, Second, EPT_READ, &Exited ) == 1 && !Exited && vmx::coverage::Collect( Coverage, Pages, 4 ) == 1 &&
+		Pages[0] == First, "reads aren't executions" );
+
+	Check( sim::GuestAccess( &Exit, Far, EPT_EXECUTE, &Exited ) == 1 && Exited && vcpu->Ept.CoverageHits == 2 &&
+		vmx::coverage::Collect( Coverage, Pages, 1 ) == 2, "executed pages collected" );
+
+	Check( vmx::coverage::Reset( Global ) == 2 && vmx::coverage::Collect( Coverage, Pages, 4 ) == 0 &&
+		vmx::ept::GetPage( Ept, 1, First, &Physical, &Access, &Type, &Size ) && Access == ( EPT_READ | EPT_WRITE ), "reset" );
+	Check( sim::GuestAccess( &Exit, First, EPT_EXECUTE, &Exited ) == 1 && Exited && vcpu->Ept.CoverageHits == 3, "recorded again after a reset" );
+
+	//
+	// Writes, tracked in the slots of the covered pages and drained in batches
+	//
+	Check( vmx::coverage::TrackWrites( Global, First ) && vmx::coverage::TrackWrites( Global, Second ) &&
+		!vmx::coverage::TrackWrites( Global, First ) && Coverage->Count == 3 &&
+		vmx::ept::GetPage( Ept, 1, First, &Physical, &Access, &Type, &Size ) && Access == ( EPT_READ | EPT_EXECUTE ), "writes tracked" );
+	Check( sim::GuestAccess( &Exit, First, EPT_WRITE, &Exited ) == 1 && Exited && vcpu->Ept.DirtyHits == 1 &&
+		sim::GuestAccess( &Exit, First + 8, EPT_WRITE, &Exited ) == 1 && !Exited && vmx::ept::CurrentView( vcpu ) == 1, "first write recorded" );
+	Check( sim::GuestAccess( &Exit, Second, EPT_WRITE, &Exited ) == 1 && Exited && vcpu->Ept.DirtyHits == 2 &&
+		vcpu->Ept.CoverageHits == 3 && vmx::coverage::Collect( Coverage, Pages, 4 ) == 1, "writes aren't executions" );
+	Check( vmx::coverage::Drain( Global, Pages, 1 ) == 1 && vmx::coverage::Drain( Global, Pages + 1, 3 ) == 1 &&
+		Pages[0] + Pages[1] == First + Second && vmx::coverage::Drain( Global, Pages, 4 ) == 0 && Coverage->Drains == 3, "drained in batches" );
+	Check( vmx::ept::GetPage( Ept, 1, First, &Physical, &Access, &Type, &Size ) && Access == ( EPT_READ | EPT_EXECUTE ) &&
+		sim::GuestAccess( &Exit, First, EPT_WRITE, &Exited ) == 1 && Exited && vcpu->Ept.DirtyHits == 3, "written again after a drain" );
+
+	//
+	// A fetch outside the view is an ordinary violation
+	//
+	vmx::ept::SwitchView( vcpu, 0 );
+	Check( sim::GuestAccess( &Exit, Second, EPT_EXECUTE, &Exited ) == 1 && !Exited && vcpu->Ept.CoverageHits == 3, "view 0 isn't covered" );
+
+	//
+	// One page every 2 MB, each takes a page table of its own: the pool has room for all of them
+	//
+	for ( UINT64 Page = 0x140000000ULL; Coverage->Count < MAX_COVERED_PAGES; Page += 1ULL << 21 )
+		Full &= vmx::coverage::Cover( Global, Page );
+
+	Check( Full && !vmx::coverage::Cover( Global, 0x140001000ULL ), "coverage full" );
+
+	__vmx_off();
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+	memset( Ept, 0, sizeof( EptState ) );
+	memset( Coverage, 0, sizeof( ExecutionCoverage ) );
+}
+
+
+//
+// Random 4 KB accesses over Pages pages, with and without the cache
+//
+static void Measure( UINT64 Pages, UINT64 Iterations )
+{
+	TranslationCache Cache;
+	GuestTranslation Translation;
+	std::vector< UINT64 > Addresses( Iterations );
+	std::mt19937_64 Random( 1 );
+	UINT64 Root = AllocatePage();
+	UINT64 Base = 0x00007FF000000000ULL;
+	UINT64 Sum = 0;
+
+	for ( UINT64 i = 0; i < Pages; i++ )
+		Map( Root, false, Base + i * PAGE_SIZE, ( i + 1 ) * PAGE_SIZE, GUEST_PAGE_SHIFT_4KB, PTE_USER );
+
+	for ( UINT64 i = 0; i < Iterations; i++ )
+		Addresses[i] = Base + Random() % Pages * PAGE_SIZE;
+
+	auto Start = std::chrono::steady_clock::now();
+
+	for ( UINT64 i = 0; i < Iterations; i++ )
+	{
+		vmx::guest::Walk( &Guest.Host, Root, 0, Addresses[i], &Translation );
+		Sum += Translation.PhysicalAddress;
+	}
+
+	double Uncached = std::chrono::duration< double, std::nano >( std::chrono::steady_clock::now() - Start ).count() / Iterations;
+
+	vmx::guest::ResetCache( &Cache, true );
+	Start = std::chrono::steady_clock::now();
+
+	for ( UINT64 i = 0; i < Iterations; i++ )
+	{
+		vmx::guest::Translate( &Cache, &Guest.Host, Root, 0, Addresses[i], &Translation );
+		Sum -= Translation.PhysicalAddress;
+	}
+
+	double Cached = std::chrono::duration< double, std::nano >( std::chrono::steady_clock::now() - Start ).count() / Iterations;
+
+	Check( Sum == 0, "cached and uncached translations agree" );
+
+	printf( "%llu pages, %llu translations: %.1f%% hits, %.0f cycles/walk, %.1f ns/walk, %.1f ns/translation cached\n",
+		( unsigned long long ) Pages, ( unsigned long long ) Iterations, 100.0 * Cache.Hits / Iterations,
+		Cache.Misses ? ( double ) Cache.WalkCycles / Cache.Misses : 0.0, Uncached, Cached );
+}
+
+
+static void Usage( const char* Name )
+{
+	fprintf( stderr, "usage: %s [--pages N] [--iterations N] [--verbose]\n", Name );
+}
+
+int main( int argc, char** argv )
+{
+	UINT64 Iterations = 1000000;
+	bool Verbose = false;
+	std::vector< UINT64 > Pages;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		bool HasValue = i + 1 < argc;
+
+		if ( !strcmp( argv[i], "--pages" ) && HasValue )
+			Pages.push_back( strtoull( argv[++i], nullptr, 0 ) );
+		else if ( !strcmp( argv[i], "--iterations" ) && HasValue )
+			Iterations = strtoull( argv[++i], nullptr, 0 );
+		else if ( !strcmp( argv[i], "--verbose" ) )
+			Verbose = true;
+		else
+		{
+			Usage( argv[0] );
+			return 2;
+		}
+	}
+
+	if ( Pages.empty() )
+		Pages = { 16, 64, 1024 };
+
+	sim::SetLogging( Verbose );
+
+	Guest.Memory = ( BYTE* ) operator new( ARENA_SIZE, std::align_val_t( PAGE_SIZE ) );
+	Guest.Next = PAGE_SIZE;
+	memset( &Guest.Host, 0, sizeof( Guest.Host ) );
+	Guest.Host.DirectMapBase = Guest.Memory;
+	Guest.Host.DirectMapSize = ARENA_SIZE;
+	Guest.Host.RangeCount = 1;
+	Guest.Host.Ranges[0].Base = PAGE_SIZE;
+	Guest.Host.Ranges[0].Size = ARENA_SIZE - PAGE_SIZE;
+
+	GlobalState* Global = new ( std::align_val_t( PAGE_SIZE ) ) GlobalState;
+	memset( Global, 0, sizeof( GlobalState ) );
+	Global->Host = Guest.Host;
+	Global->Host.Cr3 = AllocatePage();
+	Global->TrackTranslations = true;
+
+	CheckWalker();
+	CheckCache();
+	CheckDirectMap();
+	CheckExits( Global );
+	CheckDescriptorExits( Global );
+	CheckTsc( Global );
+	CheckProcesses( Global );
+	CheckEptViews( Global );
+	CheckCoverage( Global );
+
+	for ( UINT64 Count : Pages )
+	{
+		if ( Count && Guest.Next + ( Count / 512 + 4 ) * PAGE_SIZE <= ARENA_SIZE )
+			Measure( Count, Iterations );
+	}
+
+	printf( Failures ? "%d checks failed\n" : "all checks passed\n", Failures );
+
+	operator delete( Global, std::align_val_t( PAGE_SIZE ) );
+	operator delete( Guest.Memory, std::align_val_t( PAGE_SIZE ) );
+
+	return Failures ? 1 : 0;
+}
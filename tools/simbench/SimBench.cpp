@@ -0,0 +1,973 @@
+//
+// Exit pipeline benchmark on the software VMX model (GESTALT_SIM build).
+// Every thread brings up its own vCPU like Hypervisor::VMXVirtualizeProcessor does, then injects a fixed mix
+// of CPUID/RDMSR/WRMSR/VMCALL exits and reports exits per second. Optionally replays the VMCS construction
+// from a CpuSnapshot saved with --save-snapshot, and records the exits in the trace format (--record).
+// --json runs the guest-side exit latency suite of bench/ExitBench.h instead and writes the same report the driver does;
+// on the model only VMCALL actually exits, the other workloads measure the intrinsics of the model.
+// --stats publishes the per-vCPU statistics in a file laid out like the driver statistics section, for tools/statmon.
+// --profile injects preemption timer exits only and reports the root mode cost of a guest RIP sample, with the share
+// of a core it takes at 1, 10 and 100 kHz (the VM exit and entry themselves are not part of the model).
+// --switches runs guest context switches with process tracking, without and with the CR3-target list and a watched
+// process, and reports the exits and root mode cycles per switch.
+// --views builds the EPT identity map and a view, and compares the cycles of a view switch with VMFUNC, with the
+// VMCALL fallback, through an EPT violation, through a #VE and of a remap of the view with its INVEPT.
+// --coverage covers 1024 pages for execution and reports the cycles and exits of the first fetches, of the fetches
+// after them and of a reset
+//
+#include "sim/SimVMX.h"
+#include "bench/ExitBench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+struct BenchOptions
+{
+	unsigned Threads;
+	UINT64 Exits;
+	UINT64 Replays;
+	const char* SaveSnapshot;
+	const char* LoadSnapshot;
+	const char* Record;
+	const char* Json;
+	const char* Stats;
+	bool Profile;
+	bool Switches;
+	bool Views;
+	bool Coverage;
+};
+
+struct ThreadResult
+{
+	bool Launched;
+	UINT64 Exits;
+	double Seconds;
+	UINT64 RootCycles;
+	UINT64 Mismatches;
+	vCPU* vcpu;
+};
+
+static GlobalState* Global;
+static void* StatsRegion;
+
+
+//
+// One exit of the mix, the guest registers are checked against what the handlers must return
+//
+static bool RunExit( UINT64 Iteration, sim::ExitEvent* Exit )
+{
+	UINT64 Rip = Exit->Regs.rip;
+
+	Exit->Qualification = 0;
+
+	switch ( Iteration & 3 )
+	{
+	case 0:
+		Exit->Reason = vmexit_cpuid;
+		Exit->InstructionLength = 2;
+		Exit->Regs.rax = 1;
+		Exit->Regs.rcx = 0;
+		break;
+	case 1:
+		Exit->Reason = vmexit_rdmsr;
+		Exit->InstructionLength = 2;
+		Exit->Regs.rcx = IA32_PAT;
+		break;
+	case 2:
+		Exit->Reason = vmexit_wrmsr;
+		Exit->InstructionLength = 2;
+		Exit->Regs.rcx = IA32_SYSENTER_ESP;
+		Exit->Regs.rax = ( UINT32 ) Iteration;
+		Exit->Regs.rdx = 0;
+		break;
+	case 3:
+		Exit->Reason = vmexit_vmcall;
+		Exit->InstructionLength = 3;
+		Exit->Regs.rcx = 0;
+		break;
+	}
+
+	if ( sim::InjectExit( Exit ) != 1 )
+		return false;
+
+	switch ( Iteration & 3 )
+	{
+	case 0:
+		//
+		// The VMX bit is hidden from the guest
+		//
+		if ( Exit->Regs.rcx & ( 1 << 5 ) )
+			return false;
+		break;
+	case 1:
+		if ( ( ( Exit->Regs.rdx << 32 ) | Exit->Regs.rax ) != __readmsr( IA32_PAT ) )
+			return false;
+		break;
+	case 3:
+		if ( Exit->Regs.rax != MAXUINT64 )
+			return false;
+		break;
+	}
+
+	return Exit->Regs.rip == Rip + Exit->InstructionLength;
+}
+
+
+static void BenchThread( int Index, const BenchOptions* Options, ThreadResult* Result )
+{
+	sim::ExitEvent Exit = {};
+	vCPU* vcpu;
+
+	sim::AttachProcessor( Index );
+	vcpu = sim::AllocateVCPU( Index, Global );
+
+	if ( Options->Record )
+	{
+		vcpu->Trace.Records = new ExitTraceRecord[Options->Exits];
+		vcpu->Trace.Capacity = Options->Exits;
+	}
+
+	vcpu->Stats = vmx::stats::Slot( StatsRegion, ( UINT32 ) Index );
+
+	Result->Launched = sim::Virtualize( vcpu );
+
+	if ( Result->Launched )
+	{
+		Exit.Regs.rip = 0xFFFFF80000100000ULL;
+		Exit.Regs.rsp = 0xFFFFF80000200000ULL;
+		Exit.Regs.rflags = 0x202;
+
+		auto Start = std::chrono::steady_clock::now();
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+		{
+			if ( !RunExit( i, &Exit ) )
+				Result->Mismatches++;
+		}
+
+		Result->Seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - Start ).count();
+		Result->Exits = vcpu->Counters.Exits;
+		Result->RootCycles = vcpu->Counters.RootCycles;
+
+		//
+		// Leave VMX operation through the devirtualize hypercall, like Hypervisor::DeVirtualize
+		//
+		if ( !vmx::StopVMX( vcpu ) || sim::InVmxOperation() )
+			Result->Mismatches++;
+	}
+
+	//
+	// Freed by main, after the trace is written
+	//
+	Result->vcpu = vcpu;
+	sim::DetachProcessor();
+}
+
+
+//
+// Rebuild the VMCS from a snapshot over and over, without touching the capture path
+//
+static bool ReplaySnapshot( const BenchOptions* Options )
+{
+	CpuSnapshot Snapshot;
+	bool status = false;
+	vCPU* vcpu;
+
+	sim::AttachProcessor( 0 );
+	vcpu = sim::AllocateVCPU( 0, Global );
+
+	if ( !vmx::Enable() || !vmx::StartVMX( vcpu ) || !vmx::ConfigureVMCS( vcpu ) )
+		goto exit;
+
+	if ( Options->LoadSnapshot )
+	{
+		BYTE Buffer[sizeof( CpuSnapshot )];
+		FILE* File = fopen( Options->LoadSnapshot, "rb" );
+		size_t Read = 0;
+
+		if ( File )
+		{
+			Read = fread( Buffer, 1, sizeof( Buffer ), File );
+			fclose( File );
+		}
+
+		if ( !VMXUtils::DeserializeCpuSnapshot( Buffer, Read, &Snapshot ) )
+		{
+			fprintf( stderr, "%s is not a valid CpuSnapshot\n", Options->LoadSnapshot );
+			goto exit;
+		}
+	}
+	else
+	{
+		VMXUtils::CaptureCpuSnapshot( &Snapshot );
+	}
+
+	if ( Options->SaveSnapshot )
+	{
+		BYTE Buffer[sizeof( CpuSnapshot )];
+		SIZE_T Size = VMXUtils::SerializeCpuSnapshot( &Snapshot, Buffer, sizeof( Buffer ) );
+		FILE* File = fopen( Options->SaveSnapshot, "wb" );
+
+		if ( !File || fwrite( Buffer, 1, Size, File ) != Size )
+		{
+			fprintf( stderr, "Unable to write %s\n", Options->SaveSnapshot );
+			if ( File )
+				fclose( File );
+			goto exit;
+		}
+
+		fclose( File );
+	}
+
+	if ( Options->Replays )
+	{
+		auto Start = std::chrono::steady_clock::now();
+
+		for ( UINT64 i = 0; i < Options->Replays; i++ )
+			vmx::ConfigureVMCSFields( vcpu, &Snapshot );
+
+		double Seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - Start ).count();
+
+		printf( "vmcs replay: %llu builds, %.1f ns/build\n", ( unsigned long long ) Options->Replays, Seconds * 1e9 / Options->Replays );
+	}
+
+	status = true;
+
+exit:
+	__vmx_off();
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	return status;
+}
+
+
+//
+// Same layout Hypervisor::WriteExitTrace produces, one block per vCPU
+//
+static bool WriteTrace( const char* Path, const std::vector< ThreadResult >& Results )
+{
+	FILE* File = fopen( Path, "wb" );
+	ExitTraceHeader Header;
+	bool status = File != nullptr;
+
+	for ( size_t i = 0; i < Results.size() && status; i++ )
+	{
+		const ExitTrace* Trace = &Results[i].vcpu->Trace;
+
+		vmx::trace::FillHeader( Trace, Results[i].vcpu->CpuNumber, &Header );
+
+		status = fwrite( &Header, sizeof( Header ), 1, File ) == 1 &&
+			fwrite( Trace->Records, sizeof( ExitTraceRecord ), Trace->Count, File ) == Trace->Count;
+	}
+
+	if ( File )
+		fclose( File );
+
+	if ( !status )
+		fprintf( stderr, "Unable to write %s\n", Path );
+
+	return status;
+}
+
+
+//
+// One thread of a latency run, the workload starts once every thread of the run is up (and virtualized)
+//
+static void LatencyThread( int Index, BENCH_PHASE Phase, BENCH_WORKLOAD Workload, UINT32 Iterations,
+	std::atomic< int >* Ready, int Threads, LatencyHistogram* Histogram, UINT64* Cycles, bool* Failed )
+{
+	vCPU* vcpu = nullptr;
+
+	sim::AttachProcessor( Index );
+	bench::ResetHistogram( Histogram );
+
+	if ( Phase == BenchVirtualized )
+	{
+		vcpu = sim::AllocateVCPU( Index, Global );
+
+		if ( !sim::Virtualize( vcpu ) )
+			*Failed = true;
+	}
+
+	Ready->fetch_add( 1 );
+
+	while ( Ready->load() < Threads )
+		std::this_thread::yield();
+
+	if ( !*Failed )
+		*Cycles = bench::Run( Workload, Iterations, Histogram );
+
+	if ( vcpu )
+	{
+		if ( !*Failed && ( !vmx::StopVMX( vcpu ) || sim::InVmxOperation() ) )
+			*Failed = true;
+
+		sim::FreeVCPU( vcpu );
+	}
+
+	sim::DetachProcessor();
+}
+
+
+//
+// Same sequence Hypervisor::RunExitBenchmark runs in the driver: every workload on 1, 2, 4 ... threads,
+// bare metal then virtualized
+//
+static bool RunLatencySuite( const BenchOptions* Options )
+{
+	BenchReport* Report = new BenchReport;
+	UINT32 Scales[BENCH_MAX_SCALES];
+	UINT32 ScaleCount;
+	bool status = true;
+
+	memset( Report, 0, sizeof( BenchReport ) );
+	Report->Processors = Options->Threads;
+	Report->Iterations = ( UINT32 ) Options->Exits;
+	ScaleCount = bench::GetScales( Options->Threads, Scales );
+
+	for ( int p = 0; p < BenchPhaseCount && status; p++ )
+	{
+		Report->Scales[p] = ScaleCount;
+
+		for ( int w = 0; w < BenchWorkloadCount && status; w++ )
+		{
+			if ( p == BenchBaseline && bench::NeedsVMX( ( BENCH_WORKLOAD ) w ) )
+				continue;
+
+			for ( UINT32 s = 0; s < ScaleCount && status; s++ )
+			{
+				BenchRun* Run = &Report->Runs[w][p][s];
+				std::vector< LatencyHistogram > Histograms( Scales[s] );
+				std::vector< UINT64 > Cycles( Scales[s] );
+				std::unique_ptr< bool[] > Failed( new bool[Scales[s]]() );
+				std::vector< std::thread > Threads;
+				std::atomic< int > Ready( 0 );
+
+				for ( UINT32 i = 0; i < Scales[s]; i++ )
+				{
+					Threads.emplace_back( LatencyThread, ( int ) i, ( BENCH_PHASE ) p, ( BENCH_WORKLOAD ) w, Report->Iterations,
+						&Ready, ( int ) Scales[s], &Histograms[i], &Cycles[i], &Failed[i] );
+				}
+
+				for ( auto& Thread : Threads )
+					Thread.join();
+
+				Run->Threads = Scales[s];
+				bench::ResetHistogram( &Run->Latency );
+
+				for ( UINT32 i = 0; i < Scales[s]; i++ )
+				{
+					bench::MergeHistogram( &Run->Latency, &Histograms[i] );
+					Run->Cycles += Cycles[i];
+
+					if ( Failed[i] )
+					{
+						fprintf( stderr, "%s: vcpu %u failed\n", bench::WorkloadName( ( BENCH_WORKLOAD ) w ), i );
+						status = false;
+					}
+				}
+
+				Run->Operations = Run->Latency.Count;
+			}
+		}
+	}
+
+	if ( status )
+	{
+		std::vector< char > Json( bench::FormatJson( Report, nullptr, 0 ) + 1 );
+		FILE* File = fopen( Options->Json, "wb" );
+
+		bench::FormatJson( Report, Json.data(), Json.size() );
+
+		status = File && fwrite( Json.data(), 1, Json.size() - 1, File ) == Json.size() - 1;
+
+		if ( File )
+			fclose( File );
+
+		if ( !status )
+			fprintf( stderr, "Unable to write %s\n", Options->Json );
+	}
+
+	delete Report;
+
+	return status;
+}
+
+
+//
+// Shared file mapping standing in for the driver statistics section
+//
+static void* MapStats( const char* Path, UINT32 CpuCount )
+{
+	SIZE_T Size = vmx::stats::RegionSize( CpuCount );
+	void* Region;
+	int File = open( Path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+
+	if ( File < 0 )
+		return nullptr;
+
+	if ( ftruncate( File, ( off_t ) Size ) )
+	{
+		close( File );
+		return nullptr;
+	}
+
+	Region = mmap( nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, File, 0 );
+	close( File );
+
+	if ( Region == MAP_FAILED )
+		return nullptr;
+
+	vmx::stats::Initialize( Region, CpuCount );
+
+	return Region;
+}
+
+
+//
+// Timer exits at a steady guest RIP walk, every one must leave a sample and re-arm the timer
+//
+static bool RunProfile( const BenchOptions* Options )
+{
+	static const UINT32 Rates[] = { 1000, 10000, 100000 };
+	sim::ExitEvent Exit = {};
+	UINT64 Mismatches = 0;
+	bool status = false;
+	vCPU* vcpu;
+
+	//
+	// TSC rate of the host, the model's TSC is the real one
+	//
+	auto Start = std::chrono::steady_clock::now();
+	UINT64 Tsc = __rdtsc();
+
+	std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+
+	double TscFrequency = ( __rdtsc() - Tsc ) / std::chrono::duration< double >( std::chrono::steady_clock::now() - Start ).count();
+
+	sim::AttachProcessor( 0 );
+	Global->ProfilePeriod = vmx::profile::PeriodFromRate( ( UINT64 ) TscFrequency, Rates[0], __readmsr( IA32_VMX_MISC ) & 0x1F );
+	vcpu = sim::AllocateVCPU( 0, Global );
+	vcpu->Profile.Samples = new ProfileSample[4096];
+	vcpu->Profile.Capacity = 4096;
+
+	if ( sim::Virtualize( vcpu ) )
+	{
+		Exit.Reason = vmexit_vmx_preemption_timer_expired;
+		Exit.Regs.rip = 0xFFFFF80000100000ULL;
+		Exit.Regs.rsp = 0xFFFFF80000200000ULL;
+		Exit.Regs.rflags = 0x202;
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+		{
+			const ProfileSample* Sample;
+
+			Exit.Regs.rip += 0x10;
+
+			if ( sim::InjectExit( &Exit ) != 1 )
+			{
+				Mismatches++;
+				continue;
+			}
+
+			Sample = &vcpu->Profile.Samples[i & ( vcpu->Profile.Capacity - 1 )];
+
+			if ( Sample->Rip != Exit.Regs.rip || Sample->Cr3 != sim::ReadField( VMCS_GUEST_CR3 ) ||
+				sim::ReadField( VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE ) != Global->ProfilePeriod )
+				Mismatches++;
+		}
+
+		double Cycles = vcpu->Counters.Exits ? ( double ) vcpu->Counters.RootCycles / vcpu->Counters.Exits : 0.0;
+
+		printf( "profile: %llu samples, period %u, %.0f root cycles/sample (%.0f in the sampler), TSC at %.0f Hz\n",
+			( unsigned long long ) vcpu->Profile.Head, vcpu->Profile.Period, Cycles,
+			vcpu->Profile.Head ? ( double ) vcpu->Profile.Cycles / vcpu->Profile.Head : 0.0, TscFrequency );
+
+		for ( UINT32 Rate : Rates )
+			printf( "profile: %6u Hz, %.4f%% of a core\n", Rate, Rate * Cycles * 100 / TscFrequency );
+
+		status = vcpu->Profile.Head == Options->Exits && !Mismatches && vmx::StopVMX( vcpu ) && !sim::InVmxOperation();
+
+		if ( Mismatches )
+			printf( "%llu samples didn't match the exit\n", ( unsigned long long ) Mismatches );
+	}
+
+	delete[] vcpu->Profile.Samples;
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	return status;
+}
+
+
+//
+// Every other switch goes back to the System CR3 like idle and system threads do, the others cycle through 15 processes
+//
+static bool RunSwitchMix( const BenchOptions* Options, const char* Name, UINT32 Targets, bool Watch, const ProcessPolicy* Policy )
+{
+	ProcessTracking* Tracking = &Global->Processes;
+	sim::ExitEvent Exit = {};
+	UINT64 System = 0x1000 | GUEST_CR3_NO_FLUSH;
+	UINT64 Exits = 0;
+	bool status = false;
+	bool Exited;
+	vCPU* vcpu;
+
+	memset( Tracking, 0, sizeof( ProcessTracking ) );
+	Global->TrackProcesses = true;
+	Tracking->Targets[0] = System;
+	Tracking->TargetCount = Targets;
+
+	sim::AttachProcessor( 0 );
+	vcpu = sim::AllocateVCPU( 0, Global );
+
+	if ( sim::Virtualize( vcpu ) )
+	{
+		if ( Watch )
+		{
+			vmx::process::Watch( Global, 0x10000, 0, Policy );
+			vmx::process::Apply( vcpu );
+		}
+
+		Exit.Regs.rip = 0xFFFFF80000100000ULL;
+		Exit.Regs.rsp = 0xFFFFF80000200000ULL;
+		Exit.Regs.rflags = 0x202;
+
+		UINT64 Start = __rdtsc();
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+		{
+			Exit.Regs.rcx = i & 1 ? System : ( 0x10000 + ( ( i >> 1 ) % 15 ) * 0x1000 ) | GUEST_CR3_NO_FLUSH;
+
+			if ( sim::MovToCr3( &Exit, &Exited ) != 1 )
+				break;
+
+			Exits += Exited;
+		}
+
+		UINT64 Cycles = __rdtsc() - Start;
+
+		printf( "switches, %s: %llu switches, %.2f exits/switch, %.0f cycles/switch, %.0f root cycles/exit (%.0f tracking), "
+			"%.3f control swaps/switch\n", Name, ( unsigned long long ) Options->Exits, ( double ) Exits / Options->Exits,
+			( double ) Cycles / Options->Exits, Exits ? ( double ) vcpu->Counters.RootCycles / Exits : 0.0,
+			vcpu->Processes.Loads ? ( double ) vcpu->Processes.Cycles / vcpu->Processes.Loads : 0.0,
+			( double ) vcpu->Processes.ControlSwaps / Options->Exits );
+
+		if ( Watch )
+		{
+			printf( "switches, watched process: %llu switches, %.1f%% of the time\n",
+				( unsigned long long ) Tracking->Watched[0].Switches, Tracking->Watched[0].Cycles * 100.0 / Cycles );
+		}
+
+		status = Exits == vcpu->Processes.Loads && vmx::StopVMX( vcpu ) && !sim::InVmxOperation();
+	}
+
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	Global->TrackProcesses = false;
+
+	return status;
+}
+
+//
+// The policy swaps the MSR and exception bitmaps in and out around the watched process only
+//
+static bool RunSwitches( const BenchOptions* Options )
+{
+	ProcessPolicy Policy = {};
+
+	Policy.ExceptionBitmap = 1 << Breakpoint;
+	Policy.MsrCount = 1;
+	Policy.Msrs[0] = { IA32_LSTAR, false, true };
+
+	return RunSwitchMix( Options, "every switch exits", 0, false, nullptr ) &&
+		RunSwitchMix( Options, "System CR3 as target", 1, false, nullptr ) &&
+		RunSwitchMix( Options, "target, one process watched", 1, true, nullptr ) &&
+		RunSwitchMix( Options, "target, one process with a policy", 1, true, &Policy );
+}
+
+
+//
+// Cycles per operation of the loop body, the VM exits and entries are not part of the model
+//
+static double PerOperation( UINT64 Start, UINT64 Count )
+{
+	return Count ? ( double ) ( __rdtsc() - Start ) / Count : 0.0;
+}
+
+static bool RunViews( const BenchOptions* Options )
+{
+	EptState* Ept = &Global->Ept;
+	sim::ExitEvent Exit = {};
+	UINT64 Remapped = 0x100005000ULL;
+	UINT64 Convertible = 0x100007000ULL;
+	UINT64 Limit;
+	UINT64 Start;
+	SIZE_T Size;
+	BYTE* Tables;
+	bool Pages1Gb;
+	bool status = false;
+	bool Exited;
+	vCPU* vcpu;
+
+	sim::AttachProcessor( 0 );
+
+	if ( !vmx::ept::Supported( &Pages1Gb ) )
+	{
+		sim::DetachProcessor();
+		return false;
+	}
+
+	Limit = vmx::ept::MapLimit( Pages1Gb );
+	Size = vmx::ept::TablesSize( Limit, Pages1Gb, 1, 0 );
+	Tables = ( BYTE* ) operator new( Size, std::align_val_t( PAGE_SIZE ) );
+	vcpu = sim::AllocateVCPU( 0, Global );
+
+	//
+	// #VE is only delivered with descriptor-table exiting, nothing here exits for it
+	//
+	Global->DescriptorTableExiting = true;
+
+	if ( vmx::ept::Build( Ept, Tables, Size, Limit, Pages1Gb ) && vmx::ept::CreateView( Ept ) == 1 &&
+		vmx::ept::SetPage( Ept, 1, Remapped, Remapped, EPT_READ ) &&
+		vmx::ept::SetPage( Ept, 1, Convertible, Convertible, EPT_READ | EPT_CONVERTIBLE ) &&
+		vmx::ept::EnableVe( Ept, nullptr, nullptr ) && sim::Virtualize( vcpu ) )
+	{
+		Start = __rdtsc();
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+			vmx::__vmfunc( 0, ( UINT32 ) ( ~i & 1 ) );
+
+		printf( "views, VMFUNC: %llu switches, %.0f cycles/switch, %llu exits\n", ( unsigned long long ) Options->Exits,
+			PerOperation( Start, Options->Exits ), ( unsigned long long ) vcpu->Counters.Exits );
+
+		Start = __rdtsc();
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+			vmx::__vmcall( VMCALL_SWITCH_VIEW, ~i & 1, 0 );
+
+		printf( "views, VMCALL: %llu switches, %.0f cycles/switch, %.0f root cycles/exit\n", ( unsigned long long ) Options->Exits,
+			PerOperation( Start, Options->Exits ), ( double ) vcpu->Counters.RootCycles / vcpu->Counters.Exits );
+
+		//
+		// A write to the read-only page of view 1 takes the vCPU back to view 0, VMFUNC goes to view 1 again
+		//
+		Start = __rdtsc();
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+		{
+			vmx::__vmfunc( 0, 1 );
+			sim::GuestAccess( &Exit, Remapped, EPT_WRITE, &Exited );
+		}
+
+		printf( "views, violation: %llu fallbacks, %.0f cycles/fallback\n", ( unsigned long long ) vcpu->Ept.Violations,
+			PerOperation( Start, Options->Exits ) );
+
+		//
+		// Same with a convertible page: the guest handler goes back to view 0 without an exit. The cost of the
+		// exception delivery itself is not modelled either
+		//
+		Start = __rdtsc();
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+		{
+			vmx::__vmfunc( 0, 1 );
+			sim::GuestAccess( &Exit, Convertible, EPT_WRITE, &Exited );
+		}
+
+		printf( "views, #VE: %llu fallbacks, %.0f cycles/fallback\n", ( unsigned long long ) vcpu->Ept.VeDelivered,
+			PerOperation( Start, Options->Exits ) );
+
+		//
+		// Changing the view instead of switching: one page and the INVEPT the kick does, on this processor only
+		//
+		Start = __rdtsc();
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+		{
+			vmx::ept::SetPage( Ept, 1, Remapped, Remapped, i & 1 ? EPT_ACCESS_ALL : EPT_READ );
+			vmx::ept::Invalidate( vcpu );
+		}
+
+		printf( "views, remap: %llu remaps, %.0f cycles/remap with its INVEPT\n", ( unsigned long long ) Options->Exits,
+			PerOperation( Start, Options->Exits ) );
+
+		status = vcpu->Ept.Violations == Options->Exits && vcpu->Ept.HypercallSwitches == Options->Exits &&
+			vcpu->Ept.VeDelivered == Options->Exits &&
+			vmx::StopVMX( vcpu ) && !sim::InVmxOperation();
+	}
+
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+	memset( Ept, 0, sizeof( EptState ) );
+	Global->DescriptorTableExiting = false;
+
+	return status;
+}
+
+
+#define COVERED_PAGES 1024
+
+static bool RunCoverage( const BenchOptions* Options )
+{
+	EptState* Ept = &Global->Ept;
+	sim::ExitEvent Exit = {};
+	UINT64 Base = 0x100000000ULL;
+	UINT64 Limit;
+	UINT64 Start;
+	UINT64 Exits;
+	UINT32 Reset = 0;
+	SIZE_T Size;
+	BYTE* Tables;
+	bool Pages1Gb;
+	bool status = false;
+	bool Exited;
+	vCPU* vcpu;
+
+	sim::AttachProcessor( 0 );
+
+	if ( !vmx::ept::Supported( &Pages1Gb ) )
+	{
+		sim::DetachProcessor();
+		return false;
+	}
+
+	Limit = vmx::ept::MapLimit( Pages1Gb );
+	Size = vmx::ept::TablesSize( Limit, Pages1Gb, 0, vmx::coverage::Tables( Limit ) );
+	Tables = ( BYTE* ) operator new( Size, std::align_val_t( PAGE_SIZE ) );
+	vcpu = sim::AllocateVCPU( 0, Global );
+
+	if ( vmx::ept::Build( Ept, Tables, Size, Limit, Pages1Gb ) && vmx::ept::CreateView( Ept ) == 1 &&
+		vmx::coverage::Setup( Global, 1 ) && sim::Virtualize( vcpu ) )
+	{
+		for ( UINT64 i = 0; i < COVERED_PAGES; i++ )
+			vmx::coverage::Cover( Global, Base + i * PAGE_SIZE );
+
+		vmx::coverage::Apply( vcpu );
+
+		//
+		// Every page exits once, then none does
+		//
+		Exits = vcpu->Counters.Exits;
+		Start = __rdtsc();
+
+		for ( UINT64 i = 0; i < COVERED_PAGES; i++ )
+			sim::GuestAccess( &Exit, Base + i * PAGE_SIZE, EPT_EXECUTE, &Exited );
+
+		printf( "coverage, first fetch: %u pages, %.0f cycles/fetch, %llu exits\n", COVERED_PAGES,
+			PerOperation( Start, COVERED_PAGES ), ( unsigned long long ) ( vcpu->Counters.Exits - Exits ) );
+
+		Exits = vcpu->Counters.Exits;
+		Start = __rdtsc();
+
+		for ( UINT64 i = 0; i < Options->Exits; i++ )
+			sim::GuestAccess( &Exit, Base + ( i % COVERED_PAGES ) * PAGE_SIZE, EPT_EXECUTE, &Exited );
+
+		printf( "coverage, steady state: %llu fetches, %.0f cycles/fetch, %llu exits\n", ( unsigned long long ) Options->Exits,
+			PerOperation( Start, Options->Exits ), ( unsigned long long ) ( vcpu->Counters.Exits - Exits ) );
+
+		status = vcpu->Counters.Exits == Exits;
+
+		//
+		// The batch and the INVEPT the kick does, on this processor only
+		//
+		Start = __rdtsc();
+		Reset = vmx::coverage::Reset( Global );
+		vmx::ept::Invalidate( vcpu );
+
+		printf( "coverage, reset: %u pages, %.0f cycles with its INVEPT\n", Reset, PerOperation( Start, 1 ) );
+
+		status = status && Reset == COVERED_PAGES && vcpu->Ept.CoverageHits == COVERED_PAGES &&
+			vmx::coverage::Collect( &Global->Coverage, nullptr, 0 ) == 0 && vmx::StopVMX( vcpu ) && !sim::InVmxOperation();
+	}
+
+	sim::FreeVCPU( vcpu );
+	sim::DetachProcessor();
+
+	operator delete( Tables, std::align_val_t( PAGE_SIZE ) );
+	memset( Ept, 0, sizeof( EptState ) );
+	memset( &Global->Coverage, 0, sizeof( ExecutionCoverage ) );
+
+	return status;
+}
+
+
+static void Usage( const char* Name )
+{
+	fprintf( stderr,
+		"usage: %s [--threads N] [--exits N] [--replays N] [--save-snapshot FILE] [--load-snapshot FILE] [--record FILE] [--json FILE] [--stats FILE] [--profile] [--switches] [--views] [--coverage] [--verbose]\n",
+		Name );
+}
+
+int main( int argc, char** argv )
+{
+	BenchOptions Options = { std::thread::hardware_concurrency(), 1000000, 0, nullptr, nullptr, nullptr, nullptr, nullptr, false, false, false, false };
+	bool Verbose = false;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		bool HasValue = i + 1 < argc;
+
+		if ( !strcmp( argv[i], "--threads" ) && HasValue )
+			Options.Threads = ( unsigned ) strtoul( argv[++i], nullptr, 0 );
+		else if ( !strcmp( argv[i], "--exits" ) && HasValue )
+			Options.Exits = strtoull( argv[++i], nullptr, 0 );
+		else if ( !strcmp( argv[i], "--replays" ) && HasValue )
+			Options.Replays = strtoull( argv[++i], nullptr, 0 );
+		else if ( !strcmp( argv[i], "--save-snapshot" ) && HasValue )
+			Options.SaveSnapshot = argv[++i];
+		else if ( !strcmp( argv[i], "--load-snapshot" ) && HasValue )
+			Options.LoadSnapshot = argv[++i];
+		else if ( !strcmp( argv[i], "--record" ) && HasValue )
+			Options.Record = argv[++i];
+		else if ( !strcmp( argv[i], "--json" ) && HasValue )
+			Options.Json = argv[++i];
+		else if ( !strcmp( argv[i], "--stats" ) && HasValue )
+			Options.Stats = argv[++i];
+		else if ( !strcmp( argv[i], "--profile" ) )
+			Options.Profile = true;
+		else if ( !strcmp( argv[i], "--switches" ) )
+			Options.Switches = true;
+		else if ( !strcmp( argv[i], "--views" ) )
+			Options.Views = true;
+		else if ( !strcmp( argv[i], "--coverage" ) )
+			Options.Coverage = true;
+		else if ( !strcmp( argv[i], "--verbose" ) )
+			Verbose = true;
+		else
+		{
+			Usage( argv[0] );
+			return 2;
+		}
+	}
+
+	if ( !Options.Threads )
+		Options.Threads = 1;
+
+	sim::SetLogging( Verbose );
+
+	Global = new ( std::align_val_t( PAGE_SIZE ) ) GlobalState;
+	memset( Global, 0, sizeof( GlobalState ) );
+	if ( ( Options.Replays || Options.SaveSnapshot || Options.LoadSnapshot ) && !ReplaySnapshot( &Options ) )
+		return 1;
+
+	if ( Options.Json )
+	{
+		bool Succeeded = RunLatencySuite( &Options );
+
+		operator delete( Global, std::align_val_t( PAGE_SIZE ) );
+		return Succeeded ? 0 : 1;
+	}
+
+	if ( Options.Profile )
+	{
+		bool Succeeded = RunProfile( &Options );
+
+		operator delete( Global, std::align_val_t( PAGE_SIZE ) );
+		return Succeeded ? 0 : 1;
+	}
+
+	if ( Options.Switches )
+	{
+		bool Succeeded = RunSwitches( &Options );
+
+		operator delete( Global, std::align_val_t( PAGE_SIZE ) );
+		return Succeeded ? 0 : 1;
+	}
+
+	if ( Options.Views )
+	{
+		bool Succeeded = RunViews( &Options );
+
+		operator delete( Global, std::align_val_t( PAGE_SIZE ) );
+		return Succeeded ? 0 : 1;
+	}
+
+	if ( Options.Coverage )
+	{
+		bool Succeeded = RunCoverage( &Options );
+
+		operator delete( Global, std::align_val_t( PAGE_SIZE ) );
+		return Succeeded ? 0 : 1;
+	}
+
+	if ( Options.Stats && !( StatsRegion = MapStats( Options.Stats, Options.Threads ) ) )
+	{
+		fprintf( stderr, "Unable to map %s\n", Options.Stats );
+		return 1;
+	}
+
+	std::vector< ThreadResult > Results( Options.Threads );
+	std::vector< std::thread > Threads;
+
+	for ( unsigned i = 0; i < Options.Threads; i++ )
+		Threads.emplace_back( BenchThread, ( int ) i, &Options, &Results[i] );
+
+	for ( auto& Thread : Threads )
+		Thread.join();
+
+	UINT64 TotalExits = 0;
+	UINT64 Mismatches = 0;
+	double Rate = 0;
+	int status = 0;
+
+	for ( unsigned i = 0; i < Options.Threads; i++ )
+	{
+		ThreadResult* Result = &Results[i];
+
+		if ( !Result->Launched )
+		{
+			printf( "vcpu %u: launch failed\n", i );
+			status = 1;
+			continue;
+		}
+
+		double PerSecond = Result->Seconds > 0 ? Result->Exits / Result->Seconds : 0;
+
+		printf( "vcpu %u: %llu exits, %.0f exits/s, %.0f root cycles/exit\n",
+			i, ( unsigned long long ) Result->Exits, PerSecond,
+			Result->Exits ? ( double ) Result->RootCycles / Result->Exits : 0.0 );
+
+		TotalExits += Result->Exits;
+		Mismatches += Result->Mismatches;
+		Rate += PerSecond;
+	}
+
+	printf( "total: %u vcpus, %llu exits, %.0f exits/s\n", Options.Threads, ( unsigned long long ) TotalExits, Rate );
+
+	if ( Mismatches )
+	{
+		printf( "%llu exits returned an unexpected guest state\n", ( unsigned long long ) Mismatches );
+		status = 1;
+	}
+
+	if ( Options.Record && !WriteTrace( Options.Record, Results ) )
+		status = 1;
+
+	for ( auto& Result : Results )
+	{
+		delete[] Result.vcpu->Trace.Records;
+		sim::FreeVCPU( Result.vcpu );
+	}
+
+	if ( StatsRegion )
+		munmap( StatsRegion, vmx::stats::RegionSize( Options.Threads ) );
+
+	operator delete( Global, std::align_val_t( PAGE_SIZE ) );
+
+	return status;
+}
@@ -0,0 +1,187 @@
+//
+// Poll the per-processor statistics region (vmx/Stats.h) without any syscall per sample.
+// The driver publishes it as the Global\GestaltStats section, gestalt_simbench --stats writes the same layout to a file;
+// this maps the file read-only and prints the exit rate of every processor at a fixed interval
+//
+#include "vmx/vmx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define STATS_READ_RETRIES 100000
+
+
+static const StatsHeader* MapStats( const char* Path, SIZE_T* Size )
+{
+	const StatsHeader* Header;
+	struct stat Info;
+	void* Region;
+	int File = open( Path, O_RDONLY );
+
+	if ( File < 0 )
+		return nullptr;
+
+	if ( fstat( File, &Info ) || ( SIZE_T ) Info.st_size < sizeof( StatsHeader ) )
+	{
+		close( File );
+		return nullptr;
+	}
+
+	*Size = ( SIZE_T ) Info.st_size;
+	Region = mmap( nullptr, *Size, PROT_READ, MAP_SHARED, File, 0 );
+	close( File );
+
+	if ( Region == MAP_FAILED )
+		return nullptr;
+
+	Header = ( const StatsHeader* ) Region;
+
+	if ( Header->Magic != STATS_MAGIC || Header->Version != STATS_VERSION || Header->CpuSize != sizeof( StatsCpu ) ||
+		Header->CpuOffset + ( SIZE_T ) Header->CpuCount * Header->CpuSize > *Size )
+	{
+		munmap( Region, *Size );
+		return nullptr;
+	}
+
+	return Header;
+}
+
+
+static void Usage( const char* Name )
+{
+	fprintf( stderr, "usage: %s STATS [--interval MS] [--count N] [--reasons]\n", Name );
+}
+
+int main( int argc, char** argv )
+{
+	const char* Path = nullptr;
+	const StatsHeader* Header;
+	unsigned Interval = 1000;
+	unsigned Count = 0;
+	bool Reasons = false;
+	SIZE_T Size;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		bool HasValue = i + 1 < argc;
+
+		if ( !strcmp( argv[i], "--interval" ) && HasValue )
+			Interval = ( unsigned ) strtoul( argv[++i], nullptr, 0 );
+		else if ( !strcmp( argv[i], "--count" ) && HasValue )
+			Count = ( unsigned ) strtoul( argv[++i], nullptr, 0 );
+		else if ( !strcmp( argv[i], "--reasons" ) )
+			Reasons = true;
+		else if ( argv[i][0] != '-' && !Path )
+			Path = argv[i];
+		else
+		{
+			Usage( argv[0] );
+			return 2;
+		}
+	}
+
+	if ( !Path )
+	{
+		Usage( argv[0] );
+		return 2;
+	}
+
+	Header = MapStats( Path, &Size );
+
+	if ( !Header )
+	{
+		fprintf( stderr, "%s is not a statistics region\n", Path );
+		return 1;
+	}
+
+	const StatsCpu* Slots = ( const StatsCpu* ) ( ( const BYTE* ) Header + Header->CpuOffset );
+	std::vector< StatsCpu > Previous( Header->CpuCount );
+	std::vector< StatsCpu > Current( Header->CpuCount );
+	UINT64 Torn = 0;
+	auto Last = std::chrono::steady_clock::now();
+
+	for ( UINT32 i = 0; i < Header->CpuCount; i++ )
+	{
+		if ( !vmx::stats::Read( &Slots[i], &Previous[i], STATS_READ_RETRIES ) )
+			memset( &Previous[i], 0, sizeof( StatsCpu ) );
+	}
+
+	for ( unsigned Sample = 0; !Count || Sample < Count; Sample++ )
+	{
+		std::this_thread::sleep_for( std::chrono::milliseconds( Interval ) );
+
+		auto Now = std::chrono::steady_clock::now();
+		double Seconds = std::chrono::duration< double >( Now - Last ).count();
+		UINT64 TotalExits = 0;
+		double Rate = 0;
+
+		Last = Now;
+
+		for ( UINT32 i = 0; i < Header->CpuCount; i++ )
+		{
+			const StatsCpu* Before = &Previous[i];
+			StatsCpu* After = &Current[i];
+
+			//
+			// A slot that kept changing is shown with its previous values
+			//
+			if ( !vmx::stats::Read( &Slots[i], After, STATS_READ_RETRIES ) )
+			{
+				*After = *Before;
+				Torn++;
+			}
+
+			if ( !After->Exits )
+				continue;
+
+			UINT64 Exits = After->Exits - Before->Exits;
+			UINT64 Cycles = After->RootCycles - Before->RootCycles;
+
+			printf( "cpu %u: %llu exits, %.0f exits/s, %.0f root cycles/exit, trace %llu records %llu dropped\n",
+				After->CpuNumber, ( unsigned long long ) After->Exits, Exits / Seconds, Exits ? ( double ) Cycles / Exits : 0.0,
+				( unsigned long long ) After->TraceRecords, ( unsigned long long ) After->TraceDropped );
+
+			UINT64 Hits = After->TranslationHits - Before->TranslationHits;
+			UINT64 Misses = After->TranslationMisses - Before->TranslationMisses;
+
+			if ( Hits + Misses )
+			{
+				printf( "  translations: %.1f%% hits, %.0f cycles/walk, %llu flushes\n", 100.0 * Hits / ( Hits + Misses ),
+					Misses ? ( double ) ( After->TranslationWalkCycles - Before->TranslationWalkCycles ) / Misses : 0.0,
+					( unsigned long long ) ( After->TranslationFlushes - Before->TranslationFlushes ) );
+			}
+
+			if ( Reasons )
+			{
+				for ( UINT32 j = 0; j < Header->ExitReasons && j < STATS_EXIT_REASONS; j++ )
+				{
+					if ( After->ExitsByReason[j] != Before->ExitsByReason[j] )
+						printf( "  reason %u: %llu exits\n", j, ( unsigned long long ) ( After->ExitsByReason[j] - Before->ExitsByReason[j] ) );
+				}
+			}
+
+			TotalExits += After->Exits;
+			Rate += Exits / Seconds;
+		}
+
+		printf( "total: %llu exits, %.0f exits/s\n", ( unsigned long long ) TotalExits, Rate );
+		fflush( stdout );
+
+		Previous.swap( Current );
+	}
+
+	if ( Torn )
+		printf( "%llu slot reads did not settle\n", ( unsigned long long ) Torn );
+
+	munmap( ( void* ) Header, Size );
+
+	return 0;
+}